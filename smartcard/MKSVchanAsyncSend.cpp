@@ -0,0 +1,428 @@
+/* **************************************************************************** *
+ * Copyright (C) 2020 VMware, Inc.  All rights reserved. -- VMware Confidential *
+ * **************************************************************************** */
+
+/*
+ * MKSVchanAsyncSend.cpp --
+ *
+ *    Implements the coroutine send API and its vdpservice thread scheduler.
+ */
+
+#include "MKSVchanAsyncSend.h"
+
+#include <deque>
+#include <map>
+
+#if defined(MKSVCHAN_HAVE_COROUTINES)
+
+namespace {
+
+typedef std::map<uint32, std::shared_ptr<MKSVchanAsync::SendState> > PendingSendMap;
+
+/*
+ * Sends waiting for OnDone/OnAbort, keyed by request context id.
+ */
+PendingSendMap pendingSends;
+
+/*
+ * Sends SendMessage accepted but hasn't put on the channel yet, keyed by
+ * the ticket Defer() handed out.
+ */
+PendingSendMap deferredSends;
+uint32 nextTicket = 1;
+
+/*
+ * The send currently inside SendMessage. SendMessage reports the request
+ * id it allocated through OnRequestQueued, which moves this entry into
+ * pendingSends, or defers it with Defer().
+ */
+std::shared_ptr<MKSVchanAsync::SendState> submittingSend;
+
+/*
+ * Coroutines ready to be resumed by RunPending.
+ */
+std::deque<std::coroutine_handle<> > readyQueue;
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * Finish --
+ *
+ *    Set the result of a send and schedule its waiter, if any.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+Finish(const std::shared_ptr<MKSVchanAsync::SendState> &state, // IN
+       Bool result)                                            // IN
+{
+   state->done = TRUE;
+   state->result = result;
+   if (state->waiter) {
+      readyQueue.push_back(state->waiter);
+      state->waiter = nullptr;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * Complete --
+ *
+ *    Complete a send waiting in sends under key, if there is one.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+Complete(PendingSendMap &sends, // IN/OUT
+         uint32 key,            // IN
+         Bool result)           // IN
+{
+   PendingSendMap::iterator it = sends.find(key);
+   if (it == sends.end()) {
+      return;
+   }
+
+   std::shared_ptr<MKSVchanAsync::SendState> state = it->second;
+   sends.erase(it);
+   Finish(state, result);
+}
+
+} // anonymous namespace
+
+#endif // MKSVCHAN_HAVE_COROUTINES
+
+
+namespace MKSVchanAsync {
+
+#if defined(MKSVCHAN_HAVE_COROUTINES)
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanAsync::Send --
+ *
+ *    Send a packet and return an awaitable for its completion. Must be
+ *    called on the vdpservice thread.
+ *
+ * Results:
+ *    Awaitable yielding TRUE once OnDone fires for the packet, FALSE if the
+ *    send failed, was aborted, dropped or the channel went away. A packet
+ *    SendMessage deferred completes when it is really sent and done.
+ *    Packets without a payload are not tracked by OnDone and complete
+ *    immediately.
+ *
+ * Side effects:
+ *    Calls MKSVchanRPCPlugin::SendMessage.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+SendOp
+Send(MKSVchanRPCPlugin *plugin,     // IN
+     MKSVchanPacketType packetType, // IN
+     uint8 *data,                   // IN
+     uint32 dataLen)                // IN
+{
+   std::shared_ptr<SendState> state = std::make_shared<SendState>();
+
+   ASSERT(!submittingSend);
+   submittingSend = state;
+   Bool sent = plugin->SendMessage(packetType, data, dataLen);
+   Bool tracked = !submittingSend;
+   submittingSend.reset();
+
+   if (!sent || !tracked) {
+      state->done = TRUE;
+      state->result = sent;
+   }
+   return SendOp(state);
+}
+#endif
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanAsync::OnRequestQueued --
+ *
+ *    Called by SendMessage after it added a request to m_requestList.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+OnRequestQueued(uint32 requestCtxId) // IN
+{
+#if defined(MKSVCHAN_HAVE_COROUTINES)
+   if (submittingSend) {
+      pendingSends[requestCtxId] = submittingSend;
+      submittingSend.reset();
+   }
+#endif
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanAsync::OnRequestDone --
+ *
+ *    Called by OnDone for every completed request.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+OnRequestDone(uint32 requestCtxId) // IN
+{
+#if defined(MKSVCHAN_HAVE_COROUTINES)
+   Complete(pendingSends, requestCtxId, TRUE);
+#endif
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanAsync::OnRequestAborted --
+ *
+ *    Called by OnAbort for every discarded request.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+OnRequestAborted(uint32 requestCtxId) // IN
+{
+#if defined(MKSVCHAN_HAVE_COROUTINES)
+   Complete(pendingSends, requestCtxId, FALSE);
+#endif
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanAsync::OnChannelNotReady --
+ *
+ *    Fail every outstanding send, sent or deferred, the channel won't
+ *    report them anymore.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+OnChannelNotReady()
+{
+#if defined(MKSVCHAN_HAVE_COROUTINES)
+   while (!pendingSends.empty()) {
+      Complete(pendingSends, pendingSends.begin()->first, FALSE);
+   }
+   while (!deferredSends.empty()) {
+      Complete(deferredSends, deferredSends.begin()->first, FALSE);
+   }
+#endif
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanAsync::RunPending --
+ *
+ *    Resume every coroutine whose send has completed. Coroutines resumed
+ *    here may send again, and anything they make ready in turn is run in
+ *    the same call.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Runs producer code on the calling (vdpservice) thread.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+RunPending()
+{
+#if defined(MKSVCHAN_HAVE_COROUTINES)
+   while (!readyQueue.empty()) {
+      std::coroutine_handle<> waiter = readyQueue.front();
+      readyQueue.pop_front();
+      waiter.resume();
+   }
+#endif
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanAsync::Defer --
+ *
+ *    Called by SendMessage when it accepts a packet it will put on the
+ *    channel later. Takes the send being submitted, if the packet came
+ *    from Send().
+ *
+ * Results:
+ *    Ticket to keep with the packet, 0 if no Send() is waiting for it.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+uint32
+Defer()
+{
+#if defined(MKSVCHAN_HAVE_COROUTINES)
+   if (!submittingSend) {
+      return 0;
+   }
+
+   uint32 ticket = nextTicket++;
+   if (nextTicket == 0) {
+      nextTicket = 1;
+   }
+   deferredSends[ticket] = submittingSend;
+   submittingSend.reset();
+   return ticket;
+#else
+   return 0;
+#endif
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanAsync::BeginDeferredSend --
+ *
+ *    Called right before SendMessage for a packet deferred earlier. The
+ *    request id SendMessage reports, or a further Defer(), goes to the
+ *    send waiting for the ticket.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+BeginDeferredSend(uint32 ticket) // IN
+{
+#if defined(MKSVCHAN_HAVE_COROUTINES)
+   ASSERT(!submittingSend);
+   PendingSendMap::iterator it = deferredSends.find(ticket);
+   if (it != deferredSends.end()) {
+      submittingSend = it->second;
+      deferredSends.erase(it);
+   }
+#endif
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanAsync::EndDeferredSend --
+ *
+ *    Called right after the SendMessage of BeginDeferredSend.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    If the packet got neither a request id nor a new ticket, its send
+ *    completes with the SendMessage result; RunPending resumes it.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+EndDeferredSend(Bool sent) // IN
+{
+#if defined(MKSVCHAN_HAVE_COROUTINES)
+   if (!submittingSend) {
+      return;
+   }
+
+   std::shared_ptr<SendState> state = submittingSend;
+   submittingSend.reset();
+   Finish(state, sent);
+#endif
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanAsync::CompleteDeferred --
+ *
+ *    Finish a deferred packet that is done without a request of its own:
+ *    dropped (FALSE), or skipped because the peer has it (TRUE).
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    RunPending resumes the waiting send.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+CompleteDeferred(uint32 ticket, // IN
+                 Bool result)   // IN
+{
+#if defined(MKSVCHAN_HAVE_COROUTINES)
+   Complete(deferredSends, ticket, result);
+#endif
+}
+
+} // namespace MKSVchanAsync
@@ -0,0 +1,124 @@
+/* **************************************************************************** *
+ * Copyright (C) 2020 VMware, Inc.  All rights reserved. -- VMware Confidential *
+ * **************************************************************************** */
+
+/*
+ * MKSVchanAsyncSend.h --
+ *
+ *    C++20 coroutine front end for MKSVchanRPCPlugin::SendMessage.
+ *
+ *    Send() hands the packet to the channel immediately and returns an
+ *    awaitable which completes when the matching OnDone (TRUE) or OnAbort
+ *    (FALSE) fires. Because submission is eager, a producer can start many
+ *    sends and await them afterwards to keep the channel busy:
+ *
+ *       MKSVchanAsync::Task
+ *       SendChunks(MKSVchanRPCPlugin *plugin, ...)
+ *       {
+ *          std::vector<MKSVchanAsync::SendOp> window;
+ *          for (...) {
+ *             window.push_back(MKSVchanAsync::Send(plugin, type, data, len));
+ *          }
+ *          for (auto &op : window) {
+ *             if (!co_await op) {
+ *                co_return;
+ *             }
+ *          }
+ *       }
+ *
+ *    Everything here runs on the vdpservice thread: coroutines are resumed
+ *    by RunPending(), which the plugin calls after OnDone/OnAbort have
+ *    finished walking m_requestList.
+ *
+ *    Some packets SendMessage accepts are not on the channel when it
+ *    returns: a packet queued because its class is over budget, a file
+ *    chunk handed to the compressor, and a capability the peer has cached.
+ *    SendMessage takes the send being submitted with Defer() and keeps the
+ *    ticket with the packet. When the packet is finally sent the code
+ *    sending it brackets SendMessage with BeginDeferredSend() and
+ *    EndDeferredSend(), which binds the request id it gets. A packet that
+ *    never goes out, or is done without a request, is finished with
+ *    CompleteDeferred(). Only a packet without payload completes at once.
+ */
+
+#ifndef _MKSVCHAN_ASYNC_SEND_H_
+#define _MKSVCHAN_ASYNC_SEND_H_
+
+#include "MKSVchanRPCPlugin.h"
+
+#include <memory>
+
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>
+#define MKSVCHAN_HAVE_COROUTINES 1
+#endif
+
+namespace MKSVchanAsync {
+
+/*
+ * Hooks called by MKSVchanRPCPlugin. They are available even without
+ * coroutine support so the plugin doesn't need to care.
+ */
+void OnRequestQueued(uint32 requestCtxId);
+void OnRequestDone(uint32 requestCtxId);
+void OnRequestAborted(uint32 requestCtxId);
+void OnChannelNotReady();
+void RunPending();
+uint32 Defer();
+void BeginDeferredSend(uint32 ticket);
+void EndDeferredSend(Bool sent);
+void CompleteDeferred(uint32 ticket, Bool result);
+
+#if defined(MKSVCHAN_HAVE_COROUTINES)
+
+struct SendState
+{
+   Bool done = FALSE;
+   Bool result = FALSE;
+   std::coroutine_handle<> waiter;
+};
+
+
+class SendOp
+{
+public:
+   explicit SendOp(std::shared_ptr<SendState> state) : m_state(state) { }
+
+   bool await_ready() const noexcept { return m_state->done; }
+   void await_suspend(std::coroutine_handle<> waiter) noexcept
+   {
+      m_state->waiter = waiter;
+   }
+   Bool await_resume() const noexcept { return m_state->result; }
+
+private:
+   std::shared_ptr<SendState> m_state;
+};
+
+
+/*
+ * Fire-and-forget coroutine type for producers. The coroutine starts
+ * running immediately and frees itself when it returns.
+ */
+class Task
+{
+public:
+   struct promise_type
+   {
+      Task get_return_object() noexcept { return Task(); }
+      std::suspend_never initial_suspend() noexcept { return {}; }
+      std::suspend_never final_suspend() noexcept { return {}; }
+      void return_void() noexcept { }
+      void unhandled_exception() noexcept { ASSERT(FALSE); }
+   };
+};
+
+
+SendOp Send(MKSVchanRPCPlugin *plugin, MKSVchanPacketType packetType,
+            uint8 *data, uint32 dataLen);
+
+#endif // MKSVCHAN_HAVE_COROUTINES
+
+} // namespace MKSVchanAsync
+
+#endif // _MKSVCHAN_ASYNC_SEND_H_
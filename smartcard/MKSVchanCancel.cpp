@@ -0,0 +1,315 @@
+/* **************************************************************************** *
+ * Copyright (C) 2020 VMware, Inc.  All rights reserved. -- VMware Confidential *
+ * **************************************************************************** */
+
+/*
+ * MKSVchanCancel.cpp --
+ *
+ *    Implements the copy pipeline cancellation tokens.
+ */
+
+#include "MKSVchanCancel.h"
+#include "MKSVchanMetrics.h"
+#include "MKSVchanSendBudget.h"
+
+#include <atomic>
+#include <chrono>
+
+namespace MKSVchanCancel {
+
+typedef std::chrono::steady_clock Clock;
+
+static std::atomic<Token> generation(0);
+
+// Statistics of the last cancel, vdpservice thread only
+static Bool quiescePending = FALSE;
+static Clock::time_point cancelTime;
+static MKSVchanPacketType cancelPacketType;
+static uint64 queuedAtCancel = 0;
+static uint64 inFlightAtCancel = 0;
+static uint32 droppedCount = 0;
+static uint32 discardedCount = 0;
+static Bool haveLastStats = FALSE;
+static Stats lastStats;
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanCancel::GetToken --
+ *
+ *    Token for work started now.
+ *
+ * Results:
+ *    The token.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Token
+GetToken()
+{
+   return generation.load(std::memory_order_acquire);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanCancel::IsCancelled --
+ *
+ *    Whether work started under token has been cancelled.
+ *
+ * Results:
+ *    TRUE if a copy was cancelled after the token was taken, or one is
+ *    being cancelled right now.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+IsCancelled(Token token) // IN
+{
+   Token current = generation.load(std::memory_order_acquire);
+   return token != current || (current & 1) != 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanCancel::IsCancelling --
+ *
+ *    Whether a copy was cancelled and no new one has started yet.
+ *
+ * Results:
+ *    TRUE while cancelling.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+IsCancelling()
+{
+   return (generation.load(std::memory_order_acquire) & 1) != 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanCancel::Cancel --
+ *
+ *    Cancel the current copy.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Every token taken so far is cancelled. Starts timing the time to
+ *    quiescence.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+Cancel(MKSVchanPacketType packetType) // IN
+{
+   Token current = generation.load();
+   if ((current & 1) == 0) {
+      generation.store(current + 1, std::memory_order_release);
+   }
+
+   quiescePending = TRUE;
+   cancelTime = Clock::now();
+   cancelPacketType = packetType;
+   queuedAtCancel =
+      MKSVchanBudget::GetQueued(MKSVchanBudget::PacketClass_FileTransfer);
+   inFlightAtCancel =
+      MKSVchanBudget::GetInFlight(MKSVchanBudget::PacketClass_FileTransfer);
+   droppedCount = 0;
+   discardedCount = 0;
+
+   Log("%s: %s, %llu bytes queued, %llu bytes in flight.\n", __FUNCTION__,
+       GetMKSVchanPacketTypeAsString(packetType),
+       (unsigned long long)queuedAtCancel,
+       (unsigned long long)inFlightAtCancel);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanCancel::BeginCopy --
+ *
+ *    A new copy starts, end the cancelling state.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Tokens of the cancelled copy stay cancelled.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+BeginCopy()
+{
+   Token current = generation.load();
+   if ((current & 1) == 0) {
+      return;
+   }
+
+   if (quiescePending) {
+      Log("%s: New copy %llums after %s, before the old one drained.\n",
+          __FUNCTION__,
+          (unsigned long long)std::chrono::duration_cast<
+             std::chrono::milliseconds>(Clock::now() - cancelTime).count(),
+          GetMKSVchanPacketTypeAsString(cancelPacketType));
+      quiescePending = FALSE;
+   }
+   generation.store(current + 1, std::memory_order_release);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanCancel::DiscardOnArrival --
+ *
+ *    Whether received file transfer data belongs to a cancelled copy.
+ *
+ * Results:
+ *    TRUE to drop the packet.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+DiscardOnArrival(MKSVchanPacketType packetType) // IN
+{
+   if (!IsCancelling()) {
+      return FALSE;
+   }
+
+   if (discardedCount++ == 0) {
+      Log("%s: Discarding %s of the cancelled copy.\n", __FUNCTION__,
+          GetMKSVchanPacketTypeAsString(packetType));
+   }
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanCancel::CountDropped --
+ *
+ *    Account packets the send queue dropped for a cancelled token.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+CountDropped(uint32 packets) // IN
+{
+   droppedCount += packets;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanCancel::CheckQuiescent --
+ *
+ *    Finish the cancel statistics once no file transfer data is queued or
+ *    in flight any more. Called after every drain while cancelling.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Publishes the statistics to MKSVchanMetrics.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+CheckQuiescent()
+{
+   if (!quiescePending) {
+      return;
+   }
+
+   MKSVchanBudget::PacketClass ftClass = MKSVchanBudget::PacketClass_FileTransfer;
+   if (MKSVchanBudget::GetQueued(ftClass) > 0 ||
+       MKSVchanBudget::GetInFlight(ftClass) > 0) {
+      return;
+   }
+
+   quiescePending = FALSE;
+   lastStats.quiesceMS = (uint32)std::chrono::duration_cast<
+      std::chrono::milliseconds>(Clock::now() - cancelTime).count();
+   lastStats.droppedPackets = droppedCount;
+   lastStats.discardedPackets = discardedCount;
+   lastStats.queuedBytes = queuedAtCancel;
+   lastStats.inFlightBytes = inFlightAtCancel;
+   haveLastStats = TRUE;
+   MKSVchanMetrics::RecordCancel(lastStats.quiesceMS, droppedCount,
+                                 discardedCount);
+
+   Log("%s: %s quiescent after %ums; dropped %u queued packets "
+       "(%llu bytes), waited for %llu bytes in flight, discarded %u "
+       "received packets.\n", __FUNCTION__,
+       GetMKSVchanPacketTypeAsString(cancelPacketType), lastStats.quiesceMS,
+       droppedCount, (unsigned long long)queuedAtCancel,
+       (unsigned long long)inFlightAtCancel, discardedCount);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanCancel::GetLastStats --
+ *
+ *    Statistics of the last cancel that has quiesced.
+ *
+ * Results:
+ *    FALSE if no cancel has quiesced yet.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+GetLastStats(Stats *stats) // OUT
+{
+   if (!haveLastStats) {
+      return FALSE;
+   }
+   *stats = lastStats;
+   return TRUE;
+}
+
+} // namespace MKSVchanCancel
@@ -0,0 +1,60 @@
+/* **************************************************************************** *
+ * Copyright (C) 2020 VMware, Inc.  All rights reserved. -- VMware Confidential *
+ * **************************************************************************** */
+
+/*
+ * MKSVchanCancel.h --
+ *
+ *    Cancellation of the DnD/FCP copy pipeline.
+ *
+ *    A token is a generation number. Cancel() moves the generation to an
+ *    odd "cancelling" value, which makes every token taken before it, and
+ *    the current one, cancelled. BeginCopy() moves it to the next even
+ *    value when a new copy starts, so tokens of the cancelled copy stay
+ *    cancelled. Checking a token is a single atomic load, so producer
+ *    threads can poll it per chunk.
+ *
+ *    MKSVchanSendQueue stamps file transfer data with the token it was
+ *    posted under and drops cancelled packets instead of sending them.
+ *    The plugin stops scheduling chunks from OnDone of chunks sent before
+ *    the cancel and discards file data that arrives while cancelling,
+ *    right before it would reach FT::ReceiveFileData.
+ *
+ *    The time from Cancel() until no file transfer bytes are queued or in
+ *    flight, and the packets dropped and discarded on the way, are kept
+ *    for GetLastStats() and published through MKSVchanMetrics.
+ */
+
+#ifndef _MKSVCHAN_CANCEL_H_
+#define _MKSVCHAN_CANCEL_H_
+
+#include "MKSVchanRPCPlugin.h"
+
+namespace MKSVchanCancel {
+
+typedef uint32 Token;
+
+struct Stats {
+   uint32 quiesceMS;        // Cancel() until nothing queued or in flight
+   uint32 droppedPackets;   // Queued packets never sent
+   uint32 discardedPackets; // Received packets not delivered
+   uint64 queuedBytes;      // File data queued at Cancel()
+   uint64 inFlightBytes;    // File data in flight at Cancel()
+};
+
+// Any thread
+Token GetToken();
+Bool IsCancelled(Token token);
+Bool IsCancelling();
+
+// vdpservice thread
+void Cancel(MKSVchanPacketType packetType);
+void BeginCopy();
+Bool DiscardOnArrival(MKSVchanPacketType packetType);
+void CountDropped(uint32 packets);
+void CheckQuiescent();
+Bool GetLastStats(Stats *stats);
+
+} // namespace MKSVchanCancel
+
+#endif // _MKSVCHAN_CANCEL_H_
@@ -0,0 +1,477 @@
+/* **************************************************************************** *
+ * Copyright (C) 2020 VMware, Inc.  All rights reserved. -- VMware Confidential *
+ * **************************************************************************** */
+
+/*
+ * MKSVchanCapCache.cpp --
+ *
+ *    Implements the capability cache for reconnect handshakes.
+ */
+
+#include "MKSVchanCapCache.h"
+
+#include <chrono>
+#include <list>
+#include <map>
+#include <string.h>
+#include <vector>
+
+namespace MKSVchanCapCache {
+
+typedef std::chrono::steady_clock Clock;
+typedef std::map<uint32, std::vector<uint8> > CapSet;
+
+// Sender state, vdpservice thread only
+static CapSet lastSent;             // What the last session sent
+static CapSet sent;                 // What this session sent so far
+static CapSet peerSet;              // What the peer has, once it acked
+static uint64 offeredFingerprint = 0;
+static Bool peerMatched = FALSE;
+static uint32 suppressedCount = 0;
+static uint64 suppressedBytes = 0;
+
+// Receiver state
+static std::list<std::pair<uint64, CapSet> > knownSets;   // Most recent first
+static CapSet received;
+static Clock::time_point readyTime;
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * ElapsedMS --
+ *
+ *    Milliseconds since the channel became ready.
+ *
+ * Results:
+ *    Milliseconds.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static unsigned long long
+ElapsedMS()
+{
+   return (unsigned long long)std::chrono::duration_cast<
+      std::chrono::milliseconds>(Clock::now() - readyTime).count();
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * Fingerprint --
+ *
+ *    64-bit FNV-1a over the type, length and payload of every packet of
+ *    the set, in type order.
+ *
+ * Results:
+ *    The fingerprint, never 0 for a non-empty set.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static uint64
+Fingerprint(const CapSet &set) // IN
+{
+   uint64 hash = 0xcbf29ce484222325ULL;
+   CapSet::const_iterator it;
+
+   for (it = set.begin(); it != set.end(); ++it) {
+      uint32 header[2] = { it->first, (uint32)it->second.size() };
+      const uint8 *bytes = reinterpret_cast<const uint8 *>(header);
+      for (size_t i = 0; i < sizeof header; i++) {
+         hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+      }
+      for (size_t i = 0; i < it->second.size(); i++) {
+         hash = (hash ^ it->second[i]) * 0x100000001b3ULL;
+      }
+   }
+   return hash != 0 ? hash : 1;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * SendAck --
+ *
+ *    Answer an offer.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Sends CapCache_Ack.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+SendAck(MKSVchanRPCPlugin *plugin, // IN
+        uint64 fingerprint,        // IN
+        Bool matched)              // IN
+{
+   MKSVchanCapCacheAck ack;
+   ack.version = MKSVCHAN_CAP_CACHE_VERSION;
+   ack.fingerprint = fingerprint;
+   ack.matched = matched ? 1 : 0;
+   plugin->SendMessage(MKSVchanPacketType_CapCache_Ack,
+                       reinterpret_cast<uint8 *>(&ack), sizeof ack);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanCapCache::IsCachedType --
+ *
+ *    Whether a packet type is part of the cached capability set.
+ *
+ * Results:
+ *    TRUE for the one-way capability packets. Policy packets, the
+ *    clipboard state and the file transfer config, are never served from
+ *    the cache: the peer's policy may have changed since they were cached.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+IsCachedType(MKSVchanPacketType packetType) // IN
+{
+   switch (packetType) {
+      case MKSVchanPacketType_Clipboard_Locale:
+      case MKSVchanPacketType_Clipboard_Capabilities:
+         return TRUE;
+      default:
+         return FALSE;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanCapCache::OnChannelReady --
+ *
+ *    Start a session.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+OnChannelReady()
+{
+   readyTime = Clock::now();
+   sent.clear();
+   peerSet.clear();
+   received.clear();
+   peerMatched = FALSE;
+   suppressedCount = 0;
+   suppressedBytes = 0;
+   offeredFingerprint = 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanCapCache::SendOffer --
+ *
+ *    Offer the fingerprint of the set the last session sent, once the
+ *    peer is known to take extension packets. Call before any capability
+ *    packet is sent.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Sends CapCache_Offer if a previous session sent capabilities.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+SendOffer(MKSVchanRPCPlugin *plugin) // IN
+{
+   if (lastSent.empty()) {
+      return;
+   }
+
+   MKSVchanCapCacheOffer offer;
+   offer.version = MKSVCHAN_CAP_CACHE_VERSION;
+   offer.fingerprint = Fingerprint(lastSent);
+   offer.count = (uint32)lastSent.size();
+   offeredFingerprint = offer.fingerprint;
+
+   Log("%s: Offer capability set %016llx of %u packets.\n", __FUNCTION__,
+       (unsigned long long)offer.fingerprint, offer.count);
+   plugin->SendMessage(MKSVchanPacketType_CapCache_Offer,
+                       reinterpret_cast<uint8 *>(&offer), sizeof offer);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanCapCache::OnChannelNotReady --
+ *
+ *    End the session, remembering what was sent and received.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    May drop the least recently used received set.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+OnChannelNotReady()
+{
+   if (suppressedCount > 0) {
+      Log("%s: Skipped %u capability packets (%llu bytes) the peer had "
+          "cached.\n", __FUNCTION__, suppressedCount,
+          (unsigned long long)suppressedBytes);
+   }
+
+   if (!sent.empty()) {
+      lastSent.swap(sent);
+      sent.clear();
+   }
+
+   if (!received.empty()) {
+      uint64 fingerprint = Fingerprint(received);
+      std::list<std::pair<uint64, CapSet> >::iterator it;
+      for (it = knownSets.begin(); it != knownSets.end(); ++it) {
+         if (it->first == fingerprint) {
+            knownSets.erase(it);
+            break;
+         }
+      }
+      knownSets.push_front(std::make_pair(fingerprint, CapSet()));
+      knownSets.front().second.swap(received);
+      if (knownSets.size() > MKSVCHAN_CAP_CACHE_MAX_SETS) {
+         knownSets.pop_back();
+      }
+   }
+
+   peerSet.clear();
+   received.clear();
+   peerMatched = FALSE;
+   offeredFingerprint = 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanCapCache::ShouldSend --
+ *
+ *    Record an outgoing packet and decide whether it has to go out.
+ *
+ * Results:
+ *    FALSE if the peer acked the cached set and already has this exact
+ *    payload for the type.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+ShouldSend(MKSVchanPacketType packetType, // IN
+           const uint8 *data,             // IN
+           uint32 dataLen)                // IN
+{
+   if (!IsCachedType(packetType)) {
+      return TRUE;
+   }
+
+   std::vector<uint8> payload(data, data + dataLen);
+   sent[packetType] = payload;
+
+   if (!peerMatched) {
+      return TRUE;
+   }
+
+   CapSet::iterator it = peerSet.find(packetType);
+   if (it != peerSet.end() && it->second == payload) {
+      suppressedCount++;
+      suppressedBytes += dataLen;
+      Log("%s: Peer has %s cached, not sending it.\n", __FUNCTION__,
+          GetMKSVchanPacketTypeAsString(packetType));
+      return FALSE;
+   }
+
+   Log("%s: %s changed since the cached set, sending it.\n", __FUNCTION__,
+       GetMKSVchanPacketTypeAsString(packetType));
+   peerSet[packetType].swap(payload);
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanCapCache::HandleAck --
+ *
+ *    The peer answered the offer.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    On a match, later identical capability packets are not sent.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+HandleAck(const uint8 *data, // IN
+          uint32 dataLen)    // IN
+{
+   MKSVchanCapCacheAck ack;
+   if (dataLen < sizeof ack) {
+      Log("%s: Invalid ack of %u bytes.\n", __FUNCTION__, dataLen);
+      return;
+   }
+   memcpy(&ack, data, sizeof ack);
+
+   if (ack.fingerprint != offeredFingerprint || offeredFingerprint == 0) {
+      Log("%s: Ack for %016llx doesn't answer the offer, ignored.\n",
+          __FUNCTION__, (unsigned long long)ack.fingerprint);
+      return;
+   }
+
+   if (ack.matched == 0) {
+      Log("%s: Peer doesn't have set %016llx, full exchange after %llums.\n",
+          __FUNCTION__, (unsigned long long)ack.fingerprint, ElapsedMS());
+      return;
+   }
+
+   // The peer has the old set plus whatever this session sent before now
+   peerMatched = TRUE;
+   peerSet = lastSent;
+   CapSet::const_iterator it;
+   for (it = sent.begin(); it != sent.end(); ++it) {
+      peerSet[it->first] = it->second;
+   }
+   Log("%s: Peer applied cached set %016llx, acked after %llums.\n",
+       __FUNCTION__, (unsigned long long)ack.fingerprint, ElapsedMS());
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanCapCache::HandleOffer --
+ *
+ *    The peer offered a capability set by fingerprint. Apply it if it is
+ *    known.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Calls apply for every packet of a known set. Sends CapCache_Ack.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+HandleOffer(MKSVchanRPCPlugin *plugin, // IN
+            const uint8 *data,         // IN
+            uint32 dataLen,            // IN
+            ApplyFunc apply)           // IN
+{
+   MKSVchanCapCacheOffer offer;
+   if (dataLen < sizeof offer) {
+      Log("%s: Invalid offer of %u bytes.\n", __FUNCTION__, dataLen);
+      return;
+   }
+   memcpy(&offer, data, sizeof offer);
+
+   std::list<std::pair<uint64, CapSet> >::iterator it;
+   for (it = knownSets.begin(); it != knownSets.end(); ++it) {
+      if (it->first == offer.fingerprint &&
+          it->second.size() == offer.count) {
+         break;
+      }
+   }
+
+   if (offer.version != MKSVCHAN_CAP_CACHE_VERSION || it == knownSets.end()) {
+      Log("%s: Capability set %016llx isn't cached, waiting for the full "
+          "exchange.\n", __FUNCTION__, (unsigned long long)offer.fingerprint);
+      SendAck(plugin, offer.fingerprint, FALSE);
+      return;
+   }
+
+   knownSets.splice(knownSets.begin(), knownSets, it);
+   const CapSet &set = knownSets.front().second;
+
+   // Ack first, the sender can stop sending identical packets sooner
+   SendAck(plugin, offer.fingerprint, TRUE);
+
+   CapSet::const_iterator cap;
+   for (cap = set.begin(); cap != set.end(); ++cap) {
+      const uint8 *payload = cap->second.empty() ? NULL : &cap->second[0];
+      apply((MKSVchanPacketType)cap->first, payload,
+            (uint32)cap->second.size());
+   }
+   received = set;
+
+   Log("%s: Applied cached capability set %016llx of %u packets %llums "
+       "after OnReady.\n", __FUNCTION__,
+       (unsigned long long)offer.fingerprint, offer.count, ElapsedMS());
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanCapCache::RecordReceived --
+ *
+ *    Record a capability packet received through the regular exchange.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+RecordReceived(MKSVchanPacketType packetType, // IN
+               const uint8 *data,             // IN
+               uint32 dataLen)                // IN
+{
+   if (!IsCachedType(packetType)) {
+      return;
+   }
+
+   Log("%s: %s %llums after OnReady.\n", __FUNCTION__,
+       GetMKSVchanPacketTypeAsString(packetType), ElapsedMS());
+   received[packetType].assign(data, data + dataLen);
+}
+
+} // namespace MKSVchanCapCache
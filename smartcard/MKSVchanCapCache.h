@@ -0,0 +1,85 @@
+/* **************************************************************************** *
+ * Copyright (C) 2020 VMware, Inc.  All rights reserved. -- VMware Confidential *
+ * **************************************************************************** */
+
+/*
+ * MKSVchanCapCache.h --
+ *
+ *    Cache of the capability set exchanged at connect time, so that a
+ *    reconnect to the same peer doesn't have to wait for the full
+ *    exchange.
+ *
+ *    The capability set is the latest payload of each of the cached
+ *    packet types, see IsCachedType. Its fingerprint is a hash over the
+ *    (type, payload) pairs in type order, so both ends compute the same
+ *    value for the same set.
+ *
+ *    The sender remembers the set it sent in the last session and sends
+ *    its fingerprint in CapCache_Offer, ahead of its capability packets. The receiver keeps the sets it received keyed by their
+ *    fingerprint. If it has the offered one it applies it right away and
+ *    answers with a matching CapCache_Ack; otherwise it waits for the
+ *    regular packets.
+ *
+ *    The regular capability packets are still produced every session.
+ *    Once the peer acked, those identical to what the peer has are not
+ *    sent; a changed one is sent and replaces the cached value, which is
+ *    what a full exchange does. A peer without the cache never acks and
+ *    gets everything.
+ *
+ *    DnD capabilities are a negotiation with the DnD handler rather than
+ *    a one-way setting, so they are always exchanged. Policy packets
+ *    (ClipboardState, FileTransfer_Config) are always exchanged too, so a
+ *    policy change on the peer can't be bypassed by a cached copy.
+ */
+
+#ifndef _MKSVCHAN_CAP_CACHE_H_
+#define _MKSVCHAN_CAP_CACHE_H_
+
+#include "MKSVchanRPCPlugin.h"
+#include "MKSVchanPacketTypeExt.h"
+
+#define MKSVCHAN_CAP_CACHE_VERSION 1
+
+// Capability sets the receiver keeps, least recently used dropped first
+#define MKSVCHAN_CAP_CACHE_MAX_SETS 8
+
+#pragma pack(push, 1)
+typedef struct MKSVchanCapCacheOffer {
+   uint32 version;
+   uint64 fingerprint;
+   uint32 count;          // Number of packets in the set
+} MKSVchanCapCacheOffer;
+
+typedef struct MKSVchanCapCacheAck {
+   uint32 version;
+   uint64 fingerprint;    // Fingerprint of the offer being answered
+   uint32 matched;        // 1 if the receiver applied its cached set
+} MKSVchanCapCacheAck;
+#pragma pack(pop)
+
+namespace MKSVchanCapCache {
+
+typedef void (*ApplyFunc)(MKSVchanPacketType packetType, const uint8 *data,
+                          uint32 dataLen);
+
+Bool IsCachedType(MKSVchanPacketType packetType);
+
+// vdpservice thread
+void OnChannelReady();
+void SendOffer(MKSVchanRPCPlugin *plugin);
+void OnChannelNotReady();
+
+// Sender
+Bool ShouldSend(MKSVchanPacketType packetType, const uint8 *data,
+                uint32 dataLen);
+void HandleAck(const uint8 *data, uint32 dataLen);
+
+// Receiver
+void HandleOffer(MKSVchanRPCPlugin *plugin, const uint8 *data,
+                 uint32 dataLen, ApplyFunc apply);
+void RecordReceived(MKSVchanPacketType packetType, const uint8 *data,
+                    uint32 dataLen);
+
+} // namespace MKSVchanCapCache
+
+#endif // _MKSVCHAN_CAP_CACHE_H_
@@ -0,0 +1,980 @@
+/* **************************************************************************** *
+ * Copyright (C) 2020 VMware, Inc.  All rights reserved. -- VMware Confidential *
+ * **************************************************************************** */
+
+/*
+ * MKSVchanMetrics.cpp --
+ *
+ *    Implements the MKSVchan metrics counters and the local scrape endpoint.
+ */
+
+#include "MKSVchanMetrics.h"
+#include "MKSVchanPacketTypeExt.h"
+#include "MKSVchanPayloadBuffer.h"
+
+#include <atomic>
+#include <chrono>
+#include <sstream>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <thread>
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <sddl.h>
+#else
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+/*
+ * How often the endpoint thread wakes up to check whether it should exit.
+ */
+#define METRICS_POLL_INTERVAL_MS 500
+
+/*
+ * Windows: a failed pipe connect is retried after a delay which doubles up
+ * to METRICS_PIPE_MAX_BACKOFF_MS; the endpoint gives up after
+ * METRICS_PIPE_MAX_FAILURES failures in a row.
+ */
+#define METRICS_PIPE_MAX_BACKOFF_MS 30000
+#define METRICS_PIPE_MAX_FAILURES 10
+
+#define METRICS_HTTP_HEADER                                   \
+   "HTTP/1.0 200 OK\r\n"                                      \
+   "Content-Type: text/plain; version=0.0.4\r\n"              \
+   "Connection: close\r\n\r\n"
+
+/*
+ * Counter slots: the regular packet types, the extension packet types,
+ * then "other".
+ */
+#define METRICS_EXT_SLOT_BASE MKSVCHAN_METRICS_MAX_PACKET_TYPES
+#define METRICS_OTHER_SLOT \
+   (METRICS_EXT_SLOT_BASE + MKSVCHAN_PACKET_TYPE_EXT_COUNT)
+#define METRICS_SLOT_COUNT (METRICS_OTHER_SLOT + 1)
+
+typedef std::chrono::steady_clock MetricsClock;
+
+namespace {
+
+std::atomic<uint64> g_bytesSent[METRICS_SLOT_COUNT];
+std::atomic<uint64> g_bytesReceived[METRICS_SLOT_COUNT];
+std::atomic<uint64> g_packetsSent[METRICS_SLOT_COUNT];
+std::atomic<uint64> g_packetsReceived[METRICS_SLOT_COUNT];
+
+std::atomic<int64> g_inFlightRequests(0);
+std::atomic<int64> g_inFlightBytes(0);
+std::atomic<uint32> g_queueDepth(0);
+
+/*
+ * File transfer throughput is measured between consecutive acknowledged
+ * chunks and smoothed, so a single slow OnDone does not dominate.
+ */
+std::atomic<uint64> g_ftBytesPerSecond(0);
+std::atomic<int64> g_ftLastDoneNs(0);
+
+std::atomic<uint32> g_timeToReadyMS(0);
+std::atomic<uint32> g_timeToPeerMS(0);
+
+// The last DnD/FCP cancel, published once it has quiesced.
+std::atomic<uint32> g_cancelQuiesceMS(0);
+std::atomic<uint32> g_cancelDroppedPackets(0);
+std::atomic<uint32> g_cancelDiscardedPackets(0);
+
+// 0 means no inventory has been sent or received yet.
+std::atomic<int64> g_scInventoryNs(0);
+
+std::atomic<bool> g_stopRequested(false);
+std::thread g_endpointThread;
+std::string g_endpointPath;
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * PacketTypeSlot --
+ *
+ *    Map a packet type onto its counter slot.
+ *
+ * Results:
+ *    Index into the per packet type counter arrays.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+size_t
+PacketTypeSlot(MKSVchanPacketType packetType) // IN
+{
+   size_t slot = static_cast<size_t>(packetType);
+   if (slot < MKSVCHAN_METRICS_MAX_PACKET_TYPES) {
+      return slot;
+   }
+   if (MKSVCHAN_IS_EXT_PACKET_TYPE(packetType) &&
+       slot - MKSVCHAN_PACKET_TYPE_EXT_BASE < MKSVCHAN_PACKET_TYPE_EXT_COUNT) {
+      return METRICS_EXT_SLOT_BASE + slot - MKSVCHAN_PACKET_TYPE_EXT_BASE;
+   }
+   return METRICS_OTHER_SLOT;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * NowNs --
+ *
+ *    Monotonic timestamp used by the age and throughput gauges.
+ *
+ * Results:
+ *    Nanoseconds since an unspecified epoch, never 0.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+int64
+NowNs()
+{
+   int64 now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      MetricsClock::now().time_since_epoch()).count();
+   return now != 0 ? now : 1;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * AppendPacketCounter --
+ *
+ *    Append one per packet type counter family to the exposition text.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+AppendPacketCounter(std::ostringstream &out,          // IN/OUT
+                    const char *name,                 // IN
+                    const char *help,                 // IN
+                    const std::atomic<uint64> *slots) // IN
+{
+   out << "# HELP " << name << " " << help << "\n";
+   out << "# TYPE " << name << " counter\n";
+   for (size_t i = 0; i < METRICS_SLOT_COUNT; i++) {
+      uint64 value = slots[i].load(std::memory_order_relaxed);
+      if (value == 0) {
+         continue;
+      }
+      const char *typeName = "other";
+      if (i < METRICS_EXT_SLOT_BASE) {
+         typeName = GetMKSVchanPacketTypeAsString(
+            static_cast<MKSVchanPacketType>(i));
+      } else if (i < METRICS_OTHER_SLOT) {
+         typeName = GetMKSVchanExtPacketTypeAsString(
+            MKSVCHAN_PACKET_TYPE_EXT(i - METRICS_EXT_SLOT_BASE));
+      }
+      out << name << "{packet_type=\"" << typeName << "\"} " << value << "\n";
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * FormatMetrics --
+ *
+ *    Render all counters in the Prometheus text exposition format.
+ *
+ * Results:
+ *    The response body.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+std::string
+FormatMetrics()
+{
+   std::ostringstream out;
+
+   AppendPacketCounter(out, "mksvchan_sent_bytes_total",
+                       "Payload bytes handed to the channel.", g_bytesSent);
+   AppendPacketCounter(out, "mksvchan_sent_packets_total",
+                       "Packets handed to the channel.", g_packetsSent);
+   AppendPacketCounter(out, "mksvchan_received_bytes_total",
+                       "Payload bytes received from the channel.",
+                       g_bytesReceived);
+   AppendPacketCounter(out, "mksvchan_received_packets_total",
+                       "Packets received from the channel.", g_packetsReceived);
+
+   out << "# HELP mksvchan_inflight_requests Requests waiting for OnDone.\n"
+       << "# TYPE mksvchan_inflight_requests gauge\n"
+       << "mksvchan_inflight_requests "
+       << g_inFlightRequests.load(std::memory_order_relaxed) << "\n";
+   out << "# HELP mksvchan_inflight_bytes Payload bytes waiting for OnDone.\n"
+       << "# TYPE mksvchan_inflight_bytes gauge\n"
+       << "mksvchan_inflight_bytes "
+       << g_inFlightBytes.load(std::memory_order_relaxed) << "\n";
+   out << "# HELP mksvchan_queue_depth Sends queued ahead of the channel.\n"
+       << "# TYPE mksvchan_queue_depth gauge\n"
+       << "mksvchan_queue_depth "
+       << g_queueDepth.load(std::memory_order_relaxed) << "\n";
+   out << "# HELP mksvchan_filetransfer_send_bytes_per_second "
+          "Smoothed file transfer throughput.\n"
+       << "# TYPE mksvchan_filetransfer_send_bytes_per_second gauge\n"
+       << "mksvchan_filetransfer_send_bytes_per_second "
+       << g_ftBytesPerSecond.load(std::memory_order_relaxed) << "\n";
+
+   out << "# HELP mksvchan_time_to_ready_ms Duration of the last OnReady.\n"
+       << "# TYPE mksvchan_time_to_ready_ms gauge\n"
+       << "mksvchan_time_to_ready_ms "
+       << g_timeToReadyMS.load(std::memory_order_relaxed) << "\n";
+   out << "# HELP mksvchan_time_to_peer_ms Time from the last OnReady to "
+          "the first packet from the peer.\n"
+       << "# TYPE mksvchan_time_to_peer_ms gauge\n"
+       << "mksvchan_time_to_peer_ms "
+       << g_timeToPeerMS.load(std::memory_order_relaxed) << "\n";
+
+   out << "# HELP mksvchan_cancel_quiesce_ms Time from the last copy cancel "
+          "until no file data was queued or in flight.\n"
+       << "# TYPE mksvchan_cancel_quiesce_ms gauge\n"
+       << "mksvchan_cancel_quiesce_ms "
+       << g_cancelQuiesceMS.load(std::memory_order_relaxed) << "\n";
+   out << "# HELP mksvchan_cancel_dropped_packets Queued file data packets "
+          "the last copy cancel dropped.\n"
+       << "# TYPE mksvchan_cancel_dropped_packets gauge\n"
+       << "mksvchan_cancel_dropped_packets "
+       << g_cancelDroppedPackets.load(std::memory_order_relaxed) << "\n";
+   out << "# HELP mksvchan_cancel_discarded_packets Received file data "
+          "packets discarded after the last copy cancel.\n"
+       << "# TYPE mksvchan_cancel_discarded_packets gauge\n"
+       << "mksvchan_cancel_discarded_packets "
+       << g_cancelDiscardedPackets.load(std::memory_order_relaxed) << "\n";
+
+   out << "# HELP mksvchan_payload_memory_bytes "
+          "Heap bytes held by clipboard and DnD payload buffers.\n"
+       << "# TYPE mksvchan_payload_memory_bytes gauge\n"
+       << "mksvchan_payload_memory_bytes "
+       << MKSVchanPayloadBuffer::GetMemoryInUse() << "\n";
+   out << "# HELP mksvchan_payload_spilled_bytes "
+          "Payload buffer bytes spilled to temp files.\n"
+       << "# TYPE mksvchan_payload_spilled_bytes gauge\n"
+       << "mksvchan_payload_spilled_bytes "
+       << MKSVchanPayloadBuffer::GetSpilledBytes() << "\n";
+
+   int64 inventoryNs = g_scInventoryNs.load(std::memory_order_relaxed);
+   if (inventoryNs != 0) {
+      out << "# HELP mksvchan_smartcard_inventory_age_seconds "
+             "Seconds since smart card info was last sent or received.\n"
+          << "# TYPE mksvchan_smartcard_inventory_age_seconds gauge\n"
+          << "mksvchan_smartcard_inventory_age_seconds "
+          << (NowNs() - inventoryNs) / 1000000000 << "\n";
+   }
+
+   return out.str();
+}
+
+
+#if defined(_WIN32)
+/*
+ *----------------------------------------------------------------------------
+ *
+ * CreateUserOnlySecurity --
+ *
+ *    Build a security descriptor whose DACL only grants the user this
+ *    process runs as access, so other users on the machine can't read the
+ *    metrics.
+ *
+ * Results:
+ *    The descriptor, to be freed with LocalFree; NULL on failure.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+PSECURITY_DESCRIPTOR
+CreateUserOnlySecurity()
+{
+   HANDLE token = NULL;
+   if (!OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &token)) {
+      Log("%s: OpenProcessToken failed, error %d.\n", __FUNCTION__,
+          GetLastError());
+      return NULL;
+   }
+
+   DWORD userLen = 0;
+   GetTokenInformation(token, TokenUser, NULL, 0, &userLen);
+   std::string userBuf(userLen, '\0');
+   char *userSid = NULL;
+   if (userLen == 0 ||
+       !GetTokenInformation(token, TokenUser, &userBuf[0], userLen,
+                            &userLen) ||
+       !ConvertSidToStringSidA(
+          reinterpret_cast<TOKEN_USER *>(&userBuf[0])->User.Sid, &userSid)) {
+      Log("%s: Unable to get the user SID, error %d.\n", __FUNCTION__,
+          GetLastError());
+      CloseHandle(token);
+      return NULL;
+   }
+   CloseHandle(token);
+
+   // Protected DACL with a single entry: full access for the user
+   std::string sddl = std::string("D:P(A;;GA;;;") + userSid + ")";
+   LocalFree(userSid);
+
+   PSECURITY_DESCRIPTOR descriptor = NULL;
+   if (!ConvertStringSecurityDescriptorToSecurityDescriptorA(
+          sddl.c_str(), SDDL_REVISION_1, &descriptor, NULL)) {
+      Log("%s: Unable to build the security descriptor, error %d.\n",
+          __FUNCTION__, GetLastError());
+      return NULL;
+   }
+   return descriptor;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * WaitForStopOrTimeout --
+ *
+ *    Sleep, waking up every METRICS_POLL_INTERVAL_MS to check for Stop().
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+WaitForStopOrTimeout(DWORD timeoutMS) // IN
+{
+   while (timeoutMS > 0 && !g_stopRequested.load()) {
+      DWORD slice = timeoutMS < METRICS_POLL_INTERVAL_MS ?
+                    timeoutMS : METRICS_POLL_INTERVAL_MS;
+      Sleep(slice);
+      timeoutMS -= slice;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * EndpointThread --
+ *
+ *    Serve scrapes on a named pipe until Stop() is called. Each client gets
+ *    one response and is then disconnected. Only the current user can
+ *    open the pipe, and the pipe must not exist yet, so no other process
+ *    can squat on the name.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+EndpointThread()
+{
+   std::string pipeName = std::string("\\\\.\\pipe\\") + g_endpointPath;
+   PSECURITY_DESCRIPTOR descriptor = CreateUserOnlySecurity();
+   if (descriptor == NULL) {
+      return;
+   }
+   SECURITY_ATTRIBUTES security = { sizeof security, descriptor, FALSE };
+
+   OVERLAPPED ov = { 0 };
+   ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+   if (ov.hEvent == NULL) {
+      Log("%s: CreateEvent failed, error %d.\n", __FUNCTION__, GetLastError());
+      LocalFree(descriptor);
+      return;
+   }
+
+   uint32 failures = 0;
+   while (!g_stopRequested.load()) {
+      DWORD openMode = PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED |
+                       FILE_FLAG_FIRST_PIPE_INSTANCE;
+      DWORD pipeMode = PIPE_TYPE_BYTE | PIPE_REJECT_REMOTE_CLIENTS;
+      HANDLE pipe = CreateNamedPipeA(pipeName.c_str(), openMode, pipeMode,
+                                     1, 64 * 1024, 4 * 1024, 0, &security);
+      if (pipe == INVALID_HANDLE_VALUE) {
+         Log("%s: CreateNamedPipe %s failed, error %d.\n", __FUNCTION__,
+             pipeName.c_str(), GetLastError());
+         break;
+      }
+
+      ResetEvent(ov.hEvent);
+      BOOL connected = ConnectNamedPipe(pipe, &ov);
+      DWORD err = 0;
+      if (!connected) {
+         err = GetLastError();
+         if (err == ERROR_IO_PENDING) {
+            while (!g_stopRequested.load() &&
+                   WaitForSingleObject(ov.hEvent, METRICS_POLL_INTERVAL_MS) ==
+                      WAIT_TIMEOUT) {
+            }
+            DWORD unused;
+            connected = !g_stopRequested.load() &&
+                        GetOverlappedResult(pipe, &ov, &unused, FALSE);
+            if (!connected) {
+               err = GetLastError();
+               CancelIo(pipe);
+            }
+         } else {
+            connected = (err == ERROR_PIPE_CONNECTED);
+         }
+      }
+
+      if (connected) {
+         failures = 0;
+         std::string response = FormatMetrics();
+         DWORD written = 0;
+         WriteFile(pipe, response.data(), (DWORD)response.size(), &written,
+                   NULL);
+         FlushFileBuffers(pipe);
+         DisconnectNamedPipe(pipe);
+      }
+      CloseHandle(pipe);
+
+      if (!connected && !g_stopRequested.load()) {
+         if (++failures >= METRICS_PIPE_MAX_FAILURES) {
+            Log("%s: ConnectNamedPipe failed %u times in a row, error %d, "
+                "closing the endpoint.\n", __FUNCTION__, failures, err);
+            break;
+         }
+         DWORD backoffMS = METRICS_POLL_INTERVAL_MS << (failures - 1);
+         if (backoffMS > METRICS_PIPE_MAX_BACKOFF_MS) {
+            backoffMS = METRICS_PIPE_MAX_BACKOFF_MS;
+         }
+         Log("%s: ConnectNamedPipe failed, error %d, retrying in %ums.\n",
+             __FUNCTION__, err, backoffMS);
+         WaitForStopOrTimeout(backoffMS);
+      }
+   }
+
+   CloseHandle(ov.hEvent);
+   LocalFree(descriptor);
+}
+#else
+/*
+ *----------------------------------------------------------------------------
+ *
+ * RemoveStaleSocket --
+ *
+ *    Remove the socket a previous process left at g_endpointPath. The path
+ *    comes from the environment, so anything that isn't a socket is left
+ *    alone.
+ *
+ * Results:
+ *    TRUE if nothing is in the way of bind any more.
+ *
+ * Side effects:
+ *    May unlink the socket file.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+RemoveStaleSocket()
+{
+   struct stat st;
+   if (lstat(g_endpointPath.c_str(), &st) != 0) {
+      return errno == ENOENT;
+   }
+
+   if (!S_ISSOCK(st.st_mode)) {
+      Log("%s: %s exists and is not a socket, not removing it.\n",
+          __FUNCTION__, g_endpointPath.c_str());
+      return FALSE;
+   }
+   return unlink(g_endpointPath.c_str()) == 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * EndpointThread --
+ *
+ *    Serve scrapes on a Unix domain socket until Stop() is called. The reply
+ *    is a minimal HTTP/1.0 response so that both Prometheus (via a socket
+ *    proxy) and "curl --unix-socket" can read it.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Creates the socket file and removes it again on exit.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+EndpointThread()
+{
+   struct sockaddr_un addr;
+   memset(&addr, 0, sizeof addr);
+   addr.sun_family = AF_UNIX;
+   if (g_endpointPath.size() >= sizeof addr.sun_path) {
+      Log("%s: Endpoint path %s is too long.\n", __FUNCTION__,
+          g_endpointPath.c_str());
+      return;
+   }
+   strncpy(addr.sun_path, g_endpointPath.c_str(), sizeof addr.sun_path - 1);
+
+   int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+   if (listenFd < 0) {
+      Log("%s: socket failed, errno %d.\n", __FUNCTION__, errno);
+      return;
+   }
+
+   // A stale socket from a previous session would make bind fail.
+   if (!RemoveStaleSocket()) {
+      close(listenFd);
+      return;
+   }
+
+   // Only the session user may connect: the socket is created 0600.
+   mode_t oldMask = umask(S_IRWXG | S_IRWXO | S_IXUSR);
+   int bindResult = bind(listenFd, (struct sockaddr *)&addr, sizeof addr);
+   umask(oldMask);
+   if (bindResult != 0 || listen(listenFd, 4) != 0) {
+      Log("%s: Unable to listen on %s, errno %d.\n", __FUNCTION__,
+          g_endpointPath.c_str(), errno);
+      close(listenFd);
+      return;
+   }
+
+   while (!g_stopRequested.load()) {
+      struct pollfd pfd = { listenFd, POLLIN, 0 };
+      if (poll(&pfd, 1, METRICS_POLL_INTERVAL_MS) <= 0) {
+         continue;
+      }
+
+      int clientFd = accept(listenFd, NULL, NULL);
+      if (clientFd < 0) {
+         continue;
+      }
+
+      // Drain whatever request line the client sent; it is not interpreted.
+      char request[512];
+      struct pollfd cfd = { clientFd, POLLIN, 0 };
+      if (poll(&cfd, 1, METRICS_POLL_INTERVAL_MS) > 0) {
+         (void)recv(clientFd, request, sizeof request, 0);
+      }
+
+      std::string response = std::string(METRICS_HTTP_HEADER) + FormatMetrics();
+      size_t offset = 0;
+      while (offset < response.size()) {
+         ssize_t n = send(clientFd, response.data() + offset,
+                          response.size() - offset, 0);
+         if (n <= 0) {
+            break;
+         }
+         offset += (size_t)n;
+      }
+      close(clientFd);
+   }
+
+   close(listenFd);
+   RemoveStaleSocket();
+}
+#endif
+
+} // anonymous namespace
+
+
+namespace MKSVchanMetrics {
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanMetrics::Start --
+ *
+ *    Start the scrape endpoint if MKSVCHAN_METRICS_ENV_NAME is set.
+ *
+ * Results:
+ *    TRUE if the endpoint thread is running.
+ *
+ * Side effects:
+ *    Spawns the endpoint thread.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+Start()
+{
+   if (g_endpointThread.joinable()) {
+      return TRUE;
+   }
+
+   const char *endpoint = getenv(MKSVCHAN_METRICS_ENV_NAME);
+   if (endpoint == NULL || *endpoint == '\0') {
+      return FALSE;
+   }
+
+   g_endpointPath = endpoint;
+   g_stopRequested = false;
+   g_endpointThread = std::thread(EndpointThread);
+   Log("%s: Serving MKSVchan metrics on %s.\n", __FUNCTION__, endpoint);
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanMetrics::Stop --
+ *
+ *    Stop the scrape endpoint and wait for its thread to exit.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+Stop()
+{
+   if (!g_endpointThread.joinable()) {
+      return;
+   }
+
+   g_stopRequested = true;
+   g_endpointThread.join();
+   Log("%s: MKSVchan metrics endpoint stopped.\n", __FUNCTION__);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanMetrics::RecordSend --
+ *
+ *    Account a packet handed to InvokeMessage. Packets with a payload are
+ *    tracked in m_requestList until OnDone, so they count as in flight.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+RecordSend(MKSVchanPacketType packetType, // IN
+           uint32 dataLen)                // IN
+{
+   size_t slot = PacketTypeSlot(packetType);
+   g_packetsSent[slot].fetch_add(1, std::memory_order_relaxed);
+   g_bytesSent[slot].fetch_add(dataLen, std::memory_order_relaxed);
+
+   if (dataLen != 0) {
+      g_inFlightRequests.fetch_add(1, std::memory_order_relaxed);
+      g_inFlightBytes.fetch_add(dataLen, std::memory_order_relaxed);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanMetrics::RecordSendDone --
+ *
+ *    Account a request leaving m_requestList and update the file transfer
+ *    throughput estimate. Compressed and sparse frames count with the
+ *    bytes they took on the wire, which is what the link carried.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+RecordSendDone(MKSVchanPacketType packetType, // IN
+               uint32 dataLen)                // IN
+{
+   g_inFlightRequests.fetch_sub(1, std::memory_order_relaxed);
+   g_inFlightBytes.fetch_sub(dataLen, std::memory_order_relaxed);
+
+   switch ((uint32)packetType) {
+      case MKSVchanPacketType_FileTransferData_File:
+      case MKSVchanPacketType_FileTransferData_Compressed:
+      case MKSVchanPacketType_FileTransferData_Sparse:
+         break;
+
+      default:
+         return;
+   }
+
+   int64 now = NowNs();
+   int64 last = g_ftLastDoneNs.exchange(now, std::memory_order_relaxed);
+   if (last == 0 || now <= last) {
+      return;
+   }
+
+   uint64 sample = (uint64)dataLen * 1000000000ULL / (uint64)(now - last);
+   uint64 previous = g_ftBytesPerSecond.load(std::memory_order_relaxed);
+   // Exponential moving average with alpha = 1/8.
+   g_ftBytesPerSecond.store(previous == 0 ? sample :
+                            previous - previous / 8 + sample / 8,
+                            std::memory_order_relaxed);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanMetrics::GetFileTransferSendRate --
+ *
+ *    Smoothed rate at which file transfer chunks are acknowledged.
+ *
+ * Results:
+ *    Bytes per second, 0 if not measured yet.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+uint64
+GetFileTransferSendRate()
+{
+   return g_ftBytesPerSecond.load(std::memory_order_relaxed);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanMetrics::RecordReceive --
+ *
+ *    Account a packet received in OnInvoke.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+RecordReceive(MKSVchanPacketType packetType) // IN
+{
+   g_packetsReceived[PacketTypeSlot(packetType)].fetch_add(
+      1, std::memory_order_relaxed);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanMetrics::RecordReceiveBytes --
+ *
+ *    Account the payload of a received packet once it has been extracted.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+RecordReceiveBytes(MKSVchanPacketType packetType, // IN
+                   uint32 dataLen)                // IN
+{
+   g_bytesReceived[PacketTypeSlot(packetType)].fetch_add(
+      dataLen, std::memory_order_relaxed);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanMetrics::ResetInFlight --
+ *
+ *    Called when m_requestList is dropped on disconnect.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+ResetInFlight()
+{
+   g_inFlightRequests = 0;
+   g_inFlightBytes = 0;
+   g_ftLastDoneNs = 0;
+   g_ftBytesPerSecond = 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanMetrics::SetQueueDepth --
+ *
+ *    Publish the number of sends waiting ahead of InvokeMessage.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+SetQueueDepth(uint32 depth) // IN
+{
+   g_queueDepth.store(depth, std::memory_order_relaxed);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanMetrics::MarkSmartCardInventory --
+ *
+ *    Record that smart card info was just sent (client) or received (agent).
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+MarkSmartCardInventory()
+{
+   g_scInventoryNs.store(NowNs(), std::memory_order_relaxed);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanMetrics::SetTimeToReady --
+ *
+ *    Publish how long the last OnReady took.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+SetTimeToReady(uint32 readyMS) // IN
+{
+   g_timeToReadyMS.store(readyMS, std::memory_order_relaxed);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanMetrics::SetTimeToPeer --
+ *
+ *    Publish how long after the last OnReady the peer's first packet
+ *    arrived, which is when the channel carries traffic both ways.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+SetTimeToPeer(uint32 peerMS) // IN
+{
+   g_timeToPeerMS.store(peerMS, std::memory_order_relaxed);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanMetrics::RecordCancel --
+ *
+ *    Publish how the last DnD/FCP cancel went, once it has quiesced.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+RecordCancel(uint32 quiesceMS,        // IN
+             uint32 droppedPackets,   // IN
+             uint32 discardedPackets) // IN
+{
+   g_cancelQuiesceMS.store(quiesceMS, std::memory_order_relaxed);
+   g_cancelDroppedPackets.store(droppedPackets, std::memory_order_relaxed);
+   g_cancelDiscardedPackets.store(discardedPackets, std::memory_order_relaxed);
+}
+
+} // namespace MKSVchanMetrics
@@ -0,0 +1,59 @@
+/* **************************************************************************** *
+ * Copyright (C) 2020 VMware, Inc.  All rights reserved. -- VMware Confidential *
+ * **************************************************************************** */
+
+/*
+ * MKSVchanMetrics.h --
+ *
+ *    Counters describing the MKSVchan channel and smart card health, plus an
+ *    opt-in local endpoint which serves them in the Prometheus text format.
+ *
+ *    The endpoint is a Unix domain socket (named pipe on Windows) and is
+ *    only started when MKSVCHAN_METRICS_ENV_NAME is set in the environment.
+ *    The socket is created 0600, and an existing file at the path is only
+ *    replaced if it is a socket. The pipe's DACL only admits the current
+ *    user, and the pipe is not opened if the name is taken.
+ *    All counters are atomics, so recording is cheap on the vdpservice
+ *    thread and the endpoint thread never has to synchronize with it.
+ */
+
+#ifndef _MKSVCHAN_METRICS_H_
+#define _MKSVCHAN_METRICS_H_
+
+#include "MKSVchanRPCPlugin.h"
+
+/*
+ * Environment variable holding the endpoint path, e.g.
+ *    /run/user/1000/mksvchan-metrics.sock   (Linux / macOS)
+ *    mksvchan-metrics                       (Windows, \\.\pipe\ is implied)
+ */
+#define MKSVCHAN_METRICS_ENV_NAME "MKSVCHAN_METRICS_ENDPOINT"
+
+/*
+ * Regular packet types above this value are accounted in a shared "other"
+ * bucket. Extension packet types (MKSVchanPacketTypeExt.h) have buckets
+ * of their own.
+ */
+#define MKSVCHAN_METRICS_MAX_PACKET_TYPES 64
+
+namespace MKSVchanMetrics {
+
+Bool Start();
+void Stop();
+
+void RecordSend(MKSVchanPacketType packetType, uint32 dataLen);
+void RecordSendDone(MKSVchanPacketType packetType, uint32 dataLen);
+void RecordReceive(MKSVchanPacketType packetType);
+void RecordReceiveBytes(MKSVchanPacketType packetType, uint32 dataLen);
+void ResetInFlight();
+void SetQueueDepth(uint32 depth);
+void MarkSmartCardInventory();
+void SetTimeToReady(uint32 readyMS);
+void SetTimeToPeer(uint32 peerMS);
+void RecordCancel(uint32 quiesceMS, uint32 droppedPackets,
+                  uint32 discardedPackets);
+uint64 GetFileTransferSendRate();
+
+} // namespace MKSVchanMetrics
+
+#endif // _MKSVCHAN_METRICS_H_
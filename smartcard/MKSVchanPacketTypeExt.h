@@ -0,0 +1,116 @@
+/* **************************************************************************** *
+ * Copyright (C) 2020 VMware, Inc.  All rights reserved. -- VMware Confidential *
+ * **************************************************************************** */
+
+/*
+ * MKSVchanPacketTypeExt.h --
+ *
+ *    Packet types used by optional, negotiated MKSVchan features. They live
+ *    in a private range far above the regular MKSVchanPacketType values, so
+ *    a peer which doesn't know them just logs them as unknown in OnInvoke
+ *    and the feature is never enabled.
+ */
+
+#ifndef _MKSVCHAN_PACKET_TYPE_EXT_H_
+#define _MKSVCHAN_PACKET_TYPE_EXT_H_
+
+#include "MKSVchanRPCPlugin.h"
+
+#define MKSVCHAN_PACKET_TYPE_EXT_BASE 0x4D00
+
+#define MKSVCHAN_PACKET_TYPE_EXT(n) \
+   static_cast<MKSVchanPacketType>(MKSVCHAN_PACKET_TYPE_EXT_BASE + (n))
+
+#define MKSVCHAN_IS_EXT_PACKET_TYPE(t) \
+   ((uint32)(t) >= MKSVCHAN_PACKET_TYPE_EXT_BASE)
+
+// Shared memory transport, see MKSVchanShmTransport.h
+static const MKSVchanPacketType MKSVchanPacketType_Shm_Offer =
+   MKSVCHAN_PACKET_TYPE_EXT(0);
+static const MKSVchanPacketType MKSVchanPacketType_Shm_Setup =
+   MKSVCHAN_PACKET_TYPE_EXT(1);
+static const MKSVchanPacketType MKSVchanPacketType_Shm_Ready =
+   MKSVCHAN_PACKET_TYPE_EXT(2);
+static const MKSVchanPacketType MKSVchanPacketType_Shm_Descriptor =
+   MKSVCHAN_PACKET_TYPE_EXT(3);
+static const MKSVchanPacketType MKSVchanPacketType_Shm_Teardown =
+   MKSVCHAN_PACKET_TYPE_EXT(4);
+
+// File transfer chunk compression, see filetransfer/ftCompress.h
+static const MKSVchanPacketType MKSVchanPacketType_FileTransfer_CompressionOffer =
+   MKSVCHAN_PACKET_TYPE_EXT(5);
+static const MKSVchanPacketType MKSVchanPacketType_FileTransferData_Compressed =
+   MKSVCHAN_PACKET_TYPE_EXT(6);
+
+// Zero runs sent as holes, see filetransfer/ftSparse.h
+static const MKSVchanPacketType MKSVchanPacketType_FileTransfer_SparseOffer =
+   MKSVCHAN_PACKET_TYPE_EXT(7);
+static const MKSVchanPacketType MKSVchanPacketType_FileTransferData_Sparse =
+   MKSVCHAN_PACKET_TYPE_EXT(8);
+
+// Replay of clipboard data across a channel drop, see MKSVchanReplay.h
+static const MKSVchanPacketType MKSVchanPacketType_Replay_Offer =
+   MKSVCHAN_PACKET_TYPE_EXT(9);
+static const MKSVchanPacketType MKSVchanPacketType_Replay_Data =
+   MKSVCHAN_PACKET_TYPE_EXT(10);
+
+// Capability set cached across reconnects, see MKSVchanCapCache.h
+static const MKSVchanPacketType MKSVchanPacketType_CapCache_Offer =
+   MKSVCHAN_PACKET_TYPE_EXT(11);
+static const MKSVchanPacketType MKSVchanPacketType_CapCache_Ack =
+   MKSVCHAN_PACKET_TYPE_EXT(12);
+
+// Binary smart card inventory, see scInventoryWire.h
+static const MKSVchanPacketType MKSVchanPacketType_SmartCard_FormatOffer =
+   MKSVCHAN_PACKET_TYPE_EXT(13);
+static const MKSVchanPacketType MKSVchanPacketType_SmartCardInfo_Binary =
+   MKSVCHAN_PACKET_TYPE_EXT(14);
+
+// One more than the highest index above
+#define MKSVCHAN_PACKET_TYPE_EXT_COUNT 15
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * GetMKSVchanExtPacketTypeAsString --
+ *
+ *    Name of an extension packet type, which GetMKSVchanPacketTypeAsString
+ *    doesn't know.
+ *
+ * Results:
+ *    The name, "unknown" for an index without one.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static inline const char *
+GetMKSVchanExtPacketTypeAsString(MKSVchanPacketType packetType) // IN
+{
+   static const char *const names[MKSVCHAN_PACKET_TYPE_EXT_COUNT] = {
+      "Shm_Offer",
+      "Shm_Setup",
+      "Shm_Ready",
+      "Shm_Descriptor",
+      "Shm_Teardown",
+      "FileTransfer_CompressionOffer",
+      "FileTransferData_Compressed",
+      "FileTransfer_SparseOffer",
+      "FileTransferData_Sparse",
+      "Replay_Offer",
+      "Replay_Data",
+      "CapCache_Offer",
+      "CapCache_Ack",
+      "SmartCard_FormatOffer",
+      "SmartCardInfo_Binary",
+   };
+   uint32 index = (uint32)packetType - MKSVCHAN_PACKET_TYPE_EXT_BASE;
+
+   return MKSVCHAN_IS_EXT_PACKET_TYPE(packetType) &&
+          index < MKSVCHAN_PACKET_TYPE_EXT_COUNT ? names[index] : "unknown";
+}
+
+#endif // _MKSVCHAN_PACKET_TYPE_EXT_H_
@@ -0,0 +1,573 @@
+/* **************************************************************************** *
+ * Copyright (C) 2020 VMware, Inc.  All rights reserved. -- VMware Confidential *
+ * **************************************************************************** */
+
+/*
+ * MKSVchanPayloadBuffer.cpp --
+ *
+ *    Implements the spill-to-disk payload buffer.
+ */
+
+#include "MKSVchanPayloadBuffer.h"
+#include "log.h"
+
+#include <atomic>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <errno.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#define PAYLOAD_MIN_CAPACITY (64 * 1024)
+#define PAYLOAD_FILE_GRANULARITY (1024 * 1024)
+
+static std::atomic<size_t> g_payloadBudget(MKSVCHAN_PAYLOAD_DEFAULT_BUDGET);
+static std::atomic<size_t> g_payloadMemoryInUse(0);
+static std::atomic<size_t> g_payloadSpilledBytes(0);
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * ChargeMemory --
+ *
+ *    Account heap memory against the process wide budget.
+ *
+ * Results:
+ *    TRUE if the bytes fit in the budget and were charged.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static Bool
+ChargeMemory(size_t bytes) // IN
+{
+   size_t inUse = g_payloadMemoryInUse.load(std::memory_order_relaxed);
+   do {
+      if (inUse + bytes > g_payloadBudget.load(std::memory_order_relaxed)) {
+         return FALSE;
+      }
+   } while (!g_payloadMemoryInUse.compare_exchange_weak(inUse, inUse + bytes));
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanPayloadBuffer::MKSVchanPayloadBuffer --
+ *
+ *    Constructor.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+MKSVchanPayloadBuffer::MKSVchanPayloadBuffer()
+   : m_data(NULL),
+     m_size(0),
+     m_capacity(0),
+     m_spilled(FALSE),
+#if defined(_WIN32)
+     m_file(INVALID_HANDLE_VALUE),
+     m_mapping(NULL)
+#else
+     m_fd(-1)
+#endif
+{
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanPayloadBuffer::~MKSVchanPayloadBuffer --
+ *
+ *    Destructor.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Frees the heap memory or closes the temp file.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+MKSVchanPayloadBuffer::~MKSVchanPayloadBuffer()
+{
+   Release();
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanPayloadBuffer::Append --
+ *
+ *    Append bytes at the end of the payload.
+ *
+ * Results:
+ *    FALSE if neither memory nor the temp file could hold the payload.
+ *
+ * Side effects:
+ *    May spill the buffer to disk.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+MKSVchanPayloadBuffer::Append(const uint8 *data, // IN
+                              size_t len)        // IN
+{
+   uint8 *dest = Extend(len);
+   if (dest == NULL) {
+      return FALSE;
+   }
+   memcpy(dest, data, len);
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanPayloadBuffer::Extend --
+ *
+ *    Grow the payload by len bytes and hand out the new range, so receivers
+ *    can fill it in place.
+ *
+ * Results:
+ *    Pointer to the new, uninitialized bytes. NULL on failure, in which
+ *    case the buffer is unchanged.
+ *
+ * Side effects:
+ *    May spill the buffer to disk. Pointers previously returned by Data()
+ *    or Extend() become invalid.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+uint8 *
+MKSVchanPayloadBuffer::Extend(size_t len) // IN
+{
+   if (len > (size_t)-1 - m_size) {
+      return NULL;
+   }
+   if (m_size + len > m_capacity && !Grow(m_size + len)) {
+      return NULL;
+   }
+
+   uint8 *dest = m_data + m_size;
+   m_size += len;
+   return dest;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanPayloadBuffer::Clear --
+ *
+ *    Drop the payload and all backing storage.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+MKSVchanPayloadBuffer::Clear()
+{
+   Release();
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanPayloadBuffer::SetMemoryBudget --
+ *
+ *    Set the process wide limit for heap backed payloads. Buffers which
+ *    would exceed it spill to disk instead.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+MKSVchanPayloadBuffer::SetMemoryBudget(size_t budget) // IN
+{
+   g_payloadBudget.store(budget);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanPayloadBuffer::GetMemoryInUse --
+ *
+ *    Heap bytes currently held by all payload buffers.
+ *
+ * Results:
+ *    Number of bytes.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+size_t
+MKSVchanPayloadBuffer::GetMemoryInUse()
+{
+   return g_payloadMemoryInUse.load(std::memory_order_relaxed);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanPayloadBuffer::GetSpilledBytes --
+ *
+ *    Bytes currently held in temp files by all payload buffers.
+ *
+ * Results:
+ *    Number of bytes.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+size_t
+MKSVchanPayloadBuffer::GetSpilledBytes()
+{
+   return g_payloadSpilledBytes.load(std::memory_order_relaxed);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanPayloadBuffer::Grow --
+ *
+ *    Make room for at least minCapacity bytes, in memory while below the
+ *    threshold and budget, in the temp file otherwise.
+ *
+ * Results:
+ *    TRUE on success.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+MKSVchanPayloadBuffer::Grow(size_t minCapacity) // IN
+{
+   /*
+    * The first allocation is exact, so a payload appended in one go, like
+    * every queued packet, costs no slack against the budget. Buffers that
+    * keep growing double from PAYLOAD_MIN_CAPACITY on.
+    */
+   size_t capacity = minCapacity;
+   if (m_capacity != 0) {
+      capacity = m_capacity < PAYLOAD_MIN_CAPACITY ? PAYLOAD_MIN_CAPACITY :
+                                                     m_capacity;
+   }
+   while (capacity < minCapacity) {
+      capacity = capacity > (size_t)-1 / 2 ? minCapacity : capacity * 2;
+   }
+
+   if (!m_spilled && capacity <= MKSVCHAN_PAYLOAD_SPILL_THRESHOLD &&
+       GrowInMemory(capacity)) {
+      return TRUE;
+   }
+
+   // Files grow in coarser steps; remapping is more expensive than realloc.
+   capacity = (minCapacity + PAYLOAD_FILE_GRANULARITY - 1) /
+              PAYLOAD_FILE_GRANULARITY * PAYLOAD_FILE_GRANULARITY;
+   if (m_spilled && capacity < m_capacity + m_capacity / 2) {
+      capacity = m_capacity + m_capacity / 2;
+   }
+   return GrowFile(capacity);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanPayloadBuffer::GrowInMemory --
+ *
+ *    Reallocate the heap buffer if the budget allows it.
+ *
+ * Results:
+ *    TRUE on success.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+MKSVchanPayloadBuffer::GrowInMemory(size_t capacity) // IN
+{
+   if (!ChargeMemory(capacity - m_capacity)) {
+      return FALSE;
+   }
+
+   uint8 *data = static_cast<uint8 *>(realloc(m_data, capacity));
+   if (data == NULL) {
+      g_payloadMemoryInUse.fetch_sub(capacity - m_capacity);
+      return FALSE;
+   }
+
+   m_data = data;
+   m_capacity = capacity;
+   return TRUE;
+}
+
+
+#if defined(_WIN32)
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanPayloadBuffer::GrowFile --
+ *
+ *    Move the payload into, or enlarge, the mapped temp file.
+ *
+ * Results:
+ *    TRUE on success.
+ *
+ * Side effects:
+ *    Creates a delete-on-close file in the user's temp folder.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+MKSVchanPayloadBuffer::GrowFile(size_t capacity) // IN
+{
+   if (m_file == INVALID_HANDLE_VALUE) {
+      char tempDir[MAX_PATH];
+      char tempFile[MAX_PATH];
+      if (GetTempPathA(MAX_PATH, tempDir) == 0 ||
+          GetTempFileNameA(tempDir, "mks", 0, tempFile) == 0) {
+         Log("%s: Unable to get a temp file name, error %d.\n", __FUNCTION__,
+             GetLastError());
+         return FALSE;
+      }
+      m_file = CreateFileA(tempFile, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+                           CREATE_ALWAYS,
+                           FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE,
+                           NULL);
+      if (m_file == INVALID_HANDLE_VALUE) {
+         Log("%s: Unable to create %s, error %d.\n", __FUNCTION__, tempFile,
+             GetLastError());
+         return FALSE;
+      }
+   }
+
+   HANDLE mapping = CreateFileMappingA(m_file, NULL, PAGE_READWRITE,
+                                       (DWORD)((uint64)capacity >> 32),
+                                       (DWORD)capacity, NULL);
+   if (mapping == NULL) {
+      Log("%s: CreateFileMapping failed, error %d.\n", __FUNCTION__,
+          GetLastError());
+      return FALSE;
+   }
+   uint8 *data = static_cast<uint8 *>(MapViewOfFile(mapping, FILE_MAP_WRITE,
+                                                    0, 0, capacity));
+   if (data == NULL) {
+      Log("%s: MapViewOfFile failed, error %d.\n", __FUNCTION__,
+          GetLastError());
+      CloseHandle(mapping);
+      return FALSE;
+   }
+
+   if (m_spilled) {
+      // The old view maps the same file, the data is already there.
+      UnmapViewOfFile(m_data);
+      CloseHandle(m_mapping);
+      g_payloadSpilledBytes.fetch_sub(m_capacity);
+   } else if (m_data != NULL) {
+      memcpy(data, m_data, m_size);
+      free(m_data);
+      g_payloadMemoryInUse.fetch_sub(m_capacity);
+   }
+
+   m_mapping = mapping;
+   m_data = data;
+   m_capacity = capacity;
+   m_spilled = TRUE;
+   g_payloadSpilledBytes.fetch_add(capacity);
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanPayloadBuffer::Release --
+ *
+ *    Free all backing storage.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+MKSVchanPayloadBuffer::Release()
+{
+   if (m_spilled) {
+      UnmapViewOfFile(m_data);
+      CloseHandle(m_mapping);
+      g_payloadSpilledBytes.fetch_sub(m_capacity);
+   } else if (m_data != NULL) {
+      free(m_data);
+      g_payloadMemoryInUse.fetch_sub(m_capacity);
+   }
+   if (m_file != INVALID_HANDLE_VALUE) {
+      CloseHandle(m_file);
+   }
+
+   m_file = INVALID_HANDLE_VALUE;
+   m_mapping = NULL;
+   m_data = NULL;
+   m_size = 0;
+   m_capacity = 0;
+   m_spilled = FALSE;
+}
+#else
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanPayloadBuffer::GrowFile --
+ *
+ *    Move the payload into, or enlarge, the mapped temp file.
+ *
+ * Results:
+ *    TRUE on success.
+ *
+ * Side effects:
+ *    Creates an unlinked file in $TMPDIR (or /tmp).
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+MKSVchanPayloadBuffer::GrowFile(size_t capacity) // IN
+{
+   if (m_fd < 0) {
+      const char *tempDir = getenv("TMPDIR");
+      std::string path = std::string(tempDir != NULL && *tempDir != '\0' ?
+                                     tempDir : "/tmp") + "/mksvchan-XXXXXX";
+      m_fd = mkstemp(&path[0]);
+      if (m_fd < 0) {
+         Log("%s: mkstemp %s failed, errno %d.\n", __FUNCTION__, path.c_str(),
+             errno);
+         return FALSE;
+      }
+      // Nothing else needs the name, and this way the file can't leak.
+      unlink(path.c_str());
+   }
+
+   if (ftruncate(m_fd, (off_t)capacity) != 0) {
+      Log("%s: Unable to grow the temp file to %zu bytes, errno %d.\n",
+          __FUNCTION__, capacity, errno);
+      return FALSE;
+   }
+
+   void *data = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     m_fd, 0);
+   if (data == MAP_FAILED) {
+      Log("%s: mmap failed, errno %d.\n", __FUNCTION__, errno);
+      return FALSE;
+   }
+
+   if (m_spilled) {
+      munmap(m_data, m_capacity);
+      g_payloadSpilledBytes.fetch_sub(m_capacity);
+   } else if (m_data != NULL) {
+      memcpy(data, m_data, m_size);
+      free(m_data);
+      g_payloadMemoryInUse.fetch_sub(m_capacity);
+   }
+
+   m_data = static_cast<uint8 *>(data);
+   m_capacity = capacity;
+   m_spilled = TRUE;
+   g_payloadSpilledBytes.fetch_add(capacity);
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanPayloadBuffer::Release --
+ *
+ *    Free all backing storage.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+MKSVchanPayloadBuffer::Release()
+{
+   if (m_spilled) {
+      munmap(m_data, m_capacity);
+      g_payloadSpilledBytes.fetch_sub(m_capacity);
+   } else if (m_data != NULL) {
+      free(m_data);
+      g_payloadMemoryInUse.fetch_sub(m_capacity);
+   }
+   if (m_fd >= 0) {
+      close(m_fd);
+   }
+
+   m_fd = -1;
+   m_data = NULL;
+   m_size = 0;
+   m_capacity = 0;
+   m_spilled = FALSE;
+}
+#endif
@@ -0,0 +1,72 @@
+/* **************************************************************************** *
+ * Copyright (C) 2020 VMware, Inc.  All rights reserved. -- VMware Confidential *
+ * **************************************************************************** */
+
+/*
+ * MKSVchanPayloadBuffer.h --
+ *
+ *    Contiguous payload buffer for large clipboard and drop interaction
+ *    data. Small payloads live on the heap; once a payload grows past
+ *    MKSVCHAN_PAYLOAD_SPILL_THRESHOLD, or the process wide memory budget
+ *    is used up, it moves to a memory mapped, already deleted temp file so
+ *    that the kernel can page it out instead of it pinning anonymous
+ *    memory.
+ *
+ *    Data() is always one contiguous range, so a buffer can be passed
+ *    straight to MKSVchanRPCPlugin::SendMessage, and receivers can write
+ *    into the range returned by Extend() without an intermediate copy.
+ *
+ *    A buffer is not thread safe; the memory budget is.
+ */
+
+#ifndef _MKSVCHAN_PAYLOAD_BUFFER_H_
+#define _MKSVCHAN_PAYLOAD_BUFFER_H_
+
+#include "vm_basic_types.h"
+
+#include <stddef.h>
+
+#define MKSVCHAN_PAYLOAD_SPILL_THRESHOLD (8 * 1024 * 1024)
+#define MKSVCHAN_PAYLOAD_DEFAULT_BUDGET (64 * 1024 * 1024)
+
+class MKSVchanPayloadBuffer
+{
+public:
+   MKSVchanPayloadBuffer();
+   ~MKSVchanPayloadBuffer();
+
+   Bool Append(const uint8 *data, size_t len);
+   uint8 *Extend(size_t len);
+   void Clear();
+
+   uint8 *Data() { return m_data; }
+   const uint8 *Data() const { return m_data; }
+   size_t Size() const { return m_size; }
+   Bool IsSpilled() const { return m_spilled; }
+
+   static void SetMemoryBudget(size_t budget);
+   static size_t GetMemoryInUse();
+   static size_t GetSpilledBytes();
+
+private:
+   MKSVchanPayloadBuffer(const MKSVchanPayloadBuffer &);
+   MKSVchanPayloadBuffer &operator=(const MKSVchanPayloadBuffer &);
+
+   Bool Grow(size_t minCapacity);
+   Bool GrowInMemory(size_t capacity);
+   Bool GrowFile(size_t capacity);
+   void Release();
+
+   uint8 *m_data;
+   size_t m_size;
+   size_t m_capacity;
+   Bool m_spilled;
+#if defined(_WIN32)
+   void *m_file;
+   void *m_mapping;
+#else
+   int m_fd;
+#endif
+};
+
+#endif // _MKSVCHAN_PAYLOAD_BUFFER_H_
@@ -0,0 +1,590 @@
+/* **************************************************************************** *
+ * Copyright (C) 2020 VMware, Inc.  All rights reserved. -- VMware Confidential *
+ * **************************************************************************** */
+
+/*
+ * MKSVchanProgress.cpp --
+ *
+ *    Implements the copy progress aggregator.
+ */
+
+#include "MKSVchanProgress.h"
+#include "MKSVchanSendQueue.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+namespace MKSVchanProgress {
+
+typedef std::chrono::steady_clock Clock;
+
+struct ProgressState {
+   // Sender
+   Bool sendPending;
+   uint32 sendLatest;
+   Bool sentAny;
+   uint32 lastSent;
+   Clock::time_point lastSendTime;
+   uint64 submitted;
+   uint64 sent;
+
+   // Receiver
+   Bool deliverPending;
+   Bool deliverFlushQueued;   // Held value reported to heldReadyCallback
+   uint32 deliverLatest;
+   Bool deliveredAny;
+   uint32 lastDelivered;
+   Clock::time_point lastDeliverTime;
+   uint64 received;
+   uint64 delivered;
+};
+
+static const MKSVchanPacketType progressTypes[] = {
+   MKSVchanPacketType_DnD_CopyProgress,
+   MKSVchanPacketType_FCP_CopyProgress,
+};
+
+#define PROGRESS_TYPE_COUNT (sizeof progressTypes / sizeof progressTypes[0])
+
+static ProgressState states[PROGRESS_TYPE_COUNT];
+static std::mutex progressLock;
+static std::condition_variable flusherWake;
+static std::thread flusherThread;
+static Bool flusherRunning = FALSE;
+static Bool stopRequested = FALSE;
+static HeldReadyCallback heldReadyCallback = NULL;
+static void *heldReadyCtx = NULL;
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * StateOf --
+ *
+ *    State of a progress packet type.
+ *
+ * Results:
+ *    The state, NULL if packetType isn't a progress packet.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static ProgressState *
+StateOf(MKSVchanPacketType packetType) // IN
+{
+   for (size_t i = 0; i < PROGRESS_TYPE_COUNT; i++) {
+      if (progressTypes[i] == packetType) {
+         return &states[i];
+      }
+   }
+   return NULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanProgress::IsProgressPacketType --
+ *
+ *    Whether packetType is coalesced by this module.
+ *
+ * Results:
+ *    TRUE for DnD_CopyProgress and FCP_CopyProgress.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+IsProgressPacketType(MKSVchanPacketType packetType) // IN
+{
+   return StateOf(packetType) != NULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * IsDue --
+ *
+ *    Whether a value has to go out now rather than be coalesced.
+ *
+ * Results:
+ *    TRUE for the first value, the final value, a value lower than the
+ *    previous one (a new copy) or once the interval is over.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static Bool
+IsDue(Bool anyYet,                    // IN
+      uint32 previous,                // IN
+      Clock::time_point previousTime, // IN
+      uint32 value,                   // IN
+      Clock::time_point now)          // IN
+{
+   return !anyYet || value >= MKSVCHAN_PROGRESS_DONE || value < previous ||
+          now - previousTime >=
+             std::chrono::milliseconds(MKSVCHAN_PROGRESS_INTERVAL_MS);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * FlusherMain --
+ *
+ *    Send held back values once their interval is over, and report held
+ *    back received values to the held ready callback. Exits when nothing
+ *    is pending; Submit and ShouldDeliver start it again.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Posts progress packets to MKSVchanSendQueue, calls the held ready
+ *    callback.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+FlusherMain()
+{
+   std::unique_lock<std::mutex> guard(progressLock);
+
+   while (!stopRequested) {
+      Bool anyPending = FALSE;
+      Clock::time_point now = Clock::now();
+      Clock::time_point wakeAt = Clock::time_point::max();
+
+      for (size_t i = 0; i < PROGRESS_TYPE_COUNT; i++) {
+         ProgressState &state = states[i];
+         if (state.deliverPending && !state.deliverFlushQueued &&
+             heldReadyCallback != NULL) {
+            Clock::time_point due = state.lastDeliverTime +
+               std::chrono::milliseconds(MKSVCHAN_PROGRESS_INTERVAL_MS);
+            if (now < due) {
+               anyPending = TRUE;
+               wakeAt = due < wakeAt ? due : wakeAt;
+            } else {
+               HeldReadyCallback callback = heldReadyCallback;
+               void *ctx = heldReadyCtx;
+               state.deliverFlushQueued = TRUE;
+               guard.unlock();
+               callback(ctx);
+               guard.lock();
+               now = Clock::now();
+            }
+         }
+
+         if (!state.sendPending) {
+            continue;
+         }
+         anyPending = TRUE;
+
+         Clock::time_point due = state.lastSendTime +
+            std::chrono::milliseconds(MKSVCHAN_PROGRESS_INTERVAL_MS);
+         if (now < due) {
+            wakeAt = due < wakeAt ? due : wakeAt;
+            continue;
+         }
+
+         uint32 value = state.sendLatest;
+         state.sendPending = FALSE;
+         state.lastSent = value;
+         state.lastSendTime = now;
+         state.sent++;
+
+         guard.unlock();
+         Bool posted = MKSVchanSendQueue::Post(
+            progressTypes[i], reinterpret_cast<const uint8 *>(&value),
+            sizeof value, MKSVCHAN_CLIPBOARD_ERROR_NONE);
+         guard.lock();
+
+         if (!posted && !state.sendPending) {
+            // Queue full, retry with the next interval
+            state.sendPending = TRUE;
+            state.sendLatest = value;
+            state.sent--;
+         }
+         now = Clock::now();
+         wakeAt = now;
+      }
+
+      if (!anyPending) {
+         break;
+      }
+      if (wakeAt > now) {
+         flusherWake.wait_until(guard, wakeAt);
+      }
+   }
+   flusherRunning = FALSE;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * StartFlusher --
+ *
+ *    Make sure the flusher runs and looks at the pending values again.
+ *    Called with progressLock held.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    May start the flusher thread.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+StartFlusher()
+{
+   if (!flusherRunning) {
+      if (flusherThread.joinable()) {
+         flusherThread.join();
+      }
+      flusherRunning = TRUE;
+      flusherThread = std::thread(FlusherMain);
+   }
+   flusherWake.notify_one();
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanProgress::Submit --
+ *
+ *    Report a copy progress value.
+ *
+ * Results:
+ *    FALSE if packetType isn't a progress packet or a value which had to
+ *    go out at once couldn't be queued.
+ *
+ * Side effects:
+ *    May post a packet or start the flusher thread.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+Submit(MKSVchanPacketType packetType, // IN
+       uint32 value)                  // IN
+{
+   ProgressState *state = StateOf(packetType);
+   if (state == NULL) {
+      return FALSE;
+   }
+
+   std::unique_lock<std::mutex> guard(progressLock);
+   Clock::time_point now = Clock::now();
+
+   state->submitted++;
+   if (IsDue(state->sentAny, state->lastSent, state->lastSendTime, value,
+             now)) {
+      state->sendPending = FALSE;
+      state->sentAny = TRUE;
+      state->lastSent = value;
+      state->lastSendTime = now;
+      state->sent++;
+      guard.unlock();
+
+      return MKSVchanSendQueue::Post(packetType,
+                                     reinterpret_cast<const uint8 *>(&value),
+                                     sizeof value,
+                                     MKSVCHAN_CLIPBOARD_ERROR_NONE);
+   }
+
+   state->sendPending = TRUE;
+   state->sendLatest = value;
+   StartFlusher();
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanProgress::Stop --
+ *
+ *    Stop the flusher thread, on exit.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Held back values are dropped.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+Stop()
+{
+   {
+      std::lock_guard<std::mutex> guard(progressLock);
+      stopRequested = TRUE;
+      flusherWake.notify_all();
+   }
+   if (flusherThread.joinable()) {
+      flusherThread.join();
+   }
+
+   std::lock_guard<std::mutex> guard(progressLock);
+   stopRequested = FALSE;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanProgress::FlushPending --
+ *
+ *    Post the value Submit held back for packetType now, ahead of the
+ *    CopyDone which ends the copy.
+ *
+ * Results:
+ *    FALSE if a held value couldn't be queued.
+ *
+ * Side effects:
+ *    May post a packet.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+FlushPending(MKSVchanPacketType packetType) // IN
+{
+   ProgressState *state = StateOf(packetType);
+   if (state == NULL) {
+      return TRUE;
+   }
+
+   std::unique_lock<std::mutex> guard(progressLock);
+   if (!state->sendPending) {
+      return TRUE;
+   }
+
+   uint32 value = state->sendLatest;
+   state->sendPending = FALSE;
+   state->lastSent = value;
+   state->lastSendTime = Clock::now();
+   state->sent++;
+   guard.unlock();
+
+   return MKSVchanSendQueue::Post(packetType,
+                                  reinterpret_cast<const uint8 *>(&value),
+                                  sizeof value, MKSVCHAN_CLIPBOARD_ERROR_NONE);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanProgress::SetHeldReadyCallback --
+ *
+ *    Set the function the flusher thread calls when a received value that
+ *    ShouldDeliver held back is due, so the owner can take it with
+ *    TakePending without waiting for another update or CopyDone.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+SetHeldReadyCallback(HeldReadyCallback callback, // IN
+                     void *ctx)                  // IN
+{
+   std::lock_guard<std::mutex> guard(progressLock);
+   heldReadyCallback = callback;
+   heldReadyCtx = ctx;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanProgress::ShouldDeliver --
+ *
+ *    Whether a received progress value is passed to the DnD/FCP handler
+ *    now.
+ *
+ * Results:
+ *    TRUE to deliver. FALSE if the value is held back for TakePending.
+ *
+ * Side effects:
+ *    A held back value is reported to the held ready callback once its
+ *    interval is over.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+ShouldDeliver(MKSVchanPacketType packetType, // IN
+              uint32 value)                  // IN
+{
+   ProgressState *state = StateOf(packetType);
+   if (state == NULL) {
+      return TRUE;
+   }
+
+   std::lock_guard<std::mutex> guard(progressLock);
+   Clock::time_point now = Clock::now();
+
+   state->received++;
+   if (!IsDue(state->deliveredAny, state->lastDelivered,
+              state->lastDeliverTime, value, now)) {
+      state->deliverPending = TRUE;
+      state->deliverLatest = value;
+      if (!state->deliverFlushQueued && heldReadyCallback != NULL) {
+         StartFlusher();
+      }
+      return FALSE;
+   }
+
+   state->deliverPending = FALSE;
+   state->deliverFlushQueued = FALSE;
+   state->deliveredAny = TRUE;
+   state->lastDelivered = value;
+   state->lastDeliverTime = now;
+   state->delivered++;
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanProgress::TakePending --
+ *
+ *    Take the last received value that ShouldDeliver held back.
+ *
+ * Results:
+ *    TRUE and the value if there is one.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+TakePending(MKSVchanPacketType packetType, // IN
+            uint32 *value)                 // OUT
+{
+   ProgressState *state = StateOf(packetType);
+   if (state == NULL) {
+      return FALSE;
+   }
+
+   std::lock_guard<std::mutex> guard(progressLock);
+   state->deliverFlushQueued = FALSE;
+   if (!state->deliverPending) {
+      return FALSE;
+   }
+
+   *value = state->deliverLatest;
+   state->deliverPending = FALSE;
+   state->lastDelivered = *value;
+   state->lastDeliverTime = Clock::now();
+   state->delivered++;
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanProgress::LogStats --
+ *
+ *    Log how many progress packets a copy produced and how many got
+ *    through, then start counting the next copy.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Resets the counters of packetType.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+LogStats(MKSVchanPacketType packetType) // IN
+{
+   ProgressState *state = StateOf(packetType);
+   if (state == NULL) {
+      return;
+   }
+
+   std::lock_guard<std::mutex> guard(progressLock);
+   if (state->submitted > 0) {
+      Log("%s: %s: sent %llu of %llu updates (%.0f%% fewer packets).\n",
+          __FUNCTION__, GetMKSVchanPacketTypeAsString(packetType),
+          (unsigned long long)state->sent,
+          (unsigned long long)state->submitted,
+          100.0 * (state->submitted - state->sent) / state->submitted);
+   }
+   if (state->received > 0) {
+      Log("%s: %s: delivered %llu of %llu received updates.\n", __FUNCTION__,
+          GetMKSVchanPacketTypeAsString(packetType),
+          (unsigned long long)state->delivered,
+          (unsigned long long)state->received);
+   }
+
+   state->submitted = 0;
+   state->sent = 0;
+   state->sentAny = FALSE;
+   state->received = 0;
+   state->delivered = 0;
+   state->deliveredAny = FALSE;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanProgress::Reset --
+ *
+ *    Forget all progress state when the channel goes away.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Held back values are dropped; the flusher exits on its own.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+Reset()
+{
+   std::lock_guard<std::mutex> guard(progressLock);
+
+   for (size_t i = 0; i < PROGRESS_TYPE_COUNT; i++) {
+      states[i] = ProgressState();
+   }
+   flusherWake.notify_all();
+}
+
+} // namespace MKSVchanProgress
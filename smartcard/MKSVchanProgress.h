@@ -0,0 +1,62 @@
+/* **************************************************************************** *
+ * Copyright (C) 2020 VMware, Inc.  All rights reserved. -- VMware Confidential *
+ * **************************************************************************** */
+
+/*
+ * MKSVchanProgress.h --
+ *
+ *    Coalescing of DnD_CopyProgress and FCP_CopyProgress updates.
+ *
+ *    Sender: copy code calls Submit() for every progress change instead of
+ *    sending the packet itself. Only the latest value per packet type is
+ *    kept, and it goes out through MKSVchanSendQueue at most once per
+ *    MKSVCHAN_PROGRESS_INTERVAL_MS. A flusher thread sends a value that
+ *    was held back once its interval is over, so the last value always
+ *    arrives. MKSVCHAN_PROGRESS_DONE, and a value lower than the last one
+ *    sent (a new copy), go out at once.
+ *
+ *    MKSVchanRPCPlugin::SendMessage hands every progress packet to
+ *    Submit(), so the DnD/FCP copy code doesn't need to know about it.
+ *    Before a CopyDone goes out, FlushPending() posts the value still held
+ *    back, so the peer sees the final progress first.
+ *
+ *    Receiver: OnInvoke asks ShouldDeliver() before passing an update to
+ *    the DnD/FCP handler, with the same interval, so peers which don't
+ *    coalesce don't flood the UI thread. Once the interval of a held back
+ *    value is over, the flusher calls the held ready callback, and the
+ *    owner delivers the value from TakePending(). CopyDone takes it too.
+ *
+ *    Submitted, sent, received and delivered counts are logged at
+ *    CopyDone by LogStats().
+ */
+
+#ifndef _MKSVCHAN_PROGRESS_H_
+#define _MKSVCHAN_PROGRESS_H_
+
+#include "MKSVchanRPCPlugin.h"
+
+#define MKSVCHAN_PROGRESS_INTERVAL_MS 100
+#define MKSVCHAN_PROGRESS_DONE 100
+
+namespace MKSVchanProgress {
+
+typedef void (*HeldReadyCallback)(void *ctx);
+
+Bool IsProgressPacketType(MKSVchanPacketType packetType);
+
+// Sender, any thread
+Bool Submit(MKSVchanPacketType packetType, uint32 value);
+Bool FlushPending(MKSVchanPacketType packetType);
+void Stop();
+
+// Receiver, vdpservice thread
+void SetHeldReadyCallback(HeldReadyCallback callback, void *ctx);
+Bool ShouldDeliver(MKSVchanPacketType packetType, uint32 value);
+Bool TakePending(MKSVchanPacketType packetType, uint32 *value);
+void LogStats(MKSVchanPacketType packetType);
+
+void Reset();
+
+} // namespace MKSVchanProgress
+
+#endif // _MKSVCHAN_PROGRESS_H_
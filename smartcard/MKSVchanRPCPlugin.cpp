@@ -8,13 +8,35 @@
  */
 
 #include "MKSVchanRPCPlugin.h"
+#include "MKSVchanAsyncSend.h"
+#include "MKSVchanCancel.h"
+#include "MKSVchanCapCache.h"
+#include "MKSVchanMetrics.h"
+#include "MKSVchanPacketTypeExt.h"
+#include "MKSVchanPayloadBuffer.h"
+#include "MKSVchanProgress.h"
+#include "MKSVchanReplay.h"
+#include "MKSVchanSendBudget.h"
+#include "MKSVchanSendQueue.h"
+#include "MKSVchanShmTransport.h"
 #include "fileCopyUtils.h"
 #include "filetransfer/fileTransfer.h"
+#include "filetransfer/ftCompress.h"
+#include "filetransfer/ftSparse.h"
+#include "scInfoStore.h"
+#include "scInventory.h"
+#include "scInventoryWire.h"
+#include "scMonitor.h"
+#include <deque>
+#include <functional>
+#include <set>
 #include <string>
+#include <vector>
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <streambuf>
+#include <chrono>
 
 
 /*
@@ -46,6 +68,984 @@ VDP_SERVICE_CREATE_INTERFACE(MKSVCHAN_TOKEN_NAME, mksvchanRPCManager)
 #define CLIPBOARD_ERROR_PARM_NAME "Clipboard error"
 #define CLIPBOARD_PARM_MAXLEN 1024
 
+/*
+ * File transfer and the DnD/FCP copy paths are brought up on first use
+ * instead of in OnReady, so sessions that never copy files (or have the
+ * features disabled by policy) don't pay for them. Both flags are only
+ * touched on the vdpservice thread and are reset in OnNotReady.
+ */
+static Bool ftInitialized = FALSE;
+static Bool copyFeaturesUsed = FALSE;
+
+/*
+ * File chunks that were in flight when the copy was cancelled. Their
+ * OnDone must not schedule more chunks. vdpservice thread only.
+ */
+static std::set<uint32> cancelledFileRequests;
+
+/*
+ * Instance the posted packet drain runs against, set between OnReady and
+ * OnNotReady. Tasks queued to the vdpservice thread read it there, so a
+ * task that runs after the channel went away does nothing.
+ */
+static MKSVchanRPCPlugin *readyPlugin = NULL;
+
+/*
+ * Producers held back by the send budget, resumed from OnBudgetReady: the
+ * file transfer chunk pacing found its class backed up, or SendMessage
+ * refused clipboard data with the queue full. vdpservice thread only.
+ */
+static Bool ftChunksDeferred = FALSE;
+static Bool clipboardRefused = FALSE;
+
+/*
+ * Extension packets are only sent to a peer known to take them. The agent
+ * sends its offers from OnReady, the client once the agent's first
+ * extension packet arrived, so a legacy agent never gets one. The time of
+ * OnReady and whether the peer sent anything since feed the time-to-peer
+ * metric. The session count lets a task queued by an earlier session
+ * tell; ScMonitor reads it on its thread between Start and Stop.
+ * vdpservice thread only, reset in OnNotReady.
+ */
+static Bool extOffersSent = FALSE;
+static Bool peerHeard = FALSE;
+static std::chrono::steady_clock::time_point readyStart;
+static uint32 readySession = 0;
+
+/*
+ * Compresses FileTransferData_File chunks while compression is active.
+ * Created by the first chunk, deleted when a copy is cancelled and in
+ * OnNotReady. The MKSVchanAsync ticket of each chunk submitted, in
+ * submission order, which is the order its frames come out in.
+ * vdpservice thread only.
+ */
+static FT::ChunkCompressor *chunkCompressor = NULL;
+static std::deque<uint32> compressedTickets;
+
+/*
+ * Passes a received progress value to the DnD or FCP handler of the ready
+ * instance. Set by OnReady, cleared in OnNotReady. vdpservice thread only.
+ */
+static std::function<void(MKSVchanPacketType, uint32)> deliverProgress;
+
+/*
+ * Packets not sent because the peer has them cached, waiting for their
+ * OnDone notification, and the notification, set while ready.
+ */
+struct SkippedSend {
+   MKSVchanPacketType packetType;
+   uint32 asyncTicket;
+};
+static std::vector<SkippedSend> skippedSends;
+static std::function<void(MKSVchanPacketType)> completeSkippedSend;
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * EnsureFTInitialized --
+ *
+ *    Initialize the file transfer config the first time a file transfer
+ *    packet is seen in this session.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Calls FT::InitFTConfig once per session.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+EnsureFTInitialized()
+{
+#if defined(_WIN32) && !defined(VM_WIN_UWP)
+   if (ftInitialized) {
+      return;
+   }
+
+   /*
+    * NOTE: Init criticalSection here is not always safe. It cannot
+    * handle the old pcoip connection. Please refer to bug 1759096.
+    */
+   Log("%s: First file transfer packet, initializing file transfer.\n",
+       __FUNCTION__);
+   FT::InitFTConfig();
+   ftInitialized = TRUE;
+#endif
+}
+
+
+#if defined(_WIN32) && !defined(VM_WIN_UWP)
+/*
+ *----------------------------------------------------------------------------
+ *
+ * ReceiveFileChunk --
+ *
+ *    Hand a received chunk to FT::ReceiveFileData, unless it belongs to a
+ *    copy that is being cancelled. Every received file chunk lands here,
+ *    whatever packet type carried it.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+ReceiveFileChunk(MKSVchanPacketType packetType, // IN: type it arrived as
+                 const uint8 *data,             // IN
+                 uint32 dataLen)                // IN
+{
+   if (MKSVchanCancel::DiscardOnArrival(packetType)) {
+      return;
+   }
+
+   EnsureFTInitialized();
+   FT::ReceiveFileData(const_cast<uint8 *>(data), dataLen);
+}
+#endif
+
+
+#if defined(MKSVCHAN_HAVE_COROUTINES)
+/*
+ *----------------------------------------------------------------------------
+ *
+ * SendSmartCardBinary --
+ *
+ *    Send the binary inventory and wait until the agent has taken it. If
+ *    the send fails or is aborted, the JSON copy goes out instead, which
+ *    every agent reads.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Sends SmartCardInfo_Binary, maybe SmartCardInfo.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static MKSVchanAsync::Task
+SendSmartCardBinary(MKSVchanRPCPlugin *plugin,  // IN
+                    std::vector<uint8> binary,  // IN
+                    std::string json)           // IN
+{
+   std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+
+   if (co_await MKSVchanAsync::Send(plugin,
+                                    MKSVchanPacketType_SmartCardInfo_Binary,
+                                    &binary[0], (uint32)binary.size())) {
+      Log("%s: Agent took %u bytes of binary smart card info in %ums.\n",
+          __FUNCTION__, (uint32)binary.size(),
+          (uint32)std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now() - start).count());
+      co_return;
+   }
+
+   // The channel went away, the next session sends a new inventory
+   if (readyPlugin == NULL) {
+      co_return;
+   }
+   Log("%s: Binary smart card info not delivered, sending %u bytes of "
+       "JSON.\n", __FUNCTION__, (uint32)json.length());
+   MKSVchan_SendSmartCardInfo(json.c_str());
+}
+#endif
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * SendSmartCardInventory --
+ *
+ *    Send a smart card inventory in the binary format if the agent offered
+ *    it, otherwise as JSON. The agent sends its offer first thing, so an
+ *    inventory sent before it arrived goes out as JSON, and later ones in
+ *    the binary format; a legacy agent never waits for it.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Sends SmartCardInfo or SmartCardInfo_Binary.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+SendSmartCardInventory(MKSVchanRPCPlugin *plugin,        // IN
+                       const std::string &json,          // IN
+                       const std::vector<uint8> &binary) // IN
+{
+   if (ScInventory::IsBinaryActive() && !binary.empty()) {
+      Log("%s: Sending %u bytes of binary smart card info.\n", __FUNCTION__,
+          (uint32)binary.size());
+#if defined(MKSVCHAN_HAVE_COROUTINES)
+      SendSmartCardBinary(plugin, binary, json);
+#else
+      plugin->SendMessage(MKSVchanPacketType_SmartCardInfo_Binary,
+                          const_cast<uint8 *>(&binary[0]),
+                          (uint32)binary.size());
+#endif
+   } else {
+      Log("%s: Sending %u bytes of smart card info.\n", __FUNCTION__,
+          (uint32)json.length());
+      MKSVchan_SendSmartCardInfo(json.c_str());
+   }
+   MKSVchanMetrics::MarkSmartCardInventory();
+}
+
+
+/*
+ * Initial smart card inventory, from the monitor thread to the vdpservice
+ * thread.
+ */
+struct InitialSmartCardInfo {
+   uint32 session;
+   std::string json;
+   std::vector<uint8> binary;
+};
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * SendInitialSmartCardInfo --
+ *
+ *    Task queued to the vdpservice thread by QueueInitialSmartCardInfo.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Sends the inventory unless its session is over.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+SendInitialSmartCardInfo(void *ctx) // IN: InitialSmartCardInfo to delete
+{
+   InitialSmartCardInfo *info = static_cast<InitialSmartCardInfo *>(ctx);
+
+   if (readyPlugin != NULL && info->session == readySession) {
+      Log("%s: Initial smart card info ready %ums after OnReady.\n",
+          __FUNCTION__,
+          (uint32)std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now() - readyStart).count());
+      SendSmartCardInventory(readyPlugin, info->json, info->binary);
+   }
+   delete info;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * QueueInitialSmartCardInfo --
+ *
+ *    ScMonitor callback with the initial inventory, on the monitor thread.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Queues SendInitialSmartCardInfo to the vdpservice thread.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+QueueInitialSmartCardInfo(const std::string &json,          // IN
+                          const std::vector<uint8> &binary) // IN
+{
+   InitialSmartCardInfo *info = new InitialSmartCardInfo;
+   info->session = readySession;
+   info->json = json;
+   info->binary = binary;
+   MKSVchan_QueueCallback(SendInitialSmartCardInfo, info);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * SendExtensionOffers --
+ *
+ *    Send the offers of the negotiated extensions, once per session: the
+ *    agent from OnReady ahead of its capability packets, the client when
+ *    the agent's first extension packet arrives.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Sends the offers the configuration allows.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+SendExtensionOffers(MKSVchanRPCPlugin *plugin, // IN
+                    Bool isServer)             // IN
+{
+   if (extOffersSent) {
+      return;
+   }
+   extOffersSent = TRUE;
+
+#if defined(_WIN32) && !defined(VM_WIN_UWP)
+   // The client sends its smart card inventories in binary from here on
+   if (isServer) {
+      uint32 scInventoryVersion = SC_INVENTORY_VERSION;
+      plugin->SendMessage(MKSVchanPacketType_SmartCard_FormatOffer,
+                          reinterpret_cast<uint8 *>(&scInventoryVersion),
+                          sizeof scInventoryVersion);
+   }
+#endif
+
+   /*
+    * Ahead of the capability packets, so a peer which cached our set can
+    * apply it before they reach it.
+    */
+   MKSVchanCapCache::SendOffer(plugin);
+
+   // Offer the shared memory transport in case the agent runs on this host
+   MKSVchanShm::SendOffer(plugin);
+
+   Log("%s: Offer replay of clipboard data.\n", __FUNCTION__);
+   MKSVchanReplay::SendOffer(plugin);
+
+   if (FT::IsCompressionConfigured()) {
+      uint32 compressionVersion = 1;
+      Log("%s: Offer file transfer compression.\n", __FUNCTION__);
+      plugin->SendMessage(MKSVchanPacketType_FileTransfer_CompressionOffer,
+                          reinterpret_cast<uint8 *>(&compressionVersion),
+                          sizeof compressionVersion);
+   }
+
+   uint32 sparseVersion = FT_SPARSE_VERSION;
+   Log("%s: Offer sparse file transfer.\n", __FUNCTION__);
+   plugin->SendMessage(MKSVchanPacketType_FileTransfer_SparseOffer,
+                       reinterpret_cast<uint8 *>(&sparseVersion),
+                       sizeof sparseVersion);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * DeleteChunkCompressor --
+ *
+ *    Drop the compressor with the chunks it still holds.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    MKSVchanAsync sends waiting for those chunks complete with FALSE.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+DeleteChunkCompressor()
+{
+   delete chunkCompressor;
+   chunkCompressor = NULL;
+
+   while (!compressedTickets.empty()) {
+      MKSVchanAsync::CompleteDeferred(compressedTickets.front(), FALSE);
+      compressedTickets.pop_front();
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * IsCopyPacketType --
+ *
+ *    Whether the packet belongs to a DnD or FCP copy, as opposed to the
+ *    capability exchange which happens in every session.
+ *
+ * Results:
+ *    TRUE for DnD/FCP copy packets.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static Bool
+IsCopyPacketType(MKSVchanPacketType packetType) // IN
+{
+   switch (packetType) {
+      case MKSVchanPacketType_DnD_CopyProgress:
+      case MKSVchanPacketType_DnD_CopyDone:
+      case MKSVchanPacketType_DnD_ControllerRpc:
+      case MKSVchanPacketType_DnD_TempFolderSharedPath:
+      case MKSVchanPacketType_DnD_FilePaths:
+      case MKSVchanPacketType_DnD_CancelCopy:
+      case MKSVchanPacketType_FCP_CopyDone:
+      case MKSVchanPacketType_FCP_CopyProgress:
+      case MKSVchanPacketType_FCP_StartPasteFiles:
+      case MKSVchanPacketType_FCP_SharedFolderFName:
+      case MKSVchanPacketType_FCP_TempFolderFName:
+      case MKSVchanPacketType_FCP_CancelCopy:
+      case MKSVchanPacketType_LegacyDnD_Data:
+         return TRUE;
+      default:
+         return FALSE;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * IsFileDataPacketType --
+ *
+ *    Whether the packet carries file contents, in any of the encodings.
+ *
+ * Results:
+ *    TRUE for file transfer data packets.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static Bool
+IsFileDataPacketType(MKSVchanPacketType packetType) // IN
+{
+   switch ((uint32)packetType) {
+      case MKSVchanPacketType_FileTransferData_File:
+      case MKSVchanPacketType_FileTransferData_Compressed:
+      case MKSVchanPacketType_FileTransferData_Sparse:
+         return TRUE;
+      default:
+         return FALSE;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * CancelCopyPipeline --
+ *
+ *    A DnD/FCP copy was cancelled, by the peer or by us. Cancels the
+ *    token of the copy, so queued file data is dropped by the next drain,
+ *    drops the chunks waiting for compression and remembers the chunks
+ *    already in flight.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+CancelCopyPipeline(MKSVchanPacketType packetType,                          // IN
+                   const MKSVchanRPCPlugin::MKSVchanCPRequestList &requests) // IN
+{
+   MKSVchanCancel::Cancel(packetType);
+   ftChunksDeferred = FALSE;
+
+   // Chunks still being compressed belong to the cancelled copy
+   DeleteChunkCompressor();
+
+   MKSVchanRPCPlugin::MKSVchanCPRequestList::const_iterator it;
+   for (it = requests.begin(); it != requests.end(); ++it) {
+      if (it->m_dataType == MKSVchanCPRequest::MKS_FileTransfer_Data) {
+         cancelledFileRequests.insert(it->m_id);
+      }
+   }
+
+   Log("%s: %u chunks in flight.\n", __FUNCTION__,
+       (uint32)cancelledFileRequests.size());
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * BudgetClassOf --
+ *
+ *    Budget class a request was reserved under. Drop interaction data is
+ *    recorded as CPClipboard but budgeted as DnD.
+ *
+ * Results:
+ *    The packet class.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static MKSVchanBudget::PacketClass
+BudgetClassOf(const MKSVchanCPRequest &request) // IN
+{
+   if (request.m_dataType == MKSVchanCPRequest::MKS_DropInteraction_Data) {
+      return MKSVchanBudget::PacketClass_DnD;
+   }
+   return MKSVchanBudget::ClassOf(request.m_packetType);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * DispatchStagedPayload --
+ *
+ *    Deliver a payload which arrived through the shared memory transport
+ *    or wrapped in Replay_Data, applying the same policy checks as the
+ *    regular OnInvoke cases.
+ *
+ * Results:
+ *    The packet type the payload was delivered as, the replayed type for
+ *    Replay_Data, for NotifyForRegisteredOnInvokePacketType.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static MKSVchanPacketType
+DispatchStagedPayload(MKSVchanPacketType packetType, // IN
+                      uint8 *data,                   // IN
+                      uint32 dataLen)                // IN
+{
+   switch ((uint32)packetType) {
+      case MKSVchanPacketType_ClipboardData_Text:
+      case MKSVchanPacketType_ClipboardData_CPClipboard:
+         if (MKSVchan_ClipboardToServerEnabled()) {
+            Log("%s: Received message of size %u.\n", __FUNCTION__, dataLen);
+            MKSVchan_SetClipboard(packetType, data, dataLen);
+         } else {
+            Log("%s: Setting the clipboard is disabled by policy. "
+                "Ignoring clipboard data.\n", __FUNCTION__);
+         }
+         break;
+
+#if defined(_WIN32) && !defined(VM_WIN_UWP)
+      case MKSVchanPacketType_FileTransferData_File:
+         if (MKSVchan_FileTransfer_ToServerEnabled()) {
+            ReceiveFileChunk(packetType, data, dataLen);
+         }
+         break;
+#endif
+
+      case MKSVchanPacketType_Replay_Data:
+      {
+         MKSVchanPacketType replayedType;
+         const uint8 *payload = NULL;
+         uint32 payloadLen = 0;
+         if (MKSVchanReplay::Unwrap(data, dataLen, &replayedType, &payload,
+                                    &payloadLen) &&
+             MKSVchanReplay::IsReplayable(replayedType)) {
+            return DispatchStagedPayload(replayedType,
+                                         const_cast<uint8 *>(payload),
+                                         payloadLen);
+         }
+      }
+      break;
+
+      default:
+         Log("%s: Unexpected staged packet type = %s\n", __FUNCTION__,
+             GetMKSVchanPacketTypeAsString(packetType));
+   }
+   return packetType;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * ApplyCapability --
+ *
+ *    Apply a capability or policy packet as received, or a capability
+ *    packet of the set MKSVchanCapCache caches from the cache.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+ApplyCapability(MKSVchanPacketType packetType, // IN
+                const uint8 *data,             // IN
+                uint32 dataLen)                // IN
+{
+   uint32 value = 0;
+   if (packetType != MKSVchanPacketType_FileTransfer_Config) {
+      if (dataLen < sizeof value) {
+         Log("%s: Invalid %s of %u bytes.\n", __FUNCTION__,
+             GetMKSVchanPacketTypeAsString(packetType), dataLen);
+         return;
+      }
+      memcpy(&value, data, sizeof value);
+   }
+
+   switch (packetType) {
+      case MKSVchanPacketType_Clipboard_Locale:
+         Log("%s: Received locale, langid = 0x%08x.\n", __FUNCTION__, value);
+         MKSVchanPlugin_SetClipboardLocale(value);
+         break;
+
+      case MKSVchanPacketType_Clipboard_Capabilities:
+         Log("%s: Received capability value 0x%08x.\n", __FUNCTION__, value);
+         MKSVchanPlugin_SetClipboardCaps(value);
+         break;
+
+#if defined(_WIN32) && !defined(VM_WIN_UWP)
+      case MKSVchanPacketType_FileTransfer_Config:
+         EnsureFTInitialized();
+         FT::ReceiveConfig(const_cast<uint8 *>(data), dataLen);
+         break;
+#endif
+
+      case MKSVchanPacketType_ClipboardState:
+         LOG_INFO("Received clipboard policy state = %s\n",
+                  GetMKSVchanClipboardPolicyAsString((ClipboardPolicy)value));
+         break;
+
+      default:
+         Log("%s: Not a capability packet type = %s\n", __FUNCTION__,
+             GetMKSVchanPacketTypeAsString(packetType));
+   }
+}
+
+
+#if defined(_WIN32) && !defined(VM_WIN_UWP)
+/*
+ *----------------------------------------------------------------------------
+ *
+ * ReceiveSparseFileData --
+ *
+ *    FT::ApplySparseFrame callback with the expanded chunk, which goes
+ *    through ReceiveFileChunk in one piece like a plain chunk.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+ReceiveSparseFileData(const uint8 *data, // IN
+                      uint32 dataLen)    // IN
+{
+   ReceiveFileChunk(MKSVchanPacketType_FileTransferData_Sparse, data,
+                    dataLen);
+}
+#endif
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * DrainPostedPackets --
+ *
+ *    Task queued to the vdpservice thread by WakeChannelThread.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Sends packets posted to MKSVchanSendQueue.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+DrainPostedPackets(void *ctx) // IN: unused
+{
+   if (readyPlugin != NULL) {
+      MKSVchanSendQueue::Drain(readyPlugin);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * WakeChannelThread --
+ *
+ *    MKSVchanSendQueue wake callback, called on the posting thread when the
+ *    queue becomes non-empty. Without it a post in an idle session would
+ *    wait for the next packet from the peer.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Queues DrainPostedPackets to the vdpservice thread.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+WakeChannelThread(void *ctx) // IN: unused
+{
+   MKSVchan_QueueCallback(DrainPostedPackets, NULL);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * ResumeProducers --
+ *
+ *    Task queued to the vdpservice thread by OnBudgetReady. Sends the
+ *    packets held for the class, then lets the producers that were told
+ *    it would block send again: the next file chunks, or the clipboard
+ *    data that was refused, which is sent as it is now.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    May call FT::SendNextFileChunks or MKSVchanPlugin_SendClipboardData.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+ResumeProducers(void *ctx) // IN: the MKSVchanBudget::PacketClass
+{
+   MKSVchanBudget::PacketClass packetClass =
+      (MKSVchanBudget::PacketClass)(uintptr_t)ctx;
+
+   if (readyPlugin == NULL) {
+      return;
+   }
+   MKSVchanSendQueue::Drain(readyPlugin);
+
+   if (packetClass == MKSVchanBudget::PacketClass_FileTransfer &&
+       ftChunksDeferred &&
+       MKSVchanBudget::IsWritable(MKSVchanBudget::PacketClass_FileTransfer)) {
+      ftChunksDeferred = FALSE;
+#if defined(_WIN32) && !defined(VM_WIN_UWP)
+      Log("%s: Resuming file transfer.\n", __FUNCTION__);
+      FT::SendNextFileChunks();
+#endif
+   } else if (packetClass == MKSVchanBudget::PacketClass_Clipboard &&
+              clipboardRefused) {
+      clipboardRefused = FALSE;
+      Log("%s: Sending the clipboard refused earlier.\n", __FUNCTION__);
+      MKSVchanPlugin_SendClipboardData();
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * OnBudgetReady --
+ *
+ *    MKSVchanBudget readiness callback: a class that refused a packet, or
+ *    told a producer it would block, has room again.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Queues ResumeProducers to the vdpservice thread.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+OnBudgetReady(MKSVchanBudget::PacketClass packetClass, // IN
+              void *ctx)                               // IN: unused
+{
+   MKSVchan_QueueCallback(ResumeProducers,
+                          reinterpret_cast<void *>((uintptr_t)packetClass));
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * SendCompressedFrames --
+ *
+ *    Task queued to the vdpservice thread by OnCompressedFrameReady. Sends
+ *    the compressed chunks that are ready, in the order they were
+ *    submitted.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Sends FileTransferData_Compressed packets.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+SendCompressedFrames(void *ctx) // IN: unused
+{
+   std::vector<uint8> frame;
+   while (readyPlugin != NULL && chunkCompressor != NULL &&
+          chunkCompressor->Next(FALSE, &frame)) {
+      uint32 asyncTicket = 0;
+      if (!compressedTickets.empty()) {
+         asyncTicket = compressedTickets.front();
+         compressedTickets.pop_front();
+      }
+
+      MKSVchanAsync::BeginDeferredSend(asyncTicket);
+      Bool sent =
+         readyPlugin->SendMessage(MKSVchanPacketType_FileTransferData_Compressed,
+                                  &frame[0], (uint32)frame.size());
+      MKSVchanAsync::EndDeferredSend(sent);
+      if (!sent) {
+         Log("%s: Failed to send %u-bytes compressed chunk.\n",
+             __FUNCTION__, (uint32)frame.size());
+      }
+   }
+   MKSVchanAsync::RunPending();
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * OnCompressedFrameReady --
+ *
+ *    FT::ChunkCompressor frame ready callback, called on a compression
+ *    worker.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Queues SendCompressedFrames to the vdpservice thread.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+OnCompressedFrameReady(void *ctx) // IN: unused
+{
+   MKSVchan_QueueCallback(SendCompressedFrames, NULL);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * DeliverHeldProgress --
+ *
+ *    Task queued to the vdpservice thread by OnHeldProgressReady. Delivers
+ *    the received progress values MKSVchanProgress held back, so the UI
+ *    doesn't stay at a stale value until the next update or CopyDone.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Calls the DnD/FCP progress handlers.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+DeliverHeldProgress(void *ctx) // IN: unused
+{
+   static const MKSVchanPacketType progressTypes[] = {
+      MKSVchanPacketType_DnD_CopyProgress,
+      MKSVchanPacketType_FCP_CopyProgress,
+   };
+
+   for (size_t i = 0; i < sizeof progressTypes / sizeof progressTypes[0];
+        i++) {
+      uint32 value;
+      if (MKSVchanProgress::TakePending(progressTypes[i], &value) &&
+          deliverProgress) {
+         deliverProgress(progressTypes[i], value);
+      }
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * OnHeldProgressReady --
+ *
+ *    MKSVchanProgress held ready callback, called on its flusher thread.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Queues DeliverHeldProgress to the vdpservice thread.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+OnHeldProgressReady(void *ctx) // IN: unused
+{
+   MKSVchan_QueueCallback(DeliverHeldProgress, NULL);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * CompleteSkippedSends --
+ *
+ *    Task queued to the vdpservice thread by SendMessage for packets
+ *    MKSVchanCapCache found the peer already has. Fires the OnDone
+ *    notification a real send would have.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Calls MKSVchan_OnDataSentDone for registered packet types, and
+ *    completes MKSVchanAsync sends of the skipped packets.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+CompleteSkippedSends(void *ctx) // IN: unused
+{
+   std::vector<SkippedSend> skipped;
+   skipped.swap(skippedSends);
+   for (size_t i = 0; i < skipped.size() && completeSkippedSend; i++) {
+      completeSkippedSend(skipped[i].packetType);
+      MKSVchanAsync::CompleteDeferred(skipped[i].asyncTicket, TRUE);
+   }
+   MKSVchanAsync::RunPending();
+}
+
+
 /*
  *----------------------------------------------------------------------------
  *
@@ -119,6 +1119,8 @@ MKSVchanRPCManager::OnCreateInstance()
     */
    m_MKSVchanRPCPluginInstance = new MKSVchanRPCPlugin(this, mDnDMsgHandler,
                                                        mFcpMsgHandler);
+   MKSVchanMetrics::Start();
+   MKSVchanShm::Configure(FALSE);
    return m_MKSVchanRPCPluginInstance;
 }
 
@@ -147,8 +1149,12 @@ MKSVchanRPCManager::OnDestroyInstance(RPCPluginInstance *pluginInstance) //IN
 
    if (IsClient()) {
       MKSVchanPlugin_Cleanup(TRUE, TRUE);
+      ScMonitor::Stop();
    }
 
+   MKSVchanProgress::Stop();
+   MKSVchanMetrics::Stop();
+
    if (m_MKSVchanRPCPluginInstance != NULL) {
       delete m_MKSVchanRPCPluginInstance;
       m_MKSVchanRPCPluginInstance = NULL;
@@ -183,6 +1189,8 @@ MKSVchanRPCManager::Init(Bool isServer,                 // IN
    if (isServer) {
       m_MKSVchanRPCPluginInstance = new MKSVchanRPCPlugin(this, dndMsgHandler,
                                                           fcpMsgHandler);
+      MKSVchanMetrics::Start();
+      MKSVchanShm::Configure(TRUE);
 
       // Call RPCManager's ServerInit
       return ServerInit(m_MKSVchanRPCPluginInstance, RPC_INIT_TIMEOUT_MS);
@@ -229,6 +1237,8 @@ MKSVchanRPCManager::Exit()
 
       // TODO: do the DnD exit when client code is ready
       // m_MKSVchanRPCPluginInstance->ExitDnD();
+      MKSVchanProgress::Stop();
+      MKSVchanMetrics::Stop();
       delete m_MKSVchanRPCPluginInstance;
       m_MKSVchanRPCPluginInstance = NULL;
    }
@@ -367,59 +1377,39 @@ void
 MKSVchanRPCPlugin::OnReady()
 {
    Log("%s: OnReady called.\n", __FUNCTION__);
+   readyStart = std::chrono::steady_clock::now();
    //int result = -1;
-   std::stringstream buffer;
-   std::string str;
    // Set helper thread as the vdp service thread
    MKSVchan_SetVdpServiceThreadId();
 
    RPCManager* rpcManager = GetRPCManager();
    ASSERT(rpcManager);
 
+   MKSVchanCapCache::OnChannelReady();
+   MKSVchanReplay::OnChannelReady();
+
    if (!rpcManager->IsServer()) {
       // tests for windows
 #if defined(_WIN32) && !defined(VM_WIN_UWP)
       MKSVchan_SendSmartCardInfo("{\"test\":123}");
 #endif
 
-
-   const char *homeDir = getenv("HOME");
-   
-   Log("===================================================================Sabrina==================================");
-
-   std::string path = std::string(homeDir) + "/devices.json";
-   std::string cmd = std::string("system_profiler SPPrintersDataType SPSmartCardsDataType -json>") + path;
-   system(cmd.c_str());
-   //std::ifstream t("/Users/shou/devices.json");
-   std::ifstream t(path.c_str());
-   std::string str((std::istreambuf_iterator<char>(t)),
-                    std::istreambuf_iterator<char>());
-   Log("Length:%ld", str.length());
-   
-   Log("%s", str.c_str());
-   Log("Debug code for sending smart card info.");
-   MKSVchan_SendSmartCardInfo(str.c_str());
-  // MKSVchan_SendSmartCardInfo("Just for testing");
-
-
+      /*
+       * Readers, drivers and token certificates straight from PC/SC,
+       * collected on the monitor thread, which sends them again whenever a
+       * card or reader comes or goes.
+       */
+      ScMonitor::Start(QueueInitialSmartCardInfo);
    }
 
-#if defined(_WIN32) && !defined(VM_WIN_UWP)
-   /*
-    * Need to init some ft variables for both client and server
-    * NOTE: Init criticalSection here is not always safe. It cannot
-    * handle the old pcoip connection. Please refer to bug 1759096.
-    * Due to get file list is disabled on client side, file transfer
-    * related code will never be called on client side.
-    */
-   FT::InitFTConfig();
-#endif
-
    if (rpcManager->IsServer()) {
       if (!MKSVchanPlugin_Init(FALSE, NULL)) {
          Log("%s: Unable to initialize mksvchan.\n", __FUNCTION__);
          return;
       }
+
+      SendExtensionOffers(this, TRUE);
+
       Log("%s: Send desired capabilities.\n", __FUNCTION__);
       MKSVchan_QueueClipboardCapability();
 
@@ -445,6 +1435,36 @@ MKSVchanRPCPlugin::OnReady()
       }
 #endif
    }
+
+   uint32 readyMS = (uint32)std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - readyStart).count();
+   MKSVchanMetrics::SetTimeToReady(readyMS);
+   Log("%s: MKSVchan plugin is ready, OnReady took %ums.\n", __FUNCTION__,
+       readyMS);
+
+   // Send whatever other threads posted while the channel was coming up
+   readyPlugin = this;
+   MKSVchanSendQueue::SetWakeCallback(WakeChannelThread, NULL);
+   MKSVchanBudget::SetReadyCallback(OnBudgetReady, NULL);
+   deliverProgress = [this](MKSVchanPacketType packetType, uint32 value) {
+      if (packetType == MKSVchanPacketType_DnD_CopyProgress) {
+         if (NULL != mDnDMsgHandler) {
+            mDnDMsgHandler->OnRecvCopyProgress(value);
+         }
+      } else if (NULL != mFcpMsgHandler) {
+         mFcpMsgHandler->OnRecvCopyProgress(value);
+      }
+   };
+   MKSVchanProgress::SetHeldReadyCallback(OnHeldProgressReady, NULL);
+   completeSkippedSend = [this](MKSVchanPacketType packetType) {
+      MKSVchanCPRequestList skipped;
+      skipped.push_back(MKSVchanCPRequest(0, 0,
+                                          MKSVchanCPRequest::MKS_Clipboard_Data,
+                                          packetType,
+                                          MKSVchan_OnDataSentDone));
+      NotifyForRegisteredOnDonePacketType(skipped.begin());
+   };
+   MKSVchanSendQueue::Drain(this);
 }
 
 
@@ -477,14 +1497,50 @@ MKSVchanRPCPlugin::OnNotReady()
       }
       MKSVchanPlugin_Cleanup(TRUE, FALSE);
 #if defined(_WIN32) && !defined(VM_WIN_UWP)
-      FT::OnInterrupt(TRUE);
+      if (ftInitialized) {
+         FT::OnInterrupt(TRUE);
+      }
 #endif
       m_requestList.clear();
+      MKSVchanMetrics::ResetInFlight();
+      ScInfoStore::Reset();
    } else {
 #if defined(_WIN32) && !defined(VM_WIN_UWP)
-      FT::OnInterrupt(FALSE);
+      if (ftInitialized) {
+         FT::OnInterrupt(FALSE);
+      }
 #endif
+      ScMonitor::Stop();
    }
+   ftInitialized = FALSE;
+   DeleteChunkCompressor();
+   FT::SetPeerSupportsCompression(FALSE);
+   FT::SetPeerSupportsSparse(FALSE);
+   ScInventory::SetPeerBinaryVersion(0);
+   extOffersSent = FALSE;
+   peerHeard = FALSE;
+   readySession++;
+
+   MKSVchanShm::OnChannelNotReady();
+   MKSVchanCapCache::OnChannelNotReady();
+   readyPlugin = NULL;
+   MKSVchanSendQueue::SetWakeCallback(NULL, NULL);
+   MKSVchanBudget::SetReadyCallback(NULL, NULL);
+   MKSVchanProgress::SetHeldReadyCallback(NULL, NULL);
+   deliverProgress = nullptr;
+   completeSkippedSend = nullptr;
+   skippedSends.clear();
+   ftChunksDeferred = FALSE;
+   clipboardRefused = FALSE;
+   MKSVchanSendQueue::Clear();
+   MKSVchanReplay::OnChannelNotReady();
+   MKSVchanBudget::Reset();
+   MKSVchanProgress::Reset();
+   cancelledFileRequests.clear();
+
+   // Fail pending coroutine sends while we are still on the vdpservice thread
+   MKSVchanAsync::OnChannelNotReady();
+   MKSVchanAsync::RunPending();
 
    // Reset the vdpservice thread id tracked by the plugin
    MKSVchan_ResetVdpServiceThreadId();
@@ -500,11 +1556,13 @@ MKSVchanRPCPlugin::OnNotReady()
    }
 
 #ifndef VM_WIN_UWP
-   if ((nullptr != mDnDMsgHandler) || (nullptr!= mFcpMsgHandler)) {
+   if (copyFeaturesUsed &&
+       ((nullptr != mDnDMsgHandler) || (nullptr!= mFcpMsgHandler))) {
       // Remove temporary folders which may created by DnD and FCP features
       FileCopyUtils::RemoveTempFolder();
    }
 #endif
+   copyFeaturesUsed = FALSE;
 
    Log("%s: MKSVchan plugin got disconnected.\n", __FUNCTION__);
 }
@@ -572,13 +1630,24 @@ MKSVchanRPCPlugin::OnDone(uint32 requestCtxId, // IN
    MKSVchanRPCPlugin::MKSVchanCPRequestList::iterator it = m_requestList.begin();
    while (it != m_requestList.end()) {
       if (it->m_id == requestCtxId) {
+         MKSVchanMetrics::RecordSendDone(it->m_packetType, it->m_dataLen);
+         MKSVchanBudget::Release(BudgetClassOf(*it), it->m_dataLen);
          if (it->m_dataType == MKSVchanCPRequest::MKS_FileTransfer_Data) {
 #if defined(_WIN32) && !defined(VM_WIN_UWP)
             // Only windows implementation for file transfer now
-            m_chunkSendCount++;
-            if (m_chunkSendCount == FT::GetCurrentNumberOfChunkToSend()) {
-               m_chunkSendCount = 0;
-               FT::SendNextFileChunks();
+            if (cancelledFileRequests.erase(requestCtxId) == 0) {
+               m_chunkSendCount++;
+               if (m_chunkSendCount == FT::GetCurrentNumberOfChunkToSend()) {
+                  m_chunkSendCount = 0;
+
+                  // Backed up: the next chunks wait for OnBudgetReady
+                  if (MKSVchanBudget::IsWritable(
+                         MKSVchanBudget::PacketClass_FileTransfer)) {
+                     FT::SendNextFileChunks();
+                  } else {
+                     ftChunksDeferred = TRUE;
+                  }
+               }
             }
 #endif
          } else if (it->m_dataType == MKSVchanCPRequest::MKS_DropInteraction_Data) {
@@ -599,6 +1668,14 @@ MKSVchanRPCPlugin::OnDone(uint32 requestCtxId, // IN
       }
       ++it;
    }
+
+   MKSVchanReplay::OnRequestDone(requestCtxId);
+
+   // Resume coroutine producers only after we are done with m_requestList
+   MKSVchanAsync::OnRequestDone(requestCtxId);
+   MKSVchanAsync::RunPending();
+   MKSVchanSendQueue::Drain(this);
+   MKSVchanCancel::CheckQuiescent();
    return;
 }
 
@@ -611,7 +1688,8 @@ MKSVchanRPCPlugin::OnDone(uint32 requestCtxId, // IN
  *    Called by the RPCManager in case the message was discarded by the other side
  *
  * Results:
- *    Not implemented
+ *    The request is dropped from m_requestList and any coroutine awaiting
+ *    it is resumed with a failure.
  *
  * Side effects:
  *    None.
@@ -624,7 +1702,27 @@ MKSVchanRPCPlugin::OnAbort(uint32 requestCtxId, // IN
                            Bool userCancelled,  // IN
                            uint32 reason)       // IN
 {
-   // Not implemented
+   MKSVchanRPCPlugin::MKSVchanCPRequestList::iterator it = m_requestList.begin();
+   while (it != m_requestList.end()) {
+      if (it->m_id == requestCtxId) {
+         Log("%s: Sending %u-bytes payload of type %s was aborted, "
+             "userCancelled %d, reason %u.\n", __FUNCTION__, it->m_dataLen,
+             GetMKSVchanPacketTypeAsString(it->m_packetType),
+             userCancelled, reason);
+         MKSVchanMetrics::RecordSendDone(it->m_packetType, it->m_dataLen);
+         MKSVchanBudget::Release(BudgetClassOf(*it), it->m_dataLen);
+         m_requestList.erase(it);
+         break;
+      }
+      ++it;
+   }
+
+   cancelledFileRequests.erase(requestCtxId);
+   MKSVchanReplay::OnRequestDone(requestCtxId);
+   MKSVchanAsync::OnRequestAborted(requestCtxId);
+   MKSVchanAsync::RunPending();
+   MKSVchanSendQueue::Drain(this);
+   MKSVchanCancel::CheckQuiescent();
    return;
 }
 
@@ -665,6 +1763,9 @@ MKSVchanRPCPlugin::isDataValid(RPCVariant *data, // OUT
       return FALSE;
    }
 
+   MKSVchanMetrics::RecordReceiveBytes(
+      (MKSVchanPacketType)iChannelCtx->v1.GetCommand(messageCtx),
+      data->blobVal.size);
    return TRUE;
 }
 
@@ -700,6 +1801,258 @@ MKSVchanRPCPlugin::OnInvoke(void* messageCtx) // IN: message context from vdpser
 
    Log("%s: Received packetType = %s.\n", __FUNCTION__,
        GetMKSVchanPacketTypeAsString(receivedPacketType));
+   MKSVchanMetrics::RecordReceive(receivedPacketType);
+
+   if (IsCopyPacketType(receivedPacketType)) {
+      copyFeaturesUsed = TRUE;
+   }
+
+   if (!peerHeard) {
+      peerHeard = TRUE;
+      MKSVchanMetrics::SetTimeToPeer((uint32)std::chrono::duration_cast<
+         std::chrono::milliseconds>(std::chrono::steady_clock::now() -
+                                    readyStart).count());
+   }
+
+   // The agent takes extension packets, answer with ours
+   if (MKSVCHAN_IS_EXT_PACKET_TYPE(receivedPacketType)) {
+      SendExtensionOffers(this, GetRPCManager()->IsServer());
+   }
+
+   // Packets posted from other threads go out ahead of any reply to this one
+   MKSVchanSendQueue::Drain(this);
+
+   /*
+    * Packet types of negotiated extensions are outside the regular enum
+    * range, so they are dispatched separately.
+    */
+   if (MKSVCHAN_IS_EXT_PACKET_TYPE(receivedPacketType)) {
+      switch ((uint32)receivedPacketType) {
+         case MKSVchanPacketType_Shm_Offer:
+         case MKSVchanPacketType_Shm_Setup:
+         case MKSVchanPacketType_Shm_Ready:
+         case MKSVchanPacketType_Shm_Teardown:
+         {
+            RPCVariant shmControl(this);
+            if (!isDataValid(&shmControl, messageCtx)) {
+               return;
+            }
+
+            MKSVchanShm::HandleControlPacket(this, receivedPacketType,
+               reinterpret_cast<uint8 *>(shmControl.blobVal.blobData),
+               shmControl.blobVal.size);
+         }
+         break;
+
+         case MKSVchanPacketType_Shm_Descriptor:
+         {
+            RPCVariant descriptor(this);
+            if (!isDataValid(&descriptor, messageCtx)) {
+               return;
+            }
+
+            std::vector<uint8> payload;
+            if (!MKSVchanShm::Resolve(this,
+                   reinterpret_cast<uint8 *>(descriptor.blobVal.blobData),
+                   descriptor.blobVal.size, &receivedPacketType, &payload)) {
+               return;
+            }
+            // isDataValid counted the descriptor, this the payload it holds
+            MKSVchanMetrics::RecordReceiveBytes(receivedPacketType,
+                                                (uint32)payload.size());
+
+            receivedPacketType =
+               DispatchStagedPayload(receivedPacketType, &payload[0],
+                                     (uint32)payload.size());
+         }
+         break;
+
+         case MKSVchanPacketType_Replay_Offer:
+         {
+            RPCVariant offer(this);
+            if (!isDataValid(&offer, messageCtx)) {
+               return;
+            }
+
+            Log("%s: Peer dedups replayed clipboard data.\n", __FUNCTION__);
+            MKSVchanReplay::HandleOffer(this,
+               reinterpret_cast<uint8 *>(offer.blobVal.blobData),
+               offer.blobVal.size);
+         }
+         break;
+
+         case MKSVchanPacketType_CapCache_Offer:
+         {
+            RPCVariant offer(this);
+            if (!isDataValid(&offer, messageCtx)) {
+               return;
+            }
+
+            MKSVchanCapCache::HandleOffer(this,
+               reinterpret_cast<uint8 *>(offer.blobVal.blobData),
+               offer.blobVal.size, ApplyCapability);
+         }
+         break;
+
+         case MKSVchanPacketType_SmartCard_FormatOffer:
+         {
+            RPCVariant offer(this);
+            if (!isDataValid(&offer, messageCtx)) {
+               return;
+            }
+
+            uint32 version = 0;
+            if (offer.blobVal.size >= sizeof version) {
+               memcpy(&version, offer.blobVal.blobData, sizeof version);
+            }
+            ScInventory::SetPeerBinaryVersion(version);
+            Log("%s: Peer reads binary smart card info version %u, "
+                "further inventories are sent in it.\n", __FUNCTION__,
+                version);
+         }
+         break;
+
+#if defined(_WIN32) && !defined(VM_WIN_UWP)
+         case MKSVchanPacketType_SmartCardInfo_Binary:
+         {
+            RPCVariant scInfo(this);
+            if (!isDataValid(&scInfo, messageCtx)) {
+               return;
+            }
+
+            const uint8 *data =
+               reinterpret_cast<const uint8 *>(scInfo.blobVal.blobData);
+            ScInventory::Inventory inventory;
+            if (!ScInventory::FromBinary(data, scInfo.blobVal.size,
+                                         &inventory)) {
+               Log("%s: Invalid binary smart card info.\n", __FUNCTION__);
+               break;
+            }
+
+            Log("%s: Received binary Smart Card Client Info of size %d.\n",
+                __FUNCTION__, scInfo.blobVal.size);
+
+            /*
+             * What is saved keeps the JSON schema its consumers read. The
+             * store indexes the decoded inventory, not the payload again.
+             */
+            std::string json = ScInventory::ToJson(inventory);
+            MKSVchanPlugin_SaveSmartCardInfo(&json[0],
+                                             (uint32)json.length() + 1);
+            ScInfoStore::UpdateInventory(inventory);
+            MKSVchanMetrics::MarkSmartCardInventory();
+         }
+         break;
+#endif
+
+         case MKSVchanPacketType_CapCache_Ack:
+         {
+            RPCVariant ack(this);
+            if (!isDataValid(&ack, messageCtx)) {
+               return;
+            }
+
+            MKSVchanCapCache::HandleAck(
+               reinterpret_cast<uint8 *>(ack.blobVal.blobData),
+               ack.blobVal.size);
+         }
+         break;
+
+         case MKSVchanPacketType_Replay_Data:
+         {
+            RPCVariant replayData(this);
+            if (!isDataValid(&replayData, messageCtx)) {
+               return;
+            }
+
+            // Handlers registered for clipboard data are told of it
+            receivedPacketType = DispatchStagedPayload(receivedPacketType,
+               reinterpret_cast<uint8 *>(replayData.blobVal.blobData),
+               replayData.blobVal.size);
+         }
+         break;
+
+         case MKSVchanPacketType_FileTransfer_CompressionOffer:
+         {
+            RPCVariant offer(this);
+            if (!isDataValid(&offer, messageCtx)) {
+               return;
+            }
+
+            FT::SetPeerSupportsCompression(TRUE);
+            Log("%s: Peer supports file transfer compression, %s.\n",
+                __FUNCTION__, FT::IsCompressionActive() ? "enabled" : "disabled");
+         }
+         break;
+
+         case MKSVchanPacketType_FileTransfer_SparseOffer:
+         {
+            RPCVariant offer(this);
+            if (!isDataValid(&offer, messageCtx)) {
+               return;
+            }
+
+            FT::SetPeerSupportsSparse(TRUE);
+            Log("%s: Peer supports sparse file transfer.\n", __FUNCTION__);
+         }
+         break;
+
+#if defined(_WIN32) && !defined(VM_WIN_UWP)
+         case MKSVchanPacketType_FileTransferData_Compressed:
+         {
+            if (!MKSVchan_FileTransfer_ToServerEnabled()) {
+               break;
+            }
+
+            RPCVariant frame(this);
+            if (!isDataValid(&frame, messageCtx)) {
+               return;
+            }
+
+            std::vector<uint8> fileData;
+            if (!FT::DecodeChunkFrame(
+                   reinterpret_cast<uint8 *>(frame.blobVal.blobData),
+                   frame.blobVal.size, &fileData)) {
+               return;
+            }
+            ReceiveFileChunk(receivedPacketType,
+                             fileData.empty() ? NULL : &fileData[0],
+                             (uint32)fileData.size());
+         }
+         break;
+
+         case MKSVchanPacketType_FileTransferData_Sparse:
+         {
+            if (!MKSVchan_FileTransfer_ToServerEnabled()) {
+               break;
+            }
+
+            RPCVariant frame(this);
+            if (!isDataValid(&frame, messageCtx)) {
+               return;
+            }
+
+            EnsureFTInitialized();
+            if (!FT::ApplySparseFrame(
+                   reinterpret_cast<uint8 *>(frame.blobVal.blobData),
+                   frame.blobVal.size, ReceiveSparseFileData)) {
+               // The chunk is lost, the file would be written with a gap
+               Log("%s: Dropping malformed %u-bytes sparse frame, "
+                   "interrupting the file transfer.\n", __FUNCTION__,
+                   frame.blobVal.size);
+               FT::OnInterrupt(GetRPCManager()->IsServer());
+            }
+         }
+         break;
+#endif
+
+         default:
+            Log("%s: Received unknown extension packet type 0x%x\n",
+                __FUNCTION__, (uint32)receivedPacketType);
+      }
+      NotifyForRegisteredOnInvokePacketType(receivedPacketType);
+      return;
+   }
 
    /*
     * Now take appropriate action
@@ -715,9 +2068,10 @@ MKSVchanRPCPlugin::OnInvoke(void* messageCtx) // IN: message context from vdpser
             return;
          }
 
-         uint32* langIdValuePtr = reinterpret_cast<uint32*>(langIdData.blobVal.blobData);
-         Log("%s: Received locale, langid = 0x%08x.\n", __FUNCTION__, *langIdValuePtr);
-         MKSVchanPlugin_SetClipboardLocale(*langIdValuePtr);
+         const uint8 *langIdPtr = reinterpret_cast<uint8 *>(langIdData.blobVal.blobData);
+         MKSVchanCapCache::RecordReceived(receivedPacketType, langIdPtr,
+                                          langIdData.blobVal.size);
+         ApplyCapability(receivedPacketType, langIdPtr, langIdData.blobVal.size);
       }
       break;
 
@@ -730,9 +2084,10 @@ MKSVchanRPCPlugin::OnInvoke(void* messageCtx) // IN: message context from vdpser
             return;
          }
 
-         uint32* capsValuePtr = reinterpret_cast<uint32*>(capsData.blobVal.blobData);
-         Log("%s: Received capability value 0x%08x.\n", __FUNCTION__, *capsValuePtr);
-         MKSVchanPlugin_SetClipboardCaps(*capsValuePtr);
+         const uint8 *capsPtr = reinterpret_cast<uint8 *>(capsData.blobVal.blobData);
+         MKSVchanCapCache::RecordReceived(receivedPacketType, capsPtr,
+                                          capsData.blobVal.size);
+         ApplyCapability(receivedPacketType, capsPtr, capsData.blobVal.size);
       }
       break;
 
@@ -773,6 +2128,8 @@ MKSVchanRPCPlugin::OnInvoke(void* messageCtx) // IN: message context from vdpser
              scInfo.blobVal.size);
          char * data = reinterpret_cast<char *>(scInfo.blobVal.blobData);
          MKSVchanPlugin_SaveSmartCardInfo(data, scInfo.blobVal.size);
+         ScInfoStore::Update(data, scInfo.blobVal.size);
+         MKSVchanMetrics::MarkSmartCardInventory();
       }
       break;
 #endif
@@ -825,6 +2182,8 @@ MKSVchanRPCPlugin::OnInvoke(void* messageCtx) // IN: message context from vdpser
                   if (strcmp(varName, CLIPBOARD_DATA_PARM_NAME) == 0 || varData.vt == VDP_RPC_VT_BLOB) {
                      // Found clipboard data
                      Log("%s: Received message of size %d.\n", __FUNCTION__, varData.blobVal.size);
+                     MKSVchanMetrics::RecordReceiveBytes(receivedPacketType,
+                                                         varData.blobVal.size);
                      MKSVchan_SetClipboard(receivedPacketType,
                                            reinterpret_cast<uint8*>(varData.blobVal.blobData),
                                            varData.blobVal.size);
@@ -864,6 +2223,8 @@ MKSVchanRPCPlugin::OnInvoke(void* messageCtx) // IN: message context from vdpser
                      return;
                   }
                   Log("%s: Received message of size %d.\n", __FUNCTION__, varClipboardData.blobVal.size);
+                  MKSVchanMetrics::RecordReceiveBytes(receivedPacketType,
+                                                      varClipboardData.blobVal.size);
                   Log("%s: Received error message = %s.\n", __FUNCTION__,
                      GetMKSVchanClipboardErrorAsString((MKSVCHAN_CLIPBOARD_ERROR)varClipboardError.ulVal));
                   MKSVchan_SetClipboard(receivedPacketType,
@@ -892,6 +2253,8 @@ MKSVchanRPCPlugin::OnInvoke(void* messageCtx) // IN: message context from vdpser
          }
 
          uint8* requestDataPtr = reinterpret_cast<uint8*>(requestData.blobVal.blobData);
+         EnsureFTInitialized();
+         MKSVchanCancel::BeginCopy();
          FT::ReceiveRequest(requestDataPtr, requestData.blobVal.size);
       }
       break;
@@ -906,7 +2269,8 @@ MKSVchanRPCPlugin::OnInvoke(void* messageCtx) // IN: message context from vdpser
             }
 
             uint8* fileDataPtr = reinterpret_cast<uint8*>(fileData.blobVal.blobData);
-            FT::ReceiveFileData(fileDataPtr, fileData.blobVal.size);
+            ReceiveFileChunk(receivedPacketType, fileDataPtr,
+                             fileData.blobVal.size);
          }
       }
       break;
@@ -920,7 +2284,9 @@ MKSVchanRPCPlugin::OnInvoke(void* messageCtx) // IN: message context from vdpser
          }
 
          uint8* configDataPtr = reinterpret_cast<uint8*>(config.blobVal.blobData);
-         FT::ReceiveConfig(configDataPtr, config.blobVal.size);
+         MKSVchanCapCache::RecordReceived(receivedPacketType, configDataPtr,
+                                          config.blobVal.size);
+         ApplyCapability(receivedPacketType, configDataPtr, config.blobVal.size);
       }
       break;
 
@@ -951,6 +2317,9 @@ MKSVchanRPCPlugin::OnInvoke(void* messageCtx) // IN: message context from vdpser
 
          uint32 *value =
             reinterpret_cast<uint32 *>(progressValue.blobVal.blobData);
+         if (!MKSVchanProgress::ShouldDeliver(receivedPacketType, *value)) {
+            break;
+         }
          if (NULL != mDnDMsgHandler) {
             mDnDMsgHandler->OnRecvCopyProgress(*value);
          }
@@ -968,6 +2337,13 @@ MKSVchanRPCPlugin::OnInvoke(void* messageCtx) // IN: message context from vdpser
          uint32 *doneValue = reinterpret_cast<uint32 *>(copyDoneValue.blobVal.blobData);
          Log("%s: Received DnD copy done data of size %d, value %d.", __FUNCTION__,
              copyDoneValue.blobVal.size, *doneValue);
+         uint32 lastProgress;
+         if (MKSVchanProgress::TakePending(MKSVchanPacketType_DnD_CopyProgress,
+                                           &lastProgress) &&
+             NULL != mDnDMsgHandler) {
+            mDnDMsgHandler->OnRecvCopyProgress(lastProgress);
+         }
+         MKSVchanProgress::LogStats(MKSVchanPacketType_DnD_CopyProgress);
          if (NULL != mDnDMsgHandler) {
             mDnDMsgHandler->OnRecvCopyDone(*doneValue);
          }
@@ -986,6 +2362,13 @@ MKSVchanRPCPlugin::OnInvoke(void* messageCtx) // IN: message context from vdpser
              copyDoneValue.blobVal.size);
 
          uint32 *doneValue = reinterpret_cast<uint32 *>(copyDoneValue.blobVal.blobData);
+         uint32 lastProgress;
+         if (MKSVchanProgress::TakePending(MKSVchanPacketType_FCP_CopyProgress,
+                                           &lastProgress) &&
+             NULL != mFcpMsgHandler) {
+            mFcpMsgHandler->OnRecvCopyProgress(lastProgress);
+         }
+         MKSVchanProgress::LogStats(MKSVchanPacketType_FCP_CopyProgress);
          if (NULL != mFcpMsgHandler) {
             mFcpMsgHandler->OnRecvCopyDone(*doneValue);
          }
@@ -1003,6 +2386,9 @@ MKSVchanRPCPlugin::OnInvoke(void* messageCtx) // IN: message context from vdpser
          Log("%s: Received FCP copy progress of size %d, value = %d.\n",
              __FUNCTION__, progressValue.blobVal.size, *progress);
 
+         if (!MKSVchanProgress::ShouldDeliver(receivedPacketType, *progress)) {
+            break;
+         }
          if (NULL != mFcpMsgHandler) {
             mFcpMsgHandler->OnRecvCopyProgress(*progress);
          }
@@ -1110,6 +2496,12 @@ MKSVchanRPCPlugin::OnInvoke(void* messageCtx) // IN: message context from vdpser
       {
          Log("%s: Received notification to cancel DnD Copying.\n",
              __FUNCTION__);
+         CancelCopyPipeline(receivedPacketType, m_requestList);
+#if defined(_WIN32) && !defined(VM_WIN_UWP)
+         m_chunkSendCount = 0;
+#endif
+         MKSVchanSendQueue::Drain(this);
+         MKSVchanCancel::CheckQuiescent();
          if (NULL != mDnDMsgHandler) {
             mDnDMsgHandler->OnRecvCancelCopy();
          }
@@ -1153,6 +2545,12 @@ MKSVchanRPCPlugin::OnInvoke(void* messageCtx) // IN: message context from vdpser
 
       case MKSVchanPacketType_FCP_CancelCopy:
       {
+         CancelCopyPipeline(receivedPacketType, m_requestList);
+#if defined(_WIN32) && !defined(VM_WIN_UWP)
+         m_chunkSendCount = 0;
+#endif
+         MKSVchanSendQueue::Drain(this);
+         MKSVchanCancel::CheckQuiescent();
          if (NULL != mFcpMsgHandler) {
             mFcpMsgHandler->OnRecvCancelCopy();
          }
@@ -1169,9 +2567,10 @@ MKSVchanRPCPlugin::OnInvoke(void* messageCtx) // IN: message context from vdpser
             return;
          }
 
-         uint32 *policyValuePtr = reinterpret_cast<uint32 *>(policyData.blobVal.blobData);
-         LOG_INFO("Received clipboard policy state = %s\n",
-                  GetMKSVchanClipboardPolicyAsString((ClipboardPolicy)(*policyValuePtr)));
+         const uint8 *policyPtr = reinterpret_cast<uint8 *>(policyData.blobVal.blobData);
+         MKSVchanCapCache::RecordReceived(receivedPacketType, policyPtr,
+                                          policyData.blobVal.size);
+         ApplyCapability(receivedPacketType, policyPtr, policyData.blobVal.size);
       }
       break;
       default:
@@ -1192,6 +2591,8 @@ MKSVchanRPCPlugin::OnInvoke(void* messageCtx) // IN: message context from vdpser
  * Results:
  *     It sends the packet type (clipboard request or send clipboard data) as the
  *     command in the channel context. It sets the data as a variant blob.
+ *     A payload over its MKSVchanBudget limit is queued to
+ *     MKSVchanSendQueue instead; FALSE only if the queue is full too.
  *
  * Side effects:
  *    None.
@@ -1210,28 +2611,192 @@ MKSVchanRPCPlugin::SendMessage(MKSVchanPacketType packetType, // IN: format of d
       return FALSE;
    }
 
+   if (IsCopyPacketType(packetType)) {
+      copyFeaturesUsed = TRUE;
+   } else if (packetType == MKSVchanPacketType_FileTransferData_File) {
+      EnsureFTInitialized();
+   }
+
+   /*
+    * Copy progress is coalesced and comes back through MKSVchanSendQueue.
+    * A CopyDone first posts the value still held back; the budget check
+    * below then queues the CopyDone behind it.
+    */
+   if (!MKSVchanSendQueue::IsDraining()) {
+      if (MKSVchanProgress::IsProgressPacketType(packetType) &&
+          dataLen == sizeof(uint32)) {
+         uint32 value;
+         memcpy(&value, data, sizeof value);
+         return MKSVchanProgress::Submit(packetType, value);
+      }
+      if (packetType == MKSVchanPacketType_DnD_CopyDone ||
+          packetType == MKSVchanPacketType_FCP_CopyDone) {
+         MKSVchanPacketType progressType =
+            packetType == MKSVchanPacketType_DnD_CopyDone ?
+               MKSVchanPacketType_DnD_CopyProgress :
+               MKSVchanPacketType_FCP_CopyProgress;
+         MKSVchanProgress::FlushPending(progressType);
+         MKSVchanProgress::LogStats(progressType);
+      }
+   }
+
+   /*
+    * With compression on, the chunk goes to the compressor and is sent as
+    * a FileTransferData_Compressed frame by SendCompressedFrames. OnDone of
+    * the frame counts for the chunk, so the file transfer pacing holds.
+    */
+   if (packetType == MKSVchanPacketType_FileTransferData_File &&
+       0 != dataLen && FT::IsCompressionActive()) {
+      if (chunkCompressor == NULL) {
+         chunkCompressor = new FT::ChunkCompressor();
+         chunkCompressor->SetFrameReadyCallback(OnCompressedFrameReady, NULL);
+      }
+      chunkCompressor->Submit(data, dataLen);
+      compressedTickets.push_back(MKSVchanAsync::Defer());
+      return TRUE;
+   }
+
+   /*
+    * Without compression, a chunk with zero blocks goes out as a sparse
+    * frame. The chunk is opaque here and its file offset unknown, so
+    * blocks are counted from the start of the chunk. FT::ReadSparseChunk
+    * is for readers that know the file and offset.
+    */
+   if (packetType == MKSVchanPacketType_FileTransferData_File &&
+       0 != dataLen && FT::IsSparseActive()) {
+      std::vector<uint8> sparseFrame;
+      if (FT::EncodeSparseChunk(data, dataLen, 0, &sparseFrame) &&
+          sparseFrame.size() < dataLen) {
+         return SendMessage(MKSVchanPacketType_FileTransferData_Sparse,
+                            &sparseFrame[0], (uint32)sparseFrame.size());
+      }
+   }
+
+   // A new clipboard drops the kept ones before it can wait in the queue
+   if (!MKSVchanSendQueue::IsDraining()) {
+      MKSVchanReplay::Produced(packetType);
+   }
+
+   /*
+    * Over budget, or behind packets of its class that already wait for
+    * budget, the packet is queued and goes out from a later Drain. The
+    * caller sees a successful send; OnDone fires once it is really sent.
+    * Only a full queue refuses it; the producer then hears from
+    * OnBudgetReady.
+    */
+   MKSVchanBudget::PacketClass budgetClass = MKSVchanBudget::ClassOf(packetType);
+   if (0 != dataLen && !MKSVchanSendQueue::IsDraining() &&
+       (MKSVchanBudget::GetQueued(budgetClass) > 0 ||
+        MKSVchanBudget::WouldBlock(budgetClass, dataLen))) {
+      MKSVCHAN_CLIPBOARD_ERROR clipboardError = g_clipboardError;
+      g_clipboardError = MKSVCHAN_CLIPBOARD_ERROR_NONE;
+      uint32 asyncTicket = MKSVchanAsync::Defer();
+      if (!MKSVchanSendQueue::PostDeferred(packetType, data, dataLen,
+                                           clipboardError, asyncTicket)) {
+         MKSVchanAsync::CompleteDeferred(asyncTicket, FALSE);
+         if (budgetClass == MKSVchanBudget::PacketClass_Clipboard) {
+            clipboardRefused = TRUE;
+         }
+         return FALSE;
+      }
+      Log("%s: Queued %u-bytes %s payload, %llu %s bytes in flight.\n",
+          __FUNCTION__, dataLen, GetMKSVchanPacketTypeAsString(packetType),
+          (unsigned long long)MKSVchanBudget::GetInFlight(budgetClass),
+          MKSVchanBudget::GetClassName(budgetClass));
+      return TRUE;
+   }
+
+   /*
+    * The peer applied our cached capability set and has this one already.
+    * Its OnDone still fires, from a task like a real send's would.
+    */
+   if (!MKSVchanCapCache::ShouldSend(packetType, data, dataLen)) {
+      if (skippedSends.empty()) {
+         MKSVchan_QueueCallback(CompleteSkippedSends, NULL);
+      }
+      SkippedSend skipped = { packetType, MKSVchanAsync::Defer() };
+      skippedSends.push_back(skipped);
+      return TRUE;
+   }
+
+   if (packetType == MKSVchanPacketType_DnD_CancelCopy ||
+       packetType == MKSVchanPacketType_FCP_CancelCopy) {
+      // Queued file data is dropped by the next Drain, or the running one
+      CancelCopyPipeline(packetType, m_requestList);
+#if defined(_WIN32) && !defined(VM_WIN_UWP)
+      m_chunkSendCount = 0;
+#endif
+   } else if (packetType == MKSVchanPacketType_FileTransferRequest) {
+      MKSVchanCancel::BeginCopy();
+   }
+
+   // Payload stays accounted until OnDone/OnAbort
+   if (0 != dataLen && !MKSVchanBudget::Reserve(budgetClass, dataLen)) {
+      Log("%s: Would block, %u-bytes %s payload with %llu %s bytes in flight.\n",
+          __FUNCTION__, dataLen, GetMKSVchanPacketTypeAsString(packetType),
+          (unsigned long long)MKSVchanBudget::GetInFlight(budgetClass),
+          MKSVchanBudget::GetClassName(budgetClass));
+      if (budgetClass == MKSVchanBudget::PacketClass_Clipboard) {
+         clipboardRefused = TRUE;
+      }
+      return FALSE;
+   }
+
    const VDPRPC_ChannelContextInterface* iChannelCtx = ChannelContextInterface();
 
    // Create the message context using RPCManager API
    void* messageCtx = NULL;
    if (!CreateMessage(&messageCtx, RPC_CHANNEL_TYPE_CONTROL)) {
       Log("%s: Something went wrong while calling CreateMessage.\n", __FUNCTION__);
+      if (0 != dataLen) {
+         MKSVchanBudget::Release(budgetClass, dataLen);
+      }
       return FALSE;
    }
 
    // Set command as the packet type
    RPCVariant varData(this);
+   MKSVchanPacketType wirePacketType = packetType;
    if (packetType == MKSVchanPacketType_LegacyDnD_Data) {
-      iChannelCtx->v1.SetCommand(messageCtx, MKSVchanPacketType_ClipboardData_CPClipboard);
-   } else {
-      iChannelCtx->v1.SetCommand(messageCtx, packetType);
+      wirePacketType = MKSVchanPacketType_ClipboardData_CPClipboard;
+   }
+
+   // Clipboard data carries a sequence number so it can be replayed
+   uint8 *payload = data;
+   uint32 payloadLen = dataLen;
+   MKSVchanPayloadBuffer replayPayload;
+   Bool replayWrapped = g_clipboardError == MKSVCHAN_CLIPBOARD_ERROR_NONE &&
+      MKSVchanReplay::Prepare(packetType, data, dataLen, &replayPayload);
+   if (replayWrapped) {
+      wirePacketType = MKSVchanPacketType_Replay_Data;
+      payload = replayPayload.Data();
+      payloadLen = (uint32)replayPayload.Size();
+   }
+
+   /*
+    * With a co-located peer, large payloads go through shared memory and
+    * only a descriptor is put on the channel. Clipboard errors still need
+    * the named param, so those messages always use the channel.
+    */
+   MKSVchanPacketType commandType = wirePacketType;
+   uint8 *wireData = payload;
+   uint32 wireDataLen = payloadLen;
+   MKSVchanShmDescriptor shmDescriptor;
+   Bool shmStaged = g_clipboardError == MKSVCHAN_CLIPBOARD_ERROR_NONE &&
+      MKSVchanShm::Stage(wirePacketType, payload, payloadLen, &shmDescriptor);
+   if (shmStaged) {
+      commandType = MKSVchanPacketType_Shm_Descriptor;
+      wireData = reinterpret_cast<uint8 *>(&shmDescriptor);
+      wireDataLen = sizeof shmDescriptor;
    }
+   iChannelCtx->v1.SetCommand(messageCtx, commandType);
 
    // Add the data blob
+   uint32 reqId = 0;
    if (0 != dataLen) {
       // Initialize the request class with request id and clipboard data length
-      uint32 reqId = iChannelCtx->v1.GetId(messageCtx);
-      if (packetType == MKSVchanPacketType_FileTransferData_File) {
+      reqId = iChannelCtx->v1.GetId(messageCtx);
+      if (IsFileDataPacketType(packetType)) {
          m_requestList.push_back(MKSVchanCPRequest(reqId, dataLen,
                                                    MKSVchanCPRequest::MKS_FileTransfer_Data,
                                                    packetType));
@@ -1246,10 +2811,11 @@ MKSVchanRPCPlugin::SendMessage(MKSVchanPacketType packetType, // IN: format of d
                                                    packetType,
                                                    MKSVchan_OnDataSentDone));
       }
+      MKSVchanAsync::OnRequestQueued(reqId);
 
       VDP_RPC_BLOB dataBlob;
-      dataBlob.size = dataLen;
-      dataBlob.blobData = reinterpret_cast<char*>(data);
+      dataBlob.size = wireDataLen;
+      dataBlob.blobData = reinterpret_cast<char*>(wireData);
       VariantInterface()->v1.VariantFromBlob(&varData, &dataBlob);
       iChannelCtx->v1.AppendNamedParam(messageCtx, CLIPBOARD_DATA_PARM_NAME, &varData);
    }
@@ -1273,9 +2839,28 @@ MKSVchanRPCPlugin::SendMessage(MKSVchanPacketType packetType, // IN: format of d
    if (!InvokeMessage(messageCtx, TRUE, RPC_CHANNEL_TYPE_CONTROL)) {
       Log("%s: Invoke message failed. Destroying the message.\n", __FUNCTION__);
       DestroyMessage(messageCtx);
+      if (0 != dataLen) {
+         // OnDone will never fire for this request
+         m_requestList.pop_back();
+         MKSVchanBudget::Release(budgetClass, dataLen);
+         MKSVchanAsync::OnRequestAborted(reqId);
+      }
+      if (replayWrapped) {
+         MKSVchanReplay::NotSent();
+      }
+      if (shmStaged) {
+         MKSVchanShm::Unstage();
+      }
       return FALSE;
    }
 
+   if (shmStaged) {
+      MKSVchanShm::Commit();
+   }
+   if (replayWrapped) {
+      MKSVchanReplay::Sent(reqId);
+   }
+   MKSVchanMetrics::RecordSend(wirePacketType, dataLen);
    return TRUE;
 }
 
@@ -0,0 +1,698 @@
+/* **************************************************************************** *
+ * Copyright (C) 2020 VMware, Inc.  All rights reserved. -- VMware Confidential *
+ * **************************************************************************** */
+
+/*
+ * MKSVchanReplay.cpp --
+ *
+ *    Implements replay of clipboard data across a channel drop.
+ */
+
+#include "MKSVchanReplay.h"
+
+#include <chrono>
+#include <list>
+#include <random>
+#include <stdlib.h>
+#include <string.h>
+
+namespace MKSVchanReplay {
+
+typedef std::chrono::steady_clock Clock;
+
+struct Entry {
+   uint32 sequence;           // 0 until first sent
+   MKSVchanPacketType packetType;
+   MKSVchanPayloadBuffer data;
+   uint32 requestId;          // 0 while not waiting for OnDone
+   Bool replayed;
+};
+
+// Sender state, vdpservice thread only
+static uint64 streamId = 0;
+static uint32 nextSequence = 1;
+static Bool peerSupportsReplay = FALSE;
+static std::list<Entry> entries;   // Stable addresses, buffers don't copy
+static uint64 retainedBytes = 0;
+static Entry *replaying = NULL;       // Entry SendMessage is replaying
+static Entry *lastPrepared = NULL;    // Entry waiting for Sent/NotSent
+static Bool channelDown = FALSE;
+static Clock::time_point downTime;
+static Clock::time_point upTime;
+static uint32 replayOutstanding = 0;
+
+// Receiver state
+static uint64 peerStreamId = 0;
+static uint32 lastDelivered = 0;
+static uint32 duplicateCount = 0;
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * GetGraceMS --
+ *
+ *    How long kept packets survive a channel drop.
+ *
+ * Results:
+ *    Milliseconds.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static uint32
+GetGraceMS()
+{
+   static uint32 graceMS = 0;
+
+   if (graceMS == 0) {
+      graceMS = MKSVCHAN_REPLAY_DEFAULT_GRACE_MS;
+      const char *value = getenv(MKSVCHAN_REPLAY_GRACE_ENV_NAME);
+      if (value != NULL && atoi(value) > 0) {
+         graceMS = (uint32)atoi(value);
+      }
+   }
+   return graceMS;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * GetStreamId --
+ *
+ *    Random id of this process's packet stream, so a restarted peer
+ *    doesn't dedup against an old sequence.
+ *
+ * Results:
+ *    Non-zero id.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static uint64
+GetStreamId()
+{
+   while (streamId == 0) {
+      std::random_device random;
+      streamId = ((uint64)random() << 32) ^ (uint64)random() ^
+                 (uint64)Clock::now().time_since_epoch().count();
+   }
+   return streamId;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * ElapsedMS --
+ *
+ *    Milliseconds since a point in time.
+ *
+ * Results:
+ *    Elapsed milliseconds.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static uint64
+ElapsedMS(Clock::time_point since) // IN
+{
+   return (uint64)std::chrono::duration_cast<std::chrono::milliseconds>(
+      Clock::now() - since).count();
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * DropAll --
+ *
+ *    Forget every kept packet.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+DropAll(const char *reason) // IN
+{
+   if (!entries.empty()) {
+      Log("%s: Dropping %u kept packets (%llu bytes), %s.\n", __FUNCTION__,
+          (uint32)entries.size(), (unsigned long long)retainedBytes, reason);
+   }
+   entries.clear();
+   retainedBytes = 0;
+   replaying = NULL;
+   lastPrepared = NULL;
+   replayOutstanding = 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * Supersede --
+ *
+ *    Drop every kept packet; a newer clipboard replaces them. The formats
+ *    are one clipboard, so a kept Text goes as well when a CPClipboard is
+ *    produced.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+Supersede()
+{
+   if (channelDown && !entries.empty()) {
+      Log("%s: Dropping %u packets kept over the drop, a newer clipboard "
+          "replaces them.\n", __FUNCTION__, (uint32)entries.size());
+   }
+   entries.clear();
+   retainedBytes = 0;
+   replayOutstanding = 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * Keep --
+ *
+ *    Keep a copy of a packet for replay.
+ *
+ * Results:
+ *    The entry, NULL if the packet is too large.
+ *
+ * Side effects:
+ *    Replaces the older kept packets.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static Entry *
+Keep(MKSVchanPacketType packetType, // IN
+     const uint8 *data,             // IN
+     uint32 dataLen)                // IN
+{
+   Supersede();
+   if (retainedBytes + dataLen > MKSVCHAN_REPLAY_MAX_BYTES) {
+      return NULL;
+   }
+
+   entries.emplace_back();
+   Entry &entry = entries.back();
+   if (!entry.data.Append(data, dataLen)) {
+      entries.pop_back();
+      return NULL;
+   }
+   entry.sequence = 0;
+   entry.packetType = packetType;
+   entry.requestId = 0;
+   entry.replayed = FALSE;
+   retainedBytes += dataLen;
+   return &entry;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanReplay::IsReplayable --
+ *
+ *    Whether sending packetType twice is harmless, so it may be replayed.
+ *
+ * Results:
+ *    TRUE for clipboard data.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+IsReplayable(MKSVchanPacketType packetType) // IN
+{
+   return packetType == MKSVchanPacketType_ClipboardData_Text ||
+          packetType == MKSVchanPacketType_ClipboardData_CPClipboard;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanReplay::Produced --
+ *
+ *    Called by SendMessage for every packet from its caller, before the
+ *    packet may wait in MKSVchanSendQueue. A new clipboard drops the kept
+ *    ones at once, so a replay after OnReady can't overwrite it, even if
+ *    the peer's offer arrives while it is still queued.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+Produced(MKSVchanPacketType packetType) // IN
+{
+   if (IsReplayable(packetType) && replaying == NULL) {
+      Supersede();
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanReplay::OnChannelReady --
+ *
+ *    Start a session.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Drops kept packets if the channel was down for longer than the grace
+ *    period.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+OnChannelReady()
+{
+   upTime = Clock::now();
+   if (channelDown && ElapsedMS(downTime) > GetGraceMS()) {
+      DropAll("grace period expired");
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanReplay::SendOffer --
+ *
+ *    Offer replay to the peer.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Sends Replay_Offer.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+SendOffer(MKSVchanRPCPlugin *plugin) // IN
+{
+   MKSVchanReplayOffer offer;
+   offer.version = MKSVCHAN_REPLAY_VERSION;
+   offer.streamId = GetStreamId();
+   plugin->SendMessage(MKSVchanPacketType_Replay_Offer,
+                       reinterpret_cast<uint8 *>(&offer), sizeof offer);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanReplay::HandleOffer --
+ *
+ *    The peer dedups replayed packets. Send the packets kept from before
+ *    the channel drop.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Calls SendMessage for every kept packet.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+HandleOffer(MKSVchanRPCPlugin *plugin, // IN
+            const uint8 *data,         // IN
+            uint32 dataLen)            // IN
+{
+   MKSVchanReplayOffer offer;
+   if (dataLen < sizeof offer) {
+      Log("%s: Invalid offer of %u bytes.\n", __FUNCTION__, dataLen);
+      return;
+   }
+   memcpy(&offer, data, sizeof offer);
+   if (offer.version != MKSVCHAN_REPLAY_VERSION) {
+      Log("%s: Peer offered version %u, not using replay.\n", __FUNCTION__,
+          offer.version);
+      return;
+   }
+
+   peerSupportsReplay = TRUE;
+   Bool wasDown = channelDown;
+   channelDown = FALSE;
+   if (!wasDown || entries.empty()) {
+      return;
+   }
+   if (ElapsedMS(downTime) > GetGraceMS()) {
+      DropAll("grace period expired");
+      return;
+   }
+
+   Log("%s: Replaying %u packets (%llu bytes) kept over a %llums drop.\n",
+       __FUNCTION__, (uint32)entries.size(),
+       (unsigned long long)retainedBytes,
+       (unsigned long long)(ElapsedMS(downTime) - ElapsedMS(upTime)));
+
+   replayOutstanding = 0;
+   std::list<Entry>::iterator it;
+   for (it = entries.begin(); it != entries.end(); ++it) {
+      Entry &entry = *it;
+      replaying = &entry;
+      if (plugin->SendMessage(entry.packetType, entry.data.Data(),
+                              (uint32)entry.data.Size())) {
+         entry.replayed = TRUE;
+         replayOutstanding++;
+      } else {
+         Log("%s: Unable to replay %s seq %u.\n", __FUNCTION__,
+             GetMKSVchanPacketTypeAsString(entry.packetType), entry.sequence);
+      }
+   }
+   replaying = NULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanReplay::OnChannelNotReady --
+ *
+ *    The channel dropped; packets waiting for OnDone are kept for the
+ *    grace period.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+OnChannelNotReady()
+{
+   if (!peerSupportsReplay) {
+      DropAll("peer doesn't replay");
+      return;
+   }
+
+   peerSupportsReplay = FALSE;
+   channelDown = TRUE;
+   downTime = Clock::now();
+   lastPrepared = NULL;
+   replayOutstanding = 0;
+   std::list<Entry>::iterator it;
+   for (it = entries.begin(); it != entries.end(); ++it) {
+      it->requestId = 0;
+      it->replayed = FALSE;
+   }
+   if (!entries.empty()) {
+      Log("%s: Keeping %u packets (%llu bytes) for %ums.\n", __FUNCTION__,
+          (uint32)entries.size(), (unsigned long long)retainedBytes,
+          GetGraceMS());
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanReplay::Prepare --
+ *
+ *    Called by SendMessage for every packet. Wraps a replayable packet in
+ *    an MKSVchanReplayHeader and keeps a copy of it.
+ *
+ * Results:
+ *    TRUE and the Replay_Data payload in wire if the packet is to be sent
+ *    wrapped. Sent() or NotSent() must follow.
+ *
+ * Side effects:
+ *    Older kept packets are dropped.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+Prepare(MKSVchanPacketType packetType, // IN
+        const uint8 *data,             // IN
+        uint32 dataLen,                // IN
+        MKSVchanPayloadBuffer *wire)   // OUT
+{
+   if (!IsReplayable(packetType) || dataLen == 0) {
+      return FALSE;
+   }
+
+   Entry *entry = replaying;
+   if (entry == NULL) {
+      // A newer clipboard makes a kept one pointless, even unwrapped
+      Supersede();
+      if (!peerSupportsReplay) {
+         return FALSE;
+      }
+      entry = Keep(packetType, data, dataLen);
+   }
+
+   uint32 sequence = entry != NULL ? entry->sequence : 0;
+   if (sequence == 0) {
+      sequence = nextSequence++;
+      if (entry != NULL) {
+         entry->sequence = sequence;
+      }
+   }
+
+   MKSVchanReplayHeader header;
+   header.streamId = GetStreamId();
+   header.sequence = sequence;
+   header.packetType = (uint32)packetType;
+
+   wire->Clear();
+   if (!wire->Append(reinterpret_cast<uint8 *>(&header), sizeof header) ||
+       !wire->Append(data, dataLen)) {
+      Log("%s: Unable to wrap %u bytes, sending unwrapped.\n", __FUNCTION__,
+          dataLen);
+      if (entry != NULL && entry != replaying) {
+         Supersede();
+      }
+      return FALSE;
+   }
+   lastPrepared = entry;
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanReplay::Sent --
+ *
+ *    The packet of the last Prepare is waiting for OnDone.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+Sent(uint32 requestId) // IN
+{
+   if (lastPrepared != NULL) {
+      lastPrepared->requestId = requestId;
+      lastPrepared = NULL;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanReplay::NotSent --
+ *
+ *    The packet of the last Prepare never made it onto the channel. The
+ *    caller was told it failed, so it isn't replayed either.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+NotSent()
+{
+   if (lastPrepared != NULL && lastPrepared != replaying) {
+      Supersede();
+   }
+   lastPrepared = NULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanReplay::OnRequestDone --
+ *
+ *    The peer has a packet; its copy is no longer needed.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Logs the recovery time once the last replayed packet is done.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+OnRequestDone(uint32 requestId) // IN
+{
+   if (requestId == 0) {
+      return;
+   }
+
+   std::list<Entry>::iterator it;
+   for (it = entries.begin(); it != entries.end(); ++it) {
+      if (it->requestId != requestId) {
+         continue;
+      }
+
+      Bool replayed = it->replayed;
+      retainedBytes -= it->data.Size();
+      entries.erase(it);
+
+      if (replayed && replayOutstanding > 0 && --replayOutstanding == 0) {
+         Log("%s: Recovered %llums after the channel dropped, %llums after "
+             "it came back.\n", __FUNCTION__,
+             (unsigned long long)ElapsedMS(downTime),
+             (unsigned long long)ElapsedMS(upTime));
+      }
+      return;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanReplay::RetainUnsent --
+ *
+ *    Keep a packet that was still queued when the channel dropped.
+ *
+ * Results:
+ *    TRUE if the packet is kept for replay.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+RetainUnsent(MKSVchanPacketType packetType, // IN
+             const uint8 *data,             // IN
+             uint32 dataLen)                // IN
+{
+   if (!peerSupportsReplay || !IsReplayable(packetType) || dataLen == 0) {
+      return FALSE;
+   }
+   return Keep(packetType, data, dataLen) != NULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanReplay::Unwrap --
+ *
+ *    Open a Replay_Data payload.
+ *
+ * Results:
+ *    TRUE and the original packet type and payload, FALSE if the payload
+ *    is invalid or its sequence number was already delivered.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+Unwrap(const uint8 *data,                // IN
+       uint32 dataLen,                   // IN
+       MKSVchanPacketType *packetType,   // OUT
+       const uint8 **payload,            // OUT
+       uint32 *payloadLen)               // OUT
+{
+   MKSVchanReplayHeader header;
+   if (dataLen <= sizeof header) {
+      Log("%s: Invalid replay packet of %u bytes.\n", __FUNCTION__, dataLen);
+      return FALSE;
+   }
+   memcpy(&header, data, sizeof header);
+
+   if (header.streamId != peerStreamId) {
+      peerStreamId = header.streamId;
+      lastDelivered = 0;
+      duplicateCount = 0;
+   }
+   if (header.sequence <= lastDelivered) {
+      duplicateCount++;
+      Log("%s: Dropping replayed duplicate seq %u of %s, %u so far.\n",
+          __FUNCTION__, header.sequence,
+          GetMKSVchanPacketTypeAsString((MKSVchanPacketType)header.packetType),
+          duplicateCount);
+      return FALSE;
+   }
+
+   lastDelivered = header.sequence;
+   *packetType = (MKSVchanPacketType)header.packetType;
+   *payload = data + sizeof header;
+   *payloadLen = dataLen - sizeof header;
+   return TRUE;
+}
+
+} // namespace MKSVchanReplay
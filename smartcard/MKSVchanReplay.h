@@ -0,0 +1,91 @@
+/* **************************************************************************** *
+ * Copyright (C) 2020 VMware, Inc.  All rights reserved. -- VMware Confidential *
+ * **************************************************************************** */
+
+/*
+ * MKSVchanReplay.h --
+ *
+ *    Replay of idempotent messages across a short channel drop.
+ *
+ *    Both ends send Replay_Offer with their other extension offers: the
+ *    agent from OnReady, the client once the agent's first extension
+ *    packet shows it takes them. Once the peer offered, replayable
+ *    packets (clipboard data) are sent as Replay_Data: an
+ *    MKSVchanReplayHeader carrying the sender's stream id and a sequence
+ *    number, followed by the original payload. The sender keeps a copy of
+ *    each one until its OnDone; a newer clipboard of any format replaces
+ *    the copies, since only the latest clipboard matters. Copies and the
+ *    wrapped payload live in MKSVchanPayloadBuffers, so large ones spill
+ *    to disk instead of adding to the memory peak.
+ *
+ *    On OnNotReady the copies still waiting for OnDone, and replayable
+ *    packets still in MKSVchanSendQueue, are kept. If the channel is back
+ *    and the peer offers again within the grace period they are sent
+ *    again with their original sequence numbers. The receiver drops any
+ *    sequence number it already delivered for the stream, so a packet
+ *    which did arrive before the drop is not applied twice. After the
+ *    grace period the copies are dropped.
+ *
+ *    File transfer data is not replayed; FT::OnInterrupt ends a transfer
+ *    the drop cut short.
+ */
+
+#ifndef _MKSVCHAN_REPLAY_H_
+#define _MKSVCHAN_REPLAY_H_
+
+#include "MKSVchanRPCPlugin.h"
+#include "MKSVchanPacketTypeExt.h"
+#include "MKSVchanPayloadBuffer.h"
+
+/*
+ * Grace period in milliseconds, overrides MKSVCHAN_REPLAY_DEFAULT_GRACE_MS.
+ */
+#define MKSVCHAN_REPLAY_GRACE_ENV_NAME "MKSVCHAN_REPLAY_GRACE_MS"
+#define MKSVCHAN_REPLAY_DEFAULT_GRACE_MS 15000
+
+/*
+ * Packets above this size are sent with a sequence number but not kept.
+ */
+#define MKSVCHAN_REPLAY_MAX_BYTES (8 * 1024 * 1024)
+
+#define MKSVCHAN_REPLAY_VERSION 1
+
+#pragma pack(push, 1)
+typedef struct MKSVchanReplayOffer {
+   uint32 version;
+   uint64 streamId;
+} MKSVchanReplayOffer;
+
+typedef struct MKSVchanReplayHeader {
+   uint64 streamId;     // Random per sending process
+   uint32 sequence;     // Per stream, starts at 1
+   uint32 packetType;   // Original packet type of the payload
+} MKSVchanReplayHeader;
+#pragma pack(pop)
+
+namespace MKSVchanReplay {
+
+Bool IsReplayable(MKSVchanPacketType packetType);
+
+// Sender, vdpservice thread
+void OnChannelReady();
+void SendOffer(MKSVchanRPCPlugin *plugin);
+void HandleOffer(MKSVchanRPCPlugin *plugin, const uint8 *data,
+                 uint32 dataLen);
+void OnChannelNotReady();
+void Produced(MKSVchanPacketType packetType);
+Bool Prepare(MKSVchanPacketType packetType, const uint8 *data,
+             uint32 dataLen, MKSVchanPayloadBuffer *wire);
+void Sent(uint32 requestId);
+void NotSent();
+void OnRequestDone(uint32 requestId);
+Bool RetainUnsent(MKSVchanPacketType packetType, const uint8 *data,
+                  uint32 dataLen);
+
+// Receiver, vdpservice thread
+Bool Unwrap(const uint8 *data, uint32 dataLen, MKSVchanPacketType *packetType,
+            const uint8 **payload, uint32 *payloadLen);
+
+} // namespace MKSVchanReplay
+
+#endif // _MKSVCHAN_REPLAY_H_
@@ -0,0 +1,499 @@
+/* **************************************************************************** *
+ * Copyright (C) 2020 VMware, Inc.  All rights reserved. -- VMware Confidential *
+ * **************************************************************************** */
+
+/*
+ * MKSVchanSendBudget.cpp --
+ *
+ *    Implements the per class byte budget for outgoing payload.
+ */
+
+#include "MKSVchanSendBudget.h"
+#include "MKSVchanPacketTypeExt.h"
+
+#include <atomic>
+
+namespace MKSVchanBudget {
+
+struct ClassState {
+   std::atomic<uint64> inFlight;
+   std::atomic<uint64> queued;
+   std::atomic<uint64> limit;
+   std::atomic<bool> blocked;
+};
+
+static ClassState classes[PacketClass_Count];
+static std::atomic<ReadyCallback> readyCallback(NULL);
+static std::atomic<void *> readyCtx(NULL);
+
+/*
+ * Default limits. File transfer is paced by FT itself, so it gets less
+ * than clipboard and DnD, whose payloads arrive in one piece.
+ */
+static const uint64 defaultLimits[PacketClass_Count] = {
+   1 * 1024 * 1024,     // Control
+   64 * 1024 * 1024,    // Clipboard
+   64 * 1024 * 1024,    // DnD
+   16 * 1024 * 1024,    // FileTransfer
+};
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * LimitOf --
+ *
+ *    Limit of a class; 0 in the state means the default.
+ *
+ * Results:
+ *    The limit in bytes.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static uint64
+LimitOf(PacketClass packetClass) // IN
+{
+   uint64 limit = classes[packetClass].limit.load();
+   return limit != 0 ? limit : defaultLimits[packetClass];
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanBudget::ClassOf --
+ *
+ *    Map a packet type to the class it is budgeted under.
+ *
+ * Results:
+ *    The packet class.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+PacketClass
+ClassOf(MKSVchanPacketType packetType) // IN
+{
+   switch ((uint32)packetType) {
+      case MKSVchanPacketType_ClipboardData_Text:
+      case MKSVchanPacketType_ClipboardData_CPClipboard:
+         return PacketClass_Clipboard;
+
+      case MKSVchanPacketType_LegacyDnD_Data:
+      case MKSVchanPacketType_DnD_ControllerRpc:
+      case MKSVchanPacketType_DnD_FilePaths:
+         return PacketClass_DnD;
+
+      case MKSVchanPacketType_FileTransferRequest:
+      case MKSVchanPacketType_FileTransferData_File:
+      case MKSVchanPacketType_FileTransferData_Compressed:
+      case MKSVchanPacketType_FileTransferData_Sparse:
+         return PacketClass_FileTransfer;
+
+      default:
+         return PacketClass_Control;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanBudget::GetClassName --
+ *
+ *    Name of a packet class for logging.
+ *
+ * Results:
+ *    A static string.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+const char *
+GetClassName(PacketClass packetClass) // IN
+{
+   switch (packetClass) {
+      case PacketClass_Control:
+         return "control";
+      case PacketClass_Clipboard:
+         return "clipboard";
+      case PacketClass_DnD:
+         return "dnd";
+      case PacketClass_FileTransfer:
+         return "filetransfer";
+      default:
+         return "unknown";
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * FitsLimit --
+ *
+ *    Whether len more bytes fit next to used. An empty class always
+ *    accepts one packet.
+ *
+ * Results:
+ *    TRUE if the bytes fit.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static Bool
+FitsLimit(uint64 used,  // IN
+          uint32 len,   // IN
+          uint64 limit) // IN
+{
+   return used == 0 || used + len <= limit;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanBudget::Reserve --
+ *
+ *    Account a packet which is about to be sent.
+ *
+ * Results:
+ *    FALSE if the packet would exceed the in-flight limit of its class.
+ *
+ * Side effects:
+ *    A refused class reports readiness later.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+Reserve(PacketClass packetClass, // IN
+        uint32 len)              // IN
+{
+   ClassState &state = classes[packetClass];
+   uint64 used = state.inFlight.load();
+
+   do {
+      if (!FitsLimit(used, len, LimitOf(packetClass))) {
+         state.blocked.store(true);
+         return FALSE;
+      }
+   } while (!state.inFlight.compare_exchange_weak(used, used + len));
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * NotifyIfReady --
+ *
+ *    Report readiness of a class that refused a packet once its usage has
+ *    dropped below half of the limit.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    May call the readiness callback.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+NotifyIfReady(PacketClass packetClass) // IN
+{
+   ClassState &state = classes[packetClass];
+   uint64 used = state.inFlight.load() + state.queued.load();
+
+   if (used > LimitOf(packetClass) / 2 || !state.blocked.exchange(false)) {
+      return;
+   }
+
+   Log("%s: %s has capacity again, %llu bytes outstanding.\n", __FUNCTION__,
+       GetClassName(packetClass), (unsigned long long)used);
+   ReadyCallback callback = readyCallback.load();
+   if (callback != NULL) {
+      callback(packetClass, readyCtx.load());
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanBudget::Release --
+ *
+ *    A packet was acknowledged or aborted.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    May call the readiness callback.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+Release(PacketClass packetClass, // IN
+        uint32 len)              // IN
+{
+   ClassState &state = classes[packetClass];
+   uint64 used = state.inFlight.load();
+
+   while (!state.inFlight.compare_exchange_weak(used,
+                                                used > len ? used - len : 0)) {
+   }
+   NotifyIfReady(packetClass);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanBudget::WouldBlock --
+ *
+ *    Whether Reserve would currently refuse the packet.
+ *
+ * Results:
+ *    TRUE if the packet doesn't fit.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+WouldBlock(PacketClass packetClass, // IN
+           uint32 len)              // IN
+{
+   ClassState &state = classes[packetClass];
+   return !FitsLimit(state.inFlight.load(), len, LimitOf(packetClass));
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanBudget::IsWritable --
+ *
+ *    Whether a producer should hand the class more packets now. Producers
+ *    which can hold their data back, like the file transfer chunk pacing,
+ *    ask this instead of filling the queue.
+ *
+ * Results:
+ *    FALSE if packets of the class are queued or the in-flight limit is
+ *    reached.
+ *
+ * Side effects:
+ *    FALSE arms the readiness callback, like a refused packet.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+IsWritable(PacketClass packetClass) // IN
+{
+   ClassState &state = classes[packetClass];
+   if (state.queued.load() == 0 &&
+       state.inFlight.load() < LimitOf(packetClass)) {
+      return TRUE;
+   }
+   state.blocked.store(true);
+   return FALSE;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanBudget::Reset --
+ *
+ *    Forget all in-flight bytes, called when the channel goes away and no
+ *    more OnDone will arrive.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Reports readiness of blocked classes.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+Reset()
+{
+   for (int i = 0; i < PacketClass_Count; i++) {
+      classes[i].inFlight.store(0);
+      NotifyIfReady((PacketClass)i);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanBudget::ReserveQueued --
+ *
+ *    Account a packet posted to MKSVchanSendQueue.
+ *
+ * Results:
+ *    FALSE if the packet would take the queued bytes of its class over
+ *    the limit. In-flight bytes aren't counted: a packet is only queued
+ *    because they are at the limit.
+ *
+ * Side effects:
+ *    A refused class reports readiness later.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+ReserveQueued(PacketClass packetClass, // IN
+              uint32 len)              // IN
+{
+   ClassState &state = classes[packetClass];
+   uint64 queued = state.queued.load();
+
+   do {
+      if (!FitsLimit(queued, len, LimitOf(packetClass))) {
+         state.blocked.store(true);
+         return FALSE;
+      }
+   } while (!state.queued.compare_exchange_weak(queued, queued + len));
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanBudget::ReleaseQueued --
+ *
+ *    A queued packet was taken off the queue, to be sent or dropped.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+ReleaseQueued(PacketClass packetClass, // IN
+              uint32 len)              // IN
+{
+   ClassState &state = classes[packetClass];
+   uint64 queued = state.queued.load();
+
+   while (!state.queued.compare_exchange_weak(queued,
+                                              queued > len ? queued - len : 0)) {
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanBudget::GetInFlight, GetQueued, GetLimit --
+ *
+ *    Current usage and limit of a class.
+ *
+ * Results:
+ *    Byte counts.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+uint64
+GetInFlight(PacketClass packetClass) // IN
+{
+   return classes[packetClass].inFlight.load();
+}
+
+
+uint64
+GetQueued(PacketClass packetClass) // IN
+{
+   return classes[packetClass].queued.load();
+}
+
+
+uint64
+GetLimit(PacketClass packetClass) // IN
+{
+   return LimitOf(packetClass);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanBudget::SetLimit --
+ *
+ *    Change the limit of a class, 0 restores the default.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+SetLimit(PacketClass packetClass, // IN
+         uint64 limit)            // IN
+{
+   classes[packetClass].limit.store(limit);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanBudget::SetReadyCallback --
+ *
+ *    Set the function called when a class which refused a packet has
+ *    capacity again. It runs on the vdpservice thread.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+SetReadyCallback(ReadyCallback callback, // IN
+                 void *ctx)              // IN
+{
+   readyCtx.store(ctx);
+   readyCallback.store(callback);
+}
+
+} // namespace MKSVchanBudget
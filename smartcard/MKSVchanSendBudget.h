@@ -0,0 +1,63 @@
+/* **************************************************************************** *
+ * Copyright (C) 2020 VMware, Inc.  All rights reserved. -- VMware Confidential *
+ * **************************************************************************** */
+
+/*
+ * MKSVchanSendBudget.h --
+ *
+ *    Per session byte budget for outgoing payload. Every packet class has
+ *    a limit on the bytes sent and waiting for OnDone/OnAbort. SendMessage
+ *    queues a packet which would go over that in-flight limit ("would
+ *    block") in MKSVchanSendQueue. The queued bytes of a class have a cap
+ *    of their own, the same size as the limit, and only a packet that
+ *    doesn't fit the queue either is refused.
+ *
+ *    A class that refused a packet, or told a producer through IsWritable
+ *    that it is backed up, calls the readiness callback once its queued
+ *    and in-flight bytes have dropped below half of the limit, so
+ *    producers can resume.
+ *
+ *    A single packet larger than the limit is let through when nothing of
+ *    its class is outstanding, so oversized payloads still make progress.
+ */
+
+#ifndef _MKSVCHAN_SEND_BUDGET_H_
+#define _MKSVCHAN_SEND_BUDGET_H_
+
+#include "MKSVchanRPCPlugin.h"
+
+namespace MKSVchanBudget {
+
+enum PacketClass {
+   PacketClass_Control = 0,
+   PacketClass_Clipboard,
+   PacketClass_DnD,
+   PacketClass_FileTransfer,
+   PacketClass_Count
+};
+
+typedef void (*ReadyCallback)(PacketClass packetClass, void *ctx);
+
+PacketClass ClassOf(MKSVchanPacketType packetType);
+const char *GetClassName(PacketClass packetClass);
+
+// In-flight bytes, vdpservice thread
+Bool Reserve(PacketClass packetClass, uint32 len);
+void Release(PacketClass packetClass, uint32 len);
+Bool WouldBlock(PacketClass packetClass, uint32 len);
+Bool IsWritable(PacketClass packetClass);
+void Reset();
+
+// Queued bytes, any thread
+Bool ReserveQueued(PacketClass packetClass, uint32 len);
+void ReleaseQueued(PacketClass packetClass, uint32 len);
+
+uint64 GetInFlight(PacketClass packetClass);
+uint64 GetQueued(PacketClass packetClass);
+uint64 GetLimit(PacketClass packetClass);
+void SetLimit(PacketClass packetClass, uint64 limit);
+void SetReadyCallback(ReadyCallback callback, void *ctx);
+
+} // namespace MKSVchanBudget
+
+#endif // _MKSVCHAN_SEND_BUDGET_H_
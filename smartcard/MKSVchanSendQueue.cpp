@@ -0,0 +1,481 @@
+/* **************************************************************************** *
+ * Copyright (C) 2020 VMware, Inc.  All rights reserved. -- VMware Confidential *
+ * **************************************************************************** */
+
+/*
+ * MKSVchanSendQueue.cpp --
+ *
+ *    Implements the multi-producer submission queue for SendMessage. The
+ *    list is the intrusive MPSC queue by D. Vyukov: producers swap
+ *    themselves in as the head, the consumer walks from the tail, and a
+ *    stub node keeps the list from ever being empty.
+ */
+
+#include "MKSVchanSendQueue.h"
+#include "MKSVchanAsyncSend.h"
+#include "MKSVchanCancel.h"
+#include "MKSVchanMetrics.h"
+#include "MKSVchanPayloadBuffer.h"
+#include "MKSVchanReplay.h"
+#include "MKSVchanSendBudget.h"
+
+#include <atomic>
+#include <new>
+
+namespace MKSVchanSendQueue {
+
+struct Node {
+   std::atomic<Node *> next;
+   MKSVchanPacketType packetType;
+   MKSVCHAN_CLIPBOARD_ERROR clipboardError;
+   MKSVchanCancel::Token cancelToken;
+   uint32 asyncTicket;              // MKSVchanAsync::Defer, 0 for none
+   uint32 dataLen;
+   MKSVchanPayloadBuffer payload;   // Spills large posts to disk
+};
+
+static Node stub;
+static std::atomic<Node *> head(&stub);   // Producers push here
+static Node *tail = &stub;                // Consumer pops here
+static Node *held = NULL;                 // Popped, waiting for budget
+static Bool draining = FALSE;             // Drain is in SendMessage
+
+static std::atomic<uint32> depth(0);
+static std::atomic<bool> wakeRequested(false);
+static std::atomic<WakeCallback> wakeCallback(NULL);
+static std::atomic<void *> wakeCtx(NULL);
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * Push --
+ *
+ *    Append a node to the list. Wait-free.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+Push(Node *node) // IN
+{
+   node->next.store(NULL, std::memory_order_relaxed);
+   Node *prev = head.exchange(node, std::memory_order_acq_rel);
+   prev->next.store(node, std::memory_order_release);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * Pop --
+ *
+ *    Take the oldest node off the list. Consumer only.
+ *
+ * Results:
+ *    The node, or NULL if the list is empty or a producer is half way
+ *    through a push (its node is picked up on the next drain).
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static Node *
+Pop()
+{
+   Node *node = tail;
+   Node *next = node->next.load(std::memory_order_acquire);
+
+   if (node == &stub) {
+      if (next == NULL) {
+         return NULL;
+      }
+      tail = next;
+      node = next;
+      next = next->next.load(std::memory_order_acquire);
+   }
+
+   if (next != NULL) {
+      tail = next;
+      return node;
+   }
+
+   if (node != head.load(std::memory_order_acquire)) {
+      return NULL;
+   }
+
+   Push(&stub);
+   next = node->next.load(std::memory_order_acquire);
+   if (next != NULL) {
+      tail = next;
+      return node;
+   }
+   return NULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * IsCancelledData --
+ *
+ *    Whether a node is file data of a copy that has been cancelled.
+ *
+ * Results:
+ *    TRUE if the node should be dropped rather than sent.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static Bool
+IsCancelledData(const Node *node) // IN
+{
+   return node->packetType != MKSVchanPacketType_FileTransferRequest &&
+          MKSVchanBudget::ClassOf(node->packetType) ==
+             MKSVchanBudget::PacketClass_FileTransfer &&
+          MKSVchanCancel::IsCancelled(node->cancelToken);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * Enqueue --
+ *
+ *    Copy a packet into a node and push it. Any thread.
+ *
+ * Results:
+ *    FALSE if the queue of the packet class is at its MKSVchanBudget cap
+ *    or the node couldn't be allocated.
+ *
+ * Side effects:
+ *    May call the wake callback on this thread.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static Bool
+Enqueue(MKSVchanPacketType packetType,             // IN
+        const uint8 *data,                         // IN
+        uint32 dataLen,                            // IN
+        MKSVCHAN_CLIPBOARD_ERROR clipboardError,   // IN
+        uint32 asyncTicket)                        // IN
+{
+   MKSVchanBudget::PacketClass budgetClass = MKSVchanBudget::ClassOf(packetType);
+   if (!MKSVchanBudget::ReserveQueued(budgetClass, dataLen)) {
+      Log("%s: Would block, %u bytes of %s.\n", __FUNCTION__, dataLen,
+          GetMKSVchanPacketTypeAsString(packetType));
+      return FALSE;
+   }
+
+   Node *node = new (std::nothrow) Node;
+   if (node == NULL ||
+       (dataLen > 0 && !node->payload.Append(data, dataLen))) {
+      Log("%s: Unable to queue %u bytes of %s.\n", __FUNCTION__, dataLen,
+          GetMKSVchanPacketTypeAsString(packetType));
+      delete node;
+      MKSVchanBudget::ReleaseQueued(budgetClass, dataLen);
+      return FALSE;
+   }
+
+   node->packetType = packetType;
+   node->clipboardError = clipboardError;
+   node->cancelToken = MKSVchanCancel::GetToken();
+   node->asyncTicket = asyncTicket;
+   node->dataLen = dataLen;
+
+   Push(node);
+   MKSVchanMetrics::SetQueueDepth(depth.fetch_add(1) + 1);
+
+   if (!wakeRequested.exchange(true, std::memory_order_acq_rel)) {
+      WakeCallback callback = wakeCallback.load();
+      if (callback != NULL) {
+         callback(wakeCtx.load());
+      }
+   }
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanSendQueue::Post --
+ *
+ *    Queue a packet to be sent by the vdpservice thread.
+ *
+ * Results:
+ *    FALSE if the queue of the packet class is at its MKSVchanBudget cap
+ *    or the node couldn't be allocated.
+ *
+ * Side effects:
+ *    May call the wake callback on this thread.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+Post(MKSVchanPacketType packetType,             // IN
+     const uint8 *data,                         // IN
+     uint32 dataLen,                            // IN
+     MKSVCHAN_CLIPBOARD_ERROR clipboardError)   // IN
+{
+   return Enqueue(packetType, data, dataLen, clipboardError, 0);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanSendQueue::PostDeferred --
+ *
+ *    Queue a packet SendMessage can't send yet. The MKSVchanAsync ticket
+ *    goes with the packet: Drain sends it inside BeginDeferredSend and
+ *    EndDeferredSend, and a packet that is dropped completes with FALSE.
+ *    vdpservice thread only.
+ *
+ * Results:
+ *    FALSE if the queue of the packet class is at its MKSVchanBudget cap
+ *    or the node couldn't be allocated. The ticket is not used then.
+ *
+ * Side effects:
+ *    May call the wake callback.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+PostDeferred(MKSVchanPacketType packetType,             // IN
+             const uint8 *data,                         // IN
+             uint32 dataLen,                            // IN
+             MKSVCHAN_CLIPBOARD_ERROR clipboardError,   // IN
+             uint32 asyncTicket)                        // IN
+{
+   return Enqueue(packetType, data, dataLen, clipboardError, asyncTicket);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanSendQueue::GetDepth --
+ *
+ *    Number of packets posted and not yet drained.
+ *
+ * Results:
+ *    The queue depth.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+uint32
+GetDepth()
+{
+   return depth.load();
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanSendQueue::SetWakeCallback --
+ *
+ *    Set the function producers call when the queue becomes non-empty.
+ *    It runs on the producer thread and should only schedule a Drain on
+ *    the vdpservice thread.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+SetWakeCallback(WakeCallback callback, // IN
+                void *ctx)             // IN
+{
+   wakeCtx.store(ctx);
+   wakeCallback.store(callback);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanSendQueue::Drain --
+ *
+ *    Send up to MKSVCHAN_SEND_QUEUE_BATCH queued packets, oldest first.
+ *    File data of a cancelled copy is dropped on the way and doesn't
+ *    count against the batch.
+ *
+ * Results:
+ *    Number of packets taken off the queue.
+ *
+ * Side effects:
+ *    Sets g_clipboardError for each packet. Stops at a packet whose class
+ *    is over budget. Wakes again if the batch limit left packets behind.
+ *    Resumes coroutines whose deferred packet failed or was dropped.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+uint32
+Drain(MKSVchanRPCPlugin *plugin) // IN
+{
+   // Posts from here on must wake again
+   wakeRequested.store(false, std::memory_order_release);
+
+   uint32 count = 0;
+   uint32 dropped = 0;
+   while (count < MKSVCHAN_SEND_QUEUE_BATCH) {
+      Node *node = held != NULL ? held : Pop();
+      if (node == NULL) {
+         break;
+      }
+
+      if (IsCancelledData(node)) {
+         held = NULL;
+         dropped++;
+         MKSVchanBudget::ReleaseQueued(MKSVchanBudget::ClassOf(node->packetType),
+                                       node->dataLen);
+         MKSVchanAsync::CompleteDeferred(node->asyncTicket, FALSE);
+         delete node;
+         continue;
+      }
+
+      /*
+       * Keep the packet, and everything behind it, queued until the budget
+       * reports capacity; OnDone drains again.
+       */
+      MKSVchanBudget::PacketClass budgetClass =
+         MKSVchanBudget::ClassOf(node->packetType);
+      if (MKSVchanBudget::WouldBlock(budgetClass, node->dataLen)) {
+         held = node;
+         break;
+      }
+      held = NULL;
+      count++;
+
+      MKSVchanBudget::ReleaseQueued(budgetClass, node->dataLen);
+      g_clipboardError = node->clipboardError;
+      draining = TRUE;
+      MKSVchanAsync::BeginDeferredSend(node->asyncTicket);
+      Bool sent = plugin->SendMessage(node->packetType, node->payload.Data(),
+                                      node->dataLen);
+      MKSVchanAsync::EndDeferredSend(sent);
+      draining = FALSE;
+      if (!sent) {
+         Log("%s: Dropping queued %s of %u bytes.\n", __FUNCTION__,
+             GetMKSVchanPacketTypeAsString(node->packetType), node->dataLen);
+         g_clipboardError = MKSVCHAN_CLIPBOARD_ERROR_NONE;
+      }
+      delete node;
+   }
+
+   if (dropped > 0) {
+      MKSVchanCancel::CountDropped(dropped);
+   }
+   MKSVchanAsync::RunPending();
+   if (count + dropped == 0) {
+      return 0;
+   }
+
+   uint32 remaining = depth.fetch_sub(count + dropped) - (count + dropped);
+   MKSVchanMetrics::SetQueueDepth(remaining);
+
+   if (remaining > 0 && held == NULL && !wakeRequested.exchange(true)) {
+      WakeCallback callback = wakeCallback.load();
+      if (callback != NULL) {
+         callback(wakeCtx.load());
+      }
+   }
+   return count;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanSendQueue::IsDraining --
+ *
+ *    Whether SendMessage is being called by Drain for a queued packet.
+ *
+ * Results:
+ *    TRUE inside Drain's SendMessage call.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+IsDraining()
+{
+   return draining;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanSendQueue::Clear --
+ *
+ *    Drop every queued packet, e.g. when the channel goes away.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Replayable packets are handed to MKSVchanReplay instead. Sends
+ *    waiting for a packet complete with FALSE.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+Clear()
+{
+   uint32 count = 0;
+   uint32 kept = 0;
+   Node *node;
+   while ((node = held != NULL ? held : Pop()) != NULL) {
+      held = NULL;
+      count++;
+      MKSVchanBudget::ReleaseQueued(MKSVchanBudget::ClassOf(node->packetType),
+                                    node->dataLen);
+      if (node->clipboardError == MKSVCHAN_CLIPBOARD_ERROR_NONE &&
+          MKSVchanReplay::RetainUnsent(node->packetType,
+                                       node->payload.Data(), node->dataLen)) {
+         kept++;
+      }
+      MKSVchanAsync::CompleteDeferred(node->asyncTicket, FALSE);
+      delete node;
+   }
+
+   if (count > 0) {
+      Log("%s: Dropped %u queued packets, %u kept for replay.\n",
+          __FUNCTION__, count, kept);
+      MKSVchanMetrics::SetQueueDepth(depth.fetch_sub(count) - count);
+   }
+   wakeRequested.store(false);
+}
+
+} // namespace MKSVchanSendQueue
@@ -0,0 +1,65 @@
+/* **************************************************************************** *
+ * Copyright (C) 2020 VMware, Inc.  All rights reserved. -- VMware Confidential *
+ * **************************************************************************** */
+
+/*
+ * MKSVchanSendQueue.h --
+ *
+ *    Submission queue in front of MKSVchanRPCPlugin::SendMessage.
+ *
+ *    SendMessage, m_requestList and g_clipboardError belong to the
+ *    vdpservice thread. Clipboard monitors, DnD handlers and file transfer
+ *    threads call Post() instead, which copies the payload into a node and
+ *    pushes it onto a lock-free multi-producer, single-consumer list
+ *    (one atomic exchange per post). The vdpservice thread drains the list
+ *    in batches from OnReady, OnInvoke and OnDone and sends the packets in
+ *    the order they were posted. Node payloads are MKSVchanPayloadBuffers,
+ *    so a large post spills to disk rather than sitting in memory until it
+ *    is drained.
+ *
+ *    The clipboard error that goes with a packet is carried in the node
+ *    and applied to g_clipboardError right before that packet is sent, so
+ *    producers never touch the global.
+ *
+ *    Queued bytes count against the MKSVchanBudget queue cap of the
+ *    packet class: Post() fails when the queue of the class is full, and
+ *    Drain() stops at a packet that would push the class over its
+ *    in-flight limit.
+ *
+ *    SendMessage itself posts a packet whose class is over budget, or has
+ *    packets queued already, unless it is called from Drain(). It uses
+ *    PostDeferred(), so a MKSVchanAsync send waits for the queued packet.
+ *
+ *    A producer whose post makes the queue non-empty calls the wake
+ *    callback, if one is set, so the owner can schedule a drain on the
+ *    vdpservice thread. Further posts before that drain don't wake again.
+ */
+
+#ifndef _MKSVCHAN_SEND_QUEUE_H_
+#define _MKSVCHAN_SEND_QUEUE_H_
+
+#include "MKSVchanRPCPlugin.h"
+
+#define MKSVCHAN_SEND_QUEUE_BATCH 32
+
+namespace MKSVchanSendQueue {
+
+typedef void (*WakeCallback)(void *ctx);
+
+// Any thread
+Bool Post(MKSVchanPacketType packetType, const uint8 *data, uint32 dataLen,
+          MKSVCHAN_CLIPBOARD_ERROR clipboardError);
+uint32 GetDepth();
+
+// vdpservice thread
+Bool PostDeferred(MKSVchanPacketType packetType, const uint8 *data,
+                  uint32 dataLen, MKSVCHAN_CLIPBOARD_ERROR clipboardError,
+                  uint32 asyncTicket);
+void SetWakeCallback(WakeCallback callback, void *ctx);
+uint32 Drain(MKSVchanRPCPlugin *plugin);
+Bool IsDraining();
+void Clear();
+
+} // namespace MKSVchanSendQueue
+
+#endif // _MKSVCHAN_SEND_QUEUE_H_
@@ -0,0 +1,921 @@
+/* **************************************************************************** *
+ * Copyright (C) 2020 VMware, Inc.  All rights reserved. -- VMware Confidential *
+ * **************************************************************************** */
+
+/*
+ * MKSVchanShmTransport.cpp --
+ *
+ *    Implements the shared memory ring transport for co-located MKSVchan
+ *    client and agent.
+ */
+
+#include "MKSVchanShmTransport.h"
+
+#if defined(MKSVCHAN_SHM_SUPPORTED)
+
+#include <atomic>
+#include <deque>
+#include <errno.h>
+#include <fcntl.h>
+#include <fstream>
+#include <new>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__APPLE__)
+#include <uuid/uuid.h>
+#endif
+
+#define SHM_PROTOCOL_VERSION 1
+#define SHM_SEGMENT_MAGIC 0x4D4B5348     // 'MKSH'
+#define SHM_RING_SIZE (16 * 1024 * 1024)
+#define SHM_HEADER_SIZE 4096
+#define SHM_HOST_ID_LEN 128
+#define SHM_NAME_LEN 64
+
+/*
+ * Ring 0 carries agent -> client payloads, ring 1 client -> agent.
+ */
+#define SHM_RING_SERVER_TO_CLIENT 0
+#define SHM_RING_CLIENT_TO_SERVER 1
+
+#define SHM_ALIGN(n) (((n) + 7) & ~(uint64)7)
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2,
+              "Shared memory rings need address-free 64-bit atomics");
+
+namespace {
+
+/*
+ * head and tail are absolute byte counts which only ever grow; the
+ * position inside the ring is the value modulo the ring size. The
+ * producer owns head, the consumer owns tail.
+ */
+struct ShmRingHeader {
+   alignas(64) std::atomic<uint64> head;
+   alignas(64) std::atomic<uint64> tail;
+};
+
+struct ShmSegmentHeader {
+   uint32 magic;
+   uint32 version;
+   uint32 ringSize;
+   uint32 reserved;
+   ShmRingHeader rings[2];
+};
+
+static_assert(sizeof(ShmSegmentHeader) <= SHM_HEADER_SIZE,
+              "Shared memory header too large");
+
+#pragma pack(push, 1)
+struct ShmOfferMsg {
+   uint32 version;
+   char hostId[SHM_HOST_ID_LEN];
+};
+
+struct ShmSetupMsg {
+   uint32 version;
+   uint32 ringSize;
+   char name[SHM_NAME_LEN];
+};
+#pragma pack(pop)
+
+Bool shmEnabled = FALSE;
+Bool shmIsServer = FALSE;
+Bool shmActive = FALSE;
+
+int shmFd = -1;
+uint8 *shmBase = NULL;
+size_t shmMapSize = 0;
+std::string shmName;
+Bool shmUnlinked = TRUE;
+
+uint64 sendSequence = 0;
+uint64 recvSequence = 0;
+
+/*
+ * Ring head before the last Stage(), restored by Unstage() if the
+ * descriptor never made it onto the channel.
+ */
+uint64 stagedPrevHead = 0;
+Bool stagePending = FALSE;
+MKSVchanShmDescriptor stagedDescriptor;
+
+/*
+ * Descriptors sent whose payload the peer may not have taken yet, oldest
+ * first. The peer's tail tells which ones it took; the rest are sent
+ * inline if the peer drops the transport.
+ */
+std::deque<MKSVchanShmDescriptor> sentDescriptors;
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * GetHostIdentity --
+ *
+ *    Build a string which is identical for two processes only if they run
+ *    on the same host and boot.
+ *
+ * Results:
+ *    The host identity, empty if it can't be determined.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+std::string
+GetHostIdentity()
+{
+   std::string identity;
+
+#if defined(__APPLE__)
+   uuid_t uuid;
+   struct timespec wait = { 0, 0 };
+   if (gethostuuid(uuid, &wait) == 0) {
+      char text[37];
+      uuid_unparse(uuid, text);
+      identity = text;
+   }
+#else
+   const char *idFiles[] = {
+      "/etc/machine-id",
+      "/var/lib/dbus/machine-id",
+      "/proc/sys/kernel/random/boot_id",
+   };
+   for (size_t i = 0; i < sizeof idFiles / sizeof idFiles[0]; i++) {
+      std::ifstream in(idFiles[i]);
+      std::string line;
+      if (std::getline(in, line)) {
+         identity += line;
+         identity += ";";
+      }
+   }
+#endif
+
+   return identity.substr(0, SHM_HOST_ID_LEN - 1);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * Ring --
+ *
+ *    Header of the given ring.
+ *
+ * Results:
+ *    Pointer into the mapped segment.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+ShmRingHeader *
+Ring(int index) // IN
+{
+   return &reinterpret_cast<ShmSegmentHeader *>(shmBase)->rings[index];
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * RingData --
+ *
+ *    Start of the given ring's data area.
+ *
+ * Results:
+ *    Pointer into the mapped segment.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+uint8 *
+RingData(int index) // IN
+{
+   return shmBase + SHM_HEADER_SIZE + (size_t)index * SHM_RING_SIZE;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * ForgetTakenDescriptors --
+ *
+ *    Drop the sent descriptors whose payload the peer has taken.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+ForgetTakenDescriptors()
+{
+   int ringIndex = shmIsServer ? SHM_RING_SERVER_TO_CLIENT :
+                                 SHM_RING_CLIENT_TO_SERVER;
+   uint64 tail = Ring(ringIndex)->tail.load(std::memory_order_acquire);
+   while (!sentDescriptors.empty() &&
+          sentDescriptors.front().offset +
+          SHM_ALIGN(sentDescriptors.front().length) <= tail) {
+      sentDescriptors.pop_front();
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * ResendUntaken --
+ *
+ *    The peer dropped the transport: send the payloads of the descriptors
+ *    it hasn't taken inline, in their order. The peer drops descriptors
+ *    that arrive after its teardown, so these would be lost otherwise.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Stops staging. Sends the payloads over the channel.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+ResendUntaken(MKSVchanRPCPlugin *plugin) // IN
+{
+   shmActive = FALSE;
+   if (shmBase == NULL) {
+      return;
+   }
+   ForgetTakenDescriptors();
+   if (sentDescriptors.empty()) {
+      return;
+   }
+
+   Log("%s: Sending %u staged payloads the peer didn't take inline.\n",
+       __FUNCTION__, (uint32)sentDescriptors.size());
+   int ringIndex = shmIsServer ? SHM_RING_SERVER_TO_CLIENT :
+                                 SHM_RING_CLIENT_TO_SERVER;
+   std::deque<MKSVchanShmDescriptor> untaken;
+   untaken.swap(sentDescriptors);
+   std::vector<uint8> payload;
+   for (size_t i = 0; i < untaken.size(); i++) {
+      const uint8 *data = RingData(ringIndex) + untaken[i].offset %
+                          SHM_RING_SIZE;
+      payload.assign(data, data + untaken[i].length);
+      plugin->SendMessage(static_cast<MKSVchanPacketType>(
+                             untaken[i].packetType),
+                          &payload[0], untaken[i].length);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * Teardown --
+ *
+ *    Unmap the segment and go back to channel only transport.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    The agent removes the segment name if nobody did so yet.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+Teardown()
+{
+   shmActive = FALSE;
+   if (shmBase != NULL) {
+      munmap(shmBase, shmMapSize);
+      shmBase = NULL;
+   }
+   if (shmFd >= 0) {
+      close(shmFd);
+      shmFd = -1;
+   }
+   if (!shmUnlinked) {
+      shm_unlink(shmName.c_str());
+      shmUnlinked = TRUE;
+   }
+   sendSequence = 0;
+   recvSequence = 0;
+   stagePending = FALSE;
+   sentDescriptors.clear();
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MapSegment --
+ *
+ *    Map shmFd and remember the mapping.
+ *
+ * Results:
+ *    TRUE on success.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+MapSegment()
+{
+   shmMapSize = SHM_HEADER_SIZE + 2 * (size_t)SHM_RING_SIZE;
+   void *base = mmap(NULL, shmMapSize, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     shmFd, 0);
+   if (base == MAP_FAILED) {
+      Log("%s: mmap of %s failed, errno %d.\n", __FUNCTION__,
+          shmName.c_str(), errno);
+      return FALSE;
+   }
+   shmBase = static_cast<uint8 *>(base);
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * CreateSegment --
+ *
+ *    Agent side: create and initialize the shared segment.
+ *
+ * Results:
+ *    TRUE on success.
+ *
+ * Side effects:
+ *    Creates a POSIX shared memory object only accessible to this user.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+CreateSegment()
+{
+   static uint32 segmentCount = 0;
+   char name[SHM_NAME_LEN];
+   snprintf(name, sizeof name, "/mksvchan-%d-%u", (int)getpid(),
+            ++segmentCount);
+   shmName = name;
+
+   shmFd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, S_IRUSR | S_IWUSR);
+   if (shmFd < 0) {
+      Log("%s: shm_open %s failed, errno %d.\n", __FUNCTION__, name, errno);
+      return FALSE;
+   }
+   shmUnlinked = FALSE;
+
+   if (ftruncate(shmFd, SHM_HEADER_SIZE + 2 * (off_t)SHM_RING_SIZE) != 0 ||
+       !MapSegment()) {
+      Log("%s: Unable to size or map %s.\n", __FUNCTION__, name);
+      Teardown();
+      return FALSE;
+   }
+
+   ShmSegmentHeader *header = reinterpret_cast<ShmSegmentHeader *>(shmBase);
+   header->version = SHM_PROTOCOL_VERSION;
+   header->ringSize = SHM_RING_SIZE;
+   for (int i = 0; i < 2; i++) {
+      new (&header->rings[i].head) std::atomic<uint64>(0);
+      new (&header->rings[i].tail) std::atomic<uint64>(0);
+   }
+   std::atomic_thread_fence(std::memory_order_release);
+   header->magic = SHM_SEGMENT_MAGIC;
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * OpenSegment --
+ *
+ *    Client side: map the segment announced by the agent.
+ *
+ * Results:
+ *    TRUE on success.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+OpenSegment(const ShmSetupMsg *setup) // IN
+{
+   char name[SHM_NAME_LEN + 1];
+   memcpy(name, setup->name, SHM_NAME_LEN);
+   name[SHM_NAME_LEN] = '\0';
+   shmName = name;
+
+   if (setup->version != SHM_PROTOCOL_VERSION ||
+       setup->ringSize != SHM_RING_SIZE) {
+      Log("%s: Unsupported segment version %u size %u.\n", __FUNCTION__,
+          setup->version, setup->ringSize);
+      return FALSE;
+   }
+
+   shmFd = shm_open(name, O_RDWR, 0);
+   if (shmFd < 0) {
+      Log("%s: shm_open %s failed, errno %d.\n", __FUNCTION__, name, errno);
+      return FALSE;
+   }
+
+   struct stat st;
+   if (fstat(shmFd, &st) != 0 ||
+       (size_t)st.st_size < SHM_HEADER_SIZE + 2 * (size_t)SHM_RING_SIZE ||
+       !MapSegment()) {
+      Teardown();
+      return FALSE;
+   }
+
+   const ShmSegmentHeader *header =
+      reinterpret_cast<const ShmSegmentHeader *>(shmBase);
+   if (header->magic != SHM_SEGMENT_MAGIC) {
+      Log("%s: Segment %s is not initialized.\n", __FUNCTION__, name);
+      Teardown();
+      return FALSE;
+   }
+   std::atomic_thread_fence(std::memory_order_acquire);
+   return TRUE;
+}
+
+} // anonymous namespace
+
+#endif // MKSVCHAN_SHM_SUPPORTED
+
+
+namespace MKSVchanShm {
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanShm::Configure --
+ *
+ *    Called by MKSVchanRPCManager when the plugin instance is created.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+Configure(Bool isServer) // IN
+{
+#if defined(MKSVCHAN_SHM_SUPPORTED)
+   const char *value = getenv(MKSVCHAN_SHM_ENV_NAME);
+   shmEnabled = (value != NULL && strcmp(value, "1") == 0);
+   shmIsServer = isServer;
+   if (shmEnabled) {
+      Log("%s: Shared memory transport allowed.\n", __FUNCTION__);
+   }
+#endif
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanShm::SendOffer --
+ *
+ *    The client offers the transport to the agent.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    May send Shm_Offer.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+SendOffer(MKSVchanRPCPlugin *plugin) // IN
+{
+#if defined(MKSVCHAN_SHM_SUPPORTED)
+   if (!shmEnabled || shmIsServer) {
+      return;
+   }
+
+   std::string identity = GetHostIdentity();
+   if (identity.empty()) {
+      return;
+   }
+
+   ShmOfferMsg offer;
+   memset(&offer, 0, sizeof offer);
+   offer.version = SHM_PROTOCOL_VERSION;
+   strncpy(offer.hostId, identity.c_str(), sizeof offer.hostId - 1);
+   plugin->SendMessage(MKSVchanPacketType_Shm_Offer,
+                       reinterpret_cast<uint8 *>(&offer), sizeof offer);
+#endif
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanShm::OnChannelNotReady --
+ *
+ *    Drop the segment; it is negotiated again on the next OnReady.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+OnChannelNotReady()
+{
+#if defined(MKSVCHAN_SHM_SUPPORTED)
+   if (shmBase != NULL) {
+      Log("%s: Releasing shared memory transport.\n", __FUNCTION__);
+   }
+   Teardown();
+#endif
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanShm::IsActive --
+ *
+ *    Whether payloads may currently be staged in shared memory.
+ *
+ * Results:
+ *    TRUE once both ends have mapped the segment.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+IsActive()
+{
+#if defined(MKSVCHAN_SHM_SUPPORTED)
+   return shmActive;
+#else
+   return FALSE;
+#endif
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanShm::HandleControlPacket --
+ *
+ *    Process Shm_Offer, Shm_Setup, Shm_Ready and Shm_Teardown.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Creates, maps or drops the segment and answers the peer.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+HandleControlPacket(MKSVchanRPCPlugin *plugin,     // IN
+                    MKSVchanPacketType packetType, // IN
+                    const uint8 *data,             // IN
+                    uint32 dataLen)                // IN
+{
+#if defined(MKSVCHAN_SHM_SUPPORTED)
+   if (!shmEnabled) {
+      Log("%s: Shared memory transport is not allowed, ignoring.\n",
+          __FUNCTION__);
+      return;
+   }
+
+   if (packetType == MKSVchanPacketType_Shm_Offer && shmIsServer) {
+      if (dataLen < sizeof(ShmOfferMsg)) {
+         return;
+      }
+      const ShmOfferMsg *offer = reinterpret_cast<const ShmOfferMsg *>(data);
+      std::string peerIdentity(offer->hostId,
+                               strnlen(offer->hostId, SHM_HOST_ID_LEN));
+      if (offer->version != SHM_PROTOCOL_VERSION ||
+          peerIdentity.empty() || peerIdentity != GetHostIdentity()) {
+         Log("%s: Client is not co-located, keeping channel transport.\n",
+             __FUNCTION__);
+         return;
+      }
+
+      Teardown();
+      if (!CreateSegment()) {
+         return;
+      }
+
+      ShmSetupMsg setup;
+      memset(&setup, 0, sizeof setup);
+      setup.version = SHM_PROTOCOL_VERSION;
+      setup.ringSize = SHM_RING_SIZE;
+      strncpy(setup.name, shmName.c_str(), sizeof setup.name - 1);
+      if (!plugin->SendMessage(MKSVchanPacketType_Shm_Setup,
+                               reinterpret_cast<uint8 *>(&setup),
+                               sizeof setup)) {
+         Teardown();
+      }
+   } else if (packetType == MKSVchanPacketType_Shm_Setup && !shmIsServer) {
+      if (dataLen < sizeof(ShmSetupMsg)) {
+         return;
+      }
+
+      Teardown();
+      if (!OpenSegment(reinterpret_cast<const ShmSetupMsg *>(data))) {
+         return;
+      }
+
+      uint32 version = SHM_PROTOCOL_VERSION;
+      if (!plugin->SendMessage(MKSVchanPacketType_Shm_Ready,
+                               reinterpret_cast<uint8 *>(&version),
+                               sizeof version)) {
+         Teardown();
+         return;
+      }
+      shmActive = TRUE;
+      Log("%s: Shared memory transport %s is active.\n", __FUNCTION__,
+          shmName.c_str());
+   } else if (packetType == MKSVchanPacketType_Shm_Ready && shmIsServer) {
+      if (shmBase == NULL) {
+         return;
+      }
+
+      // Both ends have it mapped, the name is no longer needed.
+      shm_unlink(shmName.c_str());
+      shmUnlinked = TRUE;
+      shmActive = TRUE;
+      Log("%s: Shared memory transport %s is active.\n", __FUNCTION__,
+          shmName.c_str());
+   } else if (packetType == MKSVchanPacketType_Shm_Teardown) {
+      // Payloads staged after this point go over the channel again
+      Log("%s: Peer dropped the shared memory transport, %llu payloads "
+          "were staged.\n", __FUNCTION__, (unsigned long long)sendSequence);
+      ResendUntaken(plugin);
+      Teardown();
+   }
+#endif
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanShm::Stage --
+ *
+ *    Copy a payload into the outgoing ring. The caller must follow up
+ *    with Commit() once the descriptor was handed to the channel, or with
+ *    Unstage() if it wasn't, before staging the next payload.
+ *
+ * Results:
+ *    TRUE if the payload was staged and descriptor must be sent instead of
+ *    it, FALSE if the payload has to go over the channel.
+ *
+ * Side effects:
+ *    Publishes the new ring head, so the peer can validate the descriptor
+ *    no matter how fast it arrives.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+Stage(MKSVchanPacketType packetType,       // IN
+      const uint8 *data,                   // IN
+      uint32 dataLen,                      // IN
+      MKSVchanShmDescriptor *descriptor)   // OUT
+{
+#if defined(MKSVCHAN_SHM_SUPPORTED)
+   if (!shmActive || stagePending || dataLen < MKSVCHAN_SHM_MIN_PAYLOAD ||
+       dataLen > SHM_RING_SIZE / 4) {
+      return FALSE;
+   }
+
+   /*
+    * Clipboard data is wrapped in Replay_Data once the peer offered replay.
+    * File transfer is Windows only, so its chunks never get here.
+    */
+   switch ((uint32)packetType) {
+      case MKSVchanPacketType_ClipboardData_Text:
+      case MKSVchanPacketType_ClipboardData_CPClipboard:
+      case MKSVchanPacketType_Replay_Data:
+         break;
+      default:
+         return FALSE;
+   }
+
+   int ringIndex = shmIsServer ? SHM_RING_SERVER_TO_CLIENT :
+                                 SHM_RING_CLIENT_TO_SERVER;
+   ShmRingHeader *ring = Ring(ringIndex);
+   uint64 head = ring->head.load(std::memory_order_relaxed);
+   uint64 tail = ring->tail.load(std::memory_order_acquire);
+   uint64 alignedLen = SHM_ALIGN(dataLen);
+
+   // Payloads are never split; skip the ring tail if it is too short.
+   uint64 position = head % SHM_RING_SIZE;
+   uint64 padding = position + alignedLen > SHM_RING_SIZE ?
+                    SHM_RING_SIZE - position : 0;
+   if (SHM_RING_SIZE - (head - tail) < padding + alignedLen) {
+      return FALSE;
+   }
+
+   uint64 offset = head + padding;
+   memcpy(RingData(ringIndex) + offset % SHM_RING_SIZE, data, dataLen);
+   ring->head.store(offset + alignedLen, std::memory_order_release);
+   stagedPrevHead = head;
+   stagePending = TRUE;
+
+   descriptor->packetType = packetType;
+   descriptor->length = dataLen;
+   descriptor->offset = offset;
+   descriptor->sequence = sendSequence;
+   stagedDescriptor = *descriptor;
+   return TRUE;
+#else
+   return FALSE;
+#endif
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanShm::Commit --
+ *
+ *    The descriptor of the last staged payload is on its way to the peer.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Consumes the descriptor sequence number. The payload is kept in the
+ *    ring until the peer took it.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+Commit()
+{
+#if defined(MKSVCHAN_SHM_SUPPORTED)
+   if (stagePending) {
+      stagePending = FALSE;
+      sendSequence++;
+      ForgetTakenDescriptors();
+      sentDescriptors.push_back(stagedDescriptor);
+   }
+#endif
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanShm::Unstage --
+ *
+ *    The descriptor of the last staged payload could not be sent; give its
+ *    ring space back. The peer never sees the descriptor, so it never
+ *    reads past the restored head.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+Unstage()
+{
+#if defined(MKSVCHAN_SHM_SUPPORTED)
+   if (!stagePending) {
+      return;
+   }
+   stagePending = FALSE;
+   if (shmBase != NULL) {
+      int ringIndex = shmIsServer ? SHM_RING_SERVER_TO_CLIENT :
+                                    SHM_RING_CLIENT_TO_SERVER;
+      Ring(ringIndex)->head.store(stagedPrevHead, std::memory_order_release);
+   }
+#endif
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanShm::Resolve --
+ *
+ *    Copy out the payload a received Shm_Descriptor points at. The peer
+ *    can write to the segment at any time, so the payload is only parsed
+ *    from the copy; its ring space is handed back right away.
+ *
+ * Results:
+ *    TRUE on success. On a malformed or out of order descriptor the
+ *    transport is shut down and FALSE is returned; the peer then sends
+ *    the payload inline.
+ *
+ * Side effects:
+ *    On shutdown sends Shm_Teardown, so the peer stops staging and sends
+ *    everything inline from then on.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+Resolve(MKSVchanRPCPlugin *plugin,       // IN
+        const uint8 *data,               // IN
+        uint32 dataLen,                  // IN
+        MKSVchanPacketType *packetType,  // OUT
+        std::vector<uint8> *payload)     // OUT
+{
+#if defined(MKSVCHAN_SHM_SUPPORTED)
+   if (shmBase == NULL) {
+      // Sent before the peer processed our Shm_Teardown, it resends it
+      Log("%s: Dropping descriptor, the shared memory transport is down.\n",
+          __FUNCTION__);
+      return FALSE;
+   }
+   if (dataLen < sizeof(MKSVchanShmDescriptor)) {
+      Log("%s: Unexpected shared memory descriptor.\n", __FUNCTION__);
+      return FALSE;
+   }
+
+   MKSVchanShmDescriptor descriptor;
+   memcpy(&descriptor, data, sizeof descriptor);
+
+   int ringIndex = shmIsServer ? SHM_RING_CLIENT_TO_SERVER :
+                                 SHM_RING_SERVER_TO_CLIENT;
+   ShmRingHeader *ring = Ring(ringIndex);
+   uint64 head = ring->head.load(std::memory_order_acquire);
+   uint64 position = descriptor.offset % SHM_RING_SIZE;
+
+   if (descriptor.sequence != recvSequence || descriptor.length == 0 ||
+       descriptor.offset + descriptor.length > head ||
+       position + descriptor.length > SHM_RING_SIZE) {
+      Log("%s: Invalid descriptor seq %llu (expected %llu), disabling the "
+          "shared memory transport.\n", __FUNCTION__,
+          (unsigned long long)descriptor.sequence,
+          (unsigned long long)recvSequence);
+      Teardown();
+
+      uint32 version = SHM_PROTOCOL_VERSION;
+      plugin->SendMessage(MKSVchanPacketType_Shm_Teardown,
+                          reinterpret_cast<uint8 *>(&version), sizeof version);
+      return FALSE;
+   }
+
+   const uint8 *ringData = RingData(ringIndex) + position;
+   payload->assign(ringData, ringData + descriptor.length);
+   recvSequence++;
+   ring->tail.store(descriptor.offset + SHM_ALIGN(descriptor.length),
+                    std::memory_order_release);
+
+   *packetType = static_cast<MKSVchanPacketType>(descriptor.packetType);
+   return TRUE;
+#else
+   return FALSE;
+#endif
+}
+
+} // namespace MKSVchanShm
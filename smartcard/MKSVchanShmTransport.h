@@ -0,0 +1,83 @@
+/* **************************************************************************** *
+ * Copyright (C) 2020 VMware, Inc.  All rights reserved. -- VMware Confidential *
+ * **************************************************************************** */
+
+/*
+ * MKSVchanShmTransport.h --
+ *
+ *    Shared memory side channel for MKSVchan when the client and the agent
+ *    run on the same machine (lab, kiosk and nested setups).
+ *
+ *    Negotiation, all over the regular channel:
+ *       client -> agent   Shm_Offer       host identity
+ *       agent  -> client  Shm_Setup       segment name, created by the agent
+ *       client -> agent   Shm_Ready       client mapped the segment
+ *
+ *    Either end sends Shm_Teardown when it receives a descriptor it can't
+ *    trust and drops the segment; the other end drops it too and both go
+ *    back to inline payloads until the next OnReady. The other end sends
+ *    the payloads of the descriptors that weren't taken, including the
+ *    rejected one, again inline.
+ *
+ *    Once active, large clipboard payloads are copied into a per direction
+ *    ring inside the segment and the channel only carries a
+ *    Shm_Descriptor pointing at them. The receiver copies the payload out
+ *    before parsing it, since the sender can still write to the segment,
+ *    and releases the ring space at once. Anything that doesn't fit, or
+ *    any failure, falls back to the regular channel.
+ *
+ *    POSIX only; the whole feature is compiled out elsewhere.
+ */
+
+#ifndef _MKSVCHAN_SHM_TRANSPORT_H_
+#define _MKSVCHAN_SHM_TRANSPORT_H_
+
+#include "MKSVchanRPCPlugin.h"
+#include "MKSVchanPacketTypeExt.h"
+
+#include <vector>
+
+#if !defined(_WIN32) && !defined(RDE_MOBILE_LIBS)
+#define MKSVCHAN_SHM_SUPPORTED 1
+#endif
+
+/*
+ * Set to 1 in the environment of both ends to allow the transport.
+ */
+#define MKSVCHAN_SHM_ENV_NAME "MKSVCHAN_SHM_TRANSPORT"
+
+/*
+ * Payloads below this size are cheaper to send inline.
+ */
+#define MKSVCHAN_SHM_MIN_PAYLOAD (64 * 1024)
+
+#pragma pack(push, 1)
+typedef struct MKSVchanShmDescriptor {
+   uint32 packetType;   // Original packet type of the payload
+   uint32 length;       // Payload length
+   uint64 offset;       // Absolute ring offset of the payload
+   uint64 sequence;     // Per direction sequence number
+} MKSVchanShmDescriptor;
+#pragma pack(pop)
+
+namespace MKSVchanShm {
+
+void Configure(Bool isServer);
+void SendOffer(MKSVchanRPCPlugin *plugin);
+void OnChannelNotReady();
+Bool IsActive();
+
+void HandleControlPacket(MKSVchanRPCPlugin *plugin,
+                         MKSVchanPacketType packetType,
+                         const uint8 *data, uint32 dataLen);
+
+Bool Stage(MKSVchanPacketType packetType, const uint8 *data, uint32 dataLen,
+           MKSVchanShmDescriptor *descriptor);
+void Commit();
+void Unstage();
+Bool Resolve(MKSVchanRPCPlugin *plugin, const uint8 *data, uint32 dataLen,
+             MKSVchanPacketType *packetType, std::vector<uint8> *payload);
+
+} // namespace MKSVchanShm
+
+#endif // _MKSVCHAN_SHM_TRANSPORT_H_
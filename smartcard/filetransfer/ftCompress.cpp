@@ -0,0 +1,637 @@
+/* **************************************************************************** *
+ * Copyright (C) 2020 VMware, Inc.  All rights reserved. -- VMware Confidential *
+ * **************************************************************************** */
+
+/*
+ * ftCompress.cpp --
+ *
+ *    Implements the parallel, ordered compression stage for outgoing file
+ *    transfer chunks and the matching decoder.
+ */
+
+#include "ftCompress.h"
+#include "MKSVchanMetrics.h"
+#include "log.h"
+
+#include <chrono>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+/*
+ * Chunks whose sample is above this many bits per byte are sent raw. Text
+ * and logs are around 4-5, executables 6-7, compressed media close to 8.
+ */
+#define FT_COMPRESS_ENTROPY_LIMIT 7.2
+
+#define FT_COMPRESS_SAMPLE_SLICES 16
+#define FT_COMPRESS_SAMPLE_SLICE_LEN 256
+
+#define FT_COMPRESS_MIN_LEVEL 1
+#define FT_COMPRESS_MAX_LEVEL 9
+#define FT_COMPRESS_START_LEVEL 3
+#define FT_COMPRESS_MAX_WORKERS 4
+
+// Chunks between two level decisions
+#define FT_COMPRESS_ADJUST_WINDOW 16
+
+namespace FT {
+
+static Bool peerSupportsCompression = FALSE;
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * NowNs --
+ *
+ *    Monotonic nanoseconds for measuring compression cost.
+ *
+ * Results:
+ *    Nanoseconds since an unspecified epoch.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static uint64
+NowNs()
+{
+   return (uint64)std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * FT::EstimateEntropy --
+ *
+ *    Shannon entropy of a sample of the chunk: FT_COMPRESS_SAMPLE_SLICES
+ *    slices spread evenly over it, so a chunk with a compressible header
+ *    and an incompressible body is still judged by its body.
+ *
+ * Results:
+ *    Bits per byte, 0 to 8.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+double
+EstimateEntropy(const uint8 *data, // IN
+                uint32 dataLen)    // IN
+{
+   uint32 histogram[256] = { 0 };
+   uint32 sampled = 0;
+   uint32 sliceLen = FT_COMPRESS_SAMPLE_SLICE_LEN;
+   uint32 stride = dataLen / FT_COMPRESS_SAMPLE_SLICES;
+
+   if (stride < sliceLen) {
+      sliceLen = dataLen;
+      stride = dataLen;
+   }
+
+   for (uint32 start = 0; start + sliceLen <= dataLen && stride > 0;
+        start += stride) {
+      for (uint32 i = 0; i < sliceLen; i++) {
+         histogram[data[start + i]]++;
+      }
+      sampled += sliceLen;
+   }
+
+   if (sampled == 0) {
+      return 0.0;
+   }
+
+   double entropy = 0.0;
+   for (int i = 0; i < 256; i++) {
+      if (histogram[i] != 0) {
+         double p = (double)histogram[i] / sampled;
+         entropy -= p * log2(p);
+      }
+   }
+   return entropy;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * FT::EncodeChunkFrame --
+ *
+ *    Build the frame for one chunk. Level 0, high entropy and chunks that
+ *    don't shrink are stored raw.
+ *
+ * Results:
+ *    TRUE if the frame is deflated, FALSE if it is raw.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+EncodeChunkFrame(const uint8 *data,          // IN
+                 uint32 dataLen,             // IN
+                 int level,                  // IN
+                 std::vector<uint8> *frame)  // OUT
+{
+   FTChunkFrameHeader header;
+   header.reserved = 0;
+   header.rawLen = dataLen;
+
+   if (level > 0 && EstimateEntropy(data, dataLen) < FT_COMPRESS_ENTROPY_LIMIT) {
+      uLongf bound = compressBound(dataLen);
+      frame->resize(sizeof header + bound);
+      if (compress2(&(*frame)[sizeof header], &bound, data, dataLen,
+                    level) == Z_OK && bound < dataLen) {
+         header.method = FT_CHUNK_FRAME_DEFLATE;
+         header.level = (uint8)level;
+         frame->resize(sizeof header + bound);
+         memcpy(&(*frame)[0], &header, sizeof header);
+         return TRUE;
+      }
+   }
+
+   header.method = FT_CHUNK_FRAME_RAW;
+   header.level = 0;
+   frame->resize(sizeof header + dataLen);
+   memcpy(&(*frame)[0], &header, sizeof header);
+   if (dataLen > 0) {
+      memcpy(&(*frame)[sizeof header], data, dataLen);
+   }
+   return FALSE;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * FT::DecodeChunkFrame --
+ *
+ *    Decode a frame received as FileTransferData_Compressed.
+ *
+ * Results:
+ *    TRUE and the chunk data on success, FALSE for a malformed frame.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+DecodeChunkFrame(const uint8 *frame,          // IN
+                 uint32 frameLen,             // IN
+                 std::vector<uint8> *data)    // OUT
+{
+   FTChunkFrameHeader header;
+
+   if (frameLen < sizeof header) {
+      Log("%s: Frame of %u bytes is too short.\n", __FUNCTION__, frameLen);
+      return FALSE;
+   }
+   memcpy(&header, frame, sizeof header);
+   frame += sizeof header;
+   frameLen -= sizeof header;
+
+   if (header.rawLen > FT_CHUNK_FRAME_MAX_RAW_LEN) {
+      Log("%s: Chunk of %u bytes is too large.\n", __FUNCTION__,
+          header.rawLen);
+      return FALSE;
+   }
+
+   switch (header.method) {
+      case FT_CHUNK_FRAME_RAW:
+         if (frameLen != header.rawLen) {
+            break;
+         }
+         data->assign(frame, frame + frameLen);
+         return TRUE;
+
+      case FT_CHUNK_FRAME_DEFLATE:
+      {
+         uLongf rawLen = header.rawLen;
+         data->resize(header.rawLen > 0 ? header.rawLen : 1);
+         if (uncompress(&(*data)[0], &rawLen, frame, frameLen) != Z_OK ||
+             rawLen != header.rawLen) {
+            break;
+         }
+         data->resize(rawLen);
+         return TRUE;
+      }
+
+      default:
+         break;
+   }
+
+   Log("%s: Malformed frame, method %u, %u bytes for %u.\n", __FUNCTION__,
+       header.method, frameLen, header.rawLen);
+   return FALSE;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * FT::ChunkCompressor::ChunkCompressor --
+ *
+ *    Constructor. Starts the worker threads, half of the cores up to
+ *    FT_COMPRESS_MAX_WORKERS.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Starts threads.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+ChunkCompressor::ChunkCompressor()
+   : m_nextSubmit(0),
+     m_nextDeliver(0),
+     m_compressing(0),
+     m_stopping(FALSE),
+     m_level(FT_COMPRESS_START_LEVEL),
+     m_frameReadyCallback(NULL),
+     m_frameReadyCtx(NULL),
+     m_sampleRawBytes(0),
+     m_sampleFrameBytes(0),
+     m_sampleBusyNs(0),
+     m_sampleChunks(0),
+     m_rawChunks(0)
+{
+   uint32 workers = std::thread::hardware_concurrency() / 2;
+   if (workers < 1) {
+      workers = 1;
+   } else if (workers > FT_COMPRESS_MAX_WORKERS) {
+      workers = FT_COMPRESS_MAX_WORKERS;
+   }
+
+   for (uint32 i = 0; i < workers; i++) {
+      m_workers.push_back(std::thread(&ChunkCompressor::WorkerMain, this));
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * FT::ChunkCompressor::~ChunkCompressor --
+ *
+ *    Destructor. Frames not taken with Next are dropped.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Joins the worker threads.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+ChunkCompressor::~ChunkCompressor()
+{
+   {
+      std::lock_guard<std::mutex> guard(m_lock);
+      m_stopping = TRUE;
+      m_jobs.clear();
+   }
+   m_jobReady.notify_all();
+   for (size_t i = 0; i < m_workers.size(); i++) {
+      m_workers[i].join();
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * FT::ChunkCompressor::SetFrameReadyCallback --
+ *
+ *    Set the function the workers call when the next frame in submission
+ *    order becomes ready, so the sender doesn't have to poll Next().
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+ChunkCompressor::SetFrameReadyCallback(FrameReadyCallback callback, // IN
+                                       void *ctx)                   // IN
+{
+   std::lock_guard<std::mutex> guard(m_lock);
+   m_frameReadyCallback = callback;
+   m_frameReadyCtx = ctx;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * FT::ChunkCompressor::Submit --
+ *
+ *    Queue a copy of a chunk for compression. Never waits, it is called
+ *    on the vdpservice thread. The backlog is bounded by the file
+ *    transfer pacing, which sends the next batch of chunks only after
+ *    the frames of this one are done.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+ChunkCompressor::Submit(const uint8 *data, // IN
+                        uint32 dataLen)    // IN
+{
+   std::unique_lock<std::mutex> guard(m_lock);
+   m_jobs.push_back(Job());
+   Job &job = m_jobs.back();
+   job.sequence = m_nextSubmit++;
+   job.data.assign(data, data + dataLen);
+   guard.unlock();
+   m_jobReady.notify_one();
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * FT::ChunkCompressor::Next --
+ *
+ *    Take the frame of the oldest submitted chunk.
+ *
+ * Results:
+ *    TRUE and the frame if it is ready. FALSE if it isn't and wait is
+ *    FALSE, or if nothing is outstanding.
+ *
+ * Side effects:
+ *    May change the deflate level.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+ChunkCompressor::Next(Bool wait,                 // IN
+                      std::vector<uint8> *frame) // OUT
+{
+   std::unique_lock<std::mutex> guard(m_lock);
+
+   for (;;) {
+      std::map<uint64, std::vector<uint8> >::iterator it =
+         m_frames.find(m_nextDeliver);
+      if (it != m_frames.end()) {
+         frame->swap(it->second);
+         m_frames.erase(it);
+         m_nextDeliver++;
+         break;
+      }
+      if (!wait || m_nextDeliver == m_nextSubmit) {
+         return FALSE;
+      }
+      m_frameReady.wait(guard);
+   }
+
+   if (m_sampleChunks >= FT_COMPRESS_ADJUST_WINDOW) {
+      AdjustLevel();
+   }
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * FT::ChunkCompressor::GetOutstanding --
+ *
+ *    Chunks submitted whose frame hasn't been taken yet.
+ *
+ * Results:
+ *    Number of chunks.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+uint32
+ChunkCompressor::GetOutstanding()
+{
+   std::lock_guard<std::mutex> guard(m_lock);
+   return (uint32)(m_nextSubmit - m_nextDeliver);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * FT::ChunkCompressor::WorkerMain --
+ *
+ *    Worker thread: compress jobs and file the frames by sequence.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+ChunkCompressor::WorkerMain()
+{
+   std::unique_lock<std::mutex> guard(m_lock);
+
+   for (;;) {
+      while (m_jobs.empty() && !m_stopping) {
+         m_jobReady.wait(guard);
+      }
+      if (m_stopping) {
+         return;
+      }
+
+      Job job;
+      job.sequence = m_jobs.front().sequence;
+      job.data.swap(m_jobs.front().data);
+      m_jobs.pop_front();
+      int level = m_level;
+      m_compressing++;
+      guard.unlock();
+
+      std::vector<uint8> frame;
+      uint64 startNs = NowNs();
+      Bool deflated = EncodeChunkFrame(job.data.empty() ? NULL : &job.data[0],
+                                       (uint32)job.data.size(), level, &frame);
+      uint64 busyNs = NowNs() - startNs;
+
+      guard.lock();
+      m_compressing--;
+      m_frames[job.sequence].swap(frame);
+      m_sampleRawBytes += job.data.size();
+      m_sampleFrameBytes += m_frames[job.sequence].size();
+      m_sampleBusyNs += busyNs;
+      m_sampleChunks++;
+      if (!deflated) {
+         m_rawChunks++;
+      }
+      m_frameReady.notify_all();
+
+      /*
+       * Later frames finishing first don't help the sender; it hears about
+       * them when the one it waits for is done.
+       */
+      FrameReadyCallback callback = m_frameReadyCallback;
+      void *ctx = m_frameReadyCtx;
+      if (callback != NULL && job.sequence == m_nextDeliver) {
+         guard.unlock();
+         callback(ctx);
+         guard.lock();
+      }
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * FT::ChunkCompressor::AdjustLevel --
+ *
+ *    Compare how fast the workers turn chunks into frames with how fast
+ *    the channel acknowledges frames, and move the level one step
+ *    towards the slower side. Called with m_lock held.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Resets the sample window.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+ChunkCompressor::AdjustLevel()
+{
+   uint64 linkRate = MKSVchanMetrics::GetFileTransferSendRate();
+
+   if (linkRate != 0 && m_sampleBusyNs != 0 && m_sampleRawBytes != 0) {
+      // Raw bytes per second all workers together can compress
+      double cpuRate = (double)m_sampleRawBytes * 1e9 / m_sampleBusyNs *
+                       m_workers.size();
+      // Raw bytes per second the link can carry at the current ratio
+      double ratio = (double)m_sampleFrameBytes / m_sampleRawBytes;
+      double wireRate = linkRate / (ratio > 0.01 ? ratio : 0.01);
+      int oldLevel = m_level;
+
+      if (cpuRate < wireRate && m_level > FT_COMPRESS_MIN_LEVEL) {
+         m_level--;
+      } else if (cpuRate > 2 * wireRate && m_level < FT_COMPRESS_MAX_LEVEL) {
+         m_level++;
+      }
+
+      if (m_level != oldLevel) {
+         Log("%s: Level %d -> %d, compress %.0f KB/s, link %.0f KB/s, "
+             "ratio %.2f, %u of %u chunks raw.\n", __FUNCTION__, oldLevel,
+             m_level, cpuRate / 1024, wireRate / 1024, ratio, m_rawChunks,
+             m_sampleChunks);
+      }
+   }
+
+   m_sampleRawBytes = 0;
+   m_sampleFrameBytes = 0;
+   m_sampleBusyNs = 0;
+   m_sampleChunks = 0;
+   m_rawChunks = 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * FT::IsCompressionConfigured --
+ *
+ *    Whether compression is enabled locally.
+ *
+ * Results:
+ *    TRUE if MKSVCHAN_FT_COMPRESSION_ENV_NAME is set to 1.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+IsCompressionConfigured()
+{
+   const char *value = getenv(MKSVCHAN_FT_COMPRESSION_ENV_NAME);
+   return value != NULL && strcmp(value, "1") == 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * FT::SetPeerSupportsCompression --
+ *
+ *    Record whether the peer offered compression in this session.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+SetPeerSupportsCompression(Bool supported) // IN
+{
+   peerSupportsCompression = supported;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * FT::IsCompressionActive --
+ *
+ *    Whether outgoing file transfer data is sent as compressed frames.
+ *
+ * Results:
+ *    TRUE if both sides offered compression.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+IsCompressionActive()
+{
+   return peerSupportsCompression && IsCompressionConfigured();
+}
+
+} // namespace FT
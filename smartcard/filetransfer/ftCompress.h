@@ -0,0 +1,127 @@
+/* **************************************************************************** *
+ * Copyright (C) 2020 VMware, Inc.  All rights reserved. -- VMware Confidential *
+ * **************************************************************************** */
+
+/*
+ * ftCompress.h --
+ *
+ *    Optional compression stage for outgoing file transfer chunks.
+ *
+ *    ChunkCompressor deflates chunks on a small pool of worker threads and
+ *    hands the resulting frames back strictly in submission order, so the
+ *    sender can keep several chunks compressing while it sends the oldest.
+ *    A quick entropy probe over a sample of each chunk sends data that
+ *    won't compress (media, archives) raw without running deflate.
+ *
+ *    The deflate level follows the link: while the workers produce frames
+ *    faster than the channel drains them (MKSVchanMetrics file transfer
+ *    rate) the level goes up, and when compression becomes the bottleneck
+ *    it goes down.
+ *
+ *    Each frame starts with an FTChunkFrameHeader. Frames are sent as
+ *    MKSVchanPacketType_FileTransferData_Compressed, which is only used
+ *    once both peers have sent MKSVchanPacketType_FileTransfer_CompressionOffer.
+ *    Compression is enabled with MKSVCHAN_FT_COMPRESSION_ENV_NAME=1.
+ *
+ *    While it is active, MKSVchanRPCPlugin::SendMessage submits every
+ *    FileTransferData_File chunk to its compressor and sends the frames
+ *    from the vdpservice thread as the frame ready callback reports them;
+ *    no other packet is ever labelled _Compressed.
+ */
+
+#ifndef _FT_COMPRESS_H_
+#define _FT_COMPRESS_H_
+
+#include "vm_basic_types.h"
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define MKSVCHAN_FT_COMPRESSION_ENV_NAME "MKSVCHAN_FT_COMPRESSION"
+
+#define FT_CHUNK_FRAME_RAW 0
+#define FT_CHUNK_FRAME_DEFLATE 1
+
+#define FT_CHUNK_FRAME_MAX_RAW_LEN (64 * 1024 * 1024)
+
+#pragma pack(push, 1)
+typedef struct FTChunkFrameHeader {
+   uint8 method;     // FT_CHUNK_FRAME_*
+   uint8 level;      // deflate level used, for logging on the receiver
+   uint16 reserved;
+   uint32 rawLen;    // length of the chunk after decoding
+} FTChunkFrameHeader;
+#pragma pack(pop)
+
+namespace FT {
+
+class ChunkCompressor
+{
+public:
+   /*
+    * Called on a worker thread when the frame Next() returns next is
+    * ready, without the lock held.
+    */
+   typedef void (*FrameReadyCallback)(void *ctx);
+
+   ChunkCompressor();
+   ~ChunkCompressor();
+
+   void SetFrameReadyCallback(FrameReadyCallback callback, void *ctx);
+   void Submit(const uint8 *data, uint32 dataLen);
+   Bool Next(Bool wait, std::vector<uint8> *frame);
+   uint32 GetOutstanding();
+   int GetLevel() const { return m_level; }
+
+private:
+   ChunkCompressor(const ChunkCompressor &);
+   ChunkCompressor &operator=(const ChunkCompressor &);
+
+   struct Job {
+      uint64 sequence;
+      std::vector<uint8> data;
+   };
+
+   void WorkerMain();
+   void AdjustLevel();
+
+   std::vector<std::thread> m_workers;
+   std::mutex m_lock;
+   std::condition_variable m_jobReady;
+   std::condition_variable m_frameReady;
+   std::deque<Job> m_jobs;
+   std::map<uint64, std::vector<uint8> > m_frames;
+   uint64 m_nextSubmit;
+   uint64 m_nextDeliver;
+   uint32 m_compressing;
+   Bool m_stopping;
+   int m_level;
+   FrameReadyCallback m_frameReadyCallback;
+   void *m_frameReadyCtx;
+
+   // Window of samples for AdjustLevel, guarded by m_lock
+   uint64 m_sampleRawBytes;
+   uint64 m_sampleFrameBytes;
+   uint64 m_sampleBusyNs;
+   uint32 m_sampleChunks;
+   uint32 m_rawChunks;
+};
+
+Bool EncodeChunkFrame(const uint8 *data, uint32 dataLen, int level,
+                      std::vector<uint8> *frame);
+Bool DecodeChunkFrame(const uint8 *frame, uint32 frameLen,
+                      std::vector<uint8> *data);
+double EstimateEntropy(const uint8 *data, uint32 dataLen);
+
+// Negotiation, vdpservice thread
+Bool IsCompressionConfigured();
+void SetPeerSupportsCompression(Bool supported);
+Bool IsCompressionActive();
+
+} // namespace FT
+
+#endif // _FT_COMPRESS_H_
@@ -0,0 +1,891 @@
+/* **************************************************************************** *
+ * Copyright (C) 2020 VMware, Inc.  All rights reserved. -- VMware Confidential *
+ * **************************************************************************** */
+
+/*
+ * ftSparse.cpp --
+ *
+ *    Implements zero block detection and sparse frames.
+ */
+
+#include "ftSparse.h"
+#include "log.h"
+
+#include <string.h>
+
+#if !defined(_WIN32)
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define FT_SPARSE_SSE2 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#define FT_SPARSE_NEON 1
+#endif
+
+#define FT_SPARSE_ZERO_FILL_SIZE (64 * 1024)
+
+namespace FT {
+
+/*
+ * A record of a checked frame, at its offset in the chunk.
+ */
+struct SparsePiece {
+   uint8 kind;
+   const uint8 *data;   // DATA only, points into the frame
+   uint64 offset;
+   uint64 length;
+};
+
+static Bool peerSupportsSparse = FALSE;
+static const uint8 zeroFill[FT_SPARSE_ZERO_FILL_SIZE] = { 0 };
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * FT::IsZeroBlock --
+ *
+ *    Whether a buffer is all zeros. The SIMD loops OR 64 bytes per step
+ *    and only test the accumulator every 256 bytes, so non-zero data is
+ *    still rejected early without a branch per load.
+ *
+ * Results:
+ *    TRUE if every byte is zero.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+IsZeroBlock(const uint8 *data, // IN
+            uint32 dataLen)    // IN
+{
+   uint32 i = 0;
+
+#if defined(FT_SPARSE_SSE2)
+   const __m128i zero = _mm_setzero_si128();
+   for (; i + 256 <= dataLen; i += 256) {
+      __m128i acc = zero;
+      for (uint32 j = 0; j < 256; j += 64) {
+         const __m128i *p = reinterpret_cast<const __m128i *>(data + i + j);
+         acc = _mm_or_si128(acc, _mm_or_si128(
+                  _mm_or_si128(_mm_loadu_si128(p), _mm_loadu_si128(p + 1)),
+                  _mm_or_si128(_mm_loadu_si128(p + 2), _mm_loadu_si128(p + 3))));
+      }
+      if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xffff) {
+         return FALSE;
+      }
+   }
+#elif defined(FT_SPARSE_NEON)
+   for (; i + 256 <= dataLen; i += 256) {
+      uint8x16_t acc = vdupq_n_u8(0);
+      for (uint32 j = 0; j < 256; j += 64) {
+         const uint8 *p = data + i + j;
+         acc = vorrq_u8(acc, vorrq_u8(vorrq_u8(vld1q_u8(p), vld1q_u8(p + 16)),
+                                      vorrq_u8(vld1q_u8(p + 32),
+                                               vld1q_u8(p + 48))));
+      }
+      if (vmaxvq_u8(acc) != 0) {
+         return FALSE;
+      }
+   }
+#endif
+
+   uint64 acc = 0;
+   for (; i + sizeof acc <= dataLen; i += sizeof acc) {
+      uint64 word;
+      memcpy(&word, data + i, sizeof word);
+      acc |= word;
+   }
+   for (; i < dataLen; i++) {
+      acc |= data[i];
+   }
+   return acc == 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * AppendRecord --
+ *
+ *    Add length bytes of a kind to a frame, extending the last record if
+ *    it has the same kind.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+AppendRecord(std::vector<uint8> *frame,   // IN/OUT
+             size_t *lastRecord,          // IN/OUT: offset in frame, 0 if none
+             uint8 kind,                  // IN
+             const uint8 *data,           // IN: DATA only
+             uint64 length)               // IN
+{
+   FTSparseFrameHeader header;
+   FTSparseRecord record;
+
+   if (frame->empty()) {
+      header.magic = FT_SPARSE_MAGIC;
+      header.recordCount = 0;
+      const uint8 *headerBytes = reinterpret_cast<const uint8 *>(&header);
+      frame->insert(frame->end(), headerBytes, headerBytes + sizeof header);
+   }
+
+   if (*lastRecord != 0) {
+      memcpy(&record, &(*frame)[*lastRecord], sizeof record);
+   }
+   if (*lastRecord != 0 && record.kind == kind &&
+       (kind == FT_SPARSE_RECORD_HOLE ||
+        *lastRecord + sizeof record + record.length == frame->size())) {
+      record.length += length;
+      memcpy(&(*frame)[*lastRecord], &record, sizeof record);
+   } else {
+      memset(&record, 0, sizeof record);
+      record.kind = kind;
+      record.length = length;
+      *lastRecord = frame->size();
+      const uint8 *recordBytes = reinterpret_cast<const uint8 *>(&record);
+      frame->insert(frame->end(), recordBytes, recordBytes + sizeof record);
+
+      memcpy(&header, &(*frame)[0], sizeof header);
+      header.recordCount++;
+      memcpy(&(*frame)[0], &header, sizeof header);
+   }
+
+   if (kind == FT_SPARSE_RECORD_DATA) {
+      frame->insert(frame->end(), data, data + length);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * AppendScanned --
+ *
+ *    Add data read at fileOffset to a frame, as holes where a block
+ *    aligned to the file is all zeros and as data elsewhere.
+ *
+ * Results:
+ *    TRUE if a zero block was found.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static Bool
+AppendScanned(std::vector<uint8> *frame,   // IN/OUT
+              size_t *lastRecord,          // IN/OUT
+              const uint8 *data,           // IN
+              uint32 dataLen,              // IN
+              uint64 fileOffset)           // IN
+{
+   Bool foundHole = FALSE;
+   uint32 pos = 0;
+
+   while (pos < dataLen) {
+      uint32 blockLen = FT_SPARSE_BLOCK_SIZE -
+                        (uint32)((fileOffset + pos) % FT_SPARSE_BLOCK_SIZE);
+      if (blockLen > dataLen - pos) {
+         blockLen = dataLen - pos;
+      }
+
+      if (IsZeroBlock(data + pos, blockLen)) {
+         AppendRecord(frame, lastRecord, FT_SPARSE_RECORD_HOLE, NULL,
+                      blockLen);
+         foundHole = TRUE;
+      } else {
+         AppendRecord(frame, lastRecord, FT_SPARSE_RECORD_DATA, data + pos,
+                      blockLen);
+      }
+      pos += blockLen;
+   }
+   return foundHole;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * FT::EncodeSparseChunk --
+ *
+ *    Encode a chunk read at fileOffset. Blocks are aligned to the file, so
+ *    the holes the receiver leaves line up with file system blocks.
+ *
+ * Results:
+ *    TRUE if the chunk has at least one zero block. Otherwise sending it
+ *    as a plain FileTransferData_File chunk is cheaper.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+EncodeSparseChunk(const uint8 *data,           // IN
+                  uint32 dataLen,              // IN
+                  uint64 fileOffset,           // IN
+                  std::vector<uint8> *frame)   // IN/OUT
+{
+   size_t lastRecord = 0;
+
+   frame->clear();
+   frame->reserve(sizeof(FTSparseFrameHeader) + sizeof(FTSparseRecord) +
+                  dataLen);
+   return AppendScanned(frame, &lastRecord, data, dataLen, fileOffset);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * ParseSparseFrame --
+ *
+ *    Check a whole sparse frame and list its records in chunk order.
+ *
+ * Results:
+ *    FALSE if the frame is malformed. Otherwise the records and the
+ *    length of the chunk the frame stands for.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static Bool
+ParseSparseFrame(const uint8 *frame,                 // IN
+                 uint32 frameLen,                    // IN
+                 std::vector<SparsePiece> *pieces,   // OUT
+                 uint64 *chunkLen)                   // OUT
+{
+   FTSparseFrameHeader header;
+
+   pieces->clear();
+   *chunkLen = 0;
+   if (frameLen < sizeof header) {
+      return FALSE;
+   }
+   memcpy(&header, frame, sizeof header);
+   if (header.magic != FT_SPARSE_MAGIC) {
+      Log("%s: Invalid sparse frame.\n", __FUNCTION__);
+      return FALSE;
+   }
+
+   const uint8 *cur = frame + sizeof header;
+   const uint8 *end = frame + frameLen;
+   for (uint32 i = 0; i < header.recordCount; i++) {
+      FTSparseRecord record;
+      if ((size_t)(end - cur) < sizeof record) {
+         Log("%s: Truncated sparse frame.\n", __FUNCTION__);
+         return FALSE;
+      }
+      memcpy(&record, cur, sizeof record);
+      cur += sizeof record;
+
+      // A frame stands for one chunk, its holes can't be larger
+      if (record.length > FT_SPARSE_MAX_CHUNK_LEN ||
+          *chunkLen + record.length > FT_SPARSE_MAX_CHUNK_LEN) {
+         Log("%s: Sparse frame expands past %u bytes.\n", __FUNCTION__,
+             (uint32)FT_SPARSE_MAX_CHUNK_LEN);
+         return FALSE;
+      }
+
+      SparsePiece piece;
+      piece.kind = record.kind;
+      piece.data = NULL;
+      piece.offset = *chunkLen;
+      piece.length = record.length;
+      if (record.kind == FT_SPARSE_RECORD_DATA) {
+         if (record.length > (uint64)(end - cur)) {
+            Log("%s: Truncated sparse frame.\n", __FUNCTION__);
+            return FALSE;
+         }
+         piece.data = cur;
+         cur += record.length;
+      } else if (record.kind != FT_SPARSE_RECORD_HOLE) {
+         Log("%s: Unknown sparse record %u.\n", __FUNCTION__, record.kind);
+         return FALSE;
+      }
+      pieces->push_back(piece);
+      *chunkLen += record.length;
+   }
+
+   if (cur != end) {
+      Log("%s: Trailing bytes in sparse frame.\n", __FUNCTION__);
+      return FALSE;
+   }
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * FT::ApplySparseFrame --
+ *
+ *    Expand a received MKSVchanPacketType_FileTransferData_Sparse frame
+ *    into the chunk it replaced and pass that on in one call, like the
+ *    compressed path does with a decoded frame. The frame is checked
+ *    completely first, so a malformed frame passes nothing on.
+ *
+ * Results:
+ *    FALSE if the frame is malformed.
+ *
+ * Side effects:
+ *    Calls dataFn once.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+ApplySparseFrame(const uint8 *frame,     // IN
+                 uint32 frameLen,        // IN
+                 SparseDataFn dataFn)    // IN
+{
+   std::vector<SparsePiece> pieces;
+   uint64 chunkLen;
+
+   if (!ParseSparseFrame(frame, frameLen, &pieces, &chunkLen)) {
+      return FALSE;
+   }
+
+   std::vector<uint8> chunk((size_t)chunkLen, 0);
+   for (size_t i = 0; i < pieces.size(); i++) {
+      if (pieces[i].kind == FT_SPARSE_RECORD_DATA) {
+         memcpy(&chunk[(size_t)pieces[i].offset], pieces[i].data,
+                (size_t)pieces[i].length);
+      }
+   }
+   dataFn(chunk.empty() ? NULL : &chunk[0], (uint32)chunk.size());
+   return TRUE;
+}
+
+
+/*
+ * Positioned file access and the file system's view of holes. The file
+ * position of a POSIX descriptor is moved by SEEK_DATA/SEEK_HOLE.
+ */
+
+#if defined(_WIN32)
+
+static Bool
+GetFileLength(SparseFile file, // IN
+              uint64 *length)  // OUT
+{
+   LARGE_INTEGER size;
+   if (!GetFileSizeEx(file, &size)) {
+      Log("%s: GetFileSizeEx failed, error %u.\n", __FUNCTION__,
+          (uint32)GetLastError());
+      return FALSE;
+   }
+   *length = (uint64)size.QuadPart;
+   return TRUE;
+}
+
+
+static Bool
+SetFileLength(SparseFile file, // IN
+              uint64 length)   // IN
+{
+   FILE_END_OF_FILE_INFO info;
+   info.EndOfFile.QuadPart = (LONGLONG)length;
+   if (!SetFileInformationByHandle(file, FileEndOfFileInfo, &info,
+                                   sizeof info)) {
+      Log("%s: Setting the end of file failed, error %u.\n", __FUNCTION__,
+          (uint32)GetLastError());
+      return FALSE;
+   }
+   return TRUE;
+}
+
+
+static Bool
+ReadAt(SparseFile file,  // IN
+       uint64 offset,    // IN
+       uint8 *buf,       // OUT
+       uint32 len)       // IN
+{
+   while (len > 0) {
+      OVERLAPPED at;
+      DWORD done = 0;
+      memset(&at, 0, sizeof at);
+      at.Offset = (DWORD)offset;
+      at.OffsetHigh = (DWORD)(offset >> 32);
+      if (!ReadFile(file, buf, len, &done, &at) || done == 0) {
+         Log("%s: ReadFile failed, error %u.\n", __FUNCTION__,
+             (uint32)GetLastError());
+         return FALSE;
+      }
+      offset += done;
+      buf += done;
+      len -= done;
+   }
+   return TRUE;
+}
+
+
+static Bool
+WriteAt(SparseFile file,     // IN
+        uint64 offset,       // IN
+        const uint8 *buf,    // IN
+        uint32 len)          // IN
+{
+   while (len > 0) {
+      OVERLAPPED at;
+      DWORD done = 0;
+      memset(&at, 0, sizeof at);
+      at.Offset = (DWORD)offset;
+      at.OffsetHigh = (DWORD)(offset >> 32);
+      if (!WriteFile(file, buf, len, &done, &at) || done == 0) {
+         Log("%s: WriteFile failed, error %u.\n", __FUNCTION__,
+             (uint32)GetLastError());
+         return FALSE;
+      }
+      offset += done;
+      buf += done;
+      len -= done;
+   }
+   return TRUE;
+}
+
+
+/*
+ * The first allocated range in [offset, end). A file system without
+ * sparse files fails the query, the whole range is data then.
+ */
+static Bool
+NextDataRegion(SparseFile file,    // IN
+               uint64 offset,      // IN
+               uint64 end,         // IN
+               uint64 *dataStart,  // OUT
+               uint64 *dataEnd)    // OUT
+{
+   FILE_ALLOCATED_RANGE_BUFFER query;
+   FILE_ALLOCATED_RANGE_BUFFER range;
+   DWORD bytes = 0;
+
+   query.FileOffset.QuadPart = (LONGLONG)offset;
+   query.Length.QuadPart = (LONGLONG)(end - offset);
+   if (!DeviceIoControl(file, FSCTL_QUERY_ALLOCATED_RANGES, &query,
+                        sizeof query, &range, sizeof range, &bytes, NULL) &&
+       GetLastError() != ERROR_MORE_DATA) {
+      *dataStart = offset;
+      *dataEnd = end;
+      return TRUE;
+   }
+
+   if (bytes < sizeof range) {
+      *dataStart = end;
+      *dataEnd = end;
+      return TRUE;
+   }
+   uint64 rangeStart = (uint64)range.FileOffset.QuadPart;
+   uint64 rangeEnd = rangeStart + (uint64)range.Length.QuadPart;
+   *dataStart = rangeStart > offset ? rangeStart : offset;
+   *dataEnd = rangeEnd < end ? rangeEnd : end;
+   return TRUE;
+}
+
+
+static Bool
+MakeSparse(SparseFile file) // IN
+{
+   DWORD bytes = 0;
+   if (!DeviceIoControl(file, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &bytes,
+                        NULL)) {
+      Log("%s: FSCTL_SET_SPARSE failed, error %u.\n", __FUNCTION__,
+          (uint32)GetLastError());
+      return FALSE;
+   }
+   return TRUE;
+}
+
+
+static Bool
+DeallocateRange(SparseFile file, // IN
+                uint64 offset,   // IN
+                uint64 len)      // IN
+{
+   FILE_ZERO_DATA_INFORMATION zero;
+   DWORD bytes = 0;
+
+   zero.FileOffset.QuadPart = (LONGLONG)offset;
+   zero.BeyondFinalZero.QuadPart = (LONGLONG)(offset + len);
+   return DeviceIoControl(file, FSCTL_SET_ZERO_DATA, &zero, sizeof zero,
+                          NULL, 0, &bytes, NULL) != 0;
+}
+
+#else
+
+static Bool
+GetFileLength(SparseFile file, // IN
+              uint64 *length)  // OUT
+{
+   struct stat st;
+   if (fstat(file, &st) != 0) {
+      Log("%s: fstat failed, errno %d.\n", __FUNCTION__, errno);
+      return FALSE;
+   }
+   *length = (uint64)st.st_size;
+   return TRUE;
+}
+
+
+static Bool
+SetFileLength(SparseFile file, // IN
+              uint64 length)   // IN
+{
+   if (ftruncate(file, (off_t)length) != 0) {
+      Log("%s: ftruncate failed, errno %d.\n", __FUNCTION__, errno);
+      return FALSE;
+   }
+   return TRUE;
+}
+
+
+static Bool
+ReadAt(SparseFile file,  // IN
+       uint64 offset,    // IN
+       uint8 *buf,       // OUT
+       uint32 len)       // IN
+{
+   while (len > 0) {
+      ssize_t done = pread(file, buf, len, (off_t)offset);
+      if (done < 0 && errno == EINTR) {
+         continue;
+      }
+      if (done <= 0) {
+         Log("%s: pread failed, errno %d.\n", __FUNCTION__,
+             done < 0 ? errno : 0);
+         return FALSE;
+      }
+      offset += done;
+      buf += done;
+      len -= (uint32)done;
+   }
+   return TRUE;
+}
+
+
+static Bool
+WriteAt(SparseFile file,     // IN
+        uint64 offset,       // IN
+        const uint8 *buf,    // IN
+        uint32 len)          // IN
+{
+   while (len > 0) {
+      ssize_t done = pwrite(file, buf, len, (off_t)offset);
+      if (done < 0 && errno == EINTR) {
+         continue;
+      }
+      if (done <= 0) {
+         Log("%s: pwrite failed, errno %d.\n", __FUNCTION__,
+             done < 0 ? errno : 0);
+         return FALSE;
+      }
+      offset += done;
+      buf += done;
+      len -= (uint32)done;
+   }
+   return TRUE;
+}
+
+
+/*
+ * The first data region in [offset, end). Where SEEK_DATA isn't
+ * supported, the whole range is data.
+ */
+static Bool
+NextDataRegion(SparseFile file,    // IN
+               uint64 offset,      // IN
+               uint64 end,         // IN
+               uint64 *dataStart,  // OUT
+               uint64 *dataEnd)    // OUT
+{
+   *dataStart = offset;
+   *dataEnd = end;
+
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+   off_t start = lseek(file, (off_t)offset, SEEK_DATA);
+   if (start < 0) {
+      if (errno == ENXIO) {
+         // Only a hole up to the end of the file
+         *dataStart = end;
+      }
+      return TRUE;
+   }
+   if ((uint64)start >= end) {
+      *dataStart = end;
+      return TRUE;
+   }
+
+   off_t hole = lseek(file, start, SEEK_HOLE);
+   *dataStart = (uint64)start;
+   if (hole > start && (uint64)hole < end) {
+      *dataEnd = (uint64)hole;
+   }
+#endif
+   return TRUE;
+}
+
+
+static Bool
+MakeSparse(SparseFile file) // IN
+{
+   return TRUE;
+}
+
+
+static Bool
+DeallocateRange(SparseFile file, // IN
+                uint64 offset,   // IN
+                uint64 len)      // IN
+{
+#if defined(FALLOC_FL_PUNCH_HOLE)
+   return fallocate(file, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                    (off_t)offset, (off_t)len) == 0;
+#elif defined(F_PUNCHHOLE)
+   fpunchhole_t punch;
+   memset(&punch, 0, sizeof punch);
+   punch.fp_offset = (off_t)offset;
+   punch.fp_length = (off_t)len;
+   return fcntl(file, F_PUNCHHOLE, &punch) == 0;
+#else
+   return FALSE;
+#endif
+}
+
+#endif
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * FT::ReadSparseChunk --
+ *
+ *    Read len bytes of a file at fileOffset into a sparse frame. Ranges
+ *    the file system reports as holes become hole records without being
+ *    read; the data is scanned for zero blocks like EncodeSparseChunk
+ *    does.
+ *
+ * Results:
+ *    FALSE if the range isn't in the file or can't be read. foundHole
+ *    tells whether the frame has a hole; without one, sending the chunk
+ *    plain is cheaper.
+ *
+ * Side effects:
+ *    May move the file position.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+ReadSparseChunk(SparseFile file,             // IN
+                uint64 fileOffset,           // IN
+                uint32 len,                  // IN
+                std::vector<uint8> *frame,   // OUT
+                Bool *foundHole)             // OUT
+{
+   uint64 fileLen;
+   size_t lastRecord = 0;
+   uint64 pos = fileOffset;
+   uint64 end = fileOffset + len;
+   std::vector<uint8> data;
+
+   frame->clear();
+   *foundHole = FALSE;
+   if (!GetFileLength(file, &fileLen)) {
+      return FALSE;
+   }
+   if (end > fileLen) {
+      Log("%s: %u bytes at %llu are past the end of the file.\n",
+          __FUNCTION__, len, (unsigned long long)fileOffset);
+      return FALSE;
+   }
+
+   while (pos < end) {
+      uint64 dataStart;
+      uint64 dataEnd;
+      if (!NextDataRegion(file, pos, end, &dataStart, &dataEnd)) {
+         return FALSE;
+      }
+      if (dataEnd <= dataStart) {
+         dataEnd = end;
+      }
+
+      if (dataStart > pos) {
+         AppendRecord(frame, &lastRecord, FT_SPARSE_RECORD_HOLE, NULL,
+                      dataStart - pos);
+         *foundHole = TRUE;
+         pos = dataStart;
+      }
+      if (pos < dataEnd) {
+         data.resize((size_t)(dataEnd - pos));
+         if (!ReadAt(file, pos, &data[0], (uint32)data.size())) {
+            return FALSE;
+         }
+         if (AppendScanned(frame, &lastRecord, &data[0],
+                           (uint32)data.size(), pos)) {
+            *foundHole = TRUE;
+         }
+         pos = dataEnd;
+      }
+   }
+
+   if (frame->empty()) {
+      FTSparseFrameHeader header = { FT_SPARSE_MAGIC, 0 };
+      const uint8 *headerBytes = reinterpret_cast<const uint8 *>(&header);
+      frame->assign(headerBytes, headerBytes + sizeof header);
+   }
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * FT::WriteSparseFrame --
+ *
+ *    Write a received sparse frame to a file at fileOffset. Data records
+ *    are written, holes inside the file are deallocated and holes past
+ *    its end are left unwritten, so the file system keeps them sparse.
+ *    Where it can't deallocate, zeros are written. The frame is checked
+ *    completely first, so a malformed frame writes nothing.
+ *
+ * Results:
+ *    FALSE if the frame is malformed or the file can't be written.
+ *
+ * Side effects:
+ *    The file is at least fileOffset plus the chunk length long.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+WriteSparseFrame(SparseFile file,      // IN
+                 uint64 fileOffset,    // IN
+                 const uint8 *frame,   // IN
+                 uint32 frameLen)      // IN
+{
+   std::vector<SparsePiece> pieces;
+   uint64 chunkLen;
+   uint64 fileLen;
+   Bool sparse = FALSE;
+
+   if (!ParseSparseFrame(frame, frameLen, &pieces, &chunkLen) ||
+       !GetFileLength(file, &fileLen)) {
+      return FALSE;
+   }
+
+   for (size_t i = 0; i < pieces.size(); i++) {
+      const SparsePiece &piece = pieces[i];
+      uint64 offset = fileOffset + piece.offset;
+
+      if (piece.kind == FT_SPARSE_RECORD_DATA) {
+         if (!WriteAt(file, offset, piece.data, (uint32)piece.length)) {
+            return FALSE;
+         }
+         if (offset + piece.length > fileLen) {
+            fileLen = offset + piece.length;
+         }
+         continue;
+      }
+
+      if (!sparse) {
+         sparse = MakeSparse(file);
+      }
+      if (offset >= fileLen) {
+         continue;
+      }
+
+      // Old data under the hole must read back as zeros
+      uint64 holeLen = piece.length;
+      if (offset + holeLen > fileLen) {
+         holeLen = fileLen - offset;
+      }
+      if (sparse && DeallocateRange(file, offset, holeLen)) {
+         continue;
+      }
+      for (uint64 done = 0; done < holeLen;) {
+         uint32 zeroLen = holeLen - done < sizeof zeroFill ?
+                          (uint32)(holeLen - done) : (uint32)sizeof zeroFill;
+         if (!WriteAt(file, offset + done, zeroFill, zeroLen)) {
+            return FALSE;
+         }
+         done += zeroLen;
+      }
+   }
+
+   if (fileOffset + chunkLen > fileLen) {
+      return SetFileLength(file, fileOffset + chunkLen);
+   }
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * FT::SetPeerSupportsSparse --
+ *
+ *    Record whether the peer offered sparse frames in this session.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+SetPeerSupportsSparse(Bool supported) // IN
+{
+   peerSupportsSparse = supported;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * FT::IsSparseActive --
+ *
+ *    Whether zero runs are sent as sparse frames.
+ *
+ * Results:
+ *    TRUE if the peer offered sparse frames.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+IsSparseActive()
+{
+   return peerSupportsSparse;
+}
+
+} // namespace FT
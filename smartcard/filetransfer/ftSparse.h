@@ -0,0 +1,98 @@
+/* **************************************************************************** *
+ * Copyright (C) 2020 VMware, Inc.  All rights reserved. -- VMware Confidential *
+ * **************************************************************************** */
+
+/*
+ * ftSparse.h --
+ *
+ *    Zero runs of file transfer chunks, as found in disk images, databases
+ *    and preallocated files.
+ *
+ *    When both peers sent MKSVchanPacketType_FileTransfer_SparseOffer,
+ *    MKSVchanRPCPlugin::SendMessage scans every FileTransferData_File
+ *    chunk in FT_SPARSE_BLOCK_SIZE blocks with a SIMD zero test. A chunk
+ *    with zero blocks is sent as a sparse frame (FTSparseFrameHeader, then
+ *    FTSparseRecords, each DATA record followed by its bytes) in a
+ *    MKSVchanPacketType_FileTransferData_Sparse packet instead. Chunks
+ *    taken by the ftCompress stage aren't scanned, deflate already
+ *    shrinks zero runs.
+ *
+ *    The plugin's receiver expands the frame back into the whole chunk and
+ *    passes it to FT::ReceiveFileData in one call. That chunk is opaque to
+ *    the plugin, which can't tell its file offset, so on this path holes
+ *    only save channel bytes.
+ *
+ *    The file transfer engine, which knows the files and offsets, uses
+ *    ReadSparseChunk and WriteSparseFrame instead. ReadSparseChunk asks
+ *    the file system for its holes (SEEK_DATA/SEEK_HOLE, or
+ *    FSCTL_QUERY_ALLOCATED_RANGES on Windows) and doesn't read them, then
+ *    scans the data it reads for zero blocks aligned to the file.
+ *    WriteSparseFrame writes the data records at their offset and
+ *    deallocates the holes (FALLOC_FL_PUNCH_HOLE, F_PUNCHHOLE or
+ *    FSCTL_SET_ZERO_DATA), so the copy is sparse where the source was.
+ */
+
+#ifndef _FT_SPARSE_H_
+#define _FT_SPARSE_H_
+
+#include "vm_basic_types.h"
+
+#include <vector>
+
+#if defined(_WIN32)
+#include <windows.h>
+#endif
+
+#define FT_SPARSE_BLOCK_SIZE 4096
+#define FT_SPARSE_MAX_CHUNK_LEN (64 * 1024 * 1024)
+
+#define FT_SPARSE_MAGIC 0x50535446   // "FTSP"
+#define FT_SPARSE_VERSION 1
+
+#define FT_SPARSE_RECORD_DATA 0
+#define FT_SPARSE_RECORD_HOLE 1
+
+#pragma pack(push, 1)
+typedef struct FTSparseFrameHeader {
+   uint32 magic;
+   uint32 recordCount;
+} FTSparseFrameHeader;
+
+typedef struct FTSparseRecord {
+   uint8 kind;          // FT_SPARSE_RECORD_*
+   uint8 reserved[7];
+   uint64 length;
+} FTSparseRecord;
+#pragma pack(pop)
+
+namespace FT {
+
+#if defined(_WIN32)
+typedef HANDLE SparseFile;
+#else
+typedef int SparseFile;
+#endif
+
+typedef void (*SparseDataFn)(const uint8 *data, uint32 dataLen);
+
+Bool IsZeroBlock(const uint8 *data, uint32 dataLen);
+
+// Sender
+Bool EncodeSparseChunk(const uint8 *data, uint32 dataLen, uint64 fileOffset,
+                       std::vector<uint8> *frame);
+Bool ReadSparseChunk(SparseFile file, uint64 fileOffset, uint32 len,
+                     std::vector<uint8> *frame, Bool *foundHole);
+
+// Receiver
+Bool ApplySparseFrame(const uint8 *frame, uint32 frameLen,
+                      SparseDataFn dataFn);
+Bool WriteSparseFrame(SparseFile file, uint64 fileOffset,
+                      const uint8 *frame, uint32 frameLen);
+
+// Negotiation, vdpservice thread
+void SetPeerSupportsSparse(Bool supported);
+Bool IsSparseActive();
+
+} // namespace FT
+
+#endif // _FT_SPARSE_H_
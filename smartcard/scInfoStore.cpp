@@ -0,0 +1,822 @@
+/* **************************************************************************** *
+ * Copyright (C) 2020 VMware, Inc.  All rights reserved. -- VMware Confidential *
+ * **************************************************************************** */
+
+/*
+ * scInfoStore.cpp --
+ *
+ *    Implements the agent side smart card info store.
+ */
+
+#include "scInfoStore.h"
+
+#include <atomic>
+#include <chrono>
+#include <ctype.h>
+#include <json/json.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <wincrypt.h>
+#elif defined(__APPLE__)
+#include <CommonCrypto/CommonDigest.h>
+#else
+#include <openssl/sha.h>
+#endif
+
+#define PEM_BEGIN "-----BEGIN CERTIFICATE-----"
+#define PEM_END "-----END CERTIFICATE-----"
+
+// Threads which can be inside Get at once without waiting for each other
+#define SC_INFO_STORE_HAZARD_SLOTS 32
+
+#define SC_THUMBPRINT_LEN 20                 // SHA-1
+
+namespace ScInfoStore {
+
+typedef std::chrono::steady_clock Clock;
+
+/*
+ * The current snapshot is a heap allocated SnapshotPtr behind an atomic raw
+ * pointer. Get announces the pointer in a hazard slot before copying the
+ * SnapshotPtr out of it; Replace retires the pointers it swaps out and
+ * deletes them once no slot names them. Slots start out NULL.
+ */
+static std::atomic<const SnapshotPtr *> current(NULL);
+static std::atomic<const SnapshotPtr *> hazards[SC_INFO_STORE_HAZARD_SLOTS];
+static std::vector<const SnapshotPtr *> retired;   // vdpservice thread
+static std::atomic<uint64> version(0);
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * ToHex --
+ *
+ *    Upper case hex of a buffer, as ATRs are kept.
+ *
+ * Results:
+ *    The hex string.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static std::string
+ToHex(const uint8 *data,  // IN
+      uint32 dataLen)     // IN
+{
+   static const char digits[] = "0123456789ABCDEF";
+   std::string hex;
+
+   hex.reserve(dataLen * 2);
+   for (uint32 i = 0; i < dataLen; i++) {
+      hex += digits[data[i] >> 4];
+      hex += digits[data[i] & 0xF];
+   }
+   return hex;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * Thumbprint --
+ *
+ *    SHA-1 of a DER certificate, computed by the platform crypto library.
+ *
+ * Results:
+ *    The digest as upper case hex, empty if it can't be computed.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static std::string
+Thumbprint(const std::vector<uint8> &der) // IN
+{
+   uint8 digest[SC_THUMBPRINT_LEN];
+
+#if defined(_WIN32)
+   DWORD digestLen = sizeof digest;
+   if (!CryptHashCertificate(0, CALG_SHA1, 0, &der[0], (DWORD)der.size(),
+                             digest, &digestLen)) {
+      Log("%s: CryptHashCertificate failed, error %d.\n", __FUNCTION__,
+          GetLastError());
+      return std::string();
+   }
+#elif defined(__APPLE__)
+   CC_SHA1(&der[0], (CC_LONG)der.size(), digest);
+#else
+   SHA1(&der[0], der.size(), digest);
+#endif
+   return ToHex(digest, sizeof digest);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * Base64Decode --
+ *
+ *    Decode base64, skipping whitespace.
+ *
+ * Results:
+ *    FALSE on an invalid character.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static Bool
+Base64Decode(const std::string &text,   // IN
+             std::vector<uint8> *out)   // OUT
+{
+   uint32 acc = 0;
+   int bits = 0;
+
+   out->clear();
+   for (size_t i = 0; i < text.size(); i++) {
+      char c = text[i];
+      int v;
+      if (c >= 'A' && c <= 'Z') {
+         v = c - 'A';
+      } else if (c >= 'a' && c <= 'z') {
+         v = c - 'a' + 26;
+      } else if (c >= '0' && c <= '9') {
+         v = c - '0' + 52;
+      } else if (c == '+') {
+         v = 62;
+      } else if (c == '/') {
+         v = 63;
+      } else if (c == '=' || isspace((unsigned char)c)) {
+         continue;
+      } else {
+         return FALSE;
+      }
+
+      acc = (acc << 6) | (uint32)v;
+      bits += 6;
+      if (bits >= 8) {
+         bits -= 8;
+         out->push_back((uint8)(acc >> bits));
+      }
+   }
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * IndexedEntries --
+ *
+ *    The "#01", "#02", ... entries of a system_profiler section, read the
+ *    same way VerifySmartCardClientInfo reads them.
+ *
+ * Results:
+ *    The entries in order.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static std::vector<std::string>
+IndexedEntries(const Json::Value &section) // IN
+{
+   std::vector<std::string> entries;
+
+   for (int idx = 1; ; idx++) {
+      std::string key = std::string("#0") + std::to_string(idx);
+      if (!section.isMember(key) || !section[key].isString()) {
+         break;
+      }
+      entries.push_back(section[key].asString());
+   }
+   return entries;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * ParseReader --
+ *
+ *    Split a READERS entry, "name" or "name (ATR:{length = n, bytes =
+ *    0x...})".
+ *
+ * Results:
+ *    The reader.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static Reader
+ParseReader(const std::string &entry) // IN
+{
+   Reader reader;
+   size_t atrPos = entry.rfind(" (ATR:{");
+
+   reader.cardPresent = atrPos != std::string::npos;
+   reader.name = entry.substr(0, atrPos);
+   if (reader.cardPresent) {
+      size_t bytesPos = entry.find("bytes = 0x", atrPos);
+      if (bytesPos != std::string::npos) {
+         bytesPos += strlen("bytes = 0x");
+         size_t end = entry.find('}', bytesPos);
+         reader.atr = entry.substr(bytesPos, end == std::string::npos ?
+                                   std::string::npos : end - bytesPos);
+         for (size_t i = 0; i < reader.atr.size(); i++) {
+            reader.atr[i] = (char)toupper((unsigned char)reader.atr[i]);
+         }
+      }
+   }
+   return reader;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * AddTokens --
+ *
+ *    Add the tokens of an AVAIL_SMARTCARDS_TOKEN or _KEYCHAIN section
+ *    and the certificates of their entries.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+AddTokens(const Json::Value &section,   // IN
+          Bool inKeychain,              // IN
+          Snapshot *snapshot)           // IN/OUT
+{
+   const Json::Value &items = section["_items"];
+   if (!items.isArray()) {
+      return;
+   }
+
+   for (Json::ArrayIndex i = 0; i < items.size(); i++) {
+      std::string name = items[i]["_name"].asString();
+      if (name.empty()) {
+         continue;
+      }
+
+      // The same token may be listed in both sections
+      size_t tokenIdx;
+      std::map<std::string, size_t>::iterator it =
+         snapshot->tokenIndex.find(name);
+      if (it == snapshot->tokenIndex.end()) {
+         Token token;
+         token.name = name;
+         token.inKeychain = inKeychain;
+         tokenIdx = snapshot->tokens.size();
+         snapshot->tokens.push_back(token);
+         snapshot->tokenIndex[name] = tokenIdx;
+      } else {
+         tokenIdx = it->second;
+         snapshot->tokens[tokenIdx].inKeychain |= inKeychain;
+      }
+
+      std::vector<std::string> entries = IndexedEntries(items[i]);
+      for (size_t e = 0; e < entries.size(); e++) {
+         size_t begin = entries[e].find(PEM_BEGIN);
+         size_t end = entries[e].find(PEM_END, begin);
+         if (begin == std::string::npos || end == std::string::npos) {
+            continue;
+         }
+
+         Certificate cert;
+         size_t b64 = begin + strlen(PEM_BEGIN);
+         if (!Base64Decode(entries[e].substr(b64, end - b64), &cert.der) ||
+             cert.der.empty()) {
+            continue;
+         }
+         cert.thumbprint = Thumbprint(cert.der);
+         if (cert.thumbprint.empty() ||
+             snapshot->thumbprintIndex.count(cert.thumbprint) > 0) {
+            continue;
+         }
+         cert.token = name;
+         cert.description = entries[e].substr(0, begin);
+         while (!cert.description.empty() &&
+                isspace((unsigned char)cert.description.back())) {
+            cert.description.pop_back();
+         }
+
+         size_t certIdx = snapshot->certificates.size();
+         snapshot->certificates.push_back(cert);
+         snapshot->thumbprintIndex[cert.thumbprint] = certIdx;
+         snapshot->tokens[tokenIdx].certificates.push_back(certIdx);
+      }
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * IsHazard --
+ *
+ *    Whether a reader may be copying the SnapshotPtr behind a pointer.
+ *
+ * Results:
+ *    TRUE if a hazard slot names it.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static Bool
+IsHazard(const SnapshotPtr *ptr) // IN
+{
+   for (size_t i = 0; i < SC_ARRAY_COUNT(hazards); i++) {
+      if (hazards[i].load() == ptr) {
+         return TRUE;
+      }
+   }
+   return FALSE;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * Replace --
+ *
+ *    Swap in a new current snapshot and delete the retired pointers no
+ *    reader can still be dereferencing. A snapshot a reader already
+ *    copied stays alive through its own SnapshotPtr.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Takes ownership of next.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+Replace(const SnapshotPtr *next) // IN: may be NULL
+{
+   const SnapshotPtr *previous = current.exchange(next);
+   if (previous != NULL) {
+      retired.push_back(previous);
+   }
+
+   size_t kept = 0;
+   for (size_t i = 0; i < retired.size(); i++) {
+      if (IsHazard(retired[i])) {
+         retired[kept++] = retired[i];
+      } else {
+         delete retired[i];
+      }
+   }
+   retired.resize(kept);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * Publish --
+ *
+ *    Make a parsed snapshot the current one.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Bumps the version.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+Publish(const std::shared_ptr<Snapshot> &snapshot, // IN
+        Clock::time_point start)                   // IN: parse start
+{
+   snapshot->version = version.load() + 1;
+   snapshot->receivedMS = (uint64)std::chrono::duration_cast<
+      std::chrono::milliseconds>(start.time_since_epoch()).count();
+   Replace(new SnapshotPtr(snapshot));
+   version.store(snapshot->version);
+
+   Log("%s: Smart card info version %llu: %u readers, %u tokens, %u "
+       "certificates, parsed in %lluus.\n", __FUNCTION__,
+       (unsigned long long)snapshot->version,
+       (uint32)snapshot->readers.size(), (uint32)snapshot->tokens.size(),
+       (uint32)snapshot->certificates.size(),
+       (unsigned long long)std::chrono::duration_cast<
+          std::chrono::microseconds>(Clock::now() - start).count());
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * ScInfoStore::Update --
+ *
+ *    Parse a SmartCardInfo payload and publish it as the current
+ *    snapshot.
+ *
+ * Results:
+ *    FALSE if the payload isn't valid smart card info; the current
+ *    snapshot is kept.
+ *
+ * Side effects:
+ *    Bumps the version.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+Update(const char *data,  // IN
+       uint32 dataLen)    // IN
+{
+   Clock::time_point start = Clock::now();
+
+   // Sent as a C string
+   while (dataLen > 0 && data[dataLen - 1] == '\0') {
+      dataLen--;
+   }
+
+   Json::Value root;
+   Json::Reader reader;
+   if (!reader.parse(data, data + dataLen, root, false) ||
+       !root["SPSmartCardsDataType"].isArray()) {
+      Log("%s: Unable to parse %u bytes of smart card info.\n", __FUNCTION__,
+          dataLen);
+      return FALSE;
+   }
+
+   std::shared_ptr<Snapshot> snapshot = std::make_shared<Snapshot>();
+   const Json::Value &dataTypes = root["SPSmartCardsDataType"];
+   for (Json::ArrayIndex i = 0; i < dataTypes.size(); i++) {
+      const Json::Value &section = dataTypes[i];
+      std::string name = section["_name"].asString();
+
+      if (name == "READERS") {
+         std::vector<std::string> entries = IndexedEntries(section);
+         for (size_t e = 0; e < entries.size(); e++) {
+            Reader r = ParseReader(entries[e]);
+            snapshot->readerIndex[r.name] = snapshot->readers.size();
+            snapshot->readers.push_back(r);
+         }
+      } else if (name == "READERS_DRIVERS") {
+         snapshot->readerDrivers = IndexedEntries(section);
+      } else if (name == "TOKEN_DRIVERS") {
+         snapshot->tokenDrivers = IndexedEntries(section);
+      } else if (name == "SMARTCARDS_DRIVERS") {
+         snapshot->ctkDrivers = IndexedEntries(section);
+      } else if (name == "AVAIL_SMARTCARDS_TOKEN") {
+         AddTokens(section, FALSE, snapshot.get());
+      } else if (name == "AVAIL_SMARTCARDS_KEYCHAIN") {
+         AddTokens(section, TRUE, snapshot.get());
+      }
+   }
+
+   Publish(snapshot, start);
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * AddInventoryTokens --
+ *
+ *    Add the tokens of one section of a decoded inventory and index their
+ *    certificates.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+AddInventoryTokens(const std::vector<ScInventory::Token> &tokens, // IN
+                   Bool inKeychain,                               // IN
+                   Snapshot *snapshot)                            // IN/OUT
+{
+   for (size_t t = 0; t < tokens.size(); t++) {
+      // The same token may be listed in both sections
+      const std::string &name = tokens[t].name;
+      size_t tokenIdx;
+      std::map<std::string, size_t>::iterator it =
+         snapshot->tokenIndex.find(name);
+      if (it != snapshot->tokenIndex.end()) {
+         tokenIdx = it->second;
+         snapshot->tokens[tokenIdx].inKeychain |= inKeychain;
+      } else {
+         Token token;
+         token.name = name;
+         token.inKeychain = inKeychain;
+         tokenIdx = snapshot->tokens.size();
+         snapshot->tokenIndex[name] = tokenIdx;
+         snapshot->tokens.push_back(token);
+      }
+
+      for (size_t c = 0; c < tokens[t].certificates.size(); c++) {
+         const ScInventory::Certificate &source = tokens[t].certificates[c];
+         if (source.der.empty()) {
+            continue;
+         }
+
+         Certificate cert;
+         cert.thumbprint = Thumbprint(source.der);
+         if (cert.thumbprint.empty() ||
+             snapshot->thumbprintIndex.count(cert.thumbprint) > 0) {
+            continue;
+         }
+         cert.token = name;
+         cert.description = ScInventory::DescribeCertificate(
+            source.slot, source.usage, source.der.size());
+         cert.der = source.der;
+
+         size_t certIdx = snapshot->certificates.size();
+         snapshot->thumbprintIndex[cert.thumbprint] = certIdx;
+         snapshot->certificates.push_back(cert);
+         snapshot->tokens[tokenIdx].certificates.push_back(certIdx);
+      }
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * ScInfoStore::UpdateInventory --
+ *
+ *    Like Update, for an inventory already decoded from a
+ *    SmartCardInfo_Binary payload by ScInventory::FromBinary, so the
+ *    payload is parsed only once.
+ *
+ * Results:
+ *    TRUE.
+ *
+ * Side effects:
+ *    Bumps the version.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+UpdateInventory(const ScInventory::Inventory &inventory) // IN
+{
+   Clock::time_point start = Clock::now();
+   std::shared_ptr<Snapshot> snapshot = std::make_shared<Snapshot>();
+
+   for (size_t i = 0; i < inventory.readers.size(); i++) {
+      const ScInventory::Reader &source = inventory.readers[i];
+      Reader r;
+      r.name = source.name;
+      r.cardPresent = source.cardPresent;
+      if (!source.atr.empty()) {
+         r.atr = ToHex(&source.atr[0], source.atr.size());
+      }
+      snapshot->readerIndex[r.name] = snapshot->readers.size();
+      snapshot->readers.push_back(r);
+   }
+
+   const std::vector<ScInventory::Driver> *driverLists[] = {
+      &inventory.readerDrivers, &inventory.tokenDrivers, &inventory.ctkDrivers
+   };
+   std::vector<std::string> *snapshotLists[] = {
+      &snapshot->readerDrivers, &snapshot->tokenDrivers,
+      &snapshot->ctkDrivers
+   };
+   for (size_t list = 0; list < SC_ARRAY_COUNT(driverLists); list++) {
+      const std::vector<ScInventory::Driver> &drivers = *driverLists[list];
+      for (size_t i = 0; i < drivers.size(); i++) {
+         // As the JSON lists them
+         snapshotLists[list]->push_back(drivers[i].id + ":" +
+                                        drivers[i].version + " (" +
+                                        drivers[i].path + ")");
+      }
+   }
+
+   // In the order of the JSON sections, so both formats index alike
+   AddInventoryTokens(inventory.keychainTokens, TRUE, snapshot.get());
+   AddInventoryTokens(inventory.tokens, FALSE, snapshot.get());
+
+   Publish(snapshot, start);
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * ScInfoStore::Reset --
+ *
+ *    Forget the session's smart card info.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Bumps the version.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+Reset()
+{
+   Replace(NULL);
+   version.fetch_add(1);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * ScInfoStore::Get --
+ *
+ *    The current snapshot.
+ *
+ *    Takes no lock: the pointer is announced in a free hazard slot, checked
+ *    to still be current, and the SnapshotPtr copied, which is an atomic
+ *    reference count increment. With more than SC_INFO_STORE_HAZARD_SLOTS
+ *    concurrent callers, the extra ones retry until a slot frees up.
+ *
+ * Results:
+ *    The snapshot, NULL if no smart card info arrived this session.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+SnapshotPtr
+Get()
+{
+   for (size_t i = 0; ; i = (i + 1) % SC_ARRAY_COUNT(hazards)) {
+      const SnapshotPtr *ptr = current.load();
+      if (ptr == NULL) {
+         return SnapshotPtr();
+      }
+
+      const SnapshotPtr *expected = NULL;
+      if (!hazards[i].compare_exchange_strong(expected, ptr)) {
+         continue;
+      }
+      // Replace may have retired it before the slot was seen
+      SnapshotPtr snapshot;
+      Bool stillCurrent = current.load() == ptr;
+      if (stillCurrent) {
+         snapshot = *ptr;
+      }
+      hazards[i].store(NULL);
+      if (stillCurrent) {
+         return snapshot;
+      }
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * ScInfoStore::GetVersion --
+ *
+ *    Version of the current snapshot, without taking it.
+ *
+ * Results:
+ *    The version, 0 before the first update.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+uint64
+GetVersion()
+{
+   return version.load();
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * ScInfoStore::FindReader --
+ *
+ *    Look up a reader by name.
+ *
+ * Results:
+ *    The reader, NULL if unknown. Valid as long as the snapshot is held.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+const Reader *
+FindReader(const Snapshot &snapshot, // IN
+           const std::string &name)  // IN
+{
+   std::map<std::string, size_t>::const_iterator it =
+      snapshot.readerIndex.find(name);
+   return it == snapshot.readerIndex.end() ? NULL :
+                                             &snapshot.readers[it->second];
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * ScInfoStore::FindToken --
+ *
+ *    Look up a token by name.
+ *
+ * Results:
+ *    The token, NULL if unknown. Valid as long as the snapshot is held.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+const Token *
+FindToken(const Snapshot &snapshot, // IN
+          const std::string &name)  // IN
+{
+   std::map<std::string, size_t>::const_iterator it =
+      snapshot.tokenIndex.find(name);
+   return it == snapshot.tokenIndex.end() ? NULL :
+                                            &snapshot.tokens[it->second];
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * ScInfoStore::FindCertificate --
+ *
+ *    Look up a certificate by SHA-1 thumbprint, in hex of either case,
+ *    optionally separated by spaces or colons.
+ *
+ * Results:
+ *    The certificate, NULL if unknown. Valid as long as the snapshot is
+ *    held.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+const Certificate *
+FindCertificate(const Snapshot &snapshot,      // IN
+                const std::string &thumbprint) // IN
+{
+   std::string key;
+   key.reserve(40);
+   for (size_t i = 0; i < thumbprint.size(); i++) {
+      char c = thumbprint[i];
+      if (c != ' ' && c != ':') {
+         key += (char)toupper((unsigned char)c);
+      }
+   }
+
+   std::map<std::string, size_t>::const_iterator it =
+      snapshot.thumbprintIndex.find(key);
+   if (it == snapshot.thumbprintIndex.end()) {
+      return NULL;
+   }
+   return &snapshot.certificates[it->second];
+}
+
+} // namespace ScInfoStore
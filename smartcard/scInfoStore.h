@@ -0,0 +1,89 @@
+/* **************************************************************************** *
+ * Copyright (C) 2020 VMware, Inc.  All rights reserved. -- VMware Confidential *
+ * **************************************************************************** */
+
+/*
+ * scInfoStore.h --
+ *
+ *    Agent side, parsed view of the smart card info the client sends.
+ *
+ *    Each SmartCardInfo packet, JSON or SmartCardInfo_Binary (see
+ *    scInventoryWire.h, decoded by the caller), is parsed once, on the
+ *    vdpservice thread, into an immutable Snapshot with indexes by reader name, token name
+ *    and certificate thumbprint (SHA-1 of the DER, as Windows shows it).
+ *    The snapshot is published through an atomic pointer, and Get copies
+ *    a reference to it under a hazard pointer, so readers take no lock and
+ *    never wait for a parse. Replaced pointers are deleted by the next
+ *    update once no reader is copying from them; a snapshot a reader holds
+ *    stays valid after a newer one is published.
+ *
+ *    Every update bumps the version, so a consumer can tell whether
+ *    anything changed since it last looked. The store is per session and
+ *    is cleared in OnNotReady.
+ */
+
+#ifndef _SC_INFO_STORE_H_
+#define _SC_INFO_STORE_H_
+
+#include "MKSVchanRPCPlugin.h"
+#include "scInventory.h"
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace ScInfoStore {
+
+struct Reader {
+   std::string name;
+   Bool cardPresent;
+   std::string atr;                   // Hex, empty without a card
+};
+
+struct Certificate {
+   std::string token;                 // Name of the token holding it
+   std::string description;           // Text before the PEM
+   std::string thumbprint;            // Upper case hex SHA-1 of der
+   std::vector<uint8> der;
+};
+
+struct Token {
+   std::string name;
+   Bool inKeychain;                   // From AVAIL_SMARTCARDS_KEYCHAIN
+   std::vector<size_t> certificates;  // Indexes into Snapshot::certificates
+};
+
+struct Snapshot {
+   uint64 version;
+   uint64 receivedMS;                 // Steady clock
+   std::vector<Reader> readers;
+   std::vector<std::string> readerDrivers;
+   std::vector<std::string> tokenDrivers;
+   std::vector<std::string> ctkDrivers;
+   std::vector<Token> tokens;
+   std::vector<Certificate> certificates;
+
+   std::map<std::string, size_t> readerIndex;
+   std::map<std::string, size_t> tokenIndex;
+   std::map<std::string, size_t> thumbprintIndex;
+};
+
+typedef std::shared_ptr<const Snapshot> SnapshotPtr;
+
+// vdpservice thread
+Bool Update(const char *data, uint32 dataLen);
+Bool UpdateInventory(const ScInventory::Inventory &inventory);
+void Reset();
+
+// Any thread
+SnapshotPtr Get();
+uint64 GetVersion();
+const Reader *FindReader(const Snapshot &snapshot, const std::string &name);
+const Token *FindToken(const Snapshot &snapshot, const std::string &name);
+const Certificate *FindCertificate(const Snapshot &snapshot,
+                                   const std::string &thumbprint);
+
+} // namespace ScInfoStore
+
+#endif // _SC_INFO_STORE_H_
@@ -0,0 +1,1219 @@
+/* **************************************************************************** *
+ * Copyright (C) 2020 VMware, Inc.  All rights reserved. -- VMware Confidential *
+ * **************************************************************************** */
+
+/*
+ * scInventory.cpp --
+ *
+ *    Implements the PC/SC smart card inventory.
+ */
+
+#include "scInventory.h"
+#include "scInventoryWire.h"
+
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+
+#ifdef _WIN32
+#include <winscard.h>
+#else
+#include <PCSC/winscard.h>
+#include <PCSC/wintypes.h>
+#include <dirent.h>
+#include <fstream>
+#include <iterator>
+#endif
+
+#ifdef __APPLE__
+#include <CoreFoundation/CoreFoundation.h>
+#include <Security/Security.h>
+#endif
+
+#ifdef _WIN32
+#define SC_LIST_READERS SCardListReadersA
+#define SC_GET_STATUS_CHANGE SCardGetStatusChangeA
+#define SC_CONNECT SCardConnectA
+typedef SCARD_READERSTATEA ScReaderState;
+#else
+#define SC_LIST_READERS SCardListReaders
+#define SC_GET_STATUS_CHANGE SCardGetStatusChange
+#define SC_CONNECT SCardConnect
+typedef SCARD_READERSTATE ScReaderState;
+#endif
+
+/*
+ * Where pcsclite looks for IFD handler bundles, and macOS for tokend
+ * bundles.
+ */
+#if defined(__APPLE__)
+static const char *readerDriverDirs[] = {
+   "/usr/libexec/SmartCardServices/drivers",
+   "/usr/local/libexec/SmartCardServices/drivers",
+};
+static const char *tokenDriverDirs[] = {
+   "/Library/Security/tokend",
+};
+static const char *ctkDriverDirs[] = {
+   "/System/Library/Frameworks/CryptoTokenKit.framework/PlugIns",
+};
+
+// Third party CryptoTokenKit drivers are app extensions of their apps
+#define SC_CTK_APPS_DIR "/Applications"
+#define SC_CTK_EXTENSION_POINT "com.apple.ctk-tokens"
+#elif !defined(_WIN32)
+static const char *readerDriverDirs[] = {
+   "/usr/lib/pcsc/drivers",
+   "/usr/lib64/pcsc/drivers",
+   "/usr/local/lib/pcsc/drivers",
+};
+#endif
+
+// Largest PIV data object we read, certificates are well below it
+#define SC_INVENTORY_MAX_OBJECT (16 * 1024)
+
+// Largest certificate a gzipped PIV certificate may inflate to
+#define SC_INVENTORY_MAX_CERTIFICATE (64 * 1024)
+
+#define SW_SUCCESS 0x9000
+
+namespace ScInventory {
+
+typedef std::chrono::steady_clock Clock;
+
+struct PivSlot {
+   uint32 tag;
+   const char *name;
+   const char *usage;
+};
+
+static const PivSlot pivSlots[] = {
+   { 0x5FC105, "PIV Authentication", "Sign" },
+   { 0x5FC10A, "Digital Signature", "Sign" },
+   { 0x5FC10B, "Key Management", "Decrypt" },
+   { 0x5FC101, "Card Authentication", "Sign" },
+};
+
+#define PIV_TAG_CHUID 0x5FC102
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * ElapsedMS --
+ *
+ *    Milliseconds since start.
+ *
+ * Results:
+ *    Milliseconds.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static uint32
+ElapsedMS(Clock::time_point start) // IN
+{
+   return (uint32)std::chrono::duration_cast<std::chrono::milliseconds>(
+      Clock::now() - start).count();
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * ToHex --
+ *
+ *    Hex string of a byte buffer.
+ *
+ * Results:
+ *    The string, lower or upper case.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static std::string
+ToHex(const uint8 *data, // IN
+      size_t dataLen,    // IN
+      Bool upper)        // IN
+{
+   const char *digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+   std::string hex;
+
+   hex.reserve(dataLen * 2);
+   for (size_t i = 0; i < dataLen; i++) {
+      hex += digits[data[i] >> 4];
+      hex += digits[data[i] & 0xf];
+   }
+   return hex;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * ToBase64 --
+ *
+ *    Base64 of a byte buffer, on one line like system_profiler prints it.
+ *
+ * Results:
+ *    The string.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static std::string
+ToBase64(const std::vector<uint8> &data) // IN
+{
+   static const char alphabet[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+   std::string out;
+   size_t i = 0;
+
+   out.reserve((data.size() + 2) / 3 * 4);
+   for (; i + 2 < data.size(); i += 3) {
+      uint32 v = (data[i] << 16) | (data[i + 1] << 8) | data[i + 2];
+      out += alphabet[(v >> 18) & 0x3f];
+      out += alphabet[(v >> 12) & 0x3f];
+      out += alphabet[(v >> 6) & 0x3f];
+      out += alphabet[v & 0x3f];
+   }
+   if (i < data.size()) {
+      uint32 v = data[i] << 16;
+      if (i + 1 < data.size()) {
+         v |= data[i + 1] << 8;
+      }
+      out += alphabet[(v >> 18) & 0x3f];
+      out += alphabet[(v >> 12) & 0x3f];
+      out += i + 1 < data.size() ? alphabet[(v >> 6) & 0x3f] : '=';
+      out += '=';
+   }
+   return out;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * JsonString --
+ *
+ *    Quote and escape a string for JSON.
+ *
+ * Results:
+ *    The JSON string literal.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static std::string
+JsonString(const std::string &value) // IN
+{
+   std::string out("\"");
+
+   for (size_t i = 0; i < value.size(); i++) {
+      unsigned char c = (unsigned char)value[i];
+      switch (c) {
+         case '"':  out += "\\\""; break;
+         case '\\': out += "\\\\"; break;
+         case '\n': out += "\\n"; break;
+         case '\r': out += "\\r"; break;
+         case '\t': out += "\\t"; break;
+         default:
+            if (c < 0x20) {
+               char escaped[8];
+               snprintf(escaped, sizeof escaped, "\\u%04x", c);
+               out += escaped;
+            } else {
+               out += (char)c;
+            }
+      }
+   }
+   out += '"';
+   return out;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * IndexKey --
+ *
+ *    The key of the idx-th (0 based) entry of a system_profiler section.
+ *    VerifySmartCardClientInfo looks them up as "#0" followed by the
+ *    1-based index, so "#010" follows "#09".
+ *
+ * Results:
+ *    The key.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static std::string
+IndexKey(size_t idx) // IN
+{
+   char key[32];
+   snprintf(key, sizeof key, "#0%u", (unsigned)(idx + 1));
+   return key;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * FindTlv --
+ *
+ *    Find a BER-TLV with the given tag at the top level of a buffer.
+ *
+ * Results:
+ *    TRUE and the value if found.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static Bool
+FindTlv(const uint8 *data,    // IN
+        size_t dataLen,       // IN
+        uint32 tag,           // IN
+        const uint8 **value,  // OUT
+        size_t *valueLen)     // OUT
+{
+   size_t pos = 0;
+
+   while (pos < dataLen) {
+      uint32 curTag = data[pos++];
+      if ((curTag & 0x1f) == 0x1f) {
+         do {
+            if (pos >= dataLen) {
+               return FALSE;
+            }
+            curTag = (curTag << 8) | data[pos];
+         } while (data[pos++] & 0x80);
+      }
+
+      if (pos >= dataLen) {
+         return FALSE;
+      }
+      size_t len = data[pos++];
+      if (len & 0x80) {
+         size_t lenBytes = len & 0x7f;
+         if (lenBytes == 0 || lenBytes > 3 || pos + lenBytes > dataLen) {
+            return FALSE;
+         }
+         len = 0;
+         while (lenBytes-- > 0) {
+            len = (len << 8) | data[pos++];
+         }
+      }
+      if (len > dataLen - pos) {
+         return FALSE;
+      }
+
+      if (curTag == tag) {
+         *value = data + pos;
+         *valueLen = len;
+         return TRUE;
+      }
+      pos += len;
+   }
+   return FALSE;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * Transmit --
+ *
+ *    Send an APDU and collect the whole response, following 61xx (more
+ *    data) and 6Cxx (wrong Le) status words.
+ *
+ * Results:
+ *    The final status word, 0 if the transmit itself failed.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static uint32
+Transmit(SCARDHANDLE card,               // IN
+         DWORD protocol,                 // IN
+         std::vector<uint8> apdu,        // IN
+         std::vector<uint8> *response)   // OUT
+{
+   const SCARD_IO_REQUEST *pci =
+      protocol == SCARD_PROTOCOL_T1 ? SCARD_PCI_T1 : SCARD_PCI_T0;
+   uint8 buf[258];
+
+   response->clear();
+   while (response->size() < SC_INVENTORY_MAX_OBJECT) {
+      DWORD bufLen = sizeof buf;
+      LONG rv = SCardTransmit(card, pci, &apdu[0], (DWORD)apdu.size(), NULL,
+                              buf, &bufLen);
+      if (rv != SCARD_S_SUCCESS || bufLen < 2) {
+         return 0;
+      }
+
+      uint8 sw1 = buf[bufLen - 2];
+      uint8 sw2 = buf[bufLen - 1];
+      response->insert(response->end(), buf, buf + bufLen - 2);
+
+      if (sw1 == 0x61) {
+         uint8 getResponse[] = { 0x00, 0xC0, 0x00, 0x00, sw2 };
+         apdu.assign(getResponse, getResponse + sizeof getResponse);
+      } else if (sw1 == 0x6C) {
+         apdu.back() = sw2;
+      } else {
+         return (sw1 << 8) | sw2;
+      }
+   }
+   return 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * ReadPivObject --
+ *
+ *    GET DATA of a PIV data object.
+ *
+ * Results:
+ *    TRUE and the content of its 53 container if the object exists.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static Bool
+ReadPivObject(SCARDHANDLE card,          // IN
+              DWORD protocol,            // IN
+              uint32 tag,                // IN
+              std::vector<uint8> *data)  // OUT
+{
+   uint8 getData[] = { 0x00, 0xCB, 0x3F, 0xFF, 0x05, 0x5C, 0x03,
+                       (uint8)(tag >> 16), (uint8)(tag >> 8), (uint8)tag,
+                       0x00 };
+   std::vector<uint8> response;
+
+   if (Transmit(card, protocol,
+                std::vector<uint8>(getData, getData + sizeof getData),
+                &response) != SW_SUCCESS) {
+      return FALSE;
+   }
+
+   const uint8 *value;
+   size_t valueLen;
+   if (response.empty() ||
+       !FindTlv(&response[0], response.size(), 0x53, &value, &valueLen)) {
+      return FALSE;
+   }
+   data->assign(value, value + valueLen);
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * InflateCertificate --
+ *
+ *    Decompress a PIV certificate stored gzipped (CertInfo bit 0).
+ *
+ * Results:
+ *    TRUE and the DER, FALSE if it isn't valid gzip or is too large.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static Bool
+InflateCertificate(const uint8 *data,          // IN
+                   size_t dataLen,             // IN
+                   std::vector<uint8> *der)    // OUT
+{
+   z_stream stream;
+   memset(&stream, 0, sizeof stream);
+   // 32 selects gzip or zlib by the header
+   if (inflateInit2(&stream, 15 + 32) != Z_OK) {
+      return FALSE;
+   }
+
+   der->resize(SC_INVENTORY_MAX_CERTIFICATE);
+   stream.next_in = const_cast<Bytef *>(data);
+   stream.avail_in = (uInt)dataLen;
+   stream.next_out = &(*der)[0];
+   stream.avail_out = (uInt)der->size();
+   int rv = inflate(&stream, Z_FINISH);
+   der->resize(stream.total_out);
+   inflateEnd(&stream);
+   return rv == Z_STREAM_END && !der->empty();
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * ReadToken --
+ *
+ *    Read the certificates of the PIV applet on the card in a reader.
+ *
+ * Results:
+ *    FALSE if the card couldn't be read or has no PIV applet, so its
+ *    certificates are missing from the inventory.
+ *
+ * Side effects:
+ *    Appends to tokens. Holds a transaction on the card while reading.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static Bool
+ReadToken(SCARDCONTEXT context,          // IN
+          const Reader &reader,          // IN
+          std::vector<Token> *tokens)    // IN/OUT
+{
+   SCARDHANDLE card;
+   DWORD protocol = 0;
+   LONG rv = SC_CONNECT(context, reader.name.c_str(), SCARD_SHARE_SHARED,
+                        SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1, &card,
+                        &protocol);
+   if (rv != SCARD_S_SUCCESS) {
+      Log("%s: Unable to connect to %s, 0x%08lx.\n", __FUNCTION__,
+          reader.name.c_str(), (unsigned long)rv);
+      return FALSE;
+   }
+
+   if (SCardBeginTransaction(card) != SCARD_S_SUCCESS) {
+      SCardDisconnect(card, SCARD_LEAVE_CARD);
+      return FALSE;
+   }
+
+   static const uint8 selectPiv[] = {
+      0x00, 0xA4, 0x04, 0x00, 0x09,
+      0xA0, 0x00, 0x00, 0x03, 0x08, 0x00, 0x00, 0x10, 0x00,
+      0x00
+   };
+   std::vector<uint8> response;
+   Bool isPiv = Transmit(card, protocol,
+                         std::vector<uint8>(selectPiv,
+                                            selectPiv + sizeof selectPiv),
+                         &response) == SW_SUCCESS;
+   if (isPiv) {
+      Token token;
+      token.reader = reader.name;
+      token.name = "pivtoken:" + reader.name;
+
+      std::vector<uint8> object;
+      const uint8 *value;
+      size_t valueLen;
+      if (ReadPivObject(card, protocol, PIV_TAG_CHUID, &object) &&
+          FindTlv(&object[0], object.size(), 0x34, &value, &valueLen)) {
+         token.name = "pivtoken:" + ToHex(value, valueLen, TRUE);
+      }
+
+      for (size_t i = 0; i < SC_ARRAY_COUNT(pivSlots); i++) {
+         if (!ReadPivObject(card, protocol, pivSlots[i].tag, &object) ||
+             object.empty() ||
+             !FindTlv(&object[0], object.size(), 0x70, &value, &valueLen)) {
+            continue;
+         }
+
+         Certificate cert;
+         cert.slot = pivSlots[i].name;
+         cert.usage = pivSlots[i].usage;
+
+         // CertInfo bit 0 means the certificate is gzipped
+         const uint8 *certInfo;
+         size_t certInfoLen;
+         if (FindTlv(&object[0], object.size(), 0x71, &certInfo,
+                     &certInfoLen) &&
+             certInfoLen > 0 && (certInfo[0] & 1) != 0) {
+            if (!InflateCertificate(value, valueLen, &cert.der)) {
+               Log("%s: Invalid compressed %s certificate on %s.\n",
+                   __FUNCTION__, pivSlots[i].name, reader.name.c_str());
+               continue;
+            }
+         } else {
+            cert.der.assign(value, value + valueLen);
+         }
+         token.certificates.push_back(cert);
+      }
+      tokens->push_back(token);
+   } else {
+      Log("%s: The card in %s has no PIV applet.\n", __FUNCTION__,
+          reader.name.c_str());
+   }
+
+   SCardEndTransaction(card, SCARD_LEAVE_CARD);
+   SCardDisconnect(card, SCARD_LEAVE_CARD);
+   return isPiv;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * ListReaders --
+ *
+ *    List the readers and get the ATR of every inserted card with one
+ *    non-blocking SCardGetStatusChange.
+ *
+ * Results:
+ *    FALSE if PC/SC failed. No readers is not a failure.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static Bool
+ListReaders(SCARDCONTEXT context,          // IN
+            std::vector<Reader> *readers)  // OUT
+{
+   DWORD namesLen = 0;
+   LONG rv = SC_LIST_READERS(context, NULL, NULL, &namesLen);
+   if (rv == SCARD_E_NO_READERS_AVAILABLE) {
+      return TRUE;
+   }
+   if (rv != SCARD_S_SUCCESS || namesLen == 0) {
+      Log("%s: SCardListReaders failed, 0x%08lx.\n", __FUNCTION__,
+          (unsigned long)rv);
+      return FALSE;
+   }
+
+   std::vector<char> names(namesLen);
+   rv = SC_LIST_READERS(context, NULL, &names[0], &namesLen);
+   if (rv == SCARD_E_NO_READERS_AVAILABLE) {
+      return TRUE;
+   }
+   if (rv != SCARD_S_SUCCESS) {
+      Log("%s: SCardListReaders failed, 0x%08lx.\n", __FUNCTION__,
+          (unsigned long)rv);
+      return FALSE;
+   }
+
+   std::vector<ScReaderState> states;
+   for (const char *name = &names[0];
+        name < &names[0] + namesLen && *name != '\0';
+        name += strlen(name) + 1) {
+      ScReaderState state;
+      memset(&state, 0, sizeof state);
+      state.szReader = name;
+      state.dwCurrentState = SCARD_STATE_UNAWARE;
+      states.push_back(state);
+   }
+   if (states.empty()) {
+      return TRUE;
+   }
+
+   rv = SC_GET_STATUS_CHANGE(context, 0, &states[0], (DWORD)states.size());
+   if (rv != SCARD_S_SUCCESS) {
+      Log("%s: SCardGetStatusChange failed, 0x%08lx.\n", __FUNCTION__,
+          (unsigned long)rv);
+      return FALSE;
+   }
+
+   for (size_t i = 0; i < states.size(); i++) {
+      Reader reader;
+      reader.name = states[i].szReader;
+      DWORD eventState = states[i].dwEventState;
+      reader.cardPresent = (eventState & SCARD_STATE_PRESENT) != 0 &&
+                           (eventState & SCARD_STATE_MUTE) == 0;
+      if (reader.cardPresent) {
+         reader.atr.assign(states[i].rgbAtr,
+                           states[i].rgbAtr + states[i].cbAtr);
+      }
+      readers->push_back(reader);
+   }
+   return TRUE;
+}
+
+
+#ifndef _WIN32
+/*
+ *----------------------------------------------------------------------------
+ *
+ * PlistString --
+ *
+ *    The <string> value of a key in an Info.plist.
+ *
+ * Results:
+ *    The value, or "(null)" like system_profiler prints a missing one.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static std::string
+PlistString(const std::string &plist, // IN
+            const char *key)          // IN
+{
+   std::string keyTag = std::string("<key>") + key + "</key>";
+   size_t pos = plist.find(keyTag);
+   if (pos != std::string::npos) {
+      size_t start = plist.find("<string>", pos + keyTag.size());
+      size_t end = plist.find("</string>", start);
+      if (start != std::string::npos && end != std::string::npos) {
+         start += strlen("<string>");
+         return plist.substr(start, end - start);
+      }
+   }
+   return "(null)";
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * ScanDrivers --
+ *
+ *    Add the bundles with the given suffix in a directory, only those of
+ *    an extension point if one is given.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+ScanDrivers(const char *dir,               // IN
+            const char *suffix,            // IN
+            const char *extensionPoint,    // IN: optional
+            std::vector<Driver> *drivers)  // IN/OUT
+{
+   DIR *d = opendir(dir);
+   if (d == NULL) {
+      return;
+   }
+
+   size_t suffixLen = strlen(suffix);
+   struct dirent *entry;
+   while ((entry = readdir(d)) != NULL) {
+      size_t nameLen = strlen(entry->d_name);
+      if (nameLen <= suffixLen ||
+          strcmp(entry->d_name + nameLen - suffixLen, suffix) != 0) {
+         continue;
+      }
+
+      Driver driver;
+      driver.path = std::string(dir) + "/" + entry->d_name;
+      std::ifstream in((driver.path + "/Contents/Info.plist").c_str());
+      std::string plist((std::istreambuf_iterator<char>(in)),
+                        std::istreambuf_iterator<char>());
+      if (extensionPoint != NULL &&
+          plist.find(extensionPoint) == std::string::npos) {
+         continue;
+      }
+      driver.id = PlistString(plist, "CFBundleIdentifier");
+      driver.version = PlistString(plist, "CFBundleShortVersionString");
+      if (driver.version == "(null)") {
+         driver.version = PlistString(plist, "CFBundleVersion");
+      }
+      drivers->push_back(driver);
+   }
+   closedir(d);
+}
+#endif
+
+
+#ifdef __APPLE__
+/*
+ *----------------------------------------------------------------------------
+ *
+ * ScanAppCtkDrivers --
+ *
+ *    Add the CryptoTokenKit extensions shipped inside applications.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+ScanAppCtkDrivers(std::vector<Driver> *drivers) // IN/OUT
+{
+   DIR *d = opendir(SC_CTK_APPS_DIR);
+   if (d == NULL) {
+      return;
+   }
+
+   struct dirent *entry;
+   while ((entry = readdir(d)) != NULL) {
+      size_t nameLen = strlen(entry->d_name);
+      if (nameLen > 4 && strcmp(entry->d_name + nameLen - 4, ".app") == 0) {
+         std::string plugins = std::string(SC_CTK_APPS_DIR "/") +
+                               entry->d_name + "/Contents/PlugIns";
+         ScanDrivers(plugins.c_str(), ".appex", SC_CTK_EXTENSION_POINT,
+                     drivers);
+      }
+   }
+   closedir(d);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * CFStringToString --
+ *
+ *    UTF-8 copy of a CFString.
+ *
+ * Results:
+ *    The string, empty for NULL.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static std::string
+CFStringToString(CFStringRef value) // IN
+{
+   if (value == NULL || CFGetTypeID(value) != CFStringGetTypeID()) {
+      return std::string();
+   }
+
+   CFIndex size = CFStringGetMaximumSizeForEncoding(CFStringGetLength(value),
+                                                    kCFStringEncodingUTF8) + 1;
+   std::vector<char> buf(size);
+   if (!CFStringGetCString(value, &buf[0], size, kCFStringEncodingUTF8)) {
+      return std::string();
+   }
+   return &buf[0];
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * CollectKeychainTokens --
+ *
+ *    The certificates CryptoTokenKit exposes in the keychain, grouped by
+ *    token id, which is what AVAIL_SMARTCARDS_KEYCHAIN lists. This covers
+ *    tokens of any CryptoTokenKit driver, not only PIV.
+ *
+ * Results:
+ *    FALSE if the keychain couldn't be queried. No token is not a
+ *    failure.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static Bool
+CollectKeychainTokens(const std::vector<Token> &pivTokens, // IN
+                      std::vector<Token> *tokens)          // OUT
+{
+   const void *keys[] = {
+      kSecClass, kSecAttrAccessGroup, kSecReturnAttributes, kSecReturnData,
+      kSecMatchLimit,
+   };
+   const void *values[] = {
+      kSecClassCertificate, kSecAttrAccessGroupToken, kCFBooleanTrue,
+      kCFBooleanTrue, kSecMatchLimitAll,
+   };
+   CFDictionaryRef query =
+      CFDictionaryCreate(NULL, keys, values, SC_ARRAY_COUNT(keys),
+                         &kCFTypeDictionaryKeyCallBacks,
+                         &kCFTypeDictionaryValueCallBacks);
+   if (query == NULL) {
+      return FALSE;
+   }
+
+   CFTypeRef result = NULL;
+   OSStatus status = SecItemCopyMatching(query, &result);
+   CFRelease(query);
+   if (status == errSecItemNotFound) {
+      return TRUE;
+   }
+   if (status != errSecSuccess || result == NULL ||
+       CFGetTypeID(result) != CFArrayGetTypeID()) {
+      Log("%s: SecItemCopyMatching failed, %d.\n", __FUNCTION__,
+          (int)status);
+      if (result != NULL) {
+         CFRelease(result);
+      }
+      return FALSE;
+   }
+
+   CFArrayRef items = (CFArrayRef)result;
+   for (CFIndex i = 0; i < CFArrayGetCount(items); i++) {
+      CFDictionaryRef item =
+         (CFDictionaryRef)CFArrayGetValueAtIndex(items, i);
+      std::string tokenId = CFStringToString(
+         (CFStringRef)CFDictionaryGetValue(item, kSecAttrTokenID));
+      CFDataRef data = (CFDataRef)CFDictionaryGetValue(item, kSecValueData);
+      if (tokenId.empty() || data == NULL ||
+          CFGetTypeID(data) != CFDataGetTypeID()) {
+         continue;
+      }
+
+      Certificate cert;
+      const uint8 *der = CFDataGetBytePtr(data);
+      cert.der.assign(der, der + CFDataGetLength(data));
+      cert.slot = CFStringToString(
+         (CFStringRef)CFDictionaryGetValue(item, kSecAttrLabel));
+      cert.usage = "Unknown";
+
+      // The keychain doesn't know the PIV slot, the card read does
+      for (size_t t = 0; t < pivTokens.size(); t++) {
+         for (size_t c = 0; c < pivTokens[t].certificates.size(); c++) {
+            if (pivTokens[t].certificates[c].der == cert.der) {
+               cert.slot = pivTokens[t].certificates[c].slot;
+               cert.usage = pivTokens[t].certificates[c].usage;
+            }
+         }
+      }
+
+      size_t t = 0;
+      while (t < tokens->size() && (*tokens)[t].name != tokenId) {
+         t++;
+      }
+      if (t == tokens->size()) {
+         tokens->push_back(Token());
+         tokens->back().name = tokenId;
+      }
+      (*tokens)[t].certificates.push_back(cert);
+   }
+   CFRelease(result);
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * CollectSystemProfiler --
+ *
+ *    Fallback when PC/SC is unavailable or the inventory is incomplete:
+ *    the smart card section of system_profiler. This takes seconds, see
+ *    CollectJson.
+ *
+ * Results:
+ *    TRUE if system_profiler printed anything.
+ *
+ * Side effects:
+ *    Runs system_profiler.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static Bool
+CollectSystemProfiler(std::string *json) // OUT
+{
+   FILE *pipe = popen("system_profiler SPSmartCardsDataType -json", "r");
+   if (pipe == NULL) {
+      return FALSE;
+   }
+
+   char buf[4096];
+   size_t n;
+   json->clear();
+   while ((n = fread(buf, 1, sizeof buf, pipe)) > 0) {
+      json->append(buf, n);
+   }
+   pclose(pipe);
+   return !json->empty();
+}
+#endif
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * ScInventory::Collect --
+ *
+ *    Collect the smart card inventory through PC/SC, and on macOS the
+ *    CryptoTokenKit drivers and keychain tokens.
+ *
+ * Results:
+ *    FALSE if the PC/SC service is unavailable. complete is cleared if a
+ *    card or the keychain couldn't be read.
+ *
+ * Side effects:
+ *    Briefly connects to every inserted card.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+Collect(Inventory *inventory) // OUT
+{
+   SCARDCONTEXT context;
+   LONG rv = SCardEstablishContext(SCARD_SCOPE_USER, NULL, NULL, &context);
+   if (rv != SCARD_S_SUCCESS) {
+      Log("%s: SCardEstablishContext failed, 0x%08lx.\n", __FUNCTION__,
+          (unsigned long)rv);
+      return FALSE;
+   }
+
+   *inventory = Inventory();
+   inventory->complete = TRUE;
+   Bool ok = ListReaders(context, &inventory->readers);
+   for (size_t i = 0; ok && i < inventory->readers.size(); i++) {
+      if (inventory->readers[i].cardPresent &&
+          !ReadToken(context, inventory->readers[i], &inventory->tokens)) {
+         inventory->complete = FALSE;
+      }
+   }
+   SCardReleaseContext(context);
+
+#ifndef _WIN32
+   for (size_t i = 0; i < SC_ARRAY_COUNT(readerDriverDirs); i++) {
+      ScanDrivers(readerDriverDirs[i], ".bundle", NULL,
+                  &inventory->readerDrivers);
+   }
+#endif
+#ifdef __APPLE__
+   for (size_t i = 0; i < SC_ARRAY_COUNT(tokenDriverDirs); i++) {
+      ScanDrivers(tokenDriverDirs[i], ".tokend", NULL,
+                  &inventory->tokenDrivers);
+   }
+   for (size_t i = 0; i < SC_ARRAY_COUNT(ctkDriverDirs); i++) {
+      ScanDrivers(ctkDriverDirs[i], ".appex", SC_CTK_EXTENSION_POINT,
+                  &inventory->ctkDrivers);
+   }
+   ScanAppCtkDrivers(&inventory->ctkDrivers);
+   if (!CollectKeychainTokens(inventory->tokens,
+                              &inventory->keychainTokens)) {
+      inventory->complete = FALSE;
+   }
+#endif
+   return ok;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * ScInventory::DescribeCertificate --
+ *
+ *    The text system_profiler puts in front of a token certificate.
+ *
+ * Results:
+ *    "Kind: <slot>, Certificate: {length = <n>}, Usage: <usage>".
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+std::string
+DescribeCertificate(const std::string &slot,  // IN
+                    const std::string &usage, // IN
+                    size_t derLen)            // IN
+{
+   char text[128];
+   snprintf(text, sizeof text, "Kind: %s, Certificate: {length = %u}, "
+            "Usage: %s", slot.c_str(), (unsigned)derLen, usage.c_str());
+   return text;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * ScInventory::ToJson --
+ *
+ *    Render an inventory in the system_profiler SPSmartCardsDataType
+ *    schema. Tokens go into AVAIL_SMARTCARDS_TOKEN and keychain tokens
+ *    into AVAIL_SMARTCARDS_KEYCHAIN, with one entry per certificate
+ *    carrying the PEM.
+ *
+ * Results:
+ *    The JSON document.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+std::string
+ToJson(const Inventory &inventory) // IN
+{
+   std::vector<std::string> sections;
+
+   std::string readers = "{\"_name\":\"READERS\"";
+   for (size_t i = 0; i < inventory.readers.size(); i++) {
+      const Reader &reader = inventory.readers[i];
+      std::string entry = reader.name;
+      if (reader.cardPresent) {
+         char length[64];
+         snprintf(length, sizeof length, " (ATR:{length = %u, bytes = 0x",
+                  (unsigned)reader.atr.size());
+         entry += length;
+         entry += reader.atr.empty() ? std::string() :
+                  ToHex(&reader.atr[0], reader.atr.size(), FALSE);
+         entry += "})";
+      }
+      readers += "," + JsonString(IndexKey(i)) + ":" + JsonString(entry);
+   }
+   sections.push_back(readers + "}");
+
+   const std::vector<Driver> *driverLists[] = {
+      &inventory.readerDrivers, &inventory.tokenDrivers, &inventory.ctkDrivers
+   };
+   const char *driverSections[] = {
+      "READERS_DRIVERS", "TOKEN_DRIVERS", "SMARTCARDS_DRIVERS"
+   };
+   for (size_t list = 0; list < SC_ARRAY_COUNT(driverLists); list++) {
+      const std::vector<Driver> &drivers = *driverLists[list];
+      if (drivers.empty()) {
+         continue;
+      }
+      std::string section =
+         std::string("{\"_name\":\"") + driverSections[list] + "\"";
+      for (size_t i = 0; i < drivers.size(); i++) {
+         std::string entry = drivers[i].id + ":" + drivers[i].version +
+                             " (" + drivers[i].path + ")";
+         section += "," + JsonString(IndexKey(i)) + ":" + JsonString(entry);
+      }
+      sections.push_back(section + "}");
+   }
+
+   const std::vector<Token> *tokenLists[] = {
+      &inventory.keychainTokens, &inventory.tokens
+   };
+   const char *tokenSections[] = {
+      "AVAIL_SMARTCARDS_KEYCHAIN", "AVAIL_SMARTCARDS_TOKEN"
+   };
+   for (size_t list = 0; list < SC_ARRAY_COUNT(tokenLists); list++) {
+      const std::vector<Token> &tokens = *tokenLists[list];
+      if (tokens.empty()) {
+         continue;
+      }
+      std::string items;
+      for (size_t t = 0; t < tokens.size(); t++) {
+         const Token &token = tokens[t];
+         std::string item = "{\"_name\":" + JsonString(token.name);
+         for (size_t c = 0; c < token.certificates.size(); c++) {
+            const Certificate &cert = token.certificates[c];
+            std::string entry = DescribeCertificate(cert.slot, cert.usage,
+                                                    cert.der.size()) +
+                                " \n\n-----BEGIN CERTIFICATE-----\n" +
+                                ToBase64(cert.der) +
+                                "\n-----END CERTIFICATE-----\n";
+            item += "," + JsonString(IndexKey(c)) + ":" + JsonString(entry);
+         }
+         items += (t > 0 ? "," : "") + item + "}";
+      }
+      sections.push_back("{\"_items\":[" + items + "],\"_name\":\"" +
+                         tokenSections[list] + "\"}");
+   }
+
+   std::string json = "{\"SPSmartCardsDataType\":[";
+   for (size_t i = 0; i < sections.size(); i++) {
+      json += (i > 0 ? "," : "") + sections[i];
+   }
+   return json + "]}";
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * ScInventory::CollectJson --
+ *
+ *    Collect the inventory as SPSmartCardsDataType JSON, falling back to
+ *    system_profiler on macOS if PC/SC is unavailable or the inventory is
+ *    incomplete. Elsewhere an incomplete inventory is what there is. The
+ *    native inventory is also encoded in the binary format, see
+ *    scInventoryWire.h.
+ *
+ * Results:
+ *    FALSE if no inventory could be collected. binary is left empty if
+ *    only the system_profiler JSON is available.
+ *
+ * Side effects:
+ *    Logs how long collecting took.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+CollectJson(std::string *json,         // OUT
+            std::vector<uint8> *binary) // OUT: optional
+{
+   Clock::time_point start = Clock::now();
+   Inventory inventory;
+
+   if (binary != NULL) {
+      binary->clear();
+   }
+
+   Bool collected = Collect(&inventory);
+#ifdef __APPLE__
+   if (collected && !inventory.complete) {
+      Log("%s: PC/SC inventory is incomplete after %ums, using "
+          "system_profiler.\n", __FUNCTION__, ElapsedMS(start));
+      collected = FALSE;
+   }
+#endif
+
+   if (collected) {
+      *json = ToJson(inventory);
+      if (binary != NULL) {
+         ToBinary(inventory, binary);
+      }
+      Log("%s: PC/SC inventory of %u readers, %u tokens%s took %ums.\n",
+          __FUNCTION__, (unsigned)inventory.readers.size(),
+          (unsigned)inventory.tokens.size(),
+          inventory.complete ? "" : ", only PIV certificates,",
+          ElapsedMS(start));
+      return TRUE;
+   }
+
+#ifdef __APPLE__
+   if (CollectSystemProfiler(json)) {
+      Log("%s: system_profiler inventory took %ums.\n", __FUNCTION__,
+          ElapsedMS(start));
+      return TRUE;
+   }
+#endif
+
+   Log("%s: No smart card inventory after %ums.\n", __FUNCTION__,
+       ElapsedMS(start));
+   return FALSE;
+}
+
+} // namespace ScInventory
@@ -0,0 +1,79 @@
+/* **************************************************************************** *
+ * Copyright (C) 2020 VMware, Inc.  All rights reserved. -- VMware Confidential *
+ * **************************************************************************** */
+
+/*
+ * scInventory.h --
+ *
+ *    Client side smart card inventory, collected through PC/SC (pcsclite on
+ *    Linux, the PCSC framework on macOS) instead of system_profiler.
+ *
+ *    Readers and ATRs come from one SCardGetStatusChange call, reader and
+ *    token drivers from the IFD handler bundles, and token certificates
+ *    from the PIV applet of each inserted card. On macOS the CryptoTokenKit
+ *    drivers come from their extension bundles and the keychain's token
+ *    certificates from the Security framework. ToJson renders the result
+ *    in the system_profiler SPSmartCardsDataType schema, which is what
+ *    the agent side and VerifySmartCardClientInfo consume.
+ *
+ *    A card without a PIV applet, or a keychain that can't be queried,
+ *    leaves the inventory incomplete; on macOS CollectJson then falls back
+ *    to system_profiler, which reads every token through CryptoTokenKit.
+ */
+
+#ifndef _SC_INVENTORY_H_
+#define _SC_INVENTORY_H_
+
+#include "MKSVchanRPCPlugin.h"
+
+#include <string>
+#include <vector>
+
+#define SC_ARRAY_COUNT(a) (sizeof (a) / sizeof (a)[0])
+
+namespace ScInventory {
+
+struct Reader {
+   std::string name;
+   Bool cardPresent;
+   std::vector<uint8> atr;
+};
+
+struct Driver {
+   std::string id;        // Bundle identifier
+   std::string version;
+   std::string path;
+};
+
+struct Certificate {
+   std::string slot;      // PIV slot name, e.g. "PIV Authentication"
+   std::string usage;     // "Sign" or "Decrypt"
+   std::vector<uint8> der;
+};
+
+struct Token {
+   std::string name;      // "pivtoken:" and the CHUID GUID, or the reader;
+                          // the CryptoTokenKit token id in the keychain
+   std::string reader;
+   std::vector<Certificate> certificates;
+};
+
+struct Inventory {
+   std::vector<Reader> readers;
+   std::vector<Driver> readerDrivers;
+   std::vector<Driver> tokenDrivers;
+   std::vector<Driver> ctkDrivers;          // SMARTCARDS_DRIVERS
+   std::vector<Token> tokens;               // AVAIL_SMARTCARDS_TOKEN
+   std::vector<Token> keychainTokens;       // AVAIL_SMARTCARDS_KEYCHAIN
+   Bool complete;         // Nothing system_profiler would list is missing
+};
+
+Bool Collect(Inventory *inventory);
+std::string DescribeCertificate(const std::string &slot,
+                                const std::string &usage, size_t derLen);
+std::string ToJson(const Inventory &inventory);
+Bool CollectJson(std::string *json, std::vector<uint8> *binary);
+
+} // namespace ScInventory
+
+#endif // _SC_INVENTORY_H_
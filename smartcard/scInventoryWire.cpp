@@ -0,0 +1,513 @@
+/* **************************************************************************** *
+ * Copyright (C) 2020 VMware, Inc.  All rights reserved. -- VMware Confidential *
+ * **************************************************************************** */
+
+/*
+ * scInventoryWire.cpp --
+ *
+ *    Implements the binary smart card inventory format.
+ */
+
+#include "scInventoryWire.h"
+
+#include <atomic>
+#include <string.h>
+
+namespace ScInventory {
+
+static std::atomic<uint32> peerVersion(0);
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * AppendField --
+ *
+ *    Append a length prefixed field.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+AppendField(const void *data,            // IN
+            uint32 dataLen,              // IN
+            std::vector<uint8> *binary)  // IN/OUT
+{
+   const uint8 *bytes = static_cast<const uint8 *>(data);
+
+   binary->insert(binary->end(), reinterpret_cast<const uint8 *>(&dataLen),
+                  reinterpret_cast<const uint8 *>(&dataLen) + sizeof dataLen);
+   binary->insert(binary->end(), bytes, bytes + dataLen);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * AppendRecord --
+ *
+ *    Append a record with string and byte fields.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+AppendRecord(uint8 type,                         // IN
+             uint8 flags,                        // IN
+             const std::string *strings,         // IN
+             uint32 stringCount,                 // IN
+             const std::vector<uint8> *bytes,    // IN: optional, last field
+             std::vector<uint8> *binary)         // IN/OUT
+{
+   size_t start = binary->size();
+   ScInventoryRecord record;
+
+   record.type = type;
+   record.flags = flags;
+   record.fieldCount = (uint16)(stringCount + (bytes != NULL ? 1 : 0));
+   record.length = 0;
+   binary->resize(start + sizeof record);
+
+   for (uint32 i = 0; i < stringCount; i++) {
+      AppendField(strings[i].data(), (uint32)strings[i].length(), binary);
+   }
+   if (bytes != NULL) {
+      AppendField(bytes->empty() ? NULL : &(*bytes)[0],
+                  (uint32)bytes->size(), binary);
+   }
+
+   record.length = (uint32)(binary->size() - start - sizeof record);
+   memcpy(&(*binary)[start], &record, sizeof record);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * ScInventory::ToBinary --
+ *
+ *    Encode an inventory.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+ToBinary(const Inventory &inventory,  // IN
+         std::vector<uint8> *binary)  // OUT
+{
+   ScInventoryHeader header;
+   size_t certificates = 0;
+
+   for (size_t t = 0; t < inventory.tokens.size(); t++) {
+      certificates += inventory.tokens[t].certificates.size();
+   }
+   for (size_t t = 0; t < inventory.keychainTokens.size(); t++) {
+      certificates += inventory.keychainTokens[t].certificates.size();
+   }
+
+   header.magic = SC_INVENTORY_MAGIC;
+   header.version = SC_INVENTORY_VERSION;
+   header.reserved = 0;
+   header.recordCount = (uint32)(inventory.readers.size() +
+                                 inventory.readerDrivers.size() +
+                                 inventory.tokenDrivers.size() +
+                                 inventory.ctkDrivers.size() +
+                                 inventory.tokens.size() +
+                                 inventory.keychainTokens.size() +
+                                 certificates);
+
+   binary->assign(reinterpret_cast<const uint8 *>(&header),
+                  reinterpret_cast<const uint8 *>(&header) + sizeof header);
+
+   for (size_t i = 0; i < inventory.readers.size(); i++) {
+      const Reader &reader = inventory.readers[i];
+      AppendRecord(SC_INVENTORY_RECORD_READER,
+                   reader.cardPresent ? SC_INVENTORY_READER_CARD_PRESENT : 0,
+                   &reader.name, 1, &reader.atr, binary);
+   }
+
+   const std::vector<Driver> *driverLists[] = {
+      &inventory.readerDrivers, &inventory.tokenDrivers, &inventory.ctkDrivers
+   };
+   const uint8 driverRecords[] = {
+      SC_INVENTORY_RECORD_READER_DRIVER, SC_INVENTORY_RECORD_TOKEN_DRIVER,
+      SC_INVENTORY_RECORD_CTK_DRIVER
+   };
+   for (size_t list = 0; list < SC_ARRAY_COUNT(driverLists); list++) {
+      const std::vector<Driver> &drivers = *driverLists[list];
+      for (size_t i = 0; i < drivers.size(); i++) {
+         std::string fields[] = {
+            drivers[i].id, drivers[i].version, drivers[i].path
+         };
+         AppendRecord(driverRecords[list], 0, fields, SC_ARRAY_COUNT(fields),
+                      NULL, binary);
+      }
+   }
+
+   for (size_t t = 0; t < inventory.tokens.size(); t++) {
+      const Token &token = inventory.tokens[t];
+      std::string tokenFields[] = { token.name, token.reader };
+      AppendRecord(SC_INVENTORY_RECORD_TOKEN, 0, tokenFields,
+                   SC_ARRAY_COUNT(tokenFields), NULL, binary);
+
+      for (size_t c = 0; c < token.certificates.size(); c++) {
+         const Certificate &cert = token.certificates[c];
+         std::string certFields[] = { cert.slot, cert.usage };
+         AppendRecord(SC_INVENTORY_RECORD_CERTIFICATE, 0, certFields,
+                      SC_ARRAY_COUNT(certFields), &cert.der, binary);
+      }
+   }
+
+   // Separate record types, so an older reader skips their certificates
+   for (size_t t = 0; t < inventory.keychainTokens.size(); t++) {
+      const Token &token = inventory.keychainTokens[t];
+      AppendRecord(SC_INVENTORY_RECORD_KEYCHAIN_TOKEN, 0, &token.name, 1,
+                   NULL, binary);
+
+      for (size_t c = 0; c < token.certificates.size(); c++) {
+         const Certificate &cert = token.certificates[c];
+         std::string certFields[] = { cert.slot, cert.usage };
+         AppendRecord(SC_INVENTORY_RECORD_KEYCHAIN_CERTIFICATE, 0, certFields,
+                      SC_ARRAY_COUNT(certFields), &cert.der, binary);
+      }
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * ScInventory::BinaryReader::BinaryReader --
+ *
+ *    Check the header of an encoded inventory.
+ *
+ * Results:
+ *    None. IsValid tells whether the header was good.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+BinaryReader::BinaryReader(const uint8 *data, // IN
+                           uint32 dataLen)    // IN
+   : m_cur(data),
+     m_end(data + dataLen),
+     m_recordsLeft(0),
+     m_valid(FALSE)
+{
+   ScInventoryHeader header;
+
+   if (dataLen < sizeof header) {
+      Log("%s: Truncated smart card inventory.\n", __FUNCTION__);
+      return;
+   }
+   memcpy(&header, data, sizeof header);
+
+   // A newer peer only adds records and fields, which are skipped
+   if (header.magic != SC_INVENTORY_MAGIC || header.version == 0) {
+      Log("%s: Invalid smart card inventory.\n", __FUNCTION__);
+      return;
+   }
+
+   m_cur += sizeof header;
+   m_recordsLeft = header.recordCount;
+   m_valid = TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * ScInventory::BinaryReader::Next --
+ *
+ *    Read the next record. Its fields point into the buffer.
+ *
+ * Results:
+ *    FALSE at the end, or if the record is malformed, which also clears
+ *    IsValid.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+BinaryReader::Next(RecordView *record) // OUT
+{
+   ScInventoryRecord header;
+
+   if (!m_valid || m_recordsLeft == 0) {
+      if (m_valid && m_cur != m_end) {
+         Log("%s: Trailing bytes in smart card inventory.\n", __FUNCTION__);
+         m_valid = FALSE;
+      }
+      return FALSE;
+   }
+
+   if ((size_t)(m_end - m_cur) < sizeof header) {
+      Log("%s: Truncated smart card inventory.\n", __FUNCTION__);
+      m_valid = FALSE;
+      return FALSE;
+   }
+   memcpy(&header, m_cur, sizeof header);
+   m_cur += sizeof header;
+   if (header.length > (size_t)(m_end - m_cur)) {
+      Log("%s: Truncated smart card inventory.\n", __FUNCTION__);
+      m_valid = FALSE;
+      return FALSE;
+   }
+
+   const uint8 *field = m_cur;
+   const uint8 *recordEnd = m_cur + header.length;
+   record->type = header.type;
+   record->flags = header.flags;
+   record->fieldCount = 0;
+   for (uint32 i = 0; i < header.fieldCount; i++) {
+      uint32 fieldLen;
+      if ((size_t)(recordEnd - field) < sizeof fieldLen) {
+         m_valid = FALSE;
+         break;
+      }
+      memcpy(&fieldLen, field, sizeof fieldLen);
+      field += sizeof fieldLen;
+      if (fieldLen > (size_t)(recordEnd - field)) {
+         m_valid = FALSE;
+         break;
+      }
+      if (i < SC_INVENTORY_MAX_FIELDS) {
+         record->fields[i].data = field;
+         record->fields[i].length = fieldLen;
+         record->fieldCount++;
+      }
+      field += fieldLen;
+   }
+   if (!m_valid) {
+      Log("%s: Malformed smart card inventory record.\n", __FUNCTION__);
+      return FALSE;
+   }
+
+   m_cur = recordEnd;
+   m_recordsLeft--;
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * ScInventory::FieldString --
+ *
+ *    Copy a string field of a record.
+ *
+ * Results:
+ *    The string, empty if the record has fewer fields.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+std::string
+FieldString(const RecordView &record, // IN
+            uint32 field)             // IN
+{
+   if (field >= record.fieldCount) {
+      return std::string();
+   }
+   return std::string(reinterpret_cast<const char *>(
+                         record.fields[field].data),
+                      record.fields[field].length);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * ScInventory::FieldBytes --
+ *
+ *    Copy a byte field of a record.
+ *
+ * Results:
+ *    The bytes, empty if the record has fewer fields.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+std::vector<uint8>
+FieldBytes(const RecordView &record, // IN
+           uint32 field)             // IN
+{
+   if (field >= record.fieldCount) {
+      return std::vector<uint8>();
+   }
+   return std::vector<uint8>(record.fields[field].data,
+                             record.fields[field].data +
+                             record.fields[field].length);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * ScInventory::FromBinary --
+ *
+ *    Decode an inventory. Fields a record lacks are left empty.
+ *
+ * Results:
+ *    FALSE if the data is malformed.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+FromBinary(const uint8 *data,       // IN
+           uint32 dataLen,          // IN
+           Inventory *inventory)    // OUT
+{
+   BinaryReader reader(data, dataLen);
+   RecordView record;
+
+   *inventory = Inventory();
+   inventory->complete = TRUE;
+   while (reader.Next(&record)) {
+      switch (record.type) {
+      case SC_INVENTORY_RECORD_READER:
+      {
+         Reader r;
+         r.name = FieldString(record, 0);
+         r.cardPresent =
+            (record.flags & SC_INVENTORY_READER_CARD_PRESENT) != 0;
+         r.atr = FieldBytes(record, 1);
+         inventory->readers.push_back(r);
+      }
+      break;
+
+      case SC_INVENTORY_RECORD_READER_DRIVER:
+      case SC_INVENTORY_RECORD_TOKEN_DRIVER:
+      case SC_INVENTORY_RECORD_CTK_DRIVER:
+      {
+         Driver driver;
+         driver.id = FieldString(record, 0);
+         driver.version = FieldString(record, 1);
+         driver.path = FieldString(record, 2);
+         (record.type == SC_INVENTORY_RECORD_READER_DRIVER ?
+             inventory->readerDrivers :
+          record.type == SC_INVENTORY_RECORD_TOKEN_DRIVER ?
+             inventory->tokenDrivers :
+             inventory->ctkDrivers).push_back(driver);
+      }
+      break;
+
+      case SC_INVENTORY_RECORD_TOKEN:
+      case SC_INVENTORY_RECORD_KEYCHAIN_TOKEN:
+      {
+         Token token;
+         token.name = FieldString(record, 0);
+         token.reader = FieldString(record, 1);
+         (record.type == SC_INVENTORY_RECORD_TOKEN ?
+             inventory->tokens :
+             inventory->keychainTokens).push_back(token);
+      }
+      break;
+
+      case SC_INVENTORY_RECORD_CERTIFICATE:
+      case SC_INVENTORY_RECORD_KEYCHAIN_CERTIFICATE:
+      {
+         std::vector<Token> &tokens =
+            record.type == SC_INVENTORY_RECORD_CERTIFICATE ?
+               inventory->tokens : inventory->keychainTokens;
+         if (tokens.empty()) {
+            Log("%s: Certificate without a token.\n", __FUNCTION__);
+            return FALSE;
+         }
+         Certificate cert;
+         cert.slot = FieldString(record, 0);
+         cert.usage = FieldString(record, 1);
+         cert.der = FieldBytes(record, 2);
+         tokens.back().certificates.push_back(cert);
+      }
+      break;
+
+      default:
+         break;
+      }
+   }
+   return reader.IsValid();
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * ScInventory::SetPeerBinaryVersion --
+ *
+ *    Record the binary format version the peer offered in this session,
+ *    0 for none.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+SetPeerBinaryVersion(uint32 version) // IN
+{
+   peerVersion.store(version);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * ScInventory::IsBinaryActive --
+ *
+ *    Whether the inventory should be sent in the binary format.
+ *
+ * Results:
+ *    TRUE if the peer reads SC_INVENTORY_VERSION.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+IsBinaryActive()
+{
+   return peerVersion.load() >= SC_INVENTORY_VERSION;
+}
+
+} // namespace ScInventory
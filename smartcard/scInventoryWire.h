@@ -0,0 +1,108 @@
+/* **************************************************************************** *
+ * Copyright (C) 2020 VMware, Inc.  All rights reserved. -- VMware Confidential *
+ * **************************************************************************** */
+
+/*
+ * scInventoryWire.h --
+ *
+ *    Binary wire format of the smart card inventory, sent as
+ *    MKSVchanPacketType_SmartCardInfo_Binary instead of the
+ *    SPSmartCardsDataType JSON once the agent offered it with
+ *    MKSVchanPacketType_SmartCard_FormatOffer.
+ *
+ *    A ScInventoryHeader is followed by records, each a ScInventoryRecord
+ *    and its fields. A field is a uint32 length and that many bytes:
+ *    strings are UTF-8 without a terminator, ATRs and certificates are raw
+ *    bytes, so the DER is carried as is rather than as base64 PEM inside a
+ *    JSON string. Certificate records belong to the token record before
+ *    them, keychain certificate records to the keychain token record
+ *    before them.
+ *
+ *    BinaryReader walks a buffer without copying: fields point into it.
+ *    Readers skip record types and trailing fields they don't know, so
+ *    records and fields can be added without a new version.
+ */
+
+#ifndef _SC_INVENTORY_WIRE_H_
+#define _SC_INVENTORY_WIRE_H_
+
+#include "scInventory.h"
+
+#include <string>
+#include <vector>
+
+#define SC_INVENTORY_MAGIC 0x56494353   // "SCIV"
+#define SC_INVENTORY_VERSION 1
+
+#define SC_INVENTORY_RECORD_READER         1  // name, ATR
+#define SC_INVENTORY_RECORD_READER_DRIVER  2  // id, version, path
+#define SC_INVENTORY_RECORD_TOKEN_DRIVER   3  // id, version, path
+#define SC_INVENTORY_RECORD_TOKEN          4  // name, reader
+#define SC_INVENTORY_RECORD_CERTIFICATE    5  // slot, usage, DER
+#define SC_INVENTORY_RECORD_CTK_DRIVER     6  // id, version, path
+#define SC_INVENTORY_RECORD_KEYCHAIN_TOKEN 7  // name
+#define SC_INVENTORY_RECORD_KEYCHAIN_CERTIFICATE 8  // label, usage, DER
+
+#define SC_INVENTORY_READER_CARD_PRESENT 0x01
+
+// Fields a reader looks at, further ones are skipped
+#define SC_INVENTORY_MAX_FIELDS 4
+
+#pragma pack(push, 1)
+typedef struct ScInventoryHeader {
+   uint32 magic;
+   uint16 version;
+   uint16 reserved;
+   uint32 recordCount;
+} ScInventoryHeader;
+
+typedef struct ScInventoryRecord {
+   uint8 type;          // SC_INVENTORY_RECORD_*
+   uint8 flags;
+   uint16 fieldCount;
+   uint32 length;       // Of the fields
+} ScInventoryRecord;
+#pragma pack(pop)
+
+namespace ScInventory {
+
+struct FieldView {
+   const uint8 *data;
+   uint32 length;
+};
+
+struct RecordView {
+   uint8 type;
+   uint8 flags;
+   uint32 fieldCount;   // Up to SC_INVENTORY_MAX_FIELDS
+   FieldView fields[SC_INVENTORY_MAX_FIELDS];
+};
+
+class BinaryReader
+{
+public:
+   BinaryReader(const uint8 *data, uint32 dataLen);
+
+   Bool Next(RecordView *record);
+   Bool IsValid() const { return m_valid; }
+
+private:
+   const uint8 *m_cur;
+   const uint8 *m_end;
+   uint32 m_recordsLeft;
+   Bool m_valid;
+};
+
+std::string FieldString(const RecordView &record, uint32 field);
+std::vector<uint8> FieldBytes(const RecordView &record, uint32 field);
+
+void ToBinary(const Inventory &inventory, std::vector<uint8> *binary);
+Bool FromBinary(const uint8 *data, uint32 dataLen, Inventory *inventory);
+
+// Negotiation, read from any thread
+void SetPeerBinaryVersion(uint32 version);
+Bool IsBinaryActive();
+
+} // namespace ScInventory
+
+#endif // _SC_INVENTORY_WIRE_H_
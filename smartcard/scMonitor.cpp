@@ -0,0 +1,564 @@
+/* **************************************************************************** *
+ * Copyright (C) 2020 VMware, Inc.  All rights reserved. -- VMware Confidential *
+ * **************************************************************************** */
+
+/*
+ * scMonitor.cpp --
+ *
+ *    Implements the smart card insert/remove monitor.
+ */
+
+#include "scMonitor.h"
+#include "scInventory.h"
+#include "scInventoryWire.h"
+#include "MKSVchanMetrics.h"
+#include "MKSVchanPacketTypeExt.h"
+#include "MKSVchanSendQueue.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <winscard.h>
+#else
+#include <PCSC/winscard.h>
+#include <PCSC/wintypes.h>
+#endif
+
+#ifdef _WIN32
+#define SC_LIST_READERS SCardListReadersA
+#define SC_GET_STATUS_CHANGE SCardGetStatusChangeA
+typedef SCARD_READERSTATEA ScReaderState;
+#else
+#define SC_LIST_READERS SCardListReaders
+#define SC_GET_STATUS_CHANGE SCardGetStatusChange
+typedef SCARD_READERSTATE ScReaderState;
+#endif
+
+#define SC_PNP_READER_NAME "\\\\?PnP?\\Notification"
+
+/*
+ * State bits which don't mean the inventory changed. In-use and exclusive
+ * flip whenever someone, including ScInventory, connects to the card.
+ */
+#define SC_MONITOR_IGNORED_STATES \
+   (SCARD_STATE_CHANGED | SCARD_STATE_INUSE | SCARD_STATE_EXCLUSIVE)
+
+namespace ScMonitor {
+
+typedef std::chrono::steady_clock Clock;
+
+static std::mutex monitorLock;
+static std::condition_variable monitorWake;
+static std::thread monitorThread;
+static Bool running = FALSE;
+static Bool stopRequested = FALSE;
+static Bool contextValid = FALSE;
+static SCARDCONTEXT activeContext;
+
+// Monitor thread only
+static std::string lastSent;
+static InitialCallback initialCallback = NULL;
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * IsStopping --
+ *
+ *    Whether Stop was called.
+ *
+ * Results:
+ *    TRUE if the monitor thread should exit.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static Bool
+IsStopping()
+{
+   std::lock_guard<std::mutex> guard(monitorLock);
+   return stopRequested;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * WaitForStop --
+ *
+ *    Sleep unless Stop is called first.
+ *
+ * Results:
+ *    TRUE if Stop was called.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static Bool
+WaitForStop(uint32 ms) // IN
+{
+   std::unique_lock<std::mutex> guard(monitorLock);
+   return monitorWake.wait_for(guard, std::chrono::milliseconds(ms),
+                               [] { return stopRequested; });
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * SetContext --
+ *
+ *    Publish the context the monitor thread blocks on, so Stop can cancel
+ *    the wait.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+SetContext(Bool valid,            // IN
+           SCARDCONTEXT context)  // IN
+{
+   std::lock_guard<std::mutex> guard(monitorLock);
+   contextValid = valid;
+   activeContext = context;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * IsRelevantChange --
+ *
+ *    Whether a reader state change can change the inventory.
+ *
+ * Results:
+ *    TRUE if anything but the ignored bits changed, including the event
+ *    counter in the upper 16 bits.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static Bool
+IsRelevantChange(DWORD current, // IN
+                 DWORD event)   // IN
+{
+   return (current & ~(DWORD)SC_MONITOR_IGNORED_STATES) !=
+          (event & ~(DWORD)SC_MONITOR_IGNORED_STATES);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * ListReaderNames --
+ *
+ *    Current reader names.
+ *
+ * Results:
+ *    FALSE if PC/SC failed. No readers is not a failure.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static Bool
+ListReaderNames(SCARDCONTEXT context,             // IN
+                std::vector<std::string> *names)  // OUT
+{
+   DWORD namesLen = 0;
+
+   names->clear();
+   LONG rv = SC_LIST_READERS(context, NULL, NULL, &namesLen);
+   if (rv == SCARD_S_SUCCESS && namesLen > 0) {
+      std::vector<char> buf(namesLen);
+      rv = SC_LIST_READERS(context, NULL, &buf[0], &namesLen);
+      for (const char *name = &buf[0];
+           rv == SCARD_S_SUCCESS && name < &buf[0] + namesLen &&
+           *name != '\0';
+           name += strlen(name) + 1) {
+         names->push_back(name);
+      }
+   }
+   return rv == SCARD_S_SUCCESS || rv == SCARD_E_NO_READERS_AVAILABLE;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * SendIfChanged --
+ *
+ *    Collect the inventory and post it unless it is what was sent last.
+ *
+ * Results:
+ *    FALSE if the post failed and should be retried.
+ *
+ * Side effects:
+ *    Posts SmartCardInfo to MKSVchanSendQueue.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static Bool
+SendIfChanged(uint32 events,                 // IN
+              Clock::time_point firstEvent)  // IN
+{
+   std::string inventory;
+   std::vector<uint8> binary;
+   if (!ScInventory::CollectJson(&inventory, &binary)) {
+      return TRUE;
+   }
+
+   uint32 latencyMS = (uint32)std::chrono::duration_cast<
+      std::chrono::milliseconds>(Clock::now() - firstEvent).count();
+   if (inventory == lastSent) {
+      Log("%s: %u reader events, inventory unchanged.\n", __FUNCTION__,
+          events);
+      return TRUE;
+   }
+
+   Bool posted;
+   uint32 sentLen;
+   if (ScInventory::IsBinaryActive() && !binary.empty()) {
+      sentLen = (uint32)binary.size();
+      posted = MKSVchanSendQueue::Post(MKSVchanPacketType_SmartCardInfo_Binary,
+                                       &binary[0], sentLen,
+                                       MKSVCHAN_CLIPBOARD_ERROR_NONE);
+   } else {
+      // Sent as a C string, like MKSVchan_SendSmartCardInfo
+      sentLen = (uint32)inventory.length() + 1;
+      posted = MKSVchanSendQueue::Post(MKSVchanPacketType_SmartCardInfo,
+                                       reinterpret_cast<const uint8 *>(
+                                          inventory.c_str()),
+                                       sentLen,
+                                       MKSVCHAN_CLIPBOARD_ERROR_NONE);
+   }
+   if (!posted) {
+      return FALSE;
+   }
+
+   lastSent.swap(inventory);
+   MKSVchanMetrics::MarkSmartCardInventory();
+   Log("%s: %u reader events, sent %u bytes of smart card info %ums after "
+       "the first.\n", __FUNCTION__, events, sentLen, latencyMS);
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * SendInitial --
+ *
+ *    Collect the initial inventory and hand it to the Start callback.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Whatever the callback does. Later inventories are compared with this
+ *    one.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+SendInitial()
+{
+   Clock::time_point start = Clock::now();
+   std::string inventory;
+   std::vector<uint8> binary;
+   if (!ScInventory::CollectJson(&inventory, &binary)) {
+      Log("%s: No initial smart card inventory.\n", __FUNCTION__);
+      return;
+   }
+
+   Log("%s: Collected %u bytes of smart card info in %ums.\n", __FUNCTION__,
+       (uint32)inventory.length(),
+       (uint32)std::chrono::duration_cast<std::chrono::milliseconds>(
+          Clock::now() - start).count());
+   initialCallback(inventory, binary);
+   lastSent.swap(inventory);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MonitorMain --
+ *
+ *    Send the initial inventory, then wait for reader and card events
+ *    until Stop.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    See SendInitial and SendIfChanged.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+MonitorMain()
+{
+   SCARDCONTEXT context = 0;
+   Bool haveContext = FALSE;
+   Bool pnpSupported = TRUE;
+   Bool relist = TRUE;
+   std::vector<std::string> names;
+   std::vector<ScReaderState> states;
+   std::map<std::string, DWORD> known;    // Last state per reader name
+
+   Bool debouncing = FALSE;
+   Clock::time_point deadline;
+   Clock::time_point firstEvent;
+   uint32 events = 0;
+
+   SendInitial();
+
+   while (!IsStopping()) {
+      if (!haveContext) {
+         LONG rv = SCardEstablishContext(SCARD_SCOPE_USER, NULL, NULL,
+                                         &context);
+         if (rv != SCARD_S_SUCCESS) {
+            Log("%s: SCardEstablishContext failed, 0x%08lx.\n", __FUNCTION__,
+                (unsigned long)rv);
+            WaitForStop(SC_MONITOR_RETRY_MS);
+            continue;
+         }
+         haveContext = TRUE;
+         relist = TRUE;
+         SetContext(TRUE, context);
+
+         ScReaderState probe;
+         memset(&probe, 0, sizeof probe);
+         probe.szReader = SC_PNP_READER_NAME;
+         probe.dwCurrentState = SCARD_STATE_UNAWARE;
+         rv = SC_GET_STATUS_CHANGE(context, 0, &probe, 1);
+         pnpSupported = rv != SCARD_E_UNKNOWN_READER &&
+                        (probe.dwEventState & SCARD_STATE_UNKNOWN) == 0;
+         if (!pnpSupported) {
+            Log("%s: No reader hotplug notification, listing readers every "
+                "%ums.\n", __FUNCTION__, SC_MONITOR_RETRY_MS);
+         }
+      }
+
+      if (relist) {
+         if (!ListReaderNames(context, &names)) {
+            names.clear();
+         }
+         /*
+          * Readers keep their last state, so a change while relisting is
+          * still seen. The pseudo reader starts from the current reader
+          * count in the upper 16 bits, which is all it compares.
+          */
+         if (pnpSupported) {
+            known.insert(std::make_pair(std::string(SC_PNP_READER_NAME),
+                                        (DWORD)names.size() << 16));
+            names.push_back(SC_PNP_READER_NAME);
+         }
+         std::map<std::string, DWORD> previous;
+         previous.swap(known);
+         states.clear();
+         for (size_t i = 0; i < names.size(); i++) {
+            ScReaderState state;
+            memset(&state, 0, sizeof state);
+            std::map<std::string, DWORD>::iterator it =
+               previous.find(names[i]);
+            state.dwCurrentState =
+               it != previous.end() ? it->second : SCARD_STATE_UNAWARE;
+            known[names[i]] = state.dwCurrentState;
+            states.push_back(state);
+         }
+         for (size_t i = 0; i < states.size(); i++) {
+            states[i].szReader = names[i].c_str();
+         }
+         relist = FALSE;
+      }
+
+      DWORD timeout = pnpSupported ? INFINITE : SC_MONITOR_RETRY_MS;
+      if (debouncing) {
+         Clock::time_point now = Clock::now();
+         timeout = now >= deadline ? 0 :
+            (DWORD)std::chrono::duration_cast<std::chrono::milliseconds>(
+               deadline - now).count();
+      }
+
+      LONG rv = SCARD_E_TIMEOUT;
+      if (states.empty()) {
+         WaitForStop(timeout);
+      } else {
+         rv = SC_GET_STATUS_CHANGE(context, timeout, &states[0],
+                                   (DWORD)states.size());
+      }
+
+      Bool changed = FALSE;
+      if (rv == SCARD_S_SUCCESS) {
+         for (size_t i = 0; i < states.size(); i++) {
+            DWORD current = states[i].dwCurrentState;
+            DWORD event = states[i].dwEventState;
+            // A reader's first state is the baseline, not an event
+            if ((current != SCARD_STATE_UNAWARE ||
+                 names[i] == SC_PNP_READER_NAME) &&
+                IsRelevantChange(current, event)) {
+               changed = TRUE;
+               if (names[i] == SC_PNP_READER_NAME) {
+                  relist = TRUE;
+               }
+            }
+            states[i].dwCurrentState = event & ~(DWORD)SCARD_STATE_CHANGED;
+            known[names[i]] = states[i].dwCurrentState;
+         }
+      } else if (rv == SCARD_E_TIMEOUT) {
+         if (!pnpSupported && !debouncing) {
+            std::vector<std::string> current;
+            if (ListReaderNames(context, &current) &&
+                current != names) {
+               changed = TRUE;
+               relist = TRUE;
+            }
+         }
+      } else if (rv == SCARD_E_CANCELLED) {
+         continue;
+      } else if (rv == SCARD_E_UNKNOWN_READER) {
+         // A reader went away between listing and waiting
+         changed = TRUE;
+         relist = TRUE;
+      } else {
+         Log("%s: SCardGetStatusChange failed, 0x%08lx.\n", __FUNCTION__,
+             (unsigned long)rv);
+         SetContext(FALSE, 0);
+         SCardReleaseContext(context);
+         haveContext = FALSE;
+         changed = TRUE;
+         WaitForStop(SC_MONITOR_DEBOUNCE_MS);
+      }
+
+      if (changed) {
+         if (!debouncing) {
+            firstEvent = Clock::now();
+            events = 0;
+         }
+         events++;
+         debouncing = TRUE;
+         deadline = Clock::now() +
+                    std::chrono::milliseconds(SC_MONITOR_DEBOUNCE_MS);
+      } else if (debouncing && Clock::now() >= deadline) {
+         debouncing = !SendIfChanged(events, firstEvent);
+         if (debouncing) {
+            deadline = Clock::now() +
+                       std::chrono::milliseconds(SC_MONITOR_DEBOUNCE_MS);
+         }
+      }
+   }
+
+   if (haveContext) {
+      SetContext(FALSE, 0);
+      SCardReleaseContext(context);
+   }
+
+   std::lock_guard<std::mutex> guard(monitorLock);
+   running = FALSE;
+   monitorWake.notify_all();
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * ScMonitor::Start --
+ *
+ *    Start monitoring. The monitor thread first collects the initial
+ *    inventory and passes it to sendInitial.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Starts the monitor thread.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+Start(InitialCallback sendInitial) // IN
+{
+   Stop();
+
+   lastSent.clear();
+   initialCallback = sendInitial;
+   std::lock_guard<std::mutex> guard(monitorLock);
+   running = TRUE;
+   monitorThread = std::thread(MonitorMain);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * ScMonitor::Stop --
+ *
+ *    Stop monitoring, e.g. in OnNotReady.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Cancels the blocking SCardGetStatusChange and joins the thread.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+Stop()
+{
+   {
+      std::unique_lock<std::mutex> guard(monitorLock);
+      stopRequested = TRUE;
+      monitorWake.notify_all();
+
+      /*
+       * SCardCancel only ends a wait that is already in progress, so keep
+       * cancelling until the thread noticed.
+       */
+      while (running) {
+         if (contextValid) {
+            SCardCancel(activeContext);
+         }
+         monitorWake.wait_for(guard, std::chrono::milliseconds(50));
+      }
+   }
+
+   if (monitorThread.joinable()) {
+      monitorThread.join();
+   }
+
+   std::lock_guard<std::mutex> guard(monitorLock);
+   stopRequested = FALSE;
+}
+
+} // namespace ScMonitor
@@ -0,0 +1,51 @@
+/* **************************************************************************** *
+ * Copyright (C) 2020 VMware, Inc.  All rights reserved. -- VMware Confidential *
+ * **************************************************************************** */
+
+/*
+ * scMonitor.h --
+ *
+ *    Client side monitor which collects the initial smart card inventory
+ *    and sends it again when a card or reader comes or goes.
+ *
+ *    Collecting reads every token's certificates and can take long, so
+ *    the initial inventory is collected on the monitor thread as well and
+ *    handed to the callback given to Start, which sends it; OnReady
+ *    doesn't wait for PC/SC.
+ *
+ *    A thread blocks in SCardGetStatusChange on every reader plus the
+ *    "\\?PnP?\Notification" pseudo reader, so it costs nothing while
+ *    nothing happens. A change starts a debounce period; once no further
+ *    change came in for SC_MONITOR_DEBOUNCE_MS the inventory is collected
+ *    and posted to MKSVchanSendQueue, but only if it differs from the last
+ *    one sent, in the binary format if the agent offered it. The in-use
+ *    bits are ignored, so the inventory's own card connections don't
+ *    trigger another round.
+ */
+
+#ifndef _SC_MONITOR_H_
+#define _SC_MONITOR_H_
+
+#include "MKSVchanRPCPlugin.h"
+
+#include <string>
+#include <vector>
+
+#define SC_MONITOR_DEBOUNCE_MS 500
+
+// Wait before retrying while the PC/SC service is unavailable
+#define SC_MONITOR_RETRY_MS 5000
+
+namespace ScMonitor {
+
+// Called on the monitor thread with the initial inventory
+typedef void (*InitialCallback)(const std::string &json,
+                                const std::vector<uint8> &binary);
+
+// vdpservice thread
+void Start(InitialCallback sendInitial);
+void Stop();
+
+} // namespace ScMonitor
+
+#endif // _SC_MONITOR_H_
@@ -14,7 +14,9 @@
 #include <stdio.h>
 #include <windows.h>
 #include <json/json.h>
+#include <chrono>
 #include <fstream>
+#include <functional>
 #include <iostream>
 
 using namespace std;
@@ -24,6 +26,36 @@ using namespace std;
 #define RESULT_SUCCESS 0
 #define RESULT_FAILURE -1
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * TimeTest --
+ *
+ *     Run one test case and log how long it took
+ *
+ * Results:
+ *     The result of the test case.
+ *
+ * Side Effects:
+ *     None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+TimeTest(const char *name,                  // IN
+         const std::function<bool()> &test) // IN
+{
+   std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+   bool result = test();
+   long long elapsedMS = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start).count();
+   LOG("%s: %s in %lldms", name, result ? "passed" : "failed", elapsedMS);
+   return result;
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -45,22 +77,37 @@ bool
 TestAll(const char *pin) // IN
 {
    bool result = true;
+   std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
    LOG("============Import Certificates To MY Store============");
-   result = ImportCertificatesToMYStore() && result;
+   result = TimeTest("ImportCertificatesToMYStore",
+                     ImportCertificatesToMYStore) && result;
    LOG("============Display All Certificates In MY Store============");
-   result = DisplayAllCertificatesInMyStore() && result;
+   result = TimeTest("DisplayAllCertificatesInMyStore",
+                     DisplayAllCertificatesInMyStore) && result;
    LOG("=============================================================");
    LOG("============Retrieve smart card keys============");
-   result = RetrieveCertificatesFromSmartCard() && result;
+   result = TimeTest("RetrieveCertificatesFromSmartCard",
+                     RetrieveCertificatesFromSmartCard) && result;
    LOG("=============================================================");
    LOG("============Sign test data with smart card's private key=======");
-   result = SignWithSmartCard(pin) && result;
+   result = TimeTest("SignWithSmartCard",
+                     [pin]() { return SignWithSmartCard(pin); }) && result;
    LOG("============Crypt and decrypt test data with smart card========");
-   result = EncryptAndDecryptWithSmartCard(pin) && result;
+   result = TimeTest("EncryptAndDecryptWithSmartCard",
+                     [pin]() { return EncryptAndDecryptWithSmartCard(pin); })
+            && result;
    LOG("=============================================================");
    LOG("===================Display smart card's ATR====================");
-   std::string atr = GetCardATR();
-   result = (atr.length() > 1) && result;
+   std::string atr;
+   result = TimeTest("GetCardATR",
+                     [&atr]() {
+                        atr = GetCardATR();
+                        return atr.length() > 1;
+                     }) && result;
+   LOG("All tests took %lldms.",
+       (long long)std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::steady_clock::now() - start).count());
    if (result) {
       LOG("Run all tests successfully.");
    } else {
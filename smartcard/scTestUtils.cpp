@@ -16,6 +16,7 @@
 #include <memory>
 #include <stdio.h>
 #include <sstream>
+#include <string>
 #include <tchar.h>
 #include <thread>
 #include <vector>
@@ -116,6 +117,292 @@ CheckReturnCode(char *PCSCAPIDesc, //IN
 }
 
 
+/*
+ * Every test used to establish its own context, list the readers and
+ * connect to the card, which TestAll then repeated for each test. The
+ * context, the reader list and a shared handle per reader are kept per
+ * thread instead, so concurrent test threads never share a context. The
+ * readers are listed again when one of them goes away.
+ */
+class SmartCardConnections
+{
+public:
+   SmartCardConnections();
+   ~SmartCardConnections();
+
+   bool GetContext(SCARDCONTEXT *context);
+   std::vector<SCARD_READERSTATE> GetReaders();
+   LONG GetCard(LPCTSTR reader, SCARDHANDLE *card, DWORD *protocol);
+
+private:
+   struct Card {
+      std::basic_string<TCHAR> reader;
+      SCARDHANDLE handle;
+      DWORD protocol;
+   };
+
+   void ReleaseReaders();
+
+   SCARDCONTEXT m_context;
+   bool m_hasContext;
+   LPTSTR m_readerBuf;
+   std::vector<SCARD_READERSTATE> m_readers;
+   std::vector<Card> m_cards;
+};
+
+static thread_local SmartCardConnections connections;
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SmartCardConnections::SmartCardConnections --
+ *
+ *     Constructor. Nothing is established until first use.
+ *
+ * Results:
+ *     None.
+ *
+ * Side Effects:
+ *     None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+SmartCardConnections::SmartCardConnections()
+   : m_context(0),
+     m_hasContext(false),
+     m_readerBuf(NULL)
+{
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SmartCardConnections::~SmartCardConnections --
+ *
+ *     Destructor, runs when the thread exits.
+ *
+ * Results:
+ *     None.
+ *
+ * Side Effects:
+ *     Disconnects the cards and releases the context.
+ *
+ *----------------------------------------------------------------------
+ */
+
+SmartCardConnections::~SmartCardConnections()
+{
+   ReleaseReaders();
+   if (m_hasContext) {
+      SCardReleaseContext(m_context);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SmartCardConnections::ReleaseReaders --
+ *
+ *     Forget the reader list and disconnect the cards.
+ *
+ * Results:
+ *     None.
+ *
+ * Side Effects:
+ *     None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void
+SmartCardConnections::ReleaseReaders()
+{
+   for (size_t i = 0; i < m_cards.size(); i++) {
+      SCardDisconnect(m_cards[i].handle, SCARD_LEAVE_CARD);
+   }
+   m_cards.clear();
+   m_readers.clear();
+   if (m_readerBuf) {
+      SCardFreeMemory(m_context, m_readerBuf);
+      m_readerBuf = NULL;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SmartCardConnections::GetContext --
+ *
+ *     Get the thread's context, establishing it again if the smart card
+ *     service dropped it.
+ *
+ * Results:
+ *     true: context is valid.
+ *     false: Otherwise
+ *
+ * Side Effects:
+ *     None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+bool
+SmartCardConnections::GetContext(SCARDCONTEXT *context) // OUT
+{
+   if (m_hasContext && SCardIsValidContext(m_context) == SCARD_S_SUCCESS) {
+      *context = m_context;
+      return true;
+   }
+
+   if (m_hasContext) {
+      LOG("Smart card context is no longer valid, establishing it again.");
+      ReleaseReaders();
+      SCardReleaseContext(m_context);
+      m_hasContext = false;
+   }
+
+   LONG result = SCARD_S_SUCCESS;
+   for (int retry = 0; retry < ESTABLISH_CONTEXT_RETRY_COUNT; retry++) {
+      result = SCardEstablishContext(SCARD_SCOPE_USER,
+                                     NULL,
+                                     NULL,
+                                     &m_context);
+      if (result == SCARD_S_SUCCESS) {
+         m_hasContext = true;
+         *context = m_context;
+         return true;
+      }
+   }
+   LOG_ERROR("SCardEstablishContext: %s", PCSCStringifyError(result));
+   return false;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SmartCardConnections::GetReaders --
+ *
+ *     Get the readers and their current state. The list is kept and only
+ *     the state is queried again, unless a reader went away.
+ *
+ * Results:
+ *     The reader states, valid until the next call on this thread.
+ *
+ * Side Effects:
+ *     Disconnects the cards if the readers are listed again.
+ *
+ *----------------------------------------------------------------------
+ */
+
+std::vector<SCARD_READERSTATE>
+SmartCardConnections::GetReaders()
+{
+   if (!m_readers.empty()) {
+      for (size_t i = 0; i < m_readers.size(); i++) {
+         m_readers[i].dwCurrentState = SCARD_STATE_UNAWARE;
+      }
+      LONG result = SCardGetStatusChange(m_context,
+                                         0,
+                                         &m_readers[0],
+                                         (DWORD)m_readers.size());
+      bool relist = result != SCARD_S_SUCCESS;
+      for (size_t i = 0; !relist && i < m_readers.size(); i++) {
+         relist = (m_readers[i].dwEventState & SCARD_STATE_UNKNOWN) != 0;
+         m_readers[i].dwCurrentState = m_readers[i].dwEventState;
+      }
+      if (!relist) {
+         return m_readers;
+      }
+      LOG("Smart card readers changed, listing them again.");
+      ReleaseReaders();
+   }
+
+   m_readers = GetReaderInfo(m_context, &m_readerBuf);
+   return m_readers;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SmartCardConnections::GetCard --
+ *
+ *     Get a shared handle to the card in reader. A kept handle is checked
+ *     with SCardStatus first: after SCARD_W_RESET_CARD it is reconnected,
+ *     after SCARD_W_REMOVED_CARD or any other error it is replaced.
+ *
+ * Results:
+ *     The result of SCardStatus, SCardReconnect or SCardConnect.
+ *
+ * Side Effects:
+ *     Connects to the card.
+ *
+ *----------------------------------------------------------------------
+ */
+
+LONG
+SmartCardConnections::GetCard(LPCTSTR reader,     // IN
+                              SCARDHANDLE *card,  // OUT
+                              DWORD *protocol)    // OUT
+{
+   for (size_t i = 0; i < m_cards.size(); i++) {
+      if (m_cards[i].reader != reader) {
+         continue;
+      }
+
+      DWORD readerLen = 0;
+      DWORD state = 0;
+      DWORD atrLen = 0;
+      LONG result = SCardStatus(m_cards[i].handle,
+                                NULL,
+                                &readerLen,
+                                &state,
+                                &m_cards[i].protocol,
+                                NULL,
+                                &atrLen);
+      if (result == SCARD_W_RESET_CARD) {
+         LOG("Card in %S was reset, reconnecting.", reader);
+         result = SCardReconnect(m_cards[i].handle,
+                                 SCARD_SHARE_SHARED,
+                                 SCARD_PROTOCOL_T0|SCARD_PROTOCOL_T1,
+                                 SCARD_LEAVE_CARD,
+                                 &m_cards[i].protocol);
+      }
+      if (result == SCARD_S_SUCCESS) {
+         *card = m_cards[i].handle;
+         *protocol = m_cards[i].protocol;
+         return result;
+      }
+
+      LOG("Card in %S is gone: %s", reader, PCSCStringifyError(result));
+      SCardDisconnect(m_cards[i].handle, SCARD_LEAVE_CARD);
+      m_cards.erase(m_cards.begin() + i);
+      break;
+   }
+
+   Card entry;
+   LONG result = SCardConnect(m_context,
+                              reader,
+                              SCARD_SHARE_SHARED,
+                              SCARD_PROTOCOL_T0|SCARD_PROTOCOL_T1,
+                              &entry.handle,
+                              &entry.protocol);
+   if (result == SCARD_S_SUCCESS) {
+      entry.reader = reader;
+      m_cards.push_back(entry);
+      *card = entry.handle;
+      *protocol = entry.protocol;
+   }
+   return result;
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -144,7 +431,6 @@ EncryptAndDecryptWithSmartCard(std::string pin) // IN
    SCARDCONTEXT context = NULL;
    LONG result = 0;
    DWORD readerLen = SCARD_AUTOALLOCATE;
-   LPTSTR readerBuf = NULL;
    bool returnResult = false;
    const size_t bufferLen = MAX_PATH + 11;
    WCHAR defaultContainer[bufferLen];
@@ -159,17 +445,12 @@ EncryptAndDecryptWithSmartCard(std::string pin) // IN
 
    LOG("Encrypt and decrypt with smart card...");
 
-   result = SCardEstablishContext(SCARD_SCOPE_USER,
-                                 NULL,
-                                 NULL,
-                                 &hContext);
-   if (result != SCARD_S_SUCCESS) {
+   if (!connections.GetContext(&hContext)) {
       LOG_ERROR("Fail to establish context.");
       return false;
    }
 
-   std::vector<SCARD_READERSTATE> rgscState =
-      GetReaderInfo(hContext, &readerBuf);
+   std::vector<SCARD_READERSTATE> rgscState = connections.GetReaders();
    if (rgscState.size() < 1) {
       LOG_ERROR("Fail to get reader. \n");
       goto CLEAN_UP;
@@ -275,10 +556,6 @@ EncryptAndDecryptWithSmartCard(std::string pin) // IN
    }
 
 CLEAN_UP:
-   if (readerBuf) {
-      SCardFreeMemory(hContext, readerBuf);
-      readerBuf = NULL;
-   }
    if (szCSPName) {
       SCardFreeMemory(hContext, szCSPName);
       szCSPName= NULL;
@@ -287,7 +564,6 @@ CLEAN_UP:
       CryptReleaseContext(hProv, 0);
       hProv = NULL;
    }
-   SCardReleaseContext(hContext);
 
    return returnResult;
 }
@@ -322,7 +598,6 @@ SignWithSmartCard(std::string pin) // IN
    SCARDCONTEXT hContext = NULL;
    LONG result = 0;
    DWORD readerLen = SCARD_AUTOALLOCATE;
-   LPTSTR readerBuf = NULL;
    bool signResult = false;
    const size_t bufferLen = MAX_PATH + 11;
    WCHAR defaultContainer[bufferLen];
@@ -331,17 +606,12 @@ SignWithSmartCard(std::string pin) // IN
 
    LOG("Sign with smart card...");
 
-   result = SCardEstablishContext(SCARD_SCOPE_USER,
-                                  NULL,
-                                  NULL,
-                                  &hContext);
-   if (result != SCARD_S_SUCCESS) {
+   if (!connections.GetContext(&hContext)) {
       LOG_ERROR("Fail to establish context.");
       return false;
    }
 
-   std::vector<SCARD_READERSTATE> rgscState =
-      GetReaderInfo(hContext, &readerBuf);
+   std::vector<SCARD_READERSTATE> rgscState = connections.GetReaders();
    if (rgscState.size() < 1) {
       LOG_ERROR("Fail to get reader. \n");
       goto CLEAN_UP;
@@ -450,10 +720,6 @@ SignWithSmartCard(std::string pin) // IN
    }
 
 CLEAN_UP:
-   if (readerBuf) {
-      SCardFreeMemory(hContext, readerBuf);
-      readerBuf = NULL;
-   }
    if (szCSPName) {
       SCardFreeMemory(hContext, szCSPName);
       szCSPName= NULL;
@@ -462,7 +728,6 @@ CLEAN_UP:
       CryptReleaseContext(hProv, 0);
       hProv = NULL;
    }
-   SCardReleaseContext(hContext);
 
    return signResult;
 }
@@ -870,7 +1135,6 @@ GetCardATR()
    LPBYTE pbAttr = NULL;
    DWORD attrLen = 0;
    DWORD readerLen = SCARD_AUTOALLOCATE;
-   LPTSTR readerBuf = NULL;
    LONG lReturn = -1;
    dwAutoAllocate = SCARD_AUTOALLOCATE;
    SCARDHANDLE hCard = NULL;
@@ -878,59 +1142,50 @@ GetCardATR()
    std::stringstream ss;
    std::string atr;
 
-   lReturn = SCardEstablishContext(SCARD_SCOPE_USER,
-                                   NULL,
-                                   NULL,
-                                   &hContext);
-   if (lReturn != SCARD_S_SUCCESS) {
+   if (!connections.GetContext(&hContext)) {
       LOG_ERROR("Fail to establish context.");
-      return false;
+      return atr;
    }
 
-   std::vector<SCARD_READERSTATE> rgscState =
-      GetReaderInfo(hContext, &readerBuf);
+   std::vector<SCARD_READERSTATE> rgscState = connections.GetReaders();
    if (rgscState.size() < 1) {
       LOG_ERROR("Fail to get reader. \n");
       return atr;
    }
 
-   // Retrieve the card name, so we can know what CSP the reader uses.
-   lReturn = SCardConnect(hContext,
-                          rgscState[0].szReader,
-                          SCARD_SHARE_SHARED,
-                          SCARD_PROTOCOL_T0|SCARD_PROTOCOL_T1,
-                          &hCard,
-                          &dwActiveProtocol);
-   if (lReturn != SCARD_S_SUCCESS) {
-      LOG_ERROR("Fail to call SCardConnect, error: %d", GetLastError());
-      goto CLEAN_UP;
-   } else {
+   // GetCard revalidates a handle whose card was reset or swapped meanwhile
+   for (int attempt = 0; attempt < 2; attempt++) {
+      lReturn = connections.GetCard(rgscState[0].szReader,
+                                    &hCard,
+                                    &dwActiveProtocol);
+      if (lReturn != SCARD_S_SUCCESS) {
+         LOG_ERROR("Fail to call SCardConnect, error: %d", GetLastError());
+         return atr;
+      }
+
       attrLen = SCARD_AUTOALLOCATE;
       lReturn = SCardGetAttrib(hCard,
                                SCARD_ATTR_ATR_STRING,
                                (LPBYTE)&pbAttr,
                                &attrLen);
-      LOG("ATR Length: %d\n", attrLen);
-      if (lReturn != SCARD_S_SUCCESS) {
-         LOG_ERROR("Fail to call SCardGetAttrib");
-         goto CLEAN_UP;
-      } else {
-         ss << std::hex;
-         for (int i = 0; i < (int)attrLen; ++i) {
-            ss << std::setw(2) << std::setfill('0') << (int)*(pbAttr+i);
-         }
-         atr = ss.str();
-         LOG("ATR: %s", atr.c_str());
-         LOG("Get ATR successfully.");
+      if (lReturn != SCARD_W_RESET_CARD && lReturn != SCARD_W_REMOVED_CARD) {
+         break;
       }
-      SCardFreeMemory(hContext, pbAttr);
    }
 
-CLEAN_UP:
-   if (hCard) {
-      SCardDisconnect(hCard, SCARD_LEAVE_CARD);
+   LOG("ATR Length: %d\n", attrLen);
+   if (lReturn != SCARD_S_SUCCESS) {
+      LOG_ERROR("Fail to call SCardGetAttrib");
+   } else {
+      ss << std::hex;
+      for (int i = 0; i < (int)attrLen; ++i) {
+         ss << std::setw(2) << std::setfill('0') << (int)*(pbAttr+i);
+      }
+      atr = ss.str();
+      LOG("ATR: %s", atr.c_str());
+      LOG("Get ATR successfully.");
+      SCardFreeMemory(hContext, pbAttr);
    }
-   SCardReleaseContext(hContext);
 
    return atr;
 }
@@ -1156,8 +1411,6 @@ PerformAPDUTest()
 {
    long lReturn = -1;
    SCARDCONTEXT hContext = NULL;
-   int retryCount = 0;
-   LPTSTR readerBuf = NULL;
    SCARDHANDLE hCard = 0;
    DWORD dwActiveProtocol;
    // Select file identifier command
@@ -1167,24 +1420,16 @@ PerformAPDUTest()
    DWORD dwRecvLength = sizeof(pbRecvBuffer);
    const SCARD_IO_REQUEST *pioSendPci;
    bool isSuccess = false;
+   bool inTransaction = false;
    bool result = false;
 
    LOG("Perform APDU Test...");
-   do {
-      lReturn = SCardEstablishContext(SCARD_SCOPE_USER,
-                                      NULL,
-                                      NULL,
-                                      &hContext);
-   } while (SCARD_S_SUCCESS != lReturn &&
-            retryCount < ESTABLISH_CONTEXT_RETRY_COUNT);
-
-   if (lReturn != SCARD_S_SUCCESS) {
+   if (!connections.GetContext(&hContext)) {
       LOG_ERROR("Fail to establish context.");
       return false;
    }
 
-   std::vector<SCARD_READERSTATE> rgscStateLst =
-      GetReaderInfo(hContext, &readerBuf);
+   std::vector<SCARD_READERSTATE> rgscStateLst = connections.GetReaders();
    if (rgscStateLst.size() < 1) {
       LOG_ERROR("Fail to get reader.");
       goto CLEAN_UP;
@@ -1198,13 +1443,24 @@ PerformAPDUTest()
          continue;
       }
 
-      lReturn = SCardConnect(hContext,
-                             rgscStateLst[i].szReader,
-                             SCARD_SHARE_SHARED,
-                             SCARD_PROTOCOL_T0|SCARD_PROTOCOL_T1,
-                             &hCard,
-                             &dwActiveProtocol);
-      if (!CheckReturnCode("SCardConnect", lReturn)) {
+      // GetCard revalidates a handle whose card was reset or swapped meanwhile
+      for (int attempt = 0; attempt < 2 && !inTransaction; attempt++) {
+         lReturn = connections.GetCard(rgscStateLst[i].szReader,
+                                       &hCard,
+                                       &dwActiveProtocol);
+         if (!CheckReturnCode("SCardConnect", lReturn)) {
+            goto CLEAN_UP;
+         }
+
+         // Begin transaction
+         lReturn = SCardBeginTransaction(hCard);
+         inTransaction = lReturn == SCARD_S_SUCCESS;
+         if (lReturn != SCARD_W_RESET_CARD &&
+             lReturn != SCARD_W_REMOVED_CARD) {
+            break;
+         }
+      }
+      if (!CheckReturnCode("SCardBeginTransaction", lReturn)) {
          goto CLEAN_UP;
       }
 
@@ -1220,12 +1476,6 @@ PerformAPDUTest()
             goto CLEAN_UP;
       }
 
-      // Begin transaction
-      lReturn = SCardBeginTransaction(hCard);
-      if (!CheckReturnCode("SCardBeginTransaction", lReturn)) {
-         goto CLEAN_UP;
-      }
-
       //Send APDU command
       for (DWORD i=0; i < dwSendLength; i++) {
          printf("%02X ", pbSendBuffer[i]);
@@ -1247,8 +1497,7 @@ PerformAPDUTest()
       }
 
       SCardEndTransaction(hCard, SCARD_LEAVE_CARD);
-      SCardDisconnect(hCard, SCARD_LEAVE_CARD);
-      hCard = 0;
+      inTransaction = false;
 
       result = true;
       LOG("%S: Can operate with Smart Card successfully.", rgscStateLst[i].szReader);
@@ -1256,9 +1505,8 @@ PerformAPDUTest()
    }
 
 CLEAN_UP:
-   if (hCard) {
+   if (inTransaction) {
       SCardEndTransaction(hCard, SCARD_LEAVE_CARD);
-      SCardDisconnect(hCard, SCARD_LEAVE_CARD);
    }
 
    return result;
@@ -1340,7 +1588,6 @@ VerifySmartCard(std::string pin,   // IN
    SCARDCONTEXT hContext = NULL;
    LONG result = 0;
    DWORD readerLen = SCARD_AUTOALLOCATE;
-   LPTSTR readerBuf = NULL;
    bool signResult = false;
    const size_t bufferLen = MAX_PATH + 11;
    WCHAR defaultContainer[bufferLen];
@@ -1352,17 +1599,12 @@ VerifySmartCard(std::string pin,   // IN
 
    LOG("Check smart card...");
 
-   result = SCardEstablishContext(SCARD_SCOPE_USER,
-      NULL,
-      NULL,
-      &hContext);
-   if (result != SCARD_S_SUCCESS) {
+   if (!connections.GetContext(&hContext)) {
       LOG_ERROR("Fail to establish context.");
       return false;
    }
 
-   std::vector<SCARD_READERSTATE> rgscState =
-      GetReaderInfo(hContext, &readerBuf);
+   std::vector<SCARD_READERSTATE> rgscState = connections.GetReaders();
    if (rgscState.size() < 1) {
       LOG_ERROR("Fail to get reader. \n");
       healthInfo["HealthStatus"] = "None";
@@ -1486,10 +1728,6 @@ VerifySmartCard(std::string pin,   // IN
 CLEAN_UP:
    root["AgentHealthChecking"] = healthInfo;
    root["AgentSmartCardStatus"] = scInfo;
-   if (readerBuf) {
-      SCardFreeMemory(hContext, readerBuf);
-      readerBuf = NULL;
-   }
    if (szCSPName) {
       SCardFreeMemory(hContext, szCSPName);
       szCSPName = NULL;
@@ -1498,7 +1736,6 @@ CLEAN_UP:
       CryptReleaseContext(hProv, 0);
       hProv = NULL;
    }
-   SCardReleaseContext(hContext);
 
    return signResult;
 }
@@ -0,0 +1,404 @@
+/* **************************************************************************** *
+ * Copyright (C) 2020 VMware, Inc.  All rights reserved. -- VMware Confidential *
+ * **************************************************************************** */
+
+/*
+ * MKSVchanAsyncSendTest.cpp --
+ *
+ *    Behaviour test of MKSVchanAsync: coroutines suspend in co_await until
+ *    the plugin reports OnDone/OnAbort for their request, and are resumed
+ *    by RunPending in the order the completions arrive. A packet SendMessage
+ *    queues in MKSVchanSendQueue, or skips because the peer has it, keeps
+ *    its send waiting until it is sent and done, dropped or skipped.
+ *
+ *    Links MKSVchanAsyncSend.cpp with MKSVchanSendQueue.cpp and what that
+ *    needs. MKSVchanRPCPlugin::SendMessage is replaced by FakeChannel
+ *    below, which hands out request ids the way the real one does, defers
+ *    packets the way it does, and lets the test decide when each one
+ *    completes. Needs C++20 coroutines; returns non-zero if a check fails.
+ */
+
+#include "MKSVchanAsyncSend.h"
+#include "MKSVchanSendQueue.h"
+
+#include <stdio.h>
+#include <vector>
+
+MKSVCHAN_CLIPBOARD_ERROR g_clipboardError = MKSVCHAN_CLIPBOARD_ERROR_NONE;
+
+#if defined(MKSVCHAN_HAVE_COROUTINES)
+
+static int failures = 0;
+
+#define CHECK(cond)                                                     \
+   do {                                                                 \
+      if (!(cond)) {                                                    \
+         fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__,         \
+                 __LINE__, #cond);                                      \
+         failures++;                                                    \
+      }                                                                 \
+   } while (0)
+
+namespace FakeChannel {
+
+uint32 nextRequestId = 1;
+Bool failNextSend = FALSE;
+Bool overBudget = FALSE;        // Queue sends, as over the budget
+Bool skipNextSend = FALSE;      // The peer has the next packet cached
+std::vector<uint32> requests;   // Ids of tracked sends, in send order
+std::vector<uint32> skipped;    // Tickets of skipped sends
+
+} // namespace FakeChannel
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanRPCPlugin::SendMessage --
+ *
+ *    Fake of the plugin send: payloads get a request id and are reported
+ *    through OnRequestQueued, empty packets are not tracked. Over budget
+ *    and outside of Drain a payload is queued, and a skipped one is
+ *    remembered for CompleteDeferred, both under a Defer() ticket.
+ *
+ * Results:
+ *    FALSE if the test asked for a failure or the queue is full, TRUE
+ *    otherwise.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+MKSVchanRPCPlugin::SendMessage(MKSVchanPacketType packetType, // IN
+                               uint8 *data,                   // IN
+                               uint32 dataLen)                // IN
+{
+   if (FakeChannel::failNextSend) {
+      FakeChannel::failNextSend = FALSE;
+      return FALSE;
+   }
+   if (dataLen == 0) {
+      return TRUE;
+   }
+   if (FakeChannel::overBudget && !MKSVchanSendQueue::IsDraining()) {
+      uint32 asyncTicket = MKSVchanAsync::Defer();
+      if (!MKSVchanSendQueue::PostDeferred(packetType, data, dataLen,
+                                           MKSVCHAN_CLIPBOARD_ERROR_NONE,
+                                           asyncTicket)) {
+         MKSVchanAsync::CompleteDeferred(asyncTicket, FALSE);
+         return FALSE;
+      }
+      return TRUE;
+   }
+   if (FakeChannel::skipNextSend) {
+      FakeChannel::skipNextSend = FALSE;
+      FakeChannel::skipped.push_back(MKSVchanAsync::Defer());
+      return TRUE;
+   }
+
+   uint32 reqId = FakeChannel::nextRequestId++;
+   FakeChannel::requests.push_back(reqId);
+   MKSVchanAsync::OnRequestQueued(reqId);
+   return TRUE;
+}
+
+
+/*
+ * Only SendMessage is called on the plugin, and the fake doesn't touch the
+ * object, so the tests don't need a connected instance.
+ */
+static MKSVchanRPCPlugin *const plugin =
+   reinterpret_cast<MKSVchanRPCPlugin *>(&FakeChannel::nextRequestId);
+
+static uint8 payload[16];
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * SendWindow --
+ *
+ *    Producer under test: starts count sends, then awaits them in order
+ *    and records the result of each await.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Appends to results, sets *finished when the coroutine returns.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static MKSVchanAsync::Task
+SendWindow(int count,                  // IN
+           std::vector<int> *results,  // OUT
+           Bool *finished)             // OUT
+{
+   std::vector<MKSVchanAsync::SendOp> window;
+   for (int i = 0; i < count; i++) {
+      window.push_back(MKSVchanAsync::Send(plugin,
+                                           MKSVchanPacketType_ClipboardData_Text,
+                                           payload, sizeof payload));
+   }
+   for (size_t i = 0; i < window.size(); i++) {
+      results->push_back(co_await window[i] ? 1 : 0);
+   }
+   *finished = TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * SendChain --
+ *
+ *    Producer which only sends the next packet once the previous one is
+ *    done, so every send after the first is made from RunPending.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Counts completed sends in *done.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static MKSVchanAsync::Task
+SendChain(int count, // IN
+          int *done) // OUT
+{
+   for (int i = 0; i < count; i++) {
+      if (!co_await MKSVchanAsync::Send(plugin,
+                                        MKSVchanPacketType_ClipboardData_Text,
+                                        payload, sizeof payload)) {
+         co_return;
+      }
+      (*done)++;
+   }
+}
+
+
+static void
+Reset()
+{
+   MKSVchanSendQueue::Clear();
+   MKSVchanAsync::OnChannelNotReady();
+   MKSVchanAsync::RunPending();
+   FakeChannel::overBudget = FALSE;
+   FakeChannel::requests.clear();
+   FakeChannel::skipped.clear();
+}
+
+
+static void
+TestSuspendsUntilOnDone()
+{
+   std::vector<int> results;
+   Bool finished = FALSE;
+   SendWindow(3, &results, &finished);
+
+   CHECK(FakeChannel::requests.size() == 3);
+   CHECK(results.empty());
+   uint32 first = FakeChannel::requests[0];
+   uint32 second = FakeChannel::requests[1];
+   uint32 third = FakeChannel::requests[2];
+
+   // Out of order completion only resumes once the awaited one is done
+   MKSVchanAsync::OnRequestDone(second);
+   MKSVchanAsync::RunPending();
+   CHECK(results.empty());
+
+   MKSVchanAsync::OnRequestDone(first);
+   CHECK(results.empty());          // Not before RunPending
+   MKSVchanAsync::RunPending();
+   CHECK(results.size() == 2);
+   CHECK(!finished);
+
+   MKSVchanAsync::OnRequestAborted(third);
+   MKSVchanAsync::RunPending();
+   CHECK(finished);
+   CHECK(results.size() == 3 && results[0] == 1 && results[1] == 1 &&
+         results[2] == 0);
+   Reset();
+}
+
+
+static void
+TestImmediateCompletion()
+{
+   Bool result = FALSE;
+   Bool finished = FALSE;
+
+   // A failed SendMessage completes at once with FALSE
+   FakeChannel::failNextSend = TRUE;
+   [](Bool *result, Bool *finished) -> MKSVchanAsync::Task {
+      *result = co_await MKSVchanAsync::Send(plugin,
+                                             MKSVchanPacketType_ClipboardRequest,
+                                             payload, sizeof payload);
+      *finished = TRUE;
+   }(&result, &finished);
+   CHECK(finished && !result);
+
+   // Packets without payload aren't tracked by OnDone
+   finished = FALSE;
+   [](Bool *result, Bool *finished) -> MKSVchanAsync::Task {
+      *result = co_await MKSVchanAsync::Send(plugin,
+                                             MKSVchanPacketType_ClipboardRequest,
+                                             NULL, 0);
+      *finished = TRUE;
+   }(&result, &finished);
+   CHECK(finished && result);
+   CHECK(FakeChannel::requests.empty());
+   Reset();
+}
+
+
+static void
+TestChainedSends()
+{
+   int done = 0;
+   SendChain(4, &done);
+
+   for (int i = 0; i < 4; i++) {
+      CHECK(FakeChannel::requests.size() == (size_t)i + 1);
+      CHECK(done == i);
+      MKSVchanAsync::OnRequestDone(FakeChannel::requests.back());
+      MKSVchanAsync::RunPending();
+   }
+   CHECK(done == 4);
+   CHECK(FakeChannel::requests.size() == 4);
+   Reset();
+}
+
+
+static void
+TestChannelNotReadyFailsPending()
+{
+   std::vector<int> results;
+   Bool finished = FALSE;
+   SendWindow(2, &results, &finished);
+   CHECK(!finished);
+
+   MKSVchanAsync::OnChannelNotReady();
+   MKSVchanAsync::RunPending();
+   CHECK(finished);
+   CHECK(results.size() == 2 && results[0] == 0 && results[1] == 0);
+
+   // Late completions for the dropped requests are ignored
+   MKSVchanAsync::OnRequestDone(FakeChannel::requests[0]);
+   MKSVchanAsync::RunPending();
+   CHECK(results.size() == 2);
+   Reset();
+}
+
+
+static void
+TestQueuedWaitsForOnDone()
+{
+   std::vector<int> results;
+   Bool finished = FALSE;
+
+   FakeChannel::overBudget = TRUE;
+   SendWindow(2, &results, &finished);
+   CHECK(FakeChannel::requests.empty());
+   CHECK(MKSVchanSendQueue::GetDepth() == 2);
+   CHECK(results.empty());
+
+   // Sent by the drain, but not done yet
+   FakeChannel::overBudget = FALSE;
+   MKSVchanSendQueue::Drain(plugin);
+   CHECK(FakeChannel::requests.size() == 2);
+   CHECK(results.empty());
+
+   if (FakeChannel::requests.size() == 2) {
+      MKSVchanAsync::OnRequestDone(FakeChannel::requests[0]);
+      MKSVchanAsync::RunPending();
+      CHECK(results.size() == 1 && results[0] == 1);
+      CHECK(!finished);
+      MKSVchanAsync::OnRequestDone(FakeChannel::requests[1]);
+      MKSVchanAsync::RunPending();
+   }
+   CHECK(finished);
+   CHECK(results.size() == 2 && results[1] == 1);
+   Reset();
+}
+
+
+static void
+TestQueuedFailures()
+{
+   std::vector<int> results;
+   Bool finished = FALSE;
+
+   // Dropped from the queue, e.g. by OnNotReady
+   FakeChannel::overBudget = TRUE;
+   SendWindow(1, &results, &finished);
+   CHECK(!finished);
+   MKSVchanSendQueue::Clear();
+   MKSVchanAsync::RunPending();
+   CHECK(finished && results.size() == 1 && results[0] == 0);
+
+   // The send from the drain fails
+   results.clear();
+   finished = FALSE;
+   SendWindow(1, &results, &finished);
+   FakeChannel::overBudget = FALSE;
+   FakeChannel::failNextSend = TRUE;
+   MKSVchanSendQueue::Drain(plugin);
+   CHECK(finished && results.size() == 1 && results[0] == 0);
+   CHECK(FakeChannel::requests.empty());
+   Reset();
+}
+
+
+static void
+TestSkippedWaitsForCompletion()
+{
+   std::vector<int> results;
+   Bool finished = FALSE;
+
+   FakeChannel::skipNextSend = TRUE;
+   SendWindow(1, &results, &finished);
+   CHECK(FakeChannel::skipped.size() == 1);
+   CHECK(!finished);
+
+   if (FakeChannel::skipped.size() == 1) {
+      MKSVchanAsync::CompleteDeferred(FakeChannel::skipped[0], TRUE);
+   }
+   CHECK(!finished);                // Not before RunPending
+   MKSVchanAsync::RunPending();
+   CHECK(finished && results.size() == 1 && results[0] == 1);
+   Reset();
+}
+
+
+int
+main()
+{
+   TestSuspendsUntilOnDone();
+   TestImmediateCompletion();
+   TestChainedSends();
+   TestChannelNotReadyFailsPending();
+   TestQueuedWaitsForOnDone();
+   TestQueuedFailures();
+   TestSkippedWaitsForCompletion();
+
+   printf("MKSVchanAsyncSendTest: %s\n", failures == 0 ? "passed" : "FAILED");
+   return failures == 0 ? 0 : 1;
+}
+
+#else
+
+int
+main()
+{
+   printf("MKSVchanAsyncSendTest: skipped, no coroutine support\n");
+   return 0;
+}
+
+#endif // MKSVCHAN_HAVE_COROUTINES
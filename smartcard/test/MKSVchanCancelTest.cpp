@@ -0,0 +1,233 @@
+/* **************************************************************************** *
+ * Copyright (C) 2020 VMware, Inc.  All rights reserved. -- VMware Confidential *
+ * **************************************************************************** */
+
+/*
+ * MKSVchanCancelTest.cpp --
+ *
+ *    Behaviour test of MKSVchanCancel with MKSVchanSendQueue and
+ *    MKSVchanBudget. The fake MKSVchanRPCPlugin::SendMessage takes the
+ *    budget steps of the real one, so file chunks over the in-flight limit
+ *    are queued, and OnDone releases a sent chunk, drains and checks for
+ *    quiescence like the plugin's OnDone.
+ *
+ *    Posts file chunks until some are in flight and some queued, cancels,
+ *    and checks that the queued chunks are dropped rather than sent, that
+ *    received file data is discarded until the next copy begins, and that
+ *    the statistics report the drops and a latency which covers the wait
+ *    for the chunks in flight. Returns non-zero if a check fails.
+ */
+
+#include "MKSVchanCancel.h"
+#include "MKSVchanPacketTypeExt.h"
+#include "MKSVchanSendBudget.h"
+#include "MKSVchanSendQueue.h"
+
+#include <chrono>
+#include <deque>
+#include <stdio.h>
+#include <thread>
+#include <vector>
+
+#define TEST_CHUNK_SIZE 1000
+#define TEST_WINDOW 8                  // Chunks in flight at the limit
+#define TEST_DONE_DELAY_MS 50
+
+MKSVCHAN_CLIPBOARD_ERROR g_clipboardError = MKSVCHAN_CLIPBOARD_ERROR_NONE;
+
+static int failures = 0;
+
+#define CHECK(cond)                                                     \
+   do {                                                                 \
+      if (!(cond)) {                                                    \
+         fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__,         \
+                 __LINE__, #cond);                                      \
+         failures++;                                                    \
+      }                                                                 \
+   } while (0)
+
+static const MKSVchanBudget::PacketClass ftClass =
+   MKSVchanBudget::PacketClass_FileTransfer;
+
+static std::deque<uint32> inFlight;    // Lengths, oldest first
+static std::vector<uint8> sentTags;    // First byte of each sent chunk
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanRPCPlugin::SendMessage --
+ *
+ *    Fake of the plugin send with the real budget steps.
+ *
+ * Results:
+ *    TRUE if the packet was sent or queued.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+MKSVchanRPCPlugin::SendMessage(MKSVchanPacketType packetType, // IN
+                               uint8 *data,                   // IN
+                               uint32 dataLen)                // IN
+{
+   MKSVchanBudget::PacketClass budgetClass =
+      MKSVchanBudget::ClassOf(packetType);
+
+   if (!MKSVchanSendQueue::IsDraining() &&
+       (MKSVchanBudget::GetQueued(budgetClass) > 0 ||
+        MKSVchanBudget::WouldBlock(budgetClass, dataLen))) {
+      return MKSVchanSendQueue::Post(packetType, data, dataLen,
+                                     MKSVCHAN_CLIPBOARD_ERROR_NONE);
+   }
+   if (!MKSVchanBudget::Reserve(budgetClass, dataLen)) {
+      return FALSE;
+   }
+   inFlight.push_back(dataLen);
+   sentTags.push_back(data[0]);
+   return TRUE;
+}
+
+
+static MKSVchanRPCPlugin *const plugin =
+   reinterpret_cast<MKSVchanRPCPlugin *>(&inFlight);
+
+
+static Bool
+SendChunk(uint8 tag) // IN
+{
+   std::vector<uint8> chunk(TEST_CHUNK_SIZE, tag);
+   return plugin->SendMessage(MKSVchanPacketType_FileTransferData_File,
+                              &chunk[0], TEST_CHUNK_SIZE);
+}
+
+
+static void
+OnDone()
+{
+   CHECK(!inFlight.empty());
+   if (inFlight.empty()) {
+      return;
+   }
+   MKSVchanBudget::Release(ftClass, inFlight.front());
+   inFlight.pop_front();
+   MKSVchanSendQueue::Drain(plugin);
+   MKSVchanCancel::CheckQuiescent();
+}
+
+
+static void
+Reset()
+{
+   MKSVchanSendQueue::Clear();
+   MKSVchanBudget::Reset();
+   inFlight.clear();
+   sentTags.clear();
+}
+
+
+static void
+TestCancelDropsQueuedChunks()
+{
+   Reset();
+   MKSVchanCancel::BeginCopy();
+
+   // A window in flight, as many again queued behind it
+   uint8 tag = 0;
+   for (int i = 0; i < 2 * TEST_WINDOW; i++) {
+      CHECK(SendChunk(tag++));
+   }
+   CHECK(sentTags.size() == TEST_WINDOW);
+   CHECK(MKSVchanSendQueue::GetDepth() == TEST_WINDOW);
+
+   // What a producer thread polls per chunk
+   MKSVchanCancel::Token token = MKSVchanCancel::GetToken();
+   CHECK(!MKSVchanCancel::IsCancelled(token));
+
+   std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+   MKSVchanCancel::Cancel(MKSVchanPacketType_FCP_CancelCopy);
+   CHECK(MKSVchanCancel::IsCancelled(token));
+   CHECK(MKSVchanCancel::IsCancelling());
+
+   // Chunks the peer sent before it saw the cancel
+   for (int i = 0; i < 3; i++) {
+      CHECK(MKSVchanCancel::DiscardOnArrival(
+               MKSVchanPacketType_FileTransferData_File));
+   }
+
+   // The queue is dropped on the next drain, nothing new goes out
+   MKSVchanSendQueue::Drain(plugin);
+   MKSVchanCancel::CheckQuiescent();
+   CHECK(MKSVchanSendQueue::GetDepth() == 0);
+   CHECK(MKSVchanBudget::GetQueued(ftClass) == 0);
+   CHECK(sentTags.size() == TEST_WINDOW);
+
+   // Still waiting for the window in flight
+   MKSVchanCancel::Stats stats;
+   CHECK(!MKSVchanCancel::GetLastStats(&stats));
+
+   std::this_thread::sleep_for(std::chrono::milliseconds(TEST_DONE_DELAY_MS));
+   while (!inFlight.empty()) {
+      OnDone();
+   }
+   uint32 elapsedMS = (uint32)std::chrono::duration_cast<
+      std::chrono::milliseconds>(std::chrono::steady_clock::now() -
+                                 start).count();
+   CHECK(sentTags.size() == TEST_WINDOW);
+
+   CHECK(MKSVchanCancel::GetLastStats(&stats));
+   CHECK(stats.droppedPackets == TEST_WINDOW);
+   CHECK(stats.discardedPackets == 3);
+   CHECK(stats.queuedBytes == TEST_WINDOW * TEST_CHUNK_SIZE);
+   CHECK(stats.inFlightBytes == TEST_WINDOW * TEST_CHUNK_SIZE);
+   CHECK(stats.quiesceMS >= TEST_DONE_DELAY_MS);
+   CHECK(stats.quiesceMS <= elapsedMS);
+   printf("Cancel with %u chunks queued and %u in flight: dropped %u, "
+          "discarded %u, quiescent after %ums.\n", TEST_WINDOW, TEST_WINDOW,
+          stats.droppedPackets, stats.discardedPackets, stats.quiesceMS);
+}
+
+
+static void
+TestNextCopyIsNotCancelled()
+{
+   Reset();
+
+   MKSVchanCancel::Token oldToken = MKSVchanCancel::GetToken();
+   MKSVchanCancel::Cancel(MKSVchanPacketType_DnD_CancelCopy);
+   MKSVchanCancel::BeginCopy();
+
+   CHECK(!MKSVchanCancel::IsCancelling());
+   CHECK(MKSVchanCancel::IsCancelled(oldToken));
+   CHECK(!MKSVchanCancel::IsCancelled(MKSVchanCancel::GetToken()));
+   CHECK(!MKSVchanCancel::DiscardOnArrival(
+            MKSVchanPacketType_FileTransferData_Compressed));
+
+   // Chunks of the new copy are sent, also through the queue
+   for (uint8 tag = 0; tag < TEST_WINDOW + 2; tag++) {
+      CHECK(SendChunk(tag));
+   }
+   while (!inFlight.empty()) {
+      OnDone();
+   }
+   CHECK(sentTags.size() == TEST_WINDOW + 2);
+}
+
+
+int
+main()
+{
+   MKSVchanBudget::SetLimit(ftClass, TEST_WINDOW * TEST_CHUNK_SIZE);
+
+   TestCancelDropsQueuedChunks();
+   TestNextCopyIsNotCancelled();
+
+   Reset();
+
+   printf("MKSVchanCancelTest: %s\n", failures == 0 ? "passed" : "FAILED");
+   return failures == 0 ? 0 : 1;
+}
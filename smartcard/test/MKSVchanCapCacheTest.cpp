@@ -0,0 +1,233 @@
+/* **************************************************************************** *
+ * Copyright (C) 2020 VMware, Inc.  All rights reserved. -- VMware Confidential *
+ * **************************************************************************** */
+
+/*
+ * MKSVchanCapCacheTest.cpp --
+ *
+ *    Behaviour test and reconnect report of MKSVchanCapCache. The module
+ *    talks to itself over a loopback wire: the fake
+ *    MKSVchanRPCPlugin::SendMessage makes the ShouldSend call of the real
+ *    one, and delivered packets go through HandleOffer, HandleAck and
+ *    RecordReceived the way OnInvoke does.
+ *
+ *    Checks that policy packets are never applied from the cache and are
+ *    sent every session, and that a changed capability is sent. Prints the
+ *    packets and bytes a reconnect puts on the wire with and without a
+ *    cache hit, and how many packets the receiver had to take before all
+ *    capabilities were applied. Returns non-zero if a check fails.
+ */
+
+#include "MKSVchanCapCache.h"
+
+#include <map>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+static int failures = 0;
+
+#define CHECK(cond)                                                     \
+   do {                                                                 \
+      if (!(cond)) {                                                    \
+         fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__,         \
+                 __LINE__, #cond);                                      \
+         failures++;                                                    \
+      }                                                                 \
+   } while (0)
+
+struct WirePacket {
+   MKSVchanPacketType packetType;
+   std::vector<uint8> data;
+};
+
+struct SessionStats {
+   uint32 packets;
+   uint32 bytes;
+   uint32 skipped;
+   uint32 receivedWhenApplied;   // Packets taken until both caps applied
+};
+
+static std::vector<WirePacket> wire;
+static SessionStats stats;
+static uint32 received;
+static std::map<uint32, uint32> applied;        // Type to value
+static std::map<uint32, uint32> appliedCached;  // Type to count
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanRPCPlugin::SendMessage --
+ *
+ *    Fake of the plugin send, with the cache check of the real one.
+ *
+ * Results:
+ *    TRUE.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+MKSVchanRPCPlugin::SendMessage(MKSVchanPacketType packetType, // IN
+                               uint8 *data,                   // IN
+                               uint32 dataLen)                // IN
+{
+   if (!MKSVchanCapCache::ShouldSend(packetType, data, dataLen)) {
+      stats.skipped++;
+      return TRUE;
+   }
+
+   WirePacket packet;
+   packet.packetType = packetType;
+   packet.data.assign(data, data + dataLen);
+   wire.push_back(packet);
+   stats.packets++;
+   stats.bytes += dataLen;
+   return TRUE;
+}
+
+
+static MKSVchanRPCPlugin *const plugin =
+   reinterpret_cast<MKSVchanRPCPlugin *>(&wire);
+
+
+static void
+Apply(MKSVchanPacketType packetType, // IN
+      const uint8 *data,             // IN
+      uint32 dataLen)                // IN
+{
+   uint32 value = 0;
+   memcpy(&value, data, dataLen < sizeof value ? dataLen : sizeof value);
+   applied[packetType] = value;
+   if (stats.receivedWhenApplied == 0 &&
+       applied.count(MKSVchanPacketType_Clipboard_Locale) != 0 &&
+       applied.count(MKSVchanPacketType_Clipboard_Capabilities) != 0) {
+      stats.receivedWhenApplied = received;
+   }
+}
+
+
+static void
+ApplyCached(MKSVchanPacketType packetType, // IN
+            const uint8 *data,             // IN
+            uint32 dataLen)                // IN
+{
+   appliedCached[packetType]++;
+   Apply(packetType, data, dataLen);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * Deliver --
+ *
+ *    The receiver's OnInvoke for everything on the wire, including what it
+ *    sends back, until the wire is empty.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+Deliver()
+{
+   while (!wire.empty()) {
+      WirePacket packet = wire.front();
+      wire.erase(wire.begin());
+      received++;
+      const uint8 *data = packet.data.empty() ? NULL : &packet.data[0];
+      uint32 dataLen = (uint32)packet.data.size();
+
+      switch ((uint32)packet.packetType) {
+         case MKSVchanPacketType_CapCache_Offer:
+            MKSVchanCapCache::HandleOffer(plugin, data, dataLen, ApplyCached);
+            break;
+         case MKSVchanPacketType_CapCache_Ack:
+            MKSVchanCapCache::HandleAck(data, dataLen);
+            break;
+         default:
+            MKSVchanCapCache::RecordReceived(packet.packetType, data, dataLen);
+            Apply(packet.packetType, data, dataLen);
+      }
+   }
+}
+
+
+static void
+Produce(MKSVchanPacketType packetType, // IN
+        uint32 value)                  // IN
+{
+   plugin->SendMessage(packetType, reinterpret_cast<uint8 *>(&value),
+                       sizeof value);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * RunSession --
+ *
+ *    OnReady, the handshake, then the capability and policy packets the
+ *    plugin produces every session, then OnNotReady.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static SessionStats
+RunSession(uint32 clipboardState) // IN
+{
+   memset(&stats, 0, sizeof stats);
+   received = 0;
+   applied.clear();
+   appliedCached.clear();
+
+   MKSVchanCapCache::OnChannelReady();
+   MKSVchanCapCache::SendOffer(plugin);
+   Deliver();
+   Produce(MKSVchanPacketType_Clipboard_Locale, 0x0409);
+   Produce(MKSVchanPacketType_Clipboard_Capabilities, 0x1f);
+   Produce(MKSVchanPacketType_ClipboardState, clipboardState);
+   Produce(MKSVchanPacketType_FileTransfer_Config, 1);
+   Deliver();
+   MKSVchanCapCache::OnChannelNotReady();
+   return stats;
+}
+
+
+int
+main()
+{
+   SessionStats first = RunSession(0);
+   CHECK(first.skipped == 0);
+   CHECK(appliedCached.empty());
+
+   // Same peer, policy changed while disconnected
+   SessionStats second = RunSession(3);
+   CHECK(second.skipped == 2);
+   CHECK(appliedCached.count(MKSVchanPacketType_Clipboard_Locale) == 1);
+   CHECK(appliedCached.count(MKSVchanPacketType_Clipboard_Capabilities) == 1);
+   CHECK(appliedCached.count(MKSVchanPacketType_ClipboardState) == 0);
+   CHECK(appliedCached.count(MKSVchanPacketType_FileTransfer_Config) == 0);
+   CHECK(applied[MKSVchanPacketType_ClipboardState] == 3);
+   CHECK(applied.count(MKSVchanPacketType_FileTransfer_Config) == 1);
+
+   // Policy packets go out every session, even unchanged
+   SessionStats third = RunSession(3);
+   CHECK(third.skipped == 2);
+   CHECK(appliedCached.count(MKSVchanPacketType_ClipboardState) == 0);
+   CHECK(applied[MKSVchanPacketType_ClipboardState] == 3);
+
+   printf("%-12s %8s %6s %8s %22s\n", "session", "packets", "bytes",
+          "skipped", "received until applied");
+   printf("%-12s %8u %6u %8u %22u\n", "first", first.packets, first.bytes,
+          first.skipped, first.receivedWhenApplied);
+   printf("%-12s %8u %6u %8u %22u\n", "reconnect", second.packets,
+          second.bytes, second.skipped, second.receivedWhenApplied);
+
+   printf("MKSVchanCapCacheTest: %s\n", failures == 0 ? "passed" : "FAILED");
+   return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,378 @@
+/* **************************************************************************** *
+ * Copyright (C) 2020 VMware, Inc.  All rights reserved. -- VMware Confidential *
+ * **************************************************************************** */
+
+/*
+ * MKSVchanProgressTest.cpp --
+ *
+ *    Behaviour test and packet count report of MKSVchanProgress.
+ *
+ *    The sender side runs a simulated copy which reports progress every
+ *    few hundred microseconds, like the DnD/FCP copy code does per chunk,
+ *    and counts the packets that reach MKSVchanRPCPlugin::SendMessage
+ *    through MKSVchanSendQueue. A consumer thread stands in for the
+ *    vdpservice thread, as in MKSVchanSendQueueBench.cpp.
+ *
+ *    Checks that the last value of a copy always arrives, before CopyDone
+ *    when FlushPending is used, and that a received value held back by
+ *    ShouldDeliver is delivered through the held ready callback without
+ *    another update. Returns non-zero if a check fails.
+ */
+
+#include "MKSVchanProgress.h"
+#include "MKSVchanSendQueue.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <stdio.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#define TEST_COPY_MS 1500
+#define TEST_UPDATE_US 300
+
+typedef std::chrono::steady_clock Clock;
+
+MKSVCHAN_CLIPBOARD_ERROR g_clipboardError = MKSVCHAN_CLIPBOARD_ERROR_NONE;
+
+static int failures = 0;
+
+#define CHECK(cond)                                                     \
+   do {                                                                 \
+      if (!(cond)) {                                                    \
+         fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__,         \
+                 __LINE__, #cond);                                      \
+         failures++;                                                    \
+      }                                                                 \
+   } while (0)
+
+struct SentPacket {
+   MKSVchanPacketType packetType;
+   uint32 value;
+};
+
+static std::mutex sentLock;
+static std::vector<SentPacket> sent;
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanRPCPlugin::SendMessage --
+ *
+ *    Fake of the plugin send, records the packets drained from the queue.
+ *
+ * Results:
+ *    TRUE.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+MKSVchanRPCPlugin::SendMessage(MKSVchanPacketType packetType, // IN
+                               uint8 *data,                   // IN
+                               uint32 dataLen)                // IN
+{
+   SentPacket packet = { packetType, 0 };
+   if (dataLen == sizeof packet.value) {
+      memcpy(&packet.value, data, sizeof packet.value);
+   }
+   std::lock_guard<std::mutex> guard(sentLock);
+   sent.push_back(packet);
+   return TRUE;
+}
+
+
+static MKSVchanRPCPlugin *const plugin =
+   reinterpret_cast<MKSVchanRPCPlugin *>(&sent);
+
+
+/*
+ * The vdpservice thread: runs queued tasks in order.
+ */
+namespace ChannelThread {
+
+std::mutex lock;
+std::condition_variable wake;
+std::deque<void (*)(void *)> tasks;
+Bool stop = FALSE;
+
+
+void
+Queue(void (*task)(void *)) // IN
+{
+   std::lock_guard<std::mutex> guard(lock);
+   tasks.push_back(task);
+   wake.notify_one();
+}
+
+
+void
+Main()
+{
+   std::unique_lock<std::mutex> guard(lock);
+   while (!stop || !tasks.empty()) {
+      if (tasks.empty()) {
+         wake.wait(guard);
+         continue;
+      }
+      void (*task)(void *) = tasks.front();
+      tasks.pop_front();
+      guard.unlock();
+      task(NULL);
+      guard.lock();
+   }
+}
+
+} // namespace ChannelThread
+
+
+static void
+DrainPostedPackets(void *ctx) // IN: unused
+{
+   MKSVchanSendQueue::Drain(plugin);
+}
+
+
+static void
+WakeChannelThread(void *ctx) // IN: unused
+{
+   ChannelThread::Queue(DrainPostedPackets);
+}
+
+
+/*
+ * Receiver side: values the "handler" got through the held ready path.
+ */
+static std::atomic<uint32> heldDelivered(0);
+static std::atomic<uint32> heldLastValue(0);
+
+
+static void
+DeliverHeldProgress(void *ctx) // IN: unused
+{
+   uint32 value;
+   if (MKSVchanProgress::TakePending(MKSVchanPacketType_FCP_CopyProgress,
+                                     &value)) {
+      heldLastValue.store(value);
+      heldDelivered.fetch_add(1);
+   }
+}
+
+
+static void
+OnHeldProgressReady(void *ctx) // IN: unused
+{
+   ChannelThread::Queue(DeliverHeldProgress);
+}
+
+
+static std::vector<SentPacket>
+TakeSent()
+{
+   std::lock_guard<std::mutex> guard(sentLock);
+   std::vector<SentPacket> packets;
+   packets.swap(sent);
+   return packets;
+}
+
+
+static void
+WaitMS(uint32 ms) // IN
+{
+   std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * TestSenderCoalescing --
+ *
+ *    A copy reporting every TEST_UPDATE_US for TEST_COPY_MS, then the
+ *    final value. Prints how many packets went out.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+TestSenderCoalescing()
+{
+   MKSVchanPacketType type = MKSVchanPacketType_DnD_CopyProgress;
+   uint64 submitted = 0;
+   Clock::time_point start = Clock::now();
+   Clock::time_point end = start + std::chrono::milliseconds(TEST_COPY_MS);
+
+   for (Clock::time_point now = start; now < end; now = Clock::now()) {
+      uint32 value = (uint32)(99 * (now - start) / (end - start));
+      CHECK(MKSVchanProgress::Submit(type, value));
+      submitted++;
+      std::this_thread::sleep_for(std::chrono::microseconds(TEST_UPDATE_US));
+   }
+   CHECK(MKSVchanProgress::Submit(type, MKSVCHAN_PROGRESS_DONE));
+   submitted++;
+   WaitMS(50);
+
+   std::vector<SentPacket> packets = TakeSent();
+   CHECK(!packets.empty());
+   CHECK(!packets.empty() &&
+         packets.back().value == MKSVCHAN_PROGRESS_DONE);
+   // One per interval, plus the first and the final value
+   CHECK(packets.size() <=
+         TEST_COPY_MS / MKSVCHAN_PROGRESS_INTERVAL_MS + 3);
+   for (size_t i = 1; i < packets.size(); i++) {
+      CHECK(packets[i].value >= packets[i - 1].value);
+   }
+
+   printf("Sender: %llu updates in %d ms, %u packets sent "
+          "(%.1f%% fewer)\n", (unsigned long long)submitted, TEST_COPY_MS,
+          (uint32)packets.size(),
+          100.0 * (submitted - packets.size()) / submitted);
+   MKSVchanProgress::LogStats(type);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * TestSenderTrailingValue --
+ *
+ *    A burst of updates, then silence: the flusher sends the last one.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+TestSenderTrailingValue()
+{
+   MKSVchanPacketType type = MKSVchanPacketType_FCP_CopyProgress;
+
+   for (uint32 value = 1; value <= 50; value++) {
+      CHECK(MKSVchanProgress::Submit(type, value));
+   }
+   WaitMS(MKSVCHAN_PROGRESS_INTERVAL_MS * 2);
+
+   std::vector<SentPacket> packets = TakeSent();
+   CHECK(packets.size() == 2);
+   CHECK(!packets.empty() && packets.front().value == 1);
+   CHECK(!packets.empty() && packets.back().value == 50);
+   MKSVchanProgress::LogStats(type);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * TestFlushBeforeCopyDone --
+ *
+ *    The held value is posted by FlushPending and reaches the channel
+ *    before a CopyDone posted after it.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+TestFlushBeforeCopyDone()
+{
+   MKSVchanPacketType type = MKSVchanPacketType_DnD_CopyProgress;
+   uint32 done = 0;
+
+   CHECK(MKSVchanProgress::Submit(type, 10));
+   CHECK(MKSVchanProgress::Submit(type, 20));
+   CHECK(MKSVchanProgress::FlushPending(type));
+   CHECK(MKSVchanSendQueue::Post(MKSVchanPacketType_DnD_CopyDone,
+                                 reinterpret_cast<uint8 *>(&done),
+                                 sizeof done, MKSVCHAN_CLIPBOARD_ERROR_NONE));
+   WaitMS(MKSVCHAN_PROGRESS_INTERVAL_MS * 2);
+
+   std::vector<SentPacket> packets = TakeSent();
+   CHECK(packets.size() == 3);
+   if (packets.size() == 3) {
+      CHECK(packets[0].packetType == type && packets[0].value == 10);
+      CHECK(packets[1].packetType == type && packets[1].value == 20);
+      CHECK(packets[2].packetType == MKSVchanPacketType_DnD_CopyDone);
+   }
+   MKSVchanProgress::LogStats(type);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * TestReceiverTimedFlush --
+ *
+ *    A peer which doesn't coalesce floods updates and then goes quiet.
+ *    The held back value is delivered once its interval is over, without
+ *    waiting for CopyDone.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+TestReceiverTimedFlush()
+{
+   MKSVchanPacketType type = MKSVchanPacketType_FCP_CopyProgress;
+   uint32 delivered = 0;
+   uint32 received = 0;
+
+   MKSVchanProgress::SetHeldReadyCallback(OnHeldProgressReady, NULL);
+   for (uint32 value = 1; value <= 30; value++) {
+      received++;
+      if (MKSVchanProgress::ShouldDeliver(type, value)) {
+         delivered++;
+      }
+   }
+   CHECK(delivered == 1);
+
+   Clock::time_point start = Clock::now();
+   while (heldDelivered.load() == 0 &&
+          Clock::now() - start < std::chrono::seconds(1)) {
+      WaitMS(1);
+   }
+   uint32 waitedMS = (uint32)std::chrono::duration_cast<
+      std::chrono::milliseconds>(Clock::now() - start).count();
+   CHECK(heldDelivered.load() == 1);
+   CHECK(heldLastValue.load() == 30);
+   CHECK(waitedMS <= MKSVCHAN_PROGRESS_INTERVAL_MS * 2);
+
+   // Nothing left for CopyDone
+   uint32 value;
+   CHECK(!MKSVchanProgress::TakePending(type, &value));
+
+   printf("Receiver: %u updates, %u delivered at once, last one %u ms "
+          "later by the timed flush\n", received, delivered, waitedMS);
+   MKSVchanProgress::SetHeldReadyCallback(NULL, NULL);
+   MKSVchanProgress::LogStats(type);
+}
+
+
+int
+main()
+{
+   std::thread channelThread(ChannelThread::Main);
+   MKSVchanSendQueue::SetWakeCallback(WakeChannelThread, NULL);
+
+   TestSenderCoalescing();
+   TestSenderTrailingValue();
+   TestFlushBeforeCopyDone();
+   TestReceiverTimedFlush();
+
+   MKSVchanProgress::Stop();
+   MKSVchanSendQueue::SetWakeCallback(NULL, NULL);
+   {
+      std::lock_guard<std::mutex> guard(ChannelThread::lock);
+      ChannelThread::stop = TRUE;
+      ChannelThread::wake.notify_one();
+   }
+   channelThread.join();
+
+   printf("MKSVchanProgressTest: %s\n", failures == 0 ? "passed" : "FAILED");
+   return failures == 0 ? 0 : 1;
+}
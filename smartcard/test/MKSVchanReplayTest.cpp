@@ -0,0 +1,203 @@
+/* **************************************************************************** *
+ * Copyright (C) 2020 VMware, Inc.  All rights reserved. -- VMware Confidential *
+ * **************************************************************************** */
+
+/*
+ * MKSVchanReplayTest.cpp --
+ *
+ *    Behaviour test of MKSVchanReplay across a channel drop. The fake
+ *    MKSVchanRPCPlugin::SendMessage calls Produced, Prepare and Sent the
+ *    way the plugin does and records what goes on the wire, and the
+ *    receiver side unwraps it with Unwrap.
+ *
+ *    Checks that a kept clipboard is replayed with its sequence number and
+ *    applied once, and that a newer clipboard of another format produced
+ *    after the reconnect is not overwritten by the replay. Returns
+ *    non-zero if a check fails.
+ */
+
+#include "MKSVchanReplay.h"
+
+#include <stdio.h>
+#include <string>
+#include <string.h>
+#include <vector>
+
+MKSVCHAN_CLIPBOARD_ERROR g_clipboardError = MKSVCHAN_CLIPBOARD_ERROR_NONE;
+
+static int failures = 0;
+
+#define CHECK(cond)                                                     \
+   do {                                                                 \
+      if (!(cond)) {                                                    \
+         fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__,         \
+                 __LINE__, #cond);                                      \
+         failures++;                                                    \
+      }                                                                 \
+   } while (0)
+
+struct WirePacket {
+   MKSVchanPacketType packetType;
+   std::vector<uint8> data;
+   uint32 requestId;
+};
+
+static std::vector<WirePacket> wire;
+static uint32 nextRequestId = 1;
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanRPCPlugin::SendMessage --
+ *
+ *    Fake of the plugin send, with the replay calls of the real one.
+ *
+ * Results:
+ *    TRUE.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+MKSVchanRPCPlugin::SendMessage(MKSVchanPacketType packetType, // IN
+                               uint8 *data,                   // IN
+                               uint32 dataLen)                // IN
+{
+   MKSVchanReplay::Produced(packetType);
+
+   WirePacket packet;
+   packet.packetType = packetType;
+   packet.requestId = nextRequestId++;
+   MKSVchanPayloadBuffer wrapped;
+   if (MKSVchanReplay::Prepare(packetType, data, dataLen, &wrapped)) {
+      packet.packetType = MKSVchanPacketType_Replay_Data;
+      packet.data.assign(wrapped.Data(), wrapped.Data() + wrapped.Size());
+      MKSVchanReplay::Sent(packet.requestId);
+   } else {
+      packet.data.assign(data, data + dataLen);
+   }
+   wire.push_back(packet);
+   return TRUE;
+}
+
+
+static MKSVchanRPCPlugin *const plugin =
+   reinterpret_cast<MKSVchanRPCPlugin *>(&wire);
+
+
+static void
+PeerOffers()
+{
+   MKSVchanReplayOffer offer;
+   offer.version = MKSVCHAN_REPLAY_VERSION;
+   offer.streamId = 1;
+   MKSVchanReplay::HandleOffer(plugin, reinterpret_cast<uint8 *>(&offer),
+                               sizeof offer);
+}
+
+
+static void
+SendClipboard(MKSVchanPacketType packetType, // IN
+              const char *text)              // IN
+{
+   std::string data(text);
+   plugin->SendMessage(packetType, reinterpret_cast<uint8 *>(&data[0]),
+                       (uint32)data.size());
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * Deliver --
+ *
+ *    The receiver's side of the wire: clipboard data it would apply.
+ *
+ * Results:
+ *    The payloads applied, in order.
+ *
+ * Side effects:
+ *    Empties the wire.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static std::vector<std::string>
+Deliver()
+{
+   std::vector<std::string> applied;
+   for (size_t i = 0; i < wire.size(); i++) {
+      const WirePacket &packet = wire[i];
+      MKSVchanPacketType packetType = packet.packetType;
+      const uint8 *payload = packet.data.empty() ? NULL : &packet.data[0];
+      uint32 payloadLen = (uint32)packet.data.size();
+      if (packetType == MKSVchanPacketType_Replay_Data &&
+          !MKSVchanReplay::Unwrap(&packet.data[0], payloadLen, &packetType,
+                                  &payload, &payloadLen)) {
+         continue;
+      }
+      if (MKSVchanReplay::IsReplayable(packetType)) {
+         applied.push_back(std::string(
+            reinterpret_cast<const char *>(payload), payloadLen));
+      }
+   }
+   wire.clear();
+   return applied;
+}
+
+
+static void
+TestReplayedOnce()
+{
+   PeerOffers();
+   wire.clear();
+
+   SendClipboard(MKSVchanPacketType_ClipboardData_Text, "A");
+   std::vector<WirePacket> beforeDrop = wire;
+   MKSVchanReplay::OnChannelNotReady();
+   MKSVchanReplay::OnChannelReady();
+   MKSVchanReplay::SendOffer(plugin);
+   PeerOffers();
+
+   // The packet did arrive before the drop, its replay is a duplicate
+   wire.insert(wire.begin(), beforeDrop.begin(), beforeDrop.end());
+   std::vector<std::string> applied = Deliver();
+   CHECK(applied.size() == 1);
+   CHECK(!applied.empty() && applied[0] == "A");
+}
+
+
+static void
+TestNewerClipboardNotOverwritten()
+{
+   SendClipboard(MKSVchanPacketType_ClipboardData_Text, "old");
+   MKSVchanReplay::OnChannelNotReady();
+   wire.clear();
+
+   // A copy made after OnReady, before the peer's offer arrives
+   MKSVchanReplay::OnChannelReady();
+   MKSVchanReplay::SendOffer(plugin);
+   SendClipboard(MKSVchanPacketType_ClipboardData_CPClipboard, "new");
+   PeerOffers();
+
+   std::vector<std::string> applied = Deliver();
+   CHECK(!applied.empty() && applied.back() == "new");
+   for (size_t i = 0; i < applied.size(); i++) {
+      CHECK(applied[i] != "old");
+   }
+}
+
+
+int
+main()
+{
+   TestReplayedOnce();
+   TestNewerClipboardNotOverwritten();
+
+   printf("MKSVchanReplayTest: %s\n", failures == 0 ? "passed" : "FAILED");
+   return failures == 0 ? 0 : 1;
+}
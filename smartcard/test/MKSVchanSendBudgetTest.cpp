@@ -0,0 +1,242 @@
+/* **************************************************************************** *
+ * Copyright (C) 2020 VMware, Inc.  All rights reserved. -- VMware Confidential *
+ * **************************************************************************** */
+
+/*
+ * MKSVchanSendBudgetTest.cpp --
+ *
+ *    Behaviour test of MKSVchanBudget with MKSVchanSendQueue. The fake
+ *    MKSVchanRPCPlugin::SendMessage takes the same budget steps as the
+ *    real one: outside of Drain a packet over the in-flight limit, or
+ *    behind queued packets of its class, is posted; otherwise it is
+ *    reserved and recorded as sent. OnDone releases a sent packet and
+ *    drains, as the plugin's OnDone does.
+ *
+ *    Checks that an over-budget send is queued and sent, in order, once
+ *    an earlier packet is done; that only a full queue refuses a packet;
+ *    and that a refused packet and a producer told by IsWritable that the
+ *    class is backed up both get the readiness callback once enough
+ *    bytes are done. Returns non-zero if a check fails.
+ */
+
+#include "MKSVchanSendBudget.h"
+#include "MKSVchanSendQueue.h"
+
+#include <deque>
+#include <stdio.h>
+#include <vector>
+
+#define TEST_LIMIT 1000
+
+MKSVCHAN_CLIPBOARD_ERROR g_clipboardError = MKSVCHAN_CLIPBOARD_ERROR_NONE;
+
+static int failures = 0;
+
+#define CHECK(cond)                                                     \
+   do {                                                                 \
+      if (!(cond)) {                                                    \
+         fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__,         \
+                 __LINE__, #cond);                                      \
+         failures++;                                                    \
+      }                                                                 \
+   } while (0)
+
+static const MKSVchanBudget::PacketClass testClass =
+   MKSVchanBudget::PacketClass_Clipboard;
+
+static std::deque<uint32> inFlight;        // Lengths, oldest first
+static std::vector<uint8> sentTags;        // First byte of each sent packet
+static std::vector<MKSVchanBudget::PacketClass> readyClasses;
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanRPCPlugin::SendMessage --
+ *
+ *    Fake of the plugin send with the real budget steps.
+ *
+ * Results:
+ *    TRUE if the packet was sent or queued.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+MKSVchanRPCPlugin::SendMessage(MKSVchanPacketType packetType, // IN
+                               uint8 *data,                   // IN
+                               uint32 dataLen)                // IN
+{
+   MKSVchanBudget::PacketClass budgetClass =
+      MKSVchanBudget::ClassOf(packetType);
+
+   if (!MKSVchanSendQueue::IsDraining() &&
+       (MKSVchanBudget::GetQueued(budgetClass) > 0 ||
+        MKSVchanBudget::WouldBlock(budgetClass, dataLen))) {
+      return MKSVchanSendQueue::Post(packetType, data, dataLen,
+                                     MKSVCHAN_CLIPBOARD_ERROR_NONE);
+   }
+   if (!MKSVchanBudget::Reserve(budgetClass, dataLen)) {
+      return FALSE;
+   }
+   inFlight.push_back(dataLen);
+   sentTags.push_back(data[0]);
+   return TRUE;
+}
+
+
+static MKSVchanRPCPlugin *const plugin =
+   reinterpret_cast<MKSVchanRPCPlugin *>(&inFlight);
+
+
+static Bool
+Send(uint8 tag,   // IN
+     uint32 len)  // IN
+{
+   std::vector<uint8> payload(len, tag);
+   return plugin->SendMessage(MKSVchanPacketType_ClipboardData_Text,
+                              &payload[0], len);
+}
+
+
+static void
+OnDone()
+{
+   CHECK(!inFlight.empty());
+   if (inFlight.empty()) {
+      return;
+   }
+   MKSVchanBudget::Release(testClass, inFlight.front());
+   inFlight.pop_front();
+   MKSVchanSendQueue::Drain(plugin);
+}
+
+
+static void
+OnBudgetReady(MKSVchanBudget::PacketClass packetClass, // IN
+              void *ctx)                               // IN: unused
+{
+   readyClasses.push_back(packetClass);
+}
+
+
+static void
+Reset()
+{
+   MKSVchanSendQueue::Clear();
+   MKSVchanBudget::Reset();
+   inFlight.clear();
+   sentTags.clear();
+   readyClasses.clear();
+}
+
+
+static void
+TestQueuedThenDrained()
+{
+   Reset();
+
+   CHECK(Send('A', 800));
+   CHECK(sentTags.size() == 1);
+
+   // Over the in-flight limit: queued, not refused
+   CHECK(MKSVchanBudget::WouldBlock(testClass, 300));
+   CHECK(Send('B', 300));
+   CHECK(MKSVchanBudget::GetQueued(testClass) == 300);
+
+   // Fits, but goes behind B
+   CHECK(Send('C', 100));
+   CHECK(MKSVchanBudget::GetQueued(testClass) == 400);
+   CHECK(sentTags.size() == 1);
+
+   // Nothing goes out while A holds the budget
+   MKSVchanSendQueue::Drain(plugin);
+   CHECK(sentTags.size() == 1);
+
+   OnDone();
+   CHECK(sentTags.size() == 3);
+   if (sentTags.size() == 3) {
+      CHECK(sentTags[1] == 'B');
+      CHECK(sentTags[2] == 'C');
+   }
+   CHECK(MKSVchanBudget::GetQueued(testClass) == 0);
+   CHECK(MKSVchanBudget::GetInFlight(testClass) == 400);
+   CHECK(MKSVchanSendQueue::GetDepth() == 0);
+
+   OnDone();
+   OnDone();
+   CHECK(MKSVchanBudget::GetInFlight(testClass) == 0);
+   CHECK(readyClasses.empty());
+}
+
+
+static void
+TestQueueFullRefuses()
+{
+   Reset();
+
+   CHECK(Send('A', TEST_LIMIT));
+   for (uint8 tag = 'B'; tag < 'B' + TEST_LIMIT / 250; tag++) {
+      CHECK(Send(tag, 250));
+   }
+   CHECK(MKSVchanBudget::GetQueued(testClass) == TEST_LIMIT);
+
+   // The queue has its own cap, the in-flight bytes don't count
+   CHECK(!Send('Z', 1));
+   CHECK(!MKSVchanBudget::IsWritable(testClass));
+
+   // Done: the queued packets go out, the class is below half again
+   OnDone();
+   CHECK(MKSVchanBudget::GetQueued(testClass) == 0);
+   CHECK(readyClasses.empty());
+   OnDone();
+   OnDone();
+   CHECK(readyClasses.size() == 1);
+   if (readyClasses.size() == 1) {
+      CHECK(readyClasses[0] == testClass);
+   }
+   while (!inFlight.empty()) {
+      OnDone();
+   }
+   CHECK(readyClasses.size() == 1);
+   CHECK(MKSVchanBudget::IsWritable(testClass));
+}
+
+
+static void
+TestIsWritableArmsReady()
+{
+   Reset();
+
+   CHECK(MKSVchanBudget::IsWritable(testClass));
+   CHECK(Send('A', 600));
+   CHECK(Send('B', 400));
+   CHECK(!MKSVchanBudget::IsWritable(testClass));
+
+   OnDone();
+   CHECK(readyClasses.size() == 1);
+   CHECK(MKSVchanBudget::IsWritable(testClass));
+   OnDone();
+   CHECK(readyClasses.size() == 1);
+}
+
+
+int
+main()
+{
+   MKSVchanBudget::SetLimit(testClass, TEST_LIMIT);
+   MKSVchanBudget::SetReadyCallback(OnBudgetReady, NULL);
+
+   TestQueuedThenDrained();
+   TestQueueFullRefuses();
+   TestIsWritableArmsReady();
+
+   MKSVchanBudget::SetReadyCallback(NULL, NULL);
+   Reset();
+
+   printf("MKSVchanSendBudgetTest: %s\n", failures == 0 ? "passed" : "FAILED");
+   return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,270 @@
+/* **************************************************************************** *
+ * Copyright (C) 2020 VMware, Inc.  All rights reserved. -- VMware Confidential *
+ * **************************************************************************** */
+
+/*
+ * MKSVchanSendQueueBench.cpp --
+ *
+ *    Contention benchmark of MKSVchanSendQueue with 1 to 32 producer
+ *    threads. A consumer thread stands in for the vdpservice thread: the
+ *    wake callback queues a drain task to it, the way the plugin does with
+ *    MKSVchan_QueueCallback, and MKSVchanRPCPlugin::SendMessage is replaced
+ *    by a function that only counts packets.
+ *
+ *    Checks that a single post into an idle queue is sent without any
+ *    other drain trigger, and that every post of the benchmark is sent
+ *    exactly once. Returns non-zero if a check fails.
+ */
+
+#include "MKSVchanSendQueue.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <stdio.h>
+#include <thread>
+#include <vector>
+
+#define BENCH_PAYLOAD_SIZE 256
+#define BENCH_TOTAL_POSTS (1024 * 1024)
+
+typedef std::chrono::steady_clock Clock;
+
+MKSVCHAN_CLIPBOARD_ERROR g_clipboardError = MKSVCHAN_CLIPBOARD_ERROR_NONE;
+
+static int failures = 0;
+
+#define CHECK(cond)                                                     \
+   do {                                                                 \
+      if (!(cond)) {                                                    \
+         fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__,         \
+                 __LINE__, #cond);                                      \
+         failures++;                                                    \
+      }                                                                 \
+   } while (0)
+
+static std::atomic<uint64> sentPackets(0);
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanRPCPlugin::SendMessage --
+ *
+ *    Fake of the plugin send, only counts.
+ *
+ * Results:
+ *    TRUE.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+MKSVchanRPCPlugin::SendMessage(MKSVchanPacketType packetType, // IN
+                               uint8 *data,                   // IN
+                               uint32 dataLen)                // IN
+{
+   sentPackets.fetch_add(1, std::memory_order_relaxed);
+   return TRUE;
+}
+
+
+static MKSVchanRPCPlugin *const plugin =
+   reinterpret_cast<MKSVchanRPCPlugin *>(&sentPackets);
+
+
+/*
+ * The vdpservice thread: runs queued tasks in order.
+ */
+namespace ChannelThread {
+
+std::mutex lock;
+std::condition_variable wake;
+std::deque<void (*)(void *)> tasks;
+Bool stop = FALSE;
+uint64 tasksRun = 0;
+
+
+void
+Queue(void (*task)(void *)) // IN
+{
+   std::lock_guard<std::mutex> guard(lock);
+   tasks.push_back(task);
+   wake.notify_one();
+}
+
+
+void
+Main()
+{
+   std::unique_lock<std::mutex> guard(lock);
+   while (!stop || !tasks.empty()) {
+      if (tasks.empty()) {
+         wake.wait(guard);
+         continue;
+      }
+      void (*task)(void *) = tasks.front();
+      tasks.pop_front();
+      tasksRun++;
+      guard.unlock();
+      task(NULL);
+      guard.lock();
+   }
+}
+
+} // namespace ChannelThread
+
+
+static void
+DrainPostedPackets(void *ctx) // IN: unused
+{
+   MKSVchanSendQueue::Drain(plugin);
+}
+
+
+static void
+WakeChannelThread(void *ctx) // IN: unused
+{
+   ChannelThread::Queue(DrainPostedPackets);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * Producer --
+ *
+ *    Post count packets, retrying while the budget is full.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Adds the time spent in Post to *postNS and the refusals to *retries.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+Producer(uint32 count,                  // IN
+         std::atomic<uint64> *postNS,   // IN/OUT
+         std::atomic<uint64> *retries)  // IN/OUT
+{
+   uint8 payload[BENCH_PAYLOAD_SIZE] = { 0 };
+   uint64 ns = 0;
+   uint64 refused = 0;
+
+   for (uint32 i = 0; i < count; i++) {
+      for (;;) {
+         Clock::time_point start = Clock::now();
+         Bool posted = MKSVchanSendQueue::Post(
+            MKSVchanPacketType_DnD_ControllerRpc, payload, sizeof payload,
+            MKSVCHAN_CLIPBOARD_ERROR_NONE);
+         ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+            Clock::now() - start).count();
+         if (posted) {
+            break;
+         }
+         refused++;
+         std::this_thread::yield();
+      }
+   }
+   postNS->fetch_add(ns);
+   retries->fetch_add(refused);
+}
+
+
+static Bool
+WaitForSent(uint64 expected) // IN
+{
+   Clock::time_point deadline = Clock::now() + std::chrono::seconds(10);
+   while (sentPackets.load() < expected) {
+      if (Clock::now() > deadline) {
+         return FALSE;
+      }
+      std::this_thread::sleep_for(std::chrono::microseconds(50));
+   }
+   return TRUE;
+}
+
+
+int
+main()
+{
+   std::thread channelThread(ChannelThread::Main);
+   MKSVchanSendQueue::SetWakeCallback(WakeChannelThread, NULL);
+
+   // Idle session: nothing but the wake callback drains this post
+   uint8 one = 1;
+   Clock::time_point start = Clock::now();
+   CHECK(MKSVchanSendQueue::Post(MKSVchanPacketType_ClipboardRequest, &one,
+                                 sizeof one, MKSVCHAN_CLIPBOARD_ERROR_NONE));
+   CHECK(WaitForSent(1));
+   printf("Idle post sent after %lld us\n\n",
+          (long long)std::chrono::duration_cast<std::chrono::microseconds>(
+             Clock::now() - start).count());
+
+   printf("%9s %12s %10s %10s %9s %9s\n", "producers", "posts/s",
+          "ns/post", "drains", "batch", "refused");
+   static const uint32 producerCounts[] = { 1, 2, 4, 8, 16, 32 };
+   for (size_t p = 0; p < sizeof producerCounts / sizeof producerCounts[0];
+        p++) {
+      uint32 producers = producerCounts[p];
+      uint32 perProducer = BENCH_TOTAL_POSTS / producers;
+      uint64 expected = sentPackets.load() + (uint64)perProducer * producers;
+      uint64 drainsBefore;
+      {
+         std::lock_guard<std::mutex> guard(ChannelThread::lock);
+         drainsBefore = ChannelThread::tasksRun;
+      }
+
+      std::atomic<uint64> postNS(0);
+      std::atomic<uint64> retries(0);
+      std::vector<std::thread> threads;
+      start = Clock::now();
+      for (uint32 i = 0; i < producers; i++) {
+         threads.push_back(std::thread(Producer, perProducer, &postNS,
+                                       &retries));
+      }
+      for (size_t i = 0; i < threads.size(); i++) {
+         threads[i].join();
+      }
+      CHECK(WaitForSent(expected));
+      while (MKSVchanSendQueue::GetDepth() > 0) {
+         // Drain counts a batch off the depth after sending it
+         std::this_thread::yield();
+      }
+      double seconds = std::chrono::duration<double>(Clock::now() -
+                                                     start).count();
+      CHECK(sentPackets.load() == expected);
+      CHECK(MKSVchanSendQueue::GetDepth() == 0);
+
+      uint64 drains;
+      {
+         std::lock_guard<std::mutex> guard(ChannelThread::lock);
+         drains = ChannelThread::tasksRun - drainsBefore;
+      }
+      uint64 posts = (uint64)perProducer * producers;
+      printf("%9u %12.0f %10.0f %10llu %9.1f %9llu\n", producers,
+             posts / seconds, (double)postNS.load() / posts,
+             (unsigned long long)drains,
+             drains > 0 ? (double)posts / drains : 0.0,
+             (unsigned long long)retries.load());
+   }
+
+   MKSVchanSendQueue::SetWakeCallback(NULL, NULL);
+   {
+      std::lock_guard<std::mutex> guard(ChannelThread::lock);
+      ChannelThread::stop = TRUE;
+      ChannelThread::wake.notify_one();
+   }
+   channelThread.join();
+
+   printf("MKSVchanSendQueueBench: %s\n", failures == 0 ? "passed" : "FAILED");
+   return failures == 0 ? 0 : 1;
+}
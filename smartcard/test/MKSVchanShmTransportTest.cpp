@@ -0,0 +1,463 @@
+/* **************************************************************************** *
+ * Copyright (C) 2020 VMware, Inc.  All rights reserved. -- VMware Confidential *
+ * **************************************************************************** */
+
+/*
+ * MKSVchanShmTransportTest.cpp --
+ *
+ *    Two process test and benchmark of MKSVchanShm. The parent plays the
+ *    agent and the forked child the client; a socketpair stands in for
+ *    the channel and MKSVchanRPCPlugin::SendMessage is replaced by a
+ *    function which frames packets onto it.
+ *
+ *    Checks the negotiation, that a payload whose descriptor couldn't be
+ *    sent is rolled back without breaking the sequence, that a rejected
+ *    descriptor makes both ends fall back to inline payloads, and that
+ *    the payloads of the rejected descriptor and of one sent after it
+ *    arrive inline.
+ *    The benchmark then compares staged against inline payloads for a
+ *    few sizes.
+ *
+ *    Linux and macOS only; returns non-zero if a check fails.
+ */
+
+#include "MKSVchanShmTransport.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+#if defined(MKSVCHAN_SHM_SUPPORTED)
+
+static int failures = 0;
+
+#define CHECK(cond)                                                     \
+   do {                                                                 \
+      if (!(cond)) {                                                    \
+         fprintf(stderr, "%s:%d: [%d] CHECK(%s) failed\n", __FILE__,    \
+                 __LINE__, (int)getpid(), #cond);                       \
+         failures++;                                                    \
+      }                                                                 \
+   } while (0)
+
+#define BENCH_TOTAL_BYTES (512 * 1024 * 1024)
+
+/*
+ * Channel packets are framed as packet type, length and payload.
+ */
+static int channelFd = -1;
+
+
+static Bool
+WriteAll(const void *buf, // IN
+         size_t len)      // IN
+{
+   const uint8 *p = static_cast<const uint8 *>(buf);
+   while (len > 0) {
+      ssize_t n = write(channelFd, p, len);
+      if (n < 0 && errno == EINTR) {
+         continue;
+      }
+      if (n <= 0) {
+         return FALSE;
+      }
+      p += n;
+      len -= n;
+   }
+   return TRUE;
+}
+
+
+static Bool
+ReadAll(void *buf,  // OUT
+        size_t len) // IN
+{
+   uint8 *p = static_cast<uint8 *>(buf);
+   while (len > 0) {
+      ssize_t n = read(channelFd, p, len);
+      if (n < 0 && errno == EINTR) {
+         continue;
+      }
+      if (n <= 0) {
+         return FALSE;
+      }
+      p += n;
+      len -= n;
+   }
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanRPCPlugin::SendMessage --
+ *
+ *    Fake of the plugin send: writes the packet to the socketpair.
+ *
+ * Results:
+ *    TRUE if the packet was written.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+MKSVchanRPCPlugin::SendMessage(MKSVchanPacketType packetType, // IN
+                               uint8 *data,                   // IN
+                               uint32 dataLen)                // IN
+{
+   uint32 header[2] = { (uint32)packetType, dataLen };
+   return WriteAll(header, sizeof header) && WriteAll(data, dataLen);
+}
+
+
+/*
+ * MKSVchanShm only calls SendMessage on the plugin, and the fake doesn't
+ * touch the object.
+ */
+static MKSVchanRPCPlugin *const plugin =
+   reinterpret_cast<MKSVchanRPCPlugin *>(&channelFd);
+
+
+static Bool
+ReadPacket(MKSVchanPacketType *packetType, // OUT
+           std::vector<uint8> *data)       // OUT
+{
+   uint32 header[2];
+   if (!ReadAll(header, sizeof header)) {
+      return FALSE;
+   }
+   *packetType = static_cast<MKSVchanPacketType>(header[0]);
+   data->resize(header[1]);
+   return header[1] == 0 || ReadAll(&(*data)[0], header[1]);
+}
+
+
+static void
+FillPattern(std::vector<uint8> *buf, // OUT
+            uint32 len,              // IN
+            uint8 seed)              // IN
+{
+   buf->resize(len);
+   for (uint32 i = 0; i < len; i++) {
+      (*buf)[i] = (uint8)(i * 31 + seed);
+   }
+}
+
+
+static Bool
+MatchesPattern(const uint8 *data, // IN
+               uint32 len,        // IN
+               uint8 seed)        // IN
+{
+   for (uint32 i = 0; i < len; i++) {
+      if (data[i] != (uint8)(i * 31 + seed)) {
+         return FALSE;
+      }
+   }
+   return TRUE;
+}
+
+
+static double
+Now()
+{
+   struct timeval tv;
+   gettimeofday(&tv, NULL);
+   return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * SendStaged --
+ *
+ *    What SendMessage does with a payload: stage it and send the
+ *    descriptor, or send it inline if it can't be staged.
+ *
+ * Results:
+ *    TRUE if the payload went through shared memory.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static Bool
+SendStaged(MKSVchanPacketType packetType, // IN
+           std::vector<uint8> &payload)   // IN
+{
+   MKSVchanShmDescriptor descriptor;
+   if (!MKSVchanShm::Stage(packetType, &payload[0], (uint32)payload.size(),
+                           &descriptor)) {
+      plugin->SendMessage(packetType, &payload[0], (uint32)payload.size());
+      return FALSE;
+   }
+   plugin->SendMessage(MKSVchanPacketType_Shm_Descriptor,
+                       reinterpret_cast<uint8 *>(&descriptor),
+                       sizeof descriptor);
+   MKSVchanShm::Commit();
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * Negotiate --
+ *
+ *    Run Shm_Offer, Shm_Setup and Shm_Ready between the two processes.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Both ends have the transport active.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+Negotiate(Bool isServer) // IN
+{
+   MKSVchanPacketType packetType;
+   std::vector<uint8> data;
+
+   if (!isServer) {
+      MKSVchanShm::SendOffer(plugin);
+   }
+   CHECK(ReadPacket(&packetType, &data));
+   CHECK(packetType == (isServer ? MKSVchanPacketType_Shm_Offer :
+                                   MKSVchanPacketType_Shm_Setup));
+   MKSVchanShm::HandleControlPacket(plugin, packetType, &data[0],
+                                    (uint32)data.size());
+   if (isServer) {
+      CHECK(ReadPacket(&packetType, &data));
+      CHECK(packetType == MKSVchanPacketType_Shm_Ready);
+      MKSVchanShm::HandleControlPacket(plugin, packetType, &data[0],
+                                       (uint32)data.size());
+   }
+   CHECK(MKSVchanShm::IsActive());
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * ClientMain / AgentMain --
+ *
+ *    The two halves of the test, run in lock step over the socketpair.
+ *    The client sends, the agent receives and answers.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+ClientMain()
+{
+   MKSVchanPacketType packetType;
+   std::vector<uint8> data;
+   std::vector<uint8> payload;
+   MKSVchanShmDescriptor descriptor;
+
+   MKSVchanShm::Configure(FALSE);
+   Negotiate(FALSE);
+
+   // A committed payload arrives intact
+   FillPattern(&payload, 128 * 1024, 1);
+   CHECK(SendStaged(MKSVchanPacketType_ClipboardData_Text, payload));
+
+   // Invoke failed: rolled back, the next payload reuses its space
+   FillPattern(&payload, 256 * 1024, 2);
+   CHECK(MKSVchanShm::Stage(MKSVchanPacketType_ClipboardData_Text,
+                            &payload[0], (uint32)payload.size(),
+                            &descriptor));
+   uint64 rolledBackOffset = descriptor.offset;
+   MKSVchanShm::Unstage();
+   FillPattern(&payload, 200 * 1024, 3);
+   CHECK(MKSVchanShm::Stage(MKSVchanPacketType_ClipboardData_CPClipboard,
+                            &payload[0], (uint32)payload.size(),
+                            &descriptor));
+   CHECK(descriptor.offset == rolledBackOffset);
+   plugin->SendMessage(MKSVchanPacketType_Shm_Descriptor,
+                       reinterpret_cast<uint8 *>(&descriptor),
+                       sizeof descriptor);
+   MKSVchanShm::Commit();
+
+   // Benchmark, both ways for every size
+   static const uint32 sizes[] = { 64 * 1024, 1024 * 1024, 4 * 1024 * 1024 };
+   for (size_t i = 0; i < sizeof sizes / sizeof sizes[0]; i++) {
+      FillPattern(&payload, sizes[i], 4);
+      uint32 count = BENCH_TOTAL_BYTES / sizes[i];
+      for (int staged = 0; staged < 2; staged++) {
+         uint32 viaShm = 0;
+         for (uint32 n = 0; n < count; n++) {
+            if (staged) {
+               viaShm += SendStaged(
+                  MKSVchanPacketType_ClipboardData_CPClipboard, payload);
+            } else {
+               plugin->SendMessage(MKSVchanPacketType_ClipboardData_CPClipboard,
+                                   &payload[0], (uint32)payload.size());
+            }
+         }
+         CHECK(ReadPacket(&packetType, &data));
+         if (staged) {
+            printf("   %u of %u payloads staged, the rest sent inline\n",
+                   viaShm, count);
+         }
+      }
+   }
+
+   /*
+    * A descriptor the agent rejects makes both ends go back to inline. The
+    * next one is already on its way and dropped; both payloads are sent
+    * again inline once the agent's teardown arrives.
+    */
+   CHECK(MKSVchanShm::Stage(MKSVchanPacketType_ClipboardData_Text,
+                            &payload[0], 64 * 1024, &descriptor));
+   MKSVchanShm::Commit();
+   descriptor.sequence += 5;
+   plugin->SendMessage(MKSVchanPacketType_Shm_Descriptor,
+                       reinterpret_cast<uint8 *>(&descriptor),
+                       sizeof descriptor);
+   FillPattern(&payload, 96 * 1024, 6);
+   CHECK(SendStaged(MKSVchanPacketType_ClipboardData_Text, payload));
+   CHECK(ReadPacket(&packetType, &data));
+   CHECK(packetType == MKSVchanPacketType_Shm_Teardown);
+   MKSVchanShm::HandleControlPacket(plugin, packetType, &data[0],
+                                    (uint32)data.size());
+   CHECK(!MKSVchanShm::IsActive());
+   FillPattern(&payload, 128 * 1024, 5);
+   CHECK(!SendStaged(MKSVchanPacketType_ClipboardData_Text, payload));
+}
+
+
+static void
+AgentMain()
+{
+   MKSVchanPacketType packetType;
+   std::vector<uint8> data;
+   std::vector<uint8> sink;
+   std::vector<uint8> payload;
+
+   MKSVchanShm::Configure(TRUE);
+   Negotiate(TRUE);
+
+   static const uint8 expectedSeeds[] = { 1, 3 };
+   for (size_t i = 0; i < sizeof expectedSeeds; i++) {
+      CHECK(ReadPacket(&packetType, &data));
+      CHECK(packetType == MKSVchanPacketType_Shm_Descriptor);
+      CHECK(MKSVchanShm::Resolve(plugin, &data[0], (uint32)data.size(),
+                                 &packetType, &payload));
+      CHECK(MatchesPattern(&payload[0], (uint32)payload.size(),
+                           expectedSeeds[i]));
+   }
+
+   static const uint32 sizes[] = { 64 * 1024, 1024 * 1024, 4 * 1024 * 1024 };
+   for (size_t i = 0; i < sizeof sizes / sizeof sizes[0]; i++) {
+      uint32 count = BENCH_TOTAL_BYTES / sizes[i];
+      sink.resize(sizes[i]);
+      for (int staged = 0; staged < 2; staged++) {
+         double start = Now();
+         for (uint32 n = 0; n < count; n++) {
+            CHECK(ReadPacket(&packetType, &data));
+            if (packetType == MKSVchanPacketType_Shm_Descriptor) {
+               // Copied out, like the plugin does before dispatching
+               CHECK(MKSVchanShm::Resolve(plugin, &data[0],
+                                          (uint32)data.size(), &packetType,
+                                          &payload));
+            } else {
+               memcpy(&sink[0], &data[0], data.size());
+            }
+         }
+         double elapsed = Now() - start;
+         printf("%-7s %5u KB x %5u: %8.1f MB/s\n",
+                staged ? "shm" : "inline", sizes[i] / 1024, count,
+                BENCH_TOTAL_BYTES / (1024.0 * 1024.0) / elapsed);
+         fflush(stdout);
+         uint8 ack = 1;
+         plugin->SendMessage(MKSVchanPacketType_ClipboardRequest, &ack, 1);
+      }
+   }
+
+   // The rejected descriptor, and the one sent before the client knew
+   for (int i = 0; i < 2; i++) {
+      CHECK(ReadPacket(&packetType, &data));
+      CHECK(packetType == MKSVchanPacketType_Shm_Descriptor);
+      CHECK(!MKSVchanShm::Resolve(plugin, &data[0], (uint32)data.size(),
+                                  &packetType, &payload));
+      CHECK(!MKSVchanShm::IsActive());
+   }
+
+   // Both payloads again inline, then the payload sent after the teardown
+   static const uint8 inlineSeeds[] = { 4, 6, 5 };
+   static const uint32 inlineSizes[] = { 64 * 1024, 96 * 1024, 128 * 1024 };
+   for (size_t i = 0; i < sizeof inlineSeeds; i++) {
+      CHECK(ReadPacket(&packetType, &data));
+      CHECK(packetType == MKSVchanPacketType_ClipboardData_Text);
+      CHECK(data.size() == inlineSizes[i]);
+      CHECK(MatchesPattern(&data[0], (uint32)data.size(), inlineSeeds[i]));
+   }
+}
+
+
+int
+main()
+{
+   int fds[2];
+   if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+      perror("socketpair");
+      return 1;
+   }
+   setenv(MKSVCHAN_SHM_ENV_NAME, "1", 1);
+   fflush(stdout);
+
+   pid_t child = fork();
+   if (child < 0) {
+      perror("fork");
+      return 1;
+   }
+   if (child == 0) {
+      close(fds[0]);
+      channelFd = fds[1];
+      ClientMain();
+      MKSVchanShm::OnChannelNotReady();
+      fflush(stdout);
+      _exit(failures == 0 ? 0 : 1);
+   }
+
+   close(fds[1]);
+   channelFd = fds[0];
+   AgentMain();
+   MKSVchanShm::OnChannelNotReady();
+
+   int status = 0;
+   waitpid(child, &status, 0);
+   if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      failures++;
+   }
+   printf("MKSVchanShmTransportTest: %s\n", failures == 0 ? "passed" : "FAILED");
+   return failures == 0 ? 0 : 1;
+}
+
+#else
+
+int
+main()
+{
+   printf("MKSVchanShmTransportTest: skipped, no shared memory transport\n");
+   return 0;
+}
+
+#endif // MKSVCHAN_SHM_SUPPORTED
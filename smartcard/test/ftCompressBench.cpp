@@ -0,0 +1,513 @@
+/* **************************************************************************** *
+ * Copyright (C) 2020 VMware, Inc.  All rights reserved. -- VMware Confidential *
+ * **************************************************************************** */
+
+/*
+ * ftCompressBench.cpp --
+ *
+ *    Benchmark of FT::ChunkCompressor over mixed corpora: generated text,
+ *    executables from /usr/bin, incompressible data standing in for media
+ *    and archives, and all three interleaved chunk by chunk.
+ *
+ *    Chunks are submitted the way MKSVchanRPCPlugin::SendMessage does, and
+ *    a consumer thread standing in for the vdpservice thread takes the
+ *    frames when the frame ready callback queues it a task. Every frame is
+ *    decoded and compared with the chunk it was made from.
+ *
+ *    Prints the compression throughput and ratio per corpus, and the time
+ *    the transfer would take on a few link speeds with and without
+ *    compression. These runs report no link rate, so the level stays at
+ *    its start value.
+ *
+ *    The adaptive runs then send the text frames over a simulated link:
+ *    the channel thread records each frame with MKSVchanMetrics and takes
+ *    as long as the link would to carry it before marking it done. Checks
+ *    that the level goes up on a slow link and down on an unlimited one.
+ *    Returns non-zero if a check fails.
+ */
+
+#include "ftCompress.h"
+#include "MKSVchanMetrics.h"
+#include "MKSVchanPacketTypeExt.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <dirent.h>
+#include <deque>
+#include <mutex>
+#include <stdio.h>
+#include <string>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+#define BENCH_CHUNK_SIZE (64 * 1024)
+#define BENCH_CORPUS_SIZE (16 * 1024 * 1024)
+#define BENCH_ADAPTIVE_CHUNKS 96
+
+typedef std::chrono::steady_clock Clock;
+
+static int failures = 0;
+
+#define CHECK(cond)                                                     \
+   do {                                                                 \
+      if (!(cond)) {                                                    \
+         fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__,         \
+                 __LINE__, #cond);                                      \
+         failures++;                                                    \
+      }                                                                 \
+   } while (0)
+
+
+/*
+ * The vdpservice thread: runs queued tasks in order.
+ */
+namespace ChannelThread {
+
+std::mutex lock;
+std::condition_variable wake;
+std::deque<void (*)(void *)> tasks;
+Bool stop = FALSE;
+
+
+void
+Queue(void (*task)(void *)) // IN
+{
+   std::lock_guard<std::mutex> guard(lock);
+   tasks.push_back(task);
+   wake.notify_one();
+}
+
+
+void
+Main()
+{
+   std::unique_lock<std::mutex> guard(lock);
+   while (!stop || !tasks.empty()) {
+      if (tasks.empty()) {
+         wake.wait(guard);
+         continue;
+      }
+      void (*task)(void *) = tasks.front();
+      tasks.pop_front();
+      guard.unlock();
+      task(NULL);
+      guard.lock();
+   }
+}
+
+} // namespace ChannelThread
+
+
+/*
+ * State of the run in progress. The chunks are read by the channel thread
+ * to check the frames, they are not changed while a run is going.
+ */
+static FT::ChunkCompressor *compressor = NULL;
+static const std::vector<std::vector<uint8> > *runChunks = NULL;
+static std::atomic<uint64> framesSent(0);
+static uint64 frameBytes = 0;
+static uint64 deflatedFrames = 0;
+static uint64 badFrames = 0;
+
+/*
+ * Simulated link of the adaptive runs, in bytes per second. 0 means
+ * unlimited. Frames only go through MKSVchanMetrics when linkFed is set.
+ */
+static Bool linkFed = FALSE;
+static double linkBytesPerSecond = 0;
+
+
+static void
+SendCompressedFrames(void *ctx) // IN: unused
+{
+   std::vector<uint8> frame;
+   std::vector<uint8> decoded;
+   while (compressor != NULL && compressor->Next(FALSE, &frame)) {
+      const std::vector<uint8> &chunk = (*runChunks)[framesSent.load()];
+      if (!FT::DecodeChunkFrame(&frame[0], (uint32)frame.size(), &decoded) ||
+          decoded != chunk) {
+         badFrames++;
+      }
+      if (reinterpret_cast<FTChunkFrameHeader *>(&frame[0])->method ==
+          FT_CHUNK_FRAME_DEFLATE) {
+         deflatedFrames++;
+      }
+      frameBytes += frame.size();
+      if (linkFed) {
+         MKSVchanMetrics::RecordSend(MKSVchanPacketType_FileTransferData_Compressed,
+                                     (uint32)frame.size());
+         if (linkBytesPerSecond > 0) {
+            std::this_thread::sleep_for(std::chrono::duration<double>(
+               frame.size() / linkBytesPerSecond));
+         }
+         MKSVchanMetrics::RecordSendDone(
+            MKSVchanPacketType_FileTransferData_Compressed,
+            (uint32)frame.size());
+      }
+      framesSent.fetch_add(1);
+   }
+}
+
+
+static void
+OnCompressedFrameReady(void *ctx) // IN: unused
+{
+   ChannelThread::Queue(SendCompressedFrames);
+}
+
+
+/*
+ * Deleted on the channel thread like the plugin does, so a frame task
+ * queued by a worker that was still in the callback finds no compressor.
+ */
+static std::atomic<Bool> compressorDeleted(FALSE);
+
+
+static void
+DeleteCompressor(void *ctx) // IN: unused
+{
+   delete compressor;
+   compressor = NULL;
+   compressorDeleted.store(TRUE);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MakeText --
+ *
+ *    Log lines with timestamps, levels and varying numbers, compressible
+ *    like source code and logs are.
+ *
+ * Results:
+ *    BENCH_CORPUS_SIZE bytes of text.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static std::vector<uint8>
+MakeText()
+{
+   static const char *const levels[] = { "INFO", "WARN", "DEBUG", "ERROR" };
+   static const char *const words[] = {
+      "clipboard", "channel", "request", "transfer", "session", "file",
+      "chunk", "ready", "payload", "bytes", "took", "peer", "queued",
+   };
+   std::vector<uint8> text;
+   uint32 seed = 1;
+   char line[256];
+
+   while (text.size() < BENCH_CORPUS_SIZE) {
+      seed = seed * 1103515245 + 12345;
+      int len = snprintf(line, sizeof line,
+                         "2020-06-%02u 12:%02u:%02u.%03u %s [%u] %s %s %u %s\n",
+                         1 + seed % 28, seed % 60, (seed >> 8) % 60,
+                         (seed >> 4) % 1000, levels[(seed >> 12) % 4],
+                         (seed >> 16) % 64, words[(seed >> 3) % 13],
+                         words[(seed >> 7) % 13], seed % 100000,
+                         words[(seed >> 11) % 13]);
+      text.insert(text.end(), line, line + len);
+   }
+   text.resize(BENCH_CORPUS_SIZE);
+   return text;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MakeBinary --
+ *
+ *    Concatenate executables from /usr/bin.
+ *
+ * Results:
+ *    BENCH_CORPUS_SIZE bytes, or less if /usr/bin doesn't have them.
+ *
+ * Side effects:
+ *    Reads files.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static std::vector<uint8>
+MakeBinary()
+{
+   std::vector<uint8> binary;
+   DIR *dir = opendir("/usr/bin");
+   struct dirent *entry;
+   uint8 buf[64 * 1024];
+
+   while (dir != NULL && binary.size() < BENCH_CORPUS_SIZE &&
+          (entry = readdir(dir)) != NULL) {
+      std::string path = std::string("/usr/bin/") + entry->d_name;
+      FILE *file = fopen(path.c_str(), "rb");
+      if (file == NULL) {
+         continue;
+      }
+      size_t n;
+      if (fread(buf, 1, 4, file) == 4 && memcmp(buf, "\177ELF", 4) == 0) {
+         binary.insert(binary.end(), buf, buf + 4);
+         while ((n = fread(buf, 1, sizeof buf, file)) > 0) {
+            binary.insert(binary.end(), buf, buf + n);
+         }
+      }
+      fclose(file);
+   }
+   if (dir != NULL) {
+      closedir(dir);
+   }
+   if (binary.size() > BENCH_CORPUS_SIZE) {
+      binary.resize(BENCH_CORPUS_SIZE);
+   }
+   return binary;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MakeRandom --
+ *
+ *    Incompressible bytes, like already compressed media and archives.
+ *
+ * Results:
+ *    BENCH_CORPUS_SIZE bytes.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static std::vector<uint8>
+MakeRandom()
+{
+   std::vector<uint8> random(BENCH_CORPUS_SIZE);
+   uint64 state = 0x9E3779B97F4A7C15ULL;
+
+   for (size_t i = 0; i < random.size(); i++) {
+      state ^= state << 13;
+      state ^= state >> 7;
+      state ^= state << 17;
+      random[i] = (uint8)(state >> 32);
+   }
+   return random;
+}
+
+
+static std::vector<std::vector<uint8> >
+Split(const std::vector<uint8> &corpus) // IN
+{
+   std::vector<std::vector<uint8> > chunks;
+   for (size_t off = 0; off < corpus.size(); off += BENCH_CHUNK_SIZE) {
+      size_t end = std::min(corpus.size(), off + BENCH_CHUNK_SIZE);
+      chunks.push_back(std::vector<uint8>(corpus.begin() + off,
+                                          corpus.begin() + end));
+   }
+   return chunks;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * Transfer --
+ *
+ *    Push the chunks through a new compressor and wait for every frame to
+ *    be taken by the channel thread.
+ *
+ * Results:
+ *    Seconds the transfer took. The start and final level in *startLevel
+ *    and *endLevel.
+ *
+ * Side effects:
+ *    Counts failed checks.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static double
+Transfer(const std::vector<std::vector<uint8> > &chunks, // IN
+         int *startLevel,                                // OUT
+         int *endLevel)                                  // OUT
+{
+   framesSent.store(0);
+   frameBytes = 0;
+   deflatedFrames = 0;
+   badFrames = 0;
+   runChunks = &chunks;
+   compressor = new FT::ChunkCompressor();
+   compressor->SetFrameReadyCallback(OnCompressedFrameReady, NULL);
+   *startLevel = compressor->GetLevel();
+
+   Clock::time_point start = Clock::now();
+   for (size_t i = 0; i < chunks.size(); i++) {
+      compressor->Submit(&chunks[i][0], (uint32)chunks[i].size());
+   }
+   Clock::time_point deadline = Clock::now() + std::chrono::seconds(60);
+   while (framesSent.load() < chunks.size() && Clock::now() < deadline) {
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+   }
+   double seconds = std::chrono::duration<double>(Clock::now() -
+                                                  start).count();
+   *endLevel = compressor->GetLevel();
+
+   compressorDeleted.store(FALSE);
+   ChannelThread::Queue(DeleteCompressor);
+   while (!compressorDeleted.load()) {
+      std::this_thread::yield();
+   }
+
+   CHECK(framesSent.load() == chunks.size());
+   CHECK(badFrames == 0);
+   return seconds;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * Run --
+ *
+ *    Compress the chunks with no link feedback and print one result row.
+ *
+ * Results:
+ *    None.
+ *
+ * Side effects:
+ *    Counts failed checks.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+Run(const char *name,                               // IN
+    const std::vector<std::vector<uint8> > &chunks) // IN
+{
+   static const double linkMbits[] = { 10, 100, 1000 };
+   uint64 rawBytes = 0;
+   int startLevel;
+   int endLevel;
+
+   for (size_t i = 0; i < chunks.size(); i++) {
+      rawBytes += chunks[i].size();
+   }
+
+   double seconds = Transfer(chunks, &startLevel, &endLevel);
+   CHECK(endLevel == startLevel);
+
+   double ratio = rawBytes != 0 ? (double)frameBytes / rawBytes : 0.0;
+   printf("%-8s %8.1f %9.1f %7.3f %6llu/%-6llu", name,
+          rawBytes / 1048576.0, rawBytes / 1048576.0 / seconds, ratio,
+          (unsigned long long)deflatedFrames,
+          (unsigned long long)chunks.size());
+   for (size_t i = 0; i < sizeof linkMbits / sizeof linkMbits[0]; i++) {
+      double linkBytes = linkMbits[i] * 1e6 / 8;
+      double plain = rawBytes / linkBytes;
+      // Compression and sending overlap, the slower one sets the pace
+      double compressed = std::max(seconds, frameBytes / linkBytes);
+      printf(" %7.2f/%-7.2f", plain, compressed);
+   }
+   printf("\n");
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * RunAdaptive --
+ *
+ *    Send the chunks over a simulated link of linkMbits (0 for unlimited)
+ *    and print the level the compressor settled on.
+ *
+ * Results:
+ *    The start and final level in *startLevel and *endLevel.
+ *
+ * Side effects:
+ *    Counts failed checks.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+RunAdaptive(const char *name,                               // IN
+            const std::vector<std::vector<uint8> > &chunks, // IN
+            double linkMbits,                               // IN
+            int *startLevel,                                // OUT
+            int *endLevel)                                  // OUT
+{
+   MKSVchanMetrics::ResetInFlight();
+   linkBytesPerSecond = linkMbits * 1e6 / 8;
+   linkFed = TRUE;
+   double seconds = Transfer(chunks, startLevel, endLevel);
+   linkFed = FALSE;
+
+   printf("%-8s %8.0f %9.2f %7.3f %6d -> %d\n", name, linkMbits, seconds,
+          (double)frameBytes / (chunks.size() * (double)BENCH_CHUNK_SIZE),
+          *startLevel, *endLevel);
+}
+
+
+int
+main()
+{
+   std::thread channelThread(ChannelThread::Main);
+
+   std::vector<std::vector<uint8> > text = Split(MakeText());
+   std::vector<std::vector<uint8> > binary = Split(MakeBinary());
+   std::vector<std::vector<uint8> > random = Split(MakeRandom());
+   std::vector<std::vector<uint8> > mixed;
+   size_t longest = std::max(text.size(), std::max(binary.size(),
+                                                    random.size()));
+   for (size_t i = 0; i < longest; i++) {
+      if (i < text.size()) {
+         mixed.push_back(text[i]);
+      }
+      if (i < binary.size()) {
+         mixed.push_back(binary[i]);
+      }
+      if (i < random.size()) {
+         mixed.push_back(random[i]);
+      }
+   }
+
+   printf("%-8s %8s %9s %7s %13s %15s %15s %15s\n", "corpus", "MB", "MB/s",
+          "ratio", "deflated", "10Mb raw/cmp s", "100Mb raw/cmp s",
+          "1Gb raw/cmp s");
+   Run("text", text);
+   if (!binary.empty()) {
+      Run("binary", binary);
+   }
+   Run("random", random);
+   Run("mixed", mixed);
+
+   std::vector<std::vector<uint8> > adaptive(text.begin(),
+                                             text.begin() +
+                                             BENCH_ADAPTIVE_CHUNKS);
+   int startLevel;
+   int endLevel;
+
+   printf("\n%-8s %8s %9s %7s %11s\n", "adaptive", "Mbit/s", "s", "ratio",
+          "level");
+   RunAdaptive("slow", adaptive, 8, &startLevel, &endLevel);
+   CHECK(endLevel > startLevel);
+   RunAdaptive("fast", adaptive, 0, &startLevel, &endLevel);
+   CHECK(endLevel < startLevel);
+
+   {
+      std::lock_guard<std::mutex> guard(ChannelThread::lock);
+      ChannelThread::stop = TRUE;
+      ChannelThread::wake.notify_one();
+   }
+   channelThread.join();
+
+   printf("ftCompressBench: %s\n", failures == 0 ? "passed" : "FAILED");
+   return failures == 0 ? 0 : 1;
+}
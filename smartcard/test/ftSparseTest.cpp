@@ -0,0 +1,256 @@
+/* **************************************************************************** *
+ * Copyright (C) 2020 VMware, Inc.  All rights reserved. -- VMware Confidential *
+ * **************************************************************************** */
+
+/*
+ * ftSparseTest.cpp --
+ *
+ *    Round trip test of sparse frames: chunks with zero runs are encoded
+ *    the way MKSVchanRPCPlugin::SendMessage does and expanded the way the
+ *    receiver does, in a single delivery of the whole chunk, and
+ *    malformed frames must be refused before any of their data is passed
+ *    on.
+ *
+ *    Then a sparse file is read with ReadSparseChunk and written to a
+ *    second file with WriteSparseFrame, over old data. Checks that the
+ *    contents match, that the holes the file system reports came through
+ *    as hole records, and that the copy allocates no more blocks than the
+ *    source. Returns non-zero if a check fails.
+ */
+
+#include "ftSparse.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#define TEST_FILE_LEN (4 * 1024 * 1024)
+#define TEST_CHUNK_LEN (1024 * 1024)
+
+static int failures = 0;
+
+#define CHECK(cond)                                                     \
+   do {                                                                 \
+      if (!(cond)) {                                                    \
+         fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__,         \
+                 __LINE__, #cond);                                      \
+         failures++;                                                    \
+      }                                                                 \
+   } while (0)
+
+static std::vector<uint8> received;
+static uint32 deliveries = 0;
+
+
+static void
+ReceiveData(const uint8 *data, // IN
+            uint32 dataLen)    // IN
+{
+   deliveries++;
+   received.assign(data, data + dataLen);
+}
+
+
+static std::vector<uint8>
+MakeChunk(uint32 len,         // IN
+          uint32 zeroStart,   // IN
+          uint32 zeroLen)     // IN
+{
+   std::vector<uint8> chunk(len);
+   for (uint32 i = 0; i < len; i++) {
+      chunk[i] = (uint8)(i * 31 + 7) | 1;
+   }
+   memset(&chunk[zeroStart], 0, zeroLen);
+   return chunk;
+}
+
+
+static void
+TestRoundTrip()
+{
+   static const uint32 zeroRuns[][2] = {
+      { 0, 256 * 1024 },                // All zeros
+      { 4096, 64 * 1024 },              // Aligned run
+      { 1000, 20000 },                  // Unaligned run
+      { 256 * 1024 - 8192, 8192 },      // Run at the end
+   };
+
+   for (size_t i = 0; i < sizeof zeroRuns / sizeof zeroRuns[0]; i++) {
+      std::vector<uint8> chunk = MakeChunk(256 * 1024, zeroRuns[i][0],
+                                           zeroRuns[i][1]);
+      std::vector<uint8> frame;
+      CHECK(FT::EncodeSparseChunk(&chunk[0], (uint32)chunk.size(), 0,
+                                  &frame));
+      CHECK(frame.size() < chunk.size());
+
+      received.clear();
+      deliveries = 0;
+      CHECK(FT::ApplySparseFrame(&frame[0], (uint32)frame.size(),
+                                 ReceiveData));
+      CHECK(deliveries == 1);
+      CHECK(received == chunk);
+   }
+
+   // Less than a block of zeros is not worth a frame
+   std::vector<uint8> chunk = MakeChunk(64 * 1024, 100, 1000);
+   std::vector<uint8> frame;
+   CHECK(!FT::EncodeSparseChunk(&chunk[0], (uint32)chunk.size(), 0, &frame));
+}
+
+
+static void
+TestMalformedWritesNothing()
+{
+   std::vector<uint8> chunk = MakeChunk(64 * 1024, 8192, 8192);
+   std::vector<uint8> frame;
+   CHECK(FT::EncodeSparseChunk(&chunk[0], (uint32)chunk.size(), 0, &frame));
+
+   // Truncated in the last data record
+   received.clear();
+   deliveries = 0;
+   CHECK(!FT::ApplySparseFrame(&frame[0], (uint32)frame.size() - 1,
+                               ReceiveData));
+   CHECK(received.empty());
+
+   // Trailing garbage
+   std::vector<uint8> longer = frame;
+   longer.push_back(0);
+   CHECK(!FT::ApplySparseFrame(&longer[0], (uint32)longer.size(),
+                               ReceiveData));
+   CHECK(received.empty());
+
+   // A hole far larger than any chunk
+   FTSparseFrameHeader header = { FT_SPARSE_MAGIC, 1 };
+   FTSparseRecord record;
+   memset(&record, 0, sizeof record);
+   record.kind = FT_SPARSE_RECORD_HOLE;
+   record.length = 1ULL << 40;
+   std::vector<uint8> bomb(sizeof header + sizeof record);
+   memcpy(&bomb[0], &header, sizeof header);
+   memcpy(&bomb[sizeof header], &record, sizeof record);
+   CHECK(!FT::ApplySparseFrame(&bomb[0], (uint32)bomb.size(), ReceiveData));
+   CHECK(received.empty());
+   CHECK(deliveries == 0);
+}
+
+
+static int
+OpenTemp(char *path) // IN/OUT: mkstemp template
+{
+   int fd = mkstemp(path);
+   CHECK(fd >= 0);
+   unlink(path);
+   return fd;
+}
+
+
+static void
+WriteData(int fd,          // IN
+          off_t offset,    // IN
+          size_t len,      // IN
+          uint8 seed)      // IN
+{
+   std::vector<uint8> data(len);
+   for (size_t i = 0; i < len; i++) {
+      data[i] = (uint8)(seed + i * 13) | 1;
+   }
+   CHECK(pwrite(fd, &data[0], len, offset) == (ssize_t)len);
+}
+
+
+static std::vector<uint8>
+ReadAll(int fd) // IN
+{
+   struct stat st;
+   CHECK(fstat(fd, &st) == 0);
+   std::vector<uint8> data((size_t)st.st_size);
+   CHECK(pread(fd, &data[0], data.size(), 0) == (ssize_t)data.size());
+   return data;
+}
+
+
+static uint64
+AllocatedBytes(int fd) // IN
+{
+   struct stat st;
+   CHECK(fstat(fd, &st) == 0);
+   return (uint64)st.st_blocks * 512;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * TestFileCopy --
+ *
+ *    Source: data at 0 and at 2.5MB, a zero filled (allocated) run, and
+ *    file system holes elsewhere. Destination: old data everywhere, which
+ *    the holes of the copy have to replace.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+TestFileCopy()
+{
+   char srcPath[] = "/tmp/ftSparseTestSrcXXXXXX";
+   char dstPath[] = "/tmp/ftSparseTestDstXXXXXX";
+   int src = OpenTemp(srcPath);
+   int dst = OpenTemp(dstPath);
+   if (src < 0 || dst < 0) {
+      return;
+   }
+
+   CHECK(ftruncate(src, TEST_FILE_LEN) == 0);
+   WriteData(src, 0, 64 * 1024, 1);
+   std::vector<uint8> zeros(256 * 1024, 0);
+   CHECK(pwrite(src, &zeros[0], zeros.size(), 64 * 1024) ==
+         (ssize_t)zeros.size());
+   WriteData(src, 2560 * 1024, 100 * 1000, 2);
+   WriteData(dst, 0, TEST_FILE_LEN, 3);
+
+   uint64 frameBytes = 0;
+   for (uint64 offset = 0; offset < TEST_FILE_LEN; offset += TEST_CHUNK_LEN) {
+      std::vector<uint8> frame;
+      Bool foundHole = FALSE;
+      CHECK(FT::ReadSparseChunk(src, offset, TEST_CHUNK_LEN, &frame,
+                                &foundHole));
+      CHECK(foundHole);
+      CHECK(frame.size() < TEST_CHUNK_LEN);
+      CHECK(FT::WriteSparseFrame(dst, offset, &frame[0],
+                                 (uint32)frame.size()));
+      frameBytes += frame.size();
+   }
+
+   // Past the end of the source
+   std::vector<uint8> frame;
+   Bool foundHole;
+   CHECK(!FT::ReadSparseChunk(src, TEST_FILE_LEN - 4096, 8192, &frame,
+                              &foundHole));
+
+   CHECK(ReadAll(dst) == ReadAll(src));
+   CHECK(AllocatedBytes(dst) <= AllocatedBytes(src));
+   printf("4MB file: %llu frame bytes, source allocates %llu bytes, "
+          "copy %llu bytes\n", (unsigned long long)frameBytes,
+          (unsigned long long)AllocatedBytes(src),
+          (unsigned long long)AllocatedBytes(dst));
+
+   close(src);
+   close(dst);
+}
+
+
+int
+main()
+{
+   TestRoundTrip();
+   TestMalformedWritesNothing();
+   TestFileCopy();
+
+   printf("ftSparseTest: %s\n", failures == 0 ? "passed" : "FAILED");
+   return failures == 0 ? 0 : 1;
+}
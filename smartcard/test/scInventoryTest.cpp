@@ -0,0 +1,320 @@
+/* **************************************************************************** *
+ * Copyright (C) 2020 VMware, Inc.  All rights reserved. -- VMware Confidential *
+ * **************************************************************************** */
+
+/*
+ * scInventoryTest.cpp --
+ *
+ *    Behaviour test and latency report of ScInventory against the
+ *    simulated PC/SC of scSimReader.cpp: a PIV card with a plain and a
+ *    gzipped certificate, a card without a PIV applet and an empty reader.
+ *
+ *    Checks the collected readers, tokens and certificates, that the card
+ *    without a PIV applet leaves the inventory incomplete, that ToJson
+ *    produces every section VerifySmartCardClientInfo reads in the shape
+ *    it reads them, and that the binary format round trips. Prints how
+ *    long CollectJson takes at a few APDU latencies, and how long
+ *    system_profiler takes where it exists. Returns non-zero if a check
+ *    fails.
+ */
+
+#include "scInventory.h"
+#include "scInventoryWire.h"
+#include "scSimReader.h"
+
+#include <chrono>
+#include <json/json.h>
+#include <map>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#define TEST_PIV_READER "Sim Reader 00 00"
+#define TEST_OTHER_READER "Sim Reader 01 00"
+#define TEST_EMPTY_READER "Sim Reader 02 00"
+
+typedef std::chrono::steady_clock Clock;
+
+static int failures = 0;
+
+#define CHECK(cond)                                                     \
+   do {                                                                 \
+      if (!(cond)) {                                                    \
+         fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__,         \
+                 __LINE__, #cond);                                      \
+         failures++;                                                    \
+      }                                                                 \
+   } while (0)
+
+
+static void
+AppendTlv(std::vector<uint8> *out,         // IN/OUT
+          uint8 tag,                       // IN
+          const std::vector<uint8> &value) // IN
+{
+   out->push_back(tag);
+   if (value.size() < 0x80) {
+      out->push_back((uint8)value.size());
+   } else {
+      out->push_back(0x82);
+      out->push_back((uint8)(value.size() >> 8));
+      out->push_back((uint8)value.size());
+   }
+   out->insert(out->end(), value.begin(), value.end());
+}
+
+
+static std::vector<uint8>
+FakeDer(size_t len,  // IN
+        uint8 seed)  // IN
+{
+   std::vector<uint8> der(len);
+   for (size_t i = 0; i < len; i++) {
+      der[i] = (uint8)(seed + i / 7);
+   }
+   return der;
+}
+
+
+static std::vector<uint8>
+Gzip(const std::vector<uint8> &data) // IN
+{
+   z_stream stream;
+   memset(&stream, 0, sizeof stream);
+   deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                Z_DEFAULT_STRATEGY);
+   std::vector<uint8> out(deflateBound(&stream, (uLong)data.size()) + 32);
+   stream.next_in = const_cast<Bytef *>(&data[0]);
+   stream.avail_in = (uInt)data.size();
+   stream.next_out = &out[0];
+   stream.avail_out = (uInt)out.size();
+   deflate(&stream, Z_FINISH);
+   out.resize(stream.total_out);
+   deflateEnd(&stream);
+   return out;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * PivCertObject --
+ *
+ *    A PIV certificate object: the certificate, CertInfo and an empty
+ *    error detection code.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static std::vector<uint8>
+PivCertObject(const std::vector<uint8> &der, // IN
+              Bool gzipped)                  // IN
+{
+   std::vector<uint8> object;
+   AppendTlv(&object, 0x70, gzipped ? Gzip(der) : der);
+   AppendTlv(&object, 0x71, std::vector<uint8>(1, gzipped ? 1 : 0));
+   AppendTlv(&object, 0xFE, std::vector<uint8>());
+   return object;
+}
+
+
+static const uint8 testGuid[16] = {
+   0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef,
+   0x10, 0x32, 0x54, 0x76, 0x98, 0xba, 0xdc, 0xfe
+};
+
+
+static void
+SetUpReaders()
+{
+   ScSimReader::Reset();
+   ScSimReader::AddReader(TEST_PIV_READER);
+   ScSimReader::AddReader(TEST_OTHER_READER);
+   ScSimReader::AddReader(TEST_EMPTY_READER);
+
+   ScSimReader::Card piv;
+   piv.piv = TRUE;
+   piv.atr.assign(10, 0x3b);
+   std::vector<uint8> chuid;
+   AppendTlv(&chuid, 0x34, std::vector<uint8>(testGuid,
+                                              testGuid + sizeof testGuid));
+   piv.objects[0x5FC102] = chuid;
+   piv.objects[0x5FC105] = PivCertObject(FakeDer(900, 0x30), FALSE);
+   piv.objects[0x5FC10A] = PivCertObject(FakeDer(1500, 0x40), TRUE);
+   ScSimReader::InsertCard(TEST_PIV_READER, piv);
+
+   ScSimReader::Card other;
+   other.piv = FALSE;
+   other.atr.assign(12, 0x3f);
+   ScSimReader::InsertCard(TEST_OTHER_READER, other);
+}
+
+
+static void
+TestCollect(ScInventory::Inventory *inventory) // OUT
+{
+   CHECK(ScInventory::Collect(inventory));
+   CHECK(inventory->readers.size() == 3);
+   if (inventory->readers.size() == 3) {
+      CHECK(inventory->readers[0].cardPresent);
+      CHECK(inventory->readers[0].atr.size() == 10);
+      CHECK(inventory->readers[1].cardPresent);
+      CHECK(!inventory->readers[2].cardPresent);
+   }
+
+   CHECK(inventory->tokens.size() == 1);
+   if (inventory->tokens.size() == 1) {
+      const ScInventory::Token &token = inventory->tokens[0];
+      CHECK(token.name == "pivtoken:0123456789ABCDEF1032547698BADCFE");
+      CHECK(token.reader == TEST_PIV_READER);
+      CHECK(token.certificates.size() == 2);
+      if (token.certificates.size() == 2) {
+         CHECK(token.certificates[0].slot == "PIV Authentication");
+         CHECK(token.certificates[0].der == FakeDer(900, 0x30));
+         CHECK(token.certificates[1].slot == "Digital Signature");
+         CHECK(token.certificates[1].der == FakeDer(1500, 0x40));
+      }
+   }
+
+   // The card without a PIV applet isn't covered
+   CHECK(!inventory->complete);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * CheckIndexedSection --
+ *
+ *    The "#01", "#02", ... entries VerifySmartCardClientInfo walks.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+CheckIndexedSection(const Json::Value &section, // IN
+                    size_t count)               // IN
+{
+   for (size_t i = 1; i <= count; i++) {
+      std::string key = std::string("#0") + std::to_string(i);
+      CHECK(section[key].isString() && !section[key].asString().empty());
+   }
+   CHECK(section[std::string("#0") + std::to_string(count + 1)].empty());
+}
+
+
+static void
+TestJsonSections(ScInventory::Inventory inventory) // IN
+{
+   ScInventory::Driver driver;
+   driver.id = "com.example.ctk.pivtoken";
+   driver.version = "1.0";
+   driver.path = "/Applications/Example.app/Contents/PlugIns/Token.appex";
+   inventory.ctkDrivers.push_back(driver);
+   inventory.readerDrivers.push_back(driver);
+
+   ScInventory::Token keychain = inventory.tokens[0];
+   keychain.name = "com.apple.pivtoken:0123456789ABCDEF";
+   inventory.keychainTokens.push_back(keychain);
+
+   Json::Value root;
+   Json::Reader reader;
+   CHECK(reader.parse(ScInventory::ToJson(inventory), root));
+
+   std::map<std::string, Json::Value> sections;
+   const Json::Value &list = root["SPSmartCardsDataType"];
+   for (Json::Value::ArrayIndex i = 0; i < list.size(); i++) {
+      sections[list[i]["_name"].asString()] = list[i];
+   }
+
+   CHECK(sections.count("READERS") == 1);
+   CheckIndexedSection(sections["READERS"], 3);
+   CHECK(sections.count("READERS_DRIVERS") == 1);
+   CheckIndexedSection(sections["READERS_DRIVERS"], 1);
+   CHECK(sections.count("SMARTCARDS_DRIVERS") == 1);
+   CheckIndexedSection(sections["SMARTCARDS_DRIVERS"], 1);
+
+   CHECK(sections.count("AVAIL_SMARTCARDS_KEYCHAIN") == 1);
+   const Json::Value &keychainItems =
+      sections["AVAIL_SMARTCARDS_KEYCHAIN"]["_items"];
+   CHECK(keychainItems.size() == 1);
+   CHECK(keychainItems[0]["_name"].asString() == keychain.name);
+
+   CHECK(sections.count("AVAIL_SMARTCARDS_TOKEN") == 1);
+   const Json::Value &tokenItems =
+      sections["AVAIL_SMARTCARDS_TOKEN"]["_items"];
+   CHECK(tokenItems.size() == 1);
+   CheckIndexedSection(tokenItems[0], 2);
+   CHECK(tokenItems[0]["#01"].asString().find("-----BEGIN CERTIFICATE-----")
+         != std::string::npos);
+
+   // Old and new format carry the same inventory
+   std::vector<uint8> binary;
+   ScInventory::ToBinary(inventory, &binary);
+   ScInventory::Inventory decoded;
+   CHECK(ScInventory::FromBinary(&binary[0], (uint32)binary.size(),
+                                 &decoded));
+   CHECK(ScInventory::ToJson(decoded) == ScInventory::ToJson(inventory));
+}
+
+
+static double
+TimeCollectJsonMS()
+{
+   std::string json;
+   Clock::time_point start = Clock::now();
+   CHECK(ScInventory::CollectJson(&json, NULL));
+   return std::chrono::duration<double, std::milli>(Clock::now() -
+                                                     start).count();
+}
+
+
+static void
+ReportLatency()
+{
+   static const uint32 latenciesUS[] = { 0, 1000, 5000 };
+
+   for (size_t i = 0; i < SC_ARRAY_COUNT(latenciesUS); i++) {
+      ScSimReader::SetApduLatencyUS(latenciesUS[i]);
+      uint32 before = ScSimReader::GetTransmitCount();
+      double ms = TimeCollectJsonMS();
+      printf("PC/SC inventory, %5u us per APDU: %7.1f ms, %u APDUs\n",
+             latenciesUS[i], ms, ScSimReader::GetTransmitCount() - before);
+   }
+   ScSimReader::SetApduLatencyUS(0);
+
+   Clock::time_point start = Clock::now();
+   FILE *out = popen("system_profiler SPSmartCardsDataType -json "
+                     "2>/dev/null", "r");
+   char buf[4096];
+   size_t total = 0;
+   size_t n;
+   while (out != NULL && (n = fread(buf, 1, sizeof buf, out)) > 0) {
+      total += n;
+   }
+   if (out == NULL || pclose(out) != 0 || total == 0) {
+      printf("system_profiler: not available here, not measured\n");
+   } else {
+      printf("system_profiler:                  %7.1f ms\n",
+             std::chrono::duration<double, std::milli>(Clock::now() -
+                                                        start).count());
+   }
+}
+
+
+int
+main()
+{
+   SetUpReaders();
+
+   ScInventory::Inventory inventory;
+   TestCollect(&inventory);
+   if (!inventory.tokens.empty()) {
+      TestJsonSections(inventory);
+   }
+   ReportLatency();
+
+   printf("scInventoryTest: %s\n", failures == 0 ? "passed" : "FAILED");
+   return failures == 0 ? 0 : 1;
+}
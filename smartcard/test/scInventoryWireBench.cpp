@@ -0,0 +1,235 @@
+/* **************************************************************************** *
+ * Copyright (C) 2020 VMware, Inc.  All rights reserved. -- VMware Confidential *
+ * **************************************************************************** */
+
+/*
+ * scInventoryWireBench.cpp --
+ *
+ *    Benchmark of the SmartCardInfo_Binary format against the
+ *    SPSmartCardsDataType JSON, over generated inventories from one reader
+ *    with one token to many readers with full PIV cards and keychain
+ *    tokens.
+ *
+ *    Prints the bytes each format puts on the wire and the agent's time to
+ *    take a packet in: ScInfoStore::Update for JSON, and for binary what
+ *    the plugin does, FromBinary, ToJson for the saved copy and
+ *    ScInfoStore::UpdateInventory. The store column leaves out the ToJson.
+ *    Checks that both paths give the store the same readers, tokens and
+ *    certificates. Returns non-zero if a check fails.
+ */
+
+#include "scInfoStore.h"
+#include "scInventory.h"
+#include "scInventoryWire.h"
+
+#include <chrono>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#define BENCH_CERT_SIZE 1200
+#define BENCH_MIN_MS 200
+
+typedef std::chrono::steady_clock Clock;
+
+static int failures = 0;
+
+#define CHECK(cond)                                                     \
+   do {                                                                 \
+      if (!(cond)) {                                                    \
+         fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__,         \
+                 __LINE__, #cond);                                      \
+         failures++;                                                    \
+      }                                                                 \
+   } while (0)
+
+struct BenchCase {
+   const char *name;
+   uint32 readers;
+   uint32 certsPerToken;
+   uint32 keychainTokens;
+};
+
+
+static ScInventory::Certificate
+MakeCertificate(uint32 seed) // IN
+{
+   static const char *slots[] = {
+      "PIV Authentication", "Digital Signature", "Key Management",
+      "Card Authentication"
+   };
+   ScInventory::Certificate cert;
+   cert.slot = slots[seed % SC_ARRAY_COUNT(slots)];
+   cert.usage = seed % 4 == 2 ? "Decrypt" : "Sign";
+   cert.der.resize(BENCH_CERT_SIZE);
+   uint32 x = seed * 2654435761u + 1;
+   for (size_t i = 0; i < cert.der.size(); i++) {
+      x = x * 1103515245 + 12345;
+      cert.der[i] = (uint8)(x >> 16);
+   }
+   return cert;
+}
+
+
+static ScInventory::Inventory
+MakeInventory(const BenchCase &bench) // IN
+{
+   ScInventory::Inventory inventory;
+   uint32 seed = 0;
+
+   for (uint32 r = 0; r < bench.readers; r++) {
+      char name[64];
+      snprintf(name, sizeof name, "Generic Smart Card Reader %02u 00", r);
+      ScInventory::Reader reader;
+      reader.name = name;
+      reader.cardPresent = TRUE;
+      reader.atr.assign(18, (uint8)(0x3b + r));
+      inventory.readers.push_back(reader);
+
+      ScInventory::Token token;
+      snprintf(name, sizeof name, "pivtoken:%032X", r + 1);
+      token.name = name;
+      token.reader = reader.name;
+      for (uint32 c = 0; c < bench.certsPerToken; c++) {
+         token.certificates.push_back(MakeCertificate(seed++));
+      }
+      inventory.tokens.push_back(token);
+   }
+
+   for (uint32 k = 0; k < bench.keychainTokens; k++) {
+      char name[64];
+      snprintf(name, sizeof name, "com.apple.pivtoken:%08X", k + 1);
+      ScInventory::Token token;
+      token.name = name;
+      token.certificates.push_back(MakeCertificate(seed++));
+      inventory.keychainTokens.push_back(token);
+   }
+
+   ScInventory::Driver driver;
+   driver.id = "com.apple.ifdreader";
+   driver.version = "1.0";
+   driver.path = "/usr/libexec/SmartCardServices/drivers/ifd-ccid.bundle";
+   inventory.readerDrivers.push_back(driver);
+   driver.id = "com.apple.CryptoTokenKit.pivtoken";
+   driver.path = "/System/Library/Frameworks/CryptoTokenKit.framework/"
+                 "PlugIns/pivtoken.appex";
+   inventory.ctkDrivers.push_back(driver);
+   inventory.complete = TRUE;
+   return inventory;
+}
+
+
+static void
+TakeJson(const std::string &json) // IN
+{
+   CHECK(ScInfoStore::Update(json.c_str(), (uint32)json.length() + 1));
+}
+
+
+static void
+TakeBinary(const std::vector<uint8> &binary) // IN
+{
+   ScInventory::Inventory inventory;
+   CHECK(ScInventory::FromBinary(&binary[0], (uint32)binary.size(),
+                                 &inventory));
+   std::string saved = ScInventory::ToJson(inventory);
+   CHECK(!saved.empty());
+   CHECK(ScInfoStore::UpdateInventory(inventory));
+}
+
+
+static void
+StoreBinary(const std::vector<uint8> &binary) // IN
+{
+   ScInventory::Inventory inventory;
+   CHECK(ScInventory::FromBinary(&binary[0], (uint32)binary.size(),
+                                 &inventory));
+   CHECK(ScInfoStore::UpdateInventory(inventory));
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * TimeUS --
+ *
+ *    Average microseconds per call, repeating for at least BENCH_MIN_MS.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+template <typename T>
+static double
+TimeUS(void (*take)(const T &), // IN
+       const T &payload)        // IN
+{
+   uint32 calls = 0;
+   Clock::time_point start = Clock::now();
+   Clock::time_point end;
+   do {
+      take(payload);
+      calls++;
+      end = Clock::now();
+   } while (end - start < std::chrono::milliseconds(BENCH_MIN_MS));
+   return std::chrono::duration<double, std::micro>(end - start).count() /
+          calls;
+}
+
+
+static void
+CheckSameSnapshot(const ScInfoStore::Snapshot &json,   // IN
+                  const ScInfoStore::Snapshot &binary) // IN
+{
+   CHECK(json.readers.size() == binary.readers.size());
+   for (size_t i = 0;
+        i < json.readers.size() && i < binary.readers.size(); i++) {
+      CHECK(json.readers[i].name == binary.readers[i].name);
+      CHECK(json.readers[i].atr == binary.readers[i].atr);
+   }
+   CHECK(json.tokens.size() == binary.tokens.size());
+   CHECK(json.certificates.size() == binary.certificates.size());
+   CHECK(json.thumbprintIndex == binary.thumbprintIndex);
+   CHECK(json.ctkDrivers == binary.ctkDrivers);
+}
+
+
+int
+main()
+{
+   static const BenchCase cases[] = {
+      { "1x1", 1, 1, 0 },
+      { "1x4", 1, 4, 0 },
+      { "4x4+kc", 4, 4, 4 },
+      { "16x4+kc", 16, 4, 16 },
+   };
+
+   printf("%-8s %9s %9s %6s %9s %10s %9s %8s\n", "case", "JSON B",
+          "binary B", "ratio", "JSON us", "binary us", "store us", "speedup");
+   for (size_t i = 0; i < SC_ARRAY_COUNT(cases); i++) {
+      ScInventory::Inventory inventory = MakeInventory(cases[i]);
+      std::string json = ScInventory::ToJson(inventory);
+      std::vector<uint8> binary;
+      ScInventory::ToBinary(inventory, &binary);
+
+      TakeJson(json);
+      ScInfoStore::SnapshotPtr fromJson = ScInfoStore::Get();
+      TakeBinary(binary);
+      ScInfoStore::SnapshotPtr fromBinary = ScInfoStore::Get();
+      CHECK(fromJson && fromBinary);
+      if (fromJson && fromBinary) {
+         CheckSameSnapshot(*fromJson, *fromBinary);
+      }
+
+      double jsonUS = TimeUS(TakeJson, json);
+      double binaryUS = TimeUS(TakeBinary, binary);
+      double storeUS = TimeUS(StoreBinary, binary);
+      printf("%-8s %9u %9u %6.2f %9.1f %10.1f %9.1f %7.1fx\n",
+             cases[i].name, (uint32)json.length() + 1, (uint32)binary.size(),
+             (double)binary.size() / (json.length() + 1), jsonUS, binaryUS,
+             storeUS, jsonUS / binaryUS);
+   }
+   ScInfoStore::Reset();
+
+   printf("scInventoryWireBench: %s\n", failures == 0 ? "passed" : "FAILED");
+   return failures == 0 ? 0 : 1;
+}
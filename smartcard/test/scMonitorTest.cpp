@@ -0,0 +1,356 @@
+/* **************************************************************************** *
+ * Copyright (C) 2020 VMware, Inc.  All rights reserved. -- VMware Confidential *
+ * **************************************************************************** */
+
+/*
+ * scMonitorTest.cpp --
+ *
+ *    Behaviour test and latency report of ScMonitor against the simulated
+ *    PC/SC of scSimReader.cpp. Posted inventories reach the fake
+ *    MKSVchanRPCPlugin::SendMessage through MKSVchanSendQueue and the wake
+ *    callback, with a consumer thread standing in for the vdpservice
+ *    thread, as in MKSVchanProgressTest.cpp. Nothing else is sent, so the
+ *    inventory doesn't wait for unrelated traffic to be drained.
+ *
+ *    Checks that Start returns without waiting for the initial inventory,
+ *    which the monitor thread collects and hands to the Start callback,
+ *    that an inserted card, a new reader and a removed card each send one
+ *    inventory, that a burst of events is debounced into one,
+ *    that removing and reinserting the same card sends nothing, and that
+ *    Stop ends the blocking wait. Prints the time from the event to the
+ *    packet. Returns non-zero if a check fails.
+ */
+
+#include "scMonitor.h"
+#include "scSimReader.h"
+#include "MKSVchanPacketTypeExt.h"
+#include "MKSVchanSendQueue.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <stdio.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define TEST_READER "Sim Reader 00 00"
+#define TEST_NEW_READER "Sim Reader 01 00"
+
+// Longest wait for a packet, well beyond the debounce
+#define TEST_WAIT_MS (SC_MONITOR_DEBOUNCE_MS * 4)
+
+// Per card command while the initial inventory is collected
+#define TEST_APDU_LATENCY_US 20000
+
+typedef std::chrono::steady_clock Clock;
+
+MKSVCHAN_CLIPBOARD_ERROR g_clipboardError = MKSVCHAN_CLIPBOARD_ERROR_NONE;
+
+static int failures = 0;
+
+#define CHECK(cond)                                                     \
+   do {                                                                 \
+      if (!(cond)) {                                                    \
+         fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__,         \
+                 __LINE__, #cond);                                      \
+         failures++;                                                    \
+      }                                                                 \
+   } while (0)
+
+struct SentPacket {
+   MKSVchanPacketType packetType;
+   std::string data;
+   Clock::time_point when;
+};
+
+static std::mutex sentLock;
+static std::condition_variable sentWake;
+static std::vector<SentPacket> sent;
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * MKSVchanRPCPlugin::SendMessage --
+ *
+ *    Fake of the plugin send, records the packets drained from the queue.
+ *
+ * Results:
+ *    TRUE.
+ *
+ * Side effects:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+Bool
+MKSVchanRPCPlugin::SendMessage(MKSVchanPacketType packetType, // IN
+                               uint8 *data,                   // IN
+                               uint32 dataLen)                // IN
+{
+   SentPacket packet;
+   packet.packetType = packetType;
+   packet.data.assign(reinterpret_cast<const char *>(data), dataLen);
+   packet.when = Clock::now();
+   std::lock_guard<std::mutex> guard(sentLock);
+   sent.push_back(packet);
+   sentWake.notify_all();
+   return TRUE;
+}
+
+
+static MKSVchanRPCPlugin *const plugin =
+   reinterpret_cast<MKSVchanRPCPlugin *>(&sent);
+
+
+/*
+ * The vdpservice thread: runs queued tasks in order.
+ */
+namespace ChannelThread {
+
+std::mutex lock;
+std::condition_variable wake;
+std::deque<void (*)(void *)> tasks;
+Bool stop = FALSE;
+
+
+void
+Queue(void (*task)(void *)) // IN
+{
+   std::lock_guard<std::mutex> guard(lock);
+   tasks.push_back(task);
+   wake.notify_one();
+}
+
+
+void
+Main()
+{
+   std::unique_lock<std::mutex> guard(lock);
+   while (!stop || !tasks.empty()) {
+      if (tasks.empty()) {
+         wake.wait(guard);
+         continue;
+      }
+      void (*task)(void *) = tasks.front();
+      tasks.pop_front();
+      guard.unlock();
+      task(NULL);
+      guard.lock();
+   }
+}
+
+} // namespace ChannelThread
+
+
+static void
+DrainPostedPackets(void *ctx) // IN: unused
+{
+   MKSVchanSendQueue::Drain(plugin);
+}
+
+
+static void
+WakeChannelThread(void *ctx) // IN: unused
+{
+   ChannelThread::Queue(DrainPostedPackets);
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * SendInitial --
+ *
+ *    Start callback, on the monitor thread. Posts the initial inventory
+ *    as JSON, as the plugin sends it before the agent's format offer.
+ *
+ * Results:
+ *    None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+SendInitial(const std::string &json,          // IN
+            const std::vector<uint8> &binary) // IN: unused
+{
+   CHECK(MKSVchanSendQueue::Post(MKSVchanPacketType_SmartCardInfo,
+                                 reinterpret_cast<const uint8 *>(
+                                    json.c_str()),
+                                 (uint32)json.length() + 1,
+                                 MKSVCHAN_CLIPBOARD_ERROR_NONE));
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * WaitForPackets --
+ *
+ *    Wait until count packets were sent, then a debounce period more to
+ *    catch any extra one.
+ *
+ * Results:
+ *    The packets sent, which are taken.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static std::vector<SentPacket>
+WaitForPackets(size_t count) // IN
+{
+   std::unique_lock<std::mutex> guard(sentLock);
+   sentWake.wait_for(guard, std::chrono::milliseconds(TEST_WAIT_MS),
+                     [count] { return sent.size() >= count; });
+   sentWake.wait_for(guard,
+                     std::chrono::milliseconds(SC_MONITOR_DEBOUNCE_MS * 2),
+                     [count] { return sent.size() > count; });
+   std::vector<SentPacket> packets;
+   packets.swap(sent);
+   return packets;
+}
+
+
+static uint32
+ElapsedMS(Clock::time_point start, // IN
+          Clock::time_point end)   // IN
+{
+   return (uint32)std::chrono::duration_cast<std::chrono::milliseconds>(
+      end - start).count();
+}
+
+
+static ScSimReader::Card
+TestCard(uint8 atrByte) // IN
+{
+   ScSimReader::Card card;
+   card.piv = FALSE;
+   card.atr.assign(8, atrByte);
+   return card;
+}
+
+
+static Bool
+Mentions(const SentPacket &packet, // IN
+         const char *text)         // IN
+{
+   return packet.packetType == MKSVchanPacketType_SmartCardInfo &&
+          packet.data.find(text) != std::string::npos;
+}
+
+
+int
+main()
+{
+   std::thread channelThread(ChannelThread::Main);
+   MKSVchanSendQueue::SetWakeCallback(WakeChannelThread, NULL);
+
+   ScSimReader::Reset();
+   ScSimReader::AddReader(TEST_READER);
+
+   /*
+    * Initial inventory with a slow PIV card: collected on the monitor
+    * thread, Start doesn't wait for it.
+    */
+   ScSimReader::Card pivCard = TestCard(0x3a);
+   pivCard.piv = TRUE;
+   ScSimReader::InsertCard(TEST_READER, pivCard);
+   ScSimReader::SetApduLatencyUS(TEST_APDU_LATENCY_US);
+   Clock::time_point start = Clock::now();
+   ScMonitor::Start(SendInitial);
+   uint32 startMS = ElapsedMS(start, Clock::now());
+   CHECK(startMS < TEST_APDU_LATENCY_US / 1000);
+   std::vector<SentPacket> packets = WaitForPackets(1);
+   CHECK(packets.size() == 1);
+   uint32 initialMS = 0;
+   if (packets.size() == 1) {
+      CHECK(Mentions(packets[0], "0x3a3a3a3a3a3a3a3a"));
+      initialMS = ElapsedMS(start, packets[0].when);
+      CHECK(initialMS >= TEST_APDU_LATENCY_US / 1000);
+   }
+   ScSimReader::SetApduLatencyUS(0);
+   ScSimReader::RemoveCard(TEST_READER);
+   packets = WaitForPackets(1);
+   CHECK(packets.size() == 1);
+
+   // Insert: one inventory, listing the ATR
+   Clock::time_point event = Clock::now();
+   ScSimReader::InsertCard(TEST_READER, TestCard(0x3b));
+   packets = WaitForPackets(1);
+   CHECK(packets.size() == 1);
+   uint32 insertMS = 0;
+   if (packets.size() == 1) {
+      CHECK(Mentions(packets[0], "0x3b3b3b3b3b3b3b3b"));
+      insertMS = ElapsedMS(event, packets[0].when);
+      CHECK(insertMS >= SC_MONITOR_DEBOUNCE_MS);
+      CHECK(insertMS < SC_MONITOR_DEBOUNCE_MS * 2);
+   }
+
+   // Same card out and back in: nothing changed
+   ScSimReader::RemoveCard(TEST_READER);
+   std::this_thread::sleep_for(std::chrono::milliseconds(20));
+   ScSimReader::InsertCard(TEST_READER, TestCard(0x3b));
+   packets = WaitForPackets(0);
+   CHECK(packets.empty());
+
+   // A burst of swaps inside the debounce period: one inventory
+   for (uint8 atr = 0x40; atr < 0x45; atr++) {
+      ScSimReader::RemoveCard(TEST_READER);
+      ScSimReader::InsertCard(TEST_READER, TestCard(atr));
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+   }
+   packets = WaitForPackets(1);
+   CHECK(packets.size() == 1);
+   if (packets.size() == 1) {
+      CHECK(Mentions(packets[0], "0x4444444444444444"));
+   }
+
+   // Reader plugged in, through the PnP pseudo reader
+   event = Clock::now();
+   ScSimReader::AddReader(TEST_NEW_READER);
+   packets = WaitForPackets(1);
+   CHECK(packets.size() == 1);
+   uint32 readerMS = 0;
+   if (packets.size() == 1) {
+      CHECK(Mentions(packets[0], TEST_NEW_READER));
+      readerMS = ElapsedMS(event, packets[0].when);
+   }
+
+   // Removal
+   event = Clock::now();
+   ScSimReader::RemoveCard(TEST_READER);
+   packets = WaitForPackets(1);
+   CHECK(packets.size() == 1);
+   uint32 removeMS = 0;
+   if (packets.size() == 1) {
+      CHECK(!Mentions(packets[0], "ATR"));
+      removeMS = ElapsedMS(event, packets[0].when);
+   }
+
+   // Stop while blocked without a timeout
+   Clock::time_point stopStart = Clock::now();
+   ScMonitor::Stop();
+   uint32 stopMS = ElapsedMS(stopStart, Clock::now());
+   CHECK(stopMS < 500);
+
+   printf("Start returned after %u ms, initial inventory with a PIV card "
+          "sent after %u ms\n", startMS, initialMS);
+   printf("Event to packet: insert %u ms, new reader %u ms, removal %u ms "
+          "(debounce %u ms); Stop took %u ms\n", insertMS, readerMS,
+          removeMS, SC_MONITOR_DEBOUNCE_MS, stopMS);
+
+   MKSVchanSendQueue::SetWakeCallback(NULL, NULL);
+   {
+      std::lock_guard<std::mutex> guard(ChannelThread::lock);
+      ChannelThread::stop = TRUE;
+      ChannelThread::wake.notify_one();
+   }
+   channelThread.join();
+
+   printf("scMonitorTest: %s\n", failures == 0 ? "passed" : "FAILED");
+   return failures == 0 ? 0 : 1;
+}
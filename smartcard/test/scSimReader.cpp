@@ -0,0 +1,461 @@
+/* **************************************************************************** *
+ * Copyright (C) 2020 VMware, Inc.  All rights reserved. -- VMware Confidential *
+ * **************************************************************************** */
+
+/*
+ * scSimReader.cpp --
+ *
+ *    Implements the simulated PC/SC.
+ */
+
+#include "scSimReader.h"
+
+#include <PCSC/winscard.h>
+#include <PCSC/wintypes.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string.h>
+#include <thread>
+
+#define SIM_PNP_READER_NAME "\\\\?PnP?\\Notification"
+#define SIM_MAX_RESPONSE 256
+
+const SCARD_IO_REQUEST g_rgSCardT0Pci = { SCARD_PROTOCOL_T0, 8 };
+const SCARD_IO_REQUEST g_rgSCardT1Pci = { SCARD_PROTOCOL_T1, 8 };
+
+namespace ScSimReader {
+
+struct SimReader {
+   std::string name;
+   Bool cardPresent;
+   Card card;
+   uint32 eventCount;     // Reported in the upper 16 bits
+};
+
+struct SimHandle {
+   std::string reader;
+   std::vector<uint8> pending;   // Response left for GET RESPONSE
+   Bool pivSelected;
+};
+
+static std::mutex simLock;
+static std::condition_variable simChanged;
+static std::vector<SimReader> readers;
+static std::map<SCARDHANDLE, SimHandle> handles;
+static SCARDHANDLE nextHandle = 1;
+static uint32 apduLatencyUS = 0;
+static uint32 transmitCount = 0;
+static uint32 waiting = 0;        // SCardGetStatusChange calls blocked
+static uint32 cancelGeneration = 0;
+
+
+static SimReader *
+FindReader(const std::string &name) // IN
+{
+   for (size_t i = 0; i < readers.size(); i++) {
+      if (readers[i].name == name) {
+         return &readers[i];
+      }
+   }
+   return NULL;
+}
+
+
+void
+Reset()
+{
+   std::lock_guard<std::mutex> guard(simLock);
+   readers.clear();
+   handles.clear();
+   apduLatencyUS = 0;
+   transmitCount = 0;
+   simChanged.notify_all();
+}
+
+
+void
+AddReader(const std::string &name) // IN
+{
+   std::lock_guard<std::mutex> guard(simLock);
+   SimReader reader;
+   reader.name = name;
+   reader.cardPresent = FALSE;
+   reader.eventCount = 0;
+   readers.push_back(reader);
+   simChanged.notify_all();
+}
+
+
+void
+RemoveReader(const std::string &name) // IN
+{
+   std::lock_guard<std::mutex> guard(simLock);
+   for (size_t i = 0; i < readers.size(); i++) {
+      if (readers[i].name == name) {
+         readers.erase(readers.begin() + i);
+         break;
+      }
+   }
+   simChanged.notify_all();
+}
+
+
+void
+InsertCard(const std::string &reader, // IN
+           const Card &card)          // IN
+{
+   std::lock_guard<std::mutex> guard(simLock);
+   SimReader *r = FindReader(reader);
+   if (r != NULL) {
+      r->cardPresent = TRUE;
+      r->card = card;
+      r->eventCount++;
+   }
+   simChanged.notify_all();
+}
+
+
+void
+RemoveCard(const std::string &reader) // IN
+{
+   std::lock_guard<std::mutex> guard(simLock);
+   SimReader *r = FindReader(reader);
+   if (r != NULL) {
+      r->cardPresent = FALSE;
+      r->card = Card();
+      r->eventCount++;
+   }
+   simChanged.notify_all();
+}
+
+
+void
+SetApduLatencyUS(uint32 latencyUS) // IN
+{
+   std::lock_guard<std::mutex> guard(simLock);
+   apduLatencyUS = latencyUS;
+}
+
+
+uint32
+GetTransmitCount()
+{
+   std::lock_guard<std::mutex> guard(simLock);
+   return transmitCount;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * EventState --
+ *
+ *    What SCardGetStatusChange reports for a reader name right now.
+ *
+ * Results:
+ *    FALSE if there is no such reader.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static Bool
+EventState(const char *name, // IN
+           DWORD *state,     // OUT
+           SimReader **out)  // OUT
+{
+   *out = NULL;
+   if (strcmp(name, SIM_PNP_READER_NAME) == 0) {
+      *state = (DWORD)readers.size() << 16;
+      return TRUE;
+   }
+
+   SimReader *reader = FindReader(name);
+   if (reader == NULL) {
+      return FALSE;
+   }
+   *state = (reader->cardPresent ? SCARD_STATE_PRESENT : SCARD_STATE_EMPTY) |
+            ((DWORD)reader->eventCount << 16);
+   *out = reader;
+   return TRUE;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * Respond --
+ *
+ *    Answer an APDU sent to the card in a reader.
+ *
+ * Results:
+ *    The response data and status word.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static std::vector<uint8>
+Respond(SimHandle *handle,          // IN
+        const Card &card,           // IN
+        const uint8 *apdu,          // IN
+        size_t apduLen)             // IN
+{
+   static const uint8 pivAid[] = {
+      0xA0, 0x00, 0x00, 0x03, 0x08, 0x00, 0x00, 0x10, 0x00
+   };
+   std::vector<uint8> data;
+   uint16 sw = 0x6D00;
+
+   if (apduLen >= 4 && apdu[1] == 0xA4) {
+      Bool isPiv = apduLen >= 5 + sizeof pivAid &&
+                   memcmp(apdu + 5, pivAid, sizeof pivAid) == 0;
+      handle->pivSelected = isPiv && card.piv;
+      sw = handle->pivSelected ? 0x9000 : 0x6A82;
+   } else if (apduLen >= 10 && apdu[1] == 0xCB && handle->pivSelected) {
+      uint32 tag = (apdu[7] << 16) | (apdu[8] << 8) | apdu[9];
+      std::map<uint32, std::vector<uint8> >::const_iterator it =
+         card.objects.find(tag);
+      if (it == card.objects.end()) {
+         sw = 0x6A82;
+      } else {
+         // 53 container with a BER length
+         const std::vector<uint8> &object = it->second;
+         handle->pending.assign(1, 0x53);
+         if (object.size() < 0x80) {
+            handle->pending.push_back((uint8)object.size());
+         } else {
+            handle->pending.push_back(0x82);
+            handle->pending.push_back((uint8)(object.size() >> 8));
+            handle->pending.push_back((uint8)object.size());
+         }
+         handle->pending.insert(handle->pending.end(), object.begin(),
+                                object.end());
+         sw = 0;
+      }
+   } else if (apduLen >= 4 && apdu[1] == 0xC0) {
+      sw = handle->pending.empty() ? 0x6985 : 0;
+   }
+
+   if (sw == 0) {
+      size_t len = handle->pending.size() < SIM_MAX_RESPONSE ?
+                   handle->pending.size() : SIM_MAX_RESPONSE;
+      data.assign(handle->pending.begin(), handle->pending.begin() + len);
+      handle->pending.erase(handle->pending.begin(),
+                            handle->pending.begin() + len);
+      size_t left = handle->pending.size();
+      sw = left == 0 ? 0x9000 :
+           (uint16)(0x6100 | (left < SIM_MAX_RESPONSE ? left : 0));
+   }
+   data.push_back((uint8)(sw >> 8));
+   data.push_back((uint8)sw);
+   return data;
+}
+
+} // namespace ScSimReader
+
+using namespace ScSimReader;
+
+
+extern "C" {
+
+LONG
+SCardEstablishContext(DWORD scope,            // IN
+                      LPCVOID reserved1,      // IN
+                      LPCVOID reserved2,      // IN
+                      SCARDCONTEXT *context)  // OUT
+{
+   *context = 1;
+   return SCARD_S_SUCCESS;
+}
+
+
+LONG
+SCardReleaseContext(SCARDCONTEXT context) // IN
+{
+   return SCARD_S_SUCCESS;
+}
+
+
+LONG
+SCardListReaders(SCARDCONTEXT context,  // IN
+                 LPCSTR groups,         // IN
+                 LPSTR names,           // OUT
+                 LPDWORD namesLen)      // IN/OUT
+{
+   std::lock_guard<std::mutex> guard(simLock);
+   if (readers.empty()) {
+      return SCARD_E_NO_READERS_AVAILABLE;
+   }
+
+   std::string multi;
+   for (size_t i = 0; i < readers.size(); i++) {
+      multi += readers[i].name;
+      multi += '\0';
+   }
+   multi += '\0';
+
+   if (names != NULL) {
+      if (*namesLen < multi.size()) {
+         return SCARD_E_INVALID_HANDLE;
+      }
+      memcpy(names, multi.data(), multi.size());
+   }
+   *namesLen = (DWORD)multi.size();
+   return SCARD_S_SUCCESS;
+}
+
+
+LONG
+SCardGetStatusChange(SCARDCONTEXT context,        // IN
+                     DWORD timeout,               // IN
+                     SCARD_READERSTATE *states,   // IN/OUT
+                     DWORD count)                 // IN
+{
+   std::unique_lock<std::mutex> guard(simLock);
+   std::chrono::steady_clock::time_point deadline =
+      std::chrono::steady_clock::now() + std::chrono::milliseconds(
+         timeout == INFINITE ? 24 * 3600 * 1000 : timeout);
+   uint32 generation = cancelGeneration;
+
+   waiting++;
+   for (;;) {
+      Bool changed = FALSE;
+      for (DWORD i = 0; i < count; i++) {
+         DWORD state;
+         SimReader *reader;
+         if (!EventState(states[i].szReader, &state, &reader)) {
+            waiting--;
+            return SCARD_E_UNKNOWN_READER;
+         }
+         if (state != (states[i].dwCurrentState &
+                       ~(DWORD)SCARD_STATE_CHANGED)) {
+            state |= SCARD_STATE_CHANGED;
+            changed = TRUE;
+         }
+         states[i].dwEventState = state;
+         states[i].cbAtr = 0;
+         if (reader != NULL && reader->cardPresent) {
+            states[i].cbAtr = (DWORD)reader->card.atr.size();
+            memcpy(states[i].rgbAtr, reader->card.atr.data(),
+                   reader->card.atr.size());
+         }
+      }
+      if (changed) {
+         waiting--;
+         return SCARD_S_SUCCESS;
+      }
+      if (cancelGeneration != generation) {
+         waiting--;
+         return SCARD_E_CANCELLED;
+      }
+      if (simChanged.wait_until(guard, deadline) ==
+          std::cv_status::timeout) {
+         waiting--;
+         return SCARD_E_TIMEOUT;
+      }
+   }
+}
+
+
+LONG
+SCardCancel(SCARDCONTEXT context) // IN
+{
+   std::lock_guard<std::mutex> guard(simLock);
+   // Like pcsclite, only a wait in progress is cancelled
+   if (waiting > 0) {
+      cancelGeneration++;
+      simChanged.notify_all();
+   }
+   return SCARD_S_SUCCESS;
+}
+
+
+LONG
+SCardConnect(SCARDCONTEXT context,  // IN
+             LPCSTR readerName,     // IN
+             DWORD shareMode,       // IN
+             DWORD protocols,       // IN
+             SCARDHANDLE *card,     // OUT
+             LPDWORD protocol)      // OUT
+{
+   std::lock_guard<std::mutex> guard(simLock);
+   SimReader *reader = FindReader(readerName);
+   if (reader == NULL) {
+      return SCARD_E_UNKNOWN_READER;
+   }
+   if (!reader->cardPresent) {
+      return SCARD_E_NO_SMARTCARD;
+   }
+
+   SimHandle handle;
+   handle.reader = readerName;
+   handle.pivSelected = FALSE;
+   *card = nextHandle++;
+   handles[*card] = handle;
+   *protocol = SCARD_PROTOCOL_T1;
+   return SCARD_S_SUCCESS;
+}
+
+
+LONG
+SCardDisconnect(SCARDHANDLE card,  // IN
+                DWORD disposition) // IN
+{
+   std::lock_guard<std::mutex> guard(simLock);
+   handles.erase(card);
+   return SCARD_S_SUCCESS;
+}
+
+
+LONG
+SCardBeginTransaction(SCARDHANDLE card) // IN
+{
+   return SCARD_S_SUCCESS;
+}
+
+
+LONG
+SCardEndTransaction(SCARDHANDLE card,  // IN
+                    DWORD disposition) // IN
+{
+   return SCARD_S_SUCCESS;
+}
+
+
+LONG
+SCardTransmit(SCARDHANDLE card,                  // IN
+              const SCARD_IO_REQUEST *sendPci,   // IN
+              LPCBYTE apdu,                      // IN
+              DWORD apduLen,                     // IN
+              SCARD_IO_REQUEST *recvPci,         // OUT
+              LPBYTE response,                   // OUT
+              LPDWORD responseLen)               // IN/OUT
+{
+   uint32 latencyUS;
+   std::vector<uint8> answer;
+   {
+      std::lock_guard<std::mutex> guard(simLock);
+      std::map<SCARDHANDLE, SimHandle>::iterator it = handles.find(card);
+      if (it == handles.end()) {
+         return SCARD_E_INVALID_HANDLE;
+      }
+      SimReader *reader = FindReader(it->second.reader);
+      if (reader == NULL || !reader->cardPresent) {
+         return SCARD_W_REMOVED_CARD;
+      }
+      answer = Respond(&it->second, reader->card, apdu, apduLen);
+      latencyUS = apduLatencyUS;
+      transmitCount++;
+   }
+
+   std::this_thread::sleep_for(std::chrono::microseconds(latencyUS));
+   if (*responseLen < answer.size()) {
+      return SCARD_E_INVALID_HANDLE;
+   }
+   memcpy(response, &answer[0], answer.size());
+   *responseLen = (DWORD)answer.size();
+   return SCARD_S_SUCCESS;
+}
+
+} // extern "C"
@@ -0,0 +1,48 @@
+/* **************************************************************************** *
+ * Copyright (C) 2020 VMware, Inc.  All rights reserved. -- VMware Confidential *
+ * **************************************************************************** */
+
+/*
+ * scSimReader.h --
+ *
+ *    Simulated PC/SC for the smart card tests. Linking scSimReader.cpp
+ *    instead of pcsclite gives ScInventory and ScMonitor readers and cards
+ *    the test controls.
+ *
+ *    Cards answer SELECT of the PIV applet, GET DATA of the objects they
+ *    hold and GET RESPONSE, returning long objects in 256 byte pieces
+ *    with 61xx like a real card. Every transmit sleeps for the configured
+ *    APDU latency. SCardGetStatusChange blocks until a reader or card
+ *    changes, the timeout, or SCardCancel, and reports the reader count on
+ *    the "\\?PnP?\Notification" pseudo reader, as pcsclite does.
+ */
+
+#ifndef _SC_SIM_READER_H_
+#define _SC_SIM_READER_H_
+
+#include "MKSVchanRPCPlugin.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace ScSimReader {
+
+struct Card {
+   Bool piv;                                    // Has the PIV applet
+   std::vector<uint8> atr;
+   std::map<uint32, std::vector<uint8> > objects;   // PIV tag to content
+};
+
+void Reset();
+void AddReader(const std::string &name);
+void RemoveReader(const std::string &name);
+void InsertCard(const std::string &reader, const Card &card);
+void RemoveCard(const std::string &reader);
+
+void SetApduLatencyUS(uint32 latencyUS);
+uint32 GetTransmitCount();
+
+} // namespace ScSimReader
+
+#endif // _SC_SIM_READER_H_